@@ -0,0 +1,127 @@
+/**
+ * @file BandwidthManager.h
+ * @brief Header file for transfer rate limiting
+ *
+ * This file defines the BandwidthManager class which paces FileTransfer
+ * traffic with a hierarchy of token buckets: one for the whole process, one
+ * per client IP address and one per transfer.
+ */
+
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @class BandwidthManager
+ * @brief Shares configured bandwidth between concurrent transfers
+ *
+ * Every transfer opens a Flow. Whenever flows come or go, the global rate is
+ * split max-min fairly between client IPs, and each client's share is split
+ * max-min fairly between its transfers, so a capped flow never strands
+ * bandwidth that another flow could use. Each flow then draws from its own
+ * token bucket filled at its allocated rate.
+ *
+ * Admission never blocks: Flow::acquire() returns how many bytes may be moved
+ * right now, or how long to wait before asking again.
+ */
+class BandwidthManager {
+public:
+    /**
+     * @struct Limits
+     * @brief Configured rates in bytes per second; 0 means unlimited
+     */
+    struct Limits {
+        uint64_t globalRate = 0;                        ///< Cap for all transfers together
+        uint64_t perClientRate = 0;                     ///< Cap for all transfers of one client IP
+        uint64_t perTransferRate = 0;                   ///< Cap for a single transfer
+        std::chrono::milliseconds burstWindow{50};      ///< Bucket depth, as time at the allocated rate
+    };
+
+    /**
+     * @struct Grant
+     * @brief Result of an admission request
+     */
+    struct Grant {
+        size_t bytes;                        ///< Bytes that may be moved now (0 if none)
+        std::chrono::nanoseconds retryAfter; ///< When bytes is 0, time until tokens are available
+    };
+
+    /**
+     * @class Flow
+     * @brief Registration of one transfer with the manager
+     *
+     * Unregisters itself (and rebalances the remaining flows) when destroyed.
+     */
+    class Flow {
+    public:
+        ~Flow();
+        Flow(const Flow&) = delete;
+        Flow& operator=(const Flow&) = delete;
+
+        /**
+         * @brief Asks to move up to wanted bytes
+         * @param wanted Number of bytes the caller would like to move
+         * @return Number of bytes admitted, or the delay before retrying
+         */
+        Grant acquire(size_t wanted);
+
+        /**
+         * @brief Returns admitted bytes that were not actually moved
+         * @param bytes Number of unused bytes
+         */
+        void refund(size_t bytes);
+
+    private:
+        friend class BandwidthManager;
+        Flow(BandwidthManager& manager, const std::string& clientKey);
+
+        void refill(std::chrono::steady_clock::time_point now);
+        void setRate(double newRate, std::chrono::steady_clock::time_point now);
+
+        BandwidthManager& manager;                   ///< Owning manager
+        std::string clientKey;                       ///< Client IP address this flow belongs to
+        double rate;                                 ///< Allocated rate in bytes/s (infinity if unlimited)
+        double burst;                                ///< Bucket depth in bytes
+        double tokens;                               ///< Bytes currently available
+        std::chrono::steady_clock::time_point lastRefill; ///< Last time tokens were added
+    };
+
+    /**
+     * @brief Returns the process-wide manager
+     */
+    static BandwidthManager& instance();
+
+    /**
+     * @brief Replaces the configured limits and rebalances active flows
+     * @param limits New limits
+     */
+    void setLimits(const Limits& limits);
+
+    /**
+     * @brief Returns the configured limits
+     */
+    Limits getLimits() const;
+
+    /**
+     * @brief Registers a new transfer
+     * @param clientKey Client IP address (empty if unknown)
+     * @return Handle used to pace the transfer
+     */
+    std::unique_ptr<Flow> openFlow(const std::string& clientKey);
+
+private:
+    BandwidthManager() = default;
+
+    mutable std::mutex mutex;                             ///< Guards limits, clients and every flow's bucket
+    Limits limits;                                        ///< Configured limits
+    std::map<std::string, std::vector<Flow*>> clients;    ///< Active flows grouped by client IP
+
+    void rebalance();
+
+    static std::vector<double> maxMinShare(double capacity, const std::vector<double>& demands);
+};
@@ -0,0 +1,169 @@
+/**
+ * @file BatchTransfer.h
+ * @brief Header file for multi-file batch streams
+ *
+ * This file defines the BatchTransfer class which uploads many files over a
+ * single connection, so small files are not dominated by connection setup.
+ */
+
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "BufferPool.h"
+#include "DirectoryWalker.h"
+#include "FileTransfer.h"
+#include "ZeroCopySender.h"
+
+/**
+ * @class BatchTransfer
+ * @brief Streams a sequence of files, each as a record, over one connection
+ *
+ * The connection starts with the 'B' command and the remote directory like a
+ * normal upload. Each file follows as a RecordHeader, its path relative to
+ * that directory, and exactly header.size bytes of data; a header with
+ * pathLength 0 ends the batch. A record flagged RECORD_DIRECTORY carries no
+ * data and creates the directory, so empty directories of a tree arrive too.
+ *
+ * The receiver stores the records in order, each through its own StagedFile,
+ * and answers every record with one byte, ACK_OK or ACK_FAILED. The sender
+ * does not wait for them: acknowledgements are collected by a separate
+ * thread while up to MAX_IN_FLIGHT records are outstanding, and the
+ * receiver sends them in bulk each time its buffer runs dry.
+ *
+ * Files up to INLINE_LIMIT travel inside the batch buffers on both ends, so
+ * a run of small files costs a few large send()/recv() calls rather than
+ * several per file, and are not paced by the BandwidthManager. Larger
+ * files are moved by the FileTransfer engines, paced by one flow for the
+ * whole batch.
+ *
+ * A directory download ('T') is a batch going the other way: the server
+ * walks the requested directory and is the sender, the client receives.
+ */
+class BatchTransfer {
+public:
+    static constexpr char COMMAND = 'B';                    ///< Command byte of a batch upload
+    static constexpr char TREE_COMMAND = 'T';               ///< Command byte of a directory download
+    static constexpr char ACK_OK = 'K';                     ///< File stored
+    static constexpr char ACK_FAILED = 'F';                 ///< File not stored; the batch goes on
+    static constexpr size_t INLINE_LIMIT = 256 * 1024;      ///< Larger files go through the engines
+    static constexpr size_t BUFFER_SIZE = 1024 * 1024;      ///< Batch buffer on each end
+    static constexpr size_t MAX_IN_FLIGHT = 4096;           ///< Records sent but not acknowledged
+    static constexpr uint32_t MAX_PATH_LENGTH = 4096;       ///< Longest relative path accepted
+    static constexpr uint32_t RECORD_DIRECTORY = 1;         ///< RecordHeader flag: create a directory
+
+    /**
+     * @struct RecordHeader
+     * @brief Precedes the path and data of each file in the batch
+     */
+    struct RecordHeader {
+        uint64_t size;          ///< Number of data bytes after the path
+        uint32_t pathLength;    ///< Length of the relative path (0 ends the batch)
+        uint32_t flags;         ///< RECORD_DIRECTORY or 0
+    };
+
+    /**
+     * @class Sender
+     * @brief Sending end of a batch on a connected socket
+     *
+     * The caller sends the command byte and remote directory first, then
+     * calls add() for every file and finish() once.
+     */
+    class Sender {
+    public:
+        /**
+         * @brief Starts a batch; the socket must stay open until the sender is destroyed
+         * @param socket Socket descriptor, positioned just after the remote directory
+         * @param mode Engine for files larger than INLINE_LIMIT
+         * @throws std::runtime_error if no batch buffer is available
+         */
+        explicit Sender(int socket, FileTransfer::SendMode mode = FileTransfer::SendMode::Auto);
+        ~Sender();
+
+        Sender(const Sender&) = delete;
+        Sender& operator=(const Sender&) = delete;
+
+        /**
+         * @brief Queues a file
+         * @param localPath Path of the file to read
+         * @param relativePath Path under the remote directory to store it at
+         * @return false if the connection failed; a file that cannot be
+         *         read is reported and skipped, and counts as failed
+         */
+        bool add(const std::string& localPath, const std::string& relativePath);
+
+        /**
+         * @brief Queues the creation of a directory, with any missing parents
+         * @param relativePath Path under the remote directory
+         * @return false if the connection failed
+         */
+        bool addDirectory(const std::string& relativePath);
+
+        /**
+         * @brief Queues entries taken from a walker until it has none left
+         * @param walker Walk of the tree to send; several senders may share it
+         * @return false if the connection failed
+         */
+        bool addFrom(DirectoryWalker& walker);
+
+        /**
+         * @brief Ends the batch and waits for every acknowledgement
+         * @return true if the receiver stored every file that was added
+         */
+        bool finish();
+
+        /**
+         * @brief Returns the number of files sent so far
+         */
+        size_t sentCount();
+
+        /**
+         * @brief Returns the number of files that were not stored
+         */
+        size_t failedCount();
+
+    private:
+        bool flush();
+        bool append(const void* data, size_t size);
+        bool waitForWindow();
+        void readAcknowledgements();
+
+        int socket;
+        FileTransfer::SendMode mode;
+        BufferPool::Buffer buffer;              ///< Records not yet sent
+        std::unique_ptr<ZeroCopySender> zeroCopy;   ///< Sends full buffers with MSG_ZEROCOPY, if enabled
+        std::unique_ptr<BandwidthManager::Flow> flow;   ///< Paces the files the engines move
+        size_t used = 0;                        ///< Bytes of buffer holding records
+        bool finished = false;
+
+        std::mutex mutex;
+        std::condition_variable acknowledged;   ///< Signalled as acknowledgements arrive
+        std::deque<std::string> pending;        ///< Paths awaiting acknowledgement, guarded by mutex
+        size_t sent = 0;                        ///< Records sent, guarded by mutex
+        size_t failed = 0;                      ///< Records not stored, guarded by mutex
+        bool broken = false;                    ///< Connection failed, guarded by mutex
+        std::thread reader;                     ///< Collects acknowledgements
+    };
+
+    /**
+     * @brief Receives a batch and stores its files under a directory
+     * @param socket Socket descriptor, positioned just after the remote directory
+     * @param directory Directory the relative paths are resolved against
+     * @param mode Engine for files larger than INLINE_LIMIT
+     * @return true if the batch ended normally and every file was stored
+     */
+    static bool receiveBatch(int socket, const std::string& directory,
+                             FileTransfer::ReceiveMode mode = FileTransfer::ReceiveMode::Auto);
+
+    /**
+     * @brief Tells whether a relative path stays inside the directory it is resolved against
+     * @param path Path from a RecordHeader
+     * @return false for empty or absolute paths and paths with "." or ".." components
+     */
+    static bool isSafeRelativePath(const std::string& path);
+};
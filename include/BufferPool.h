@@ -0,0 +1,163 @@
+/**
+ * @file BufferPool.h
+ * @brief Header file for the process-wide transfer buffer pool
+ *
+ * This file defines the BufferPool class which hands out the data buffers
+ * used by the FileTransfer engines, so steady-state transfers do not touch
+ * the heap and the memory they use together stays under a configured cap.
+ */
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+/**
+ * @class BufferPool
+ * @brief Size-classed, capped pool of page-aligned buffers
+ *
+ * Requests are rounded up to a power-of-two size class between
+ * MIN_CLASS_SIZE and MAX_CLASS_SIZE. Released buffers go to a small cache
+ * of the releasing thread first, so a worker that runs one transfer after
+ * another reuses the same buffers without taking a lock, and to a shared
+ * free list when that cache is full or another thread is waiting for memory.
+ *
+ * All buffers ever mapped count against Options::memoryCap, whether in use
+ * or cached. When a request would exceed it, free buffers of other classes
+ * are unmapped first; after that acquire() waits for a buffer to be
+ * released, for at most Options::waitTimeout, and tryAcquire() gives up
+ * at once (it also leaves headroom for acquire()). The timeout turns a cap too small for the transfers in flight
+ * (each of which needs at least one buffer to make progress) into failed
+ * transfers instead of a hang.
+ *
+ * Buffers come straight from mmap, so they are page aligned and suitable
+ * for O_DIRECT.
+ */
+class BufferPool {
+public:
+    static constexpr size_t MIN_CLASS_SIZE = 64 * 1024;         ///< Smallest buffer handed out
+    static constexpr size_t MAX_CLASS_SIZE = 4 * 1024 * 1024;   ///< Largest pooled buffer
+    static constexpr size_t CLASS_COUNT = 7;                    ///< Classes from MIN to MAX_CLASS_SIZE
+    static constexpr size_t THREAD_CACHE_DEPTH = 4;             ///< Buffers per class a thread keeps
+
+    /**
+     * @struct Options
+     * @brief Process-wide tunables of the pool
+     */
+    struct Options {
+        size_t memoryCap = 1024 * 1024 * 1024;  ///< Bytes of buffers mapped at once (0 = unlimited)
+        bool hugePages = false;                 ///< Back buffers of 2 MiB and more with huge pages
+        std::chrono::milliseconds waitTimeout{5000}; ///< Longest acquire() waits for memory
+    };
+
+    /**
+     * @struct Stats
+     * @brief Snapshot of the pool's memory use
+     */
+    struct Stats {
+        size_t mapped = 0;      ///< Bytes currently mapped, in use or cached
+        size_t inUse = 0;       ///< Bytes held by callers
+        size_t peakMapped = 0;  ///< Highest value of mapped so far
+    };
+
+    /**
+     * @class Buffer
+     * @brief A buffer on loan from the pool; returned when destroyed
+     */
+    class Buffer {
+    public:
+        Buffer() = default;
+        Buffer(Buffer&& other) noexcept;
+        Buffer& operator=(Buffer&& other) noexcept;
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+        ~Buffer() { reset(); }
+
+        char* data() const { return memory; }
+
+        /**
+         * @brief Returns the usable size, at least what was asked for
+         */
+        size_t size() const { return capacity; }
+
+        explicit operator bool() const { return memory != nullptr; }
+
+        /**
+         * @brief Returns the buffer to the pool early
+         */
+        void reset();
+
+    private:
+        friend class BufferPool;
+        Buffer(char* memory, size_t capacity) : memory(memory), capacity(capacity) {}
+
+        char* memory = nullptr;
+        size_t capacity = 0;
+    };
+
+    /**
+     * @brief Returns the process-wide pool
+     */
+    static BufferPool& instance();
+
+    /**
+     * @brief Borrows a buffer, waiting while the memory cap is reached
+     * @param size Minimum number of bytes
+     * @return The buffer, or an empty one if none became available within
+     *         Options::waitTimeout or mapping memory failed
+     */
+    Buffer acquire(size_t size);
+
+    /**
+     * @brief Borrows an optional buffer if memory is plentiful right now
+     * @param size Minimum number of bytes
+     * @return The buffer, or an empty one
+     *
+     * For buffers a transfer can do without (extra pipeline depth). Refused
+     * while another thread waits in acquire(), and never takes the last
+     * quarter of the cap, which stays for transfers that have no buffer yet.
+     */
+    Buffer tryAcquire(size_t size);
+
+    /**
+     * @brief Replaces the tunables; a lower cap is enforced as buffers come back
+     */
+    void setOptions(const Options& options);
+
+    /**
+     * @brief Returns a copy of the tunables
+     */
+    Options getOptions();
+
+    /**
+     * @brief Returns the current memory use
+     */
+    Stats stats();
+
+private:
+    BufferPool() = default;
+    ~BufferPool();
+
+    Buffer obtain(size_t size, bool wait);
+    void release(char* memory, size_t capacity);
+    char* map(size_t capacity);
+    void unmap(char* memory, size_t capacity);
+    bool trimLocked(size_t needed, size_t cap);
+
+    static size_t classOf(size_t size);
+    static size_t classSize(size_t index);
+
+    friend struct ThreadCache;
+
+    std::mutex mutex;
+    std::condition_variable released;       ///< Signalled when memory is returned
+    Options options;                        ///< Guarded by mutex
+    std::vector<char*> freeLists[CLASS_COUNT]; ///< Shared free buffers, guarded by mutex
+    size_t mapped = 0;                      ///< Guarded by mutex
+    size_t peakMapped = 0;                  ///< Guarded by mutex
+    std::atomic<size_t> inUse{0};           ///< Bytes on loan
+    std::atomic<unsigned> waiters{0};       ///< Threads blocked in acquire()
+};
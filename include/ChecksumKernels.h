@@ -0,0 +1,103 @@
+/**
+ * @file ChecksumKernels.h
+ * @brief Header file for the checksum inner loops
+ *
+ * This file defines the ChecksumKernels class which holds the scalar and
+ * hardware-accelerated implementations behind the classes in Checksum.h and
+ * picks the fastest one the CPU supports at run time.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @class ChecksumKernels
+ * @brief CPU-dispatched CRC-32C and wide hash kernels
+ *
+ * Every kernel of an algorithm computes exactly the same result; they only
+ * differ in speed. The first call selects the best kernel the CPU supports,
+ * use() overrides that choice (for benchmarks and cross-checking).
+ *
+ * Accelerated kernels are compiled with per-function target attributes, so
+ * the library itself needs no special compiler flags and still runs on CPUs
+ * without the instructions.
+ */
+class ChecksumKernels {
+public:
+    /**
+     * @enum Crc32cKernel
+     * @brief Implementations of the CRC-32C update
+     */
+    enum class Crc32cKernel {
+        Scalar,         ///< Slicing-by-8 tables
+        Sse42,          ///< SSE4.2 crc32 instruction, one stream
+        Sse42Clmul,     ///< Three interleaved crc32 streams joined with PCLMULQDQ
+        ArmCrc          ///< ARMv8 crc32c instructions
+    };
+
+    /**
+     * @enum WideHashKernel
+     * @brief Implementations of the XxHashWide stripe accumulation
+     */
+    enum class WideHashKernel {
+        Scalar,         ///< Eight 64-bit lanes in general-purpose registers
+        Avx2            ///< Eight lanes in two 256-bit registers
+    };
+
+    static constexpr size_t WIDE_STRIPE = 64;           ///< Bytes consumed per XxHashWide stripe
+    static constexpr unsigned WIDE_BLOCK_STRIPES = 16;  ///< Stripes between two scrambles of the lanes
+
+    /**
+     * @brief Advances a raw (not inverted) CRC-32C register over data
+     * @param crc Register value before the data
+     * @param data Bytes to process
+     * @param length Number of bytes
+     * @return Register value after the data
+     */
+    static uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+
+    /**
+     * @brief Accumulates whole stripes into the XxHashWide lanes
+     * @param lanes The eight accumulators
+     * @param data Start of the stripes
+     * @param stripes Number of WIDE_STRIPE-byte stripes
+     * @param stripeInBlock Position of the first stripe in its block; updated
+     */
+    static void wideHashStripes(uint64_t lanes[8], const unsigned char* data, size_t stripes,
+                                unsigned& stripeInBlock);
+
+    /**
+     * @brief Returns the key mixed into lane lane of the stripe at position stripe of a block
+     */
+    static uint64_t wideStripeKey(unsigned stripe, unsigned lane);
+
+    /**
+     * @brief Returns the key mixed into lane lane when the lanes are merged
+     */
+    static uint64_t wideMergeKey(unsigned lane);
+
+    /**
+     * @brief Returns whether this CPU can run a kernel
+     */
+    static bool supported(Crc32cKernel kernel);
+    static bool supported(WideHashKernel kernel);
+
+    /**
+     * @brief Forces a kernel; ignored if the CPU does not support it
+     */
+    static void use(Crc32cKernel kernel);
+    static void use(WideHashKernel kernel);
+
+    /**
+     * @brief Returns the kernel currently in use
+     */
+    static Crc32cKernel crc32cKernel();
+    static WideHashKernel wideHashKernel();
+
+    /**
+     * @brief Returns a short name of a kernel for reports
+     */
+    static const char* name(Crc32cKernel kernel);
+    static const char* name(WideHashKernel kernel);
+};
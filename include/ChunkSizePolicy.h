@@ -0,0 +1,94 @@
+/**
+ * @file ChunkSizePolicy.h
+ * @brief Header file for per-connection transfer chunk sizing
+ *
+ * This file defines the ChunkSizePolicy class which decides how many bytes
+ * FileTransfer moves per send/recv/sendfile/splice call on a connection.
+ */
+
+#pragma once
+#include <cstddef>
+#include <mutex>
+
+/**
+ * @class ChunkSizePolicy
+ * @brief Picks and adapts the chunk size used by one transfer
+ *
+ * The starting size is derived from the socket buffer (SO_SNDBUF/SO_RCVBUF)
+ * and the bandwidth-delay product estimated from TCP_INFO, capped by the
+ * file size when it is known. While the transfer runs, the size grows when
+ * the kernel keeps accepting full chunks and shrinks when calls keep coming
+ * back short. The tunables are process-wide and shared by every transfer.
+ */
+class ChunkSizePolicy {
+public:
+    /**
+     * @enum Direction
+     * @brief Which side of the connection the policy sizes for
+     */
+    enum class Direction {
+        Send,    ///< Size from SO_SNDBUF and the congestion window
+        Receive  ///< Size from SO_RCVBUF and the receive window
+    };
+
+    /**
+     * @struct Settings
+     * @brief Process-wide tunables shared by all transfers
+     */
+    struct Settings {
+        size_t minChunkSize = 16 * 1024;           ///< Never go below this many bytes
+        size_t maxChunkSize = 4 * 1024 * 1024;     ///< Never go above this many bytes
+        size_t defaultChunkSize = 256 * 1024;      ///< Used when the socket reports nothing useful
+        int growAfter = 4;                         ///< Consecutive full calls before growing
+        int shrinkAfter = 4;                       ///< Consecutive short calls before shrinking
+        int resampleInterval = 64;                 ///< Calls between TCP_INFO refreshes
+    };
+
+    /**
+     * @brief Creates a policy for one transfer
+     * @param socket Socket descriptor the transfer runs on
+     * @param direction Whether the transfer sends or receives
+     * @param fileSize Size of the file in bytes, or 0 if unknown
+     */
+    ChunkSizePolicy(int socket, Direction direction, size_t fileSize = 0);
+
+    /**
+     * @brief Returns the number of bytes to request in the next call
+     */
+    size_t chunkSize() const { return current; }
+
+    /**
+     * @brief Feeds back the outcome of one call
+     * @param requested Number of bytes asked for
+     * @param transferred Number of bytes the call actually moved
+     */
+    void update(size_t requested, size_t transferred);
+
+    /**
+     * @brief Replaces the process-wide tunables
+     * @param settings New settings; affect transfers started afterwards
+     */
+    static void setSettings(const Settings& settings);
+
+    /**
+     * @brief Returns a copy of the process-wide tunables
+     */
+    static Settings getSettings();
+
+private:
+    int socket;           ///< Socket the transfer runs on
+    Direction direction;  ///< Send or receive side
+    size_t fileSize;      ///< File size in bytes, 0 if unknown
+    Settings config;      ///< Snapshot of the settings at construction
+    size_t ceiling;       ///< Upper bound for growth
+    size_t current;       ///< Current chunk size
+    int fullCalls;        ///< Consecutive calls that moved the whole chunk
+    int shortCalls;       ///< Consecutive calls that moved under a quarter
+    int callsSinceSample; ///< Calls since TCP_INFO was last read
+
+    static Settings settings;       ///< Process-wide tunables
+    static std::mutex settingsMutex; ///< Guards settings
+
+    size_t measureTarget() const;
+    size_t clamp(size_t size) const;
+};
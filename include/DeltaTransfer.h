@@ -0,0 +1,109 @@
+/**
+ * @file DeltaTransfer.h
+ * @brief Header file for delta (rsync-style) transfers
+ *
+ * This file defines the DeltaTransfer class which updates an existing copy
+ * of a file by sending only the parts that changed.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @class DeltaTransfer
+ * @brief Sends a file as literal data plus references to blocks the receiver already has
+ *
+ * The receiver splits its current copy of the file (the basis) into fixed-size
+ * blocks and sends a weak rolling checksum and a strong xxHash64 of each.
+ * The sender slides a window over its file one byte at a time, updating the
+ * rolling checksum in constant time; where the weak checksum and then the
+ * strong hash match a block, it sends a reference to that block instead of
+ * its bytes. Everything else is sent as literal data.
+ *
+ * The receiver rebuilds the file into a StagedFile from the basis and the
+ * literals, checks the size and xxHash64 of the result against the ones the
+ * sender ends with, and only then publishes it over the basis. Each
+ * transfer ends with a one-byte acknowledgement, ACK_OK or ACK_FAILED.
+ * Literals are received under the BandwidthManager like any upload.
+ */
+class DeltaTransfer {
+public:
+    static constexpr char COMMAND = 'D';                        ///< Command byte of a delta upload
+    static constexpr char ACK_OK = 'K';                         ///< File rebuilt and verified
+    static constexpr char ACK_FAILED = 'F';                     ///< File not rebuilt
+    static constexpr size_t MIN_BLOCK_SIZE = 2 * 1024;          ///< Smallest block the basis is split into
+    static constexpr size_t MAX_BLOCK_SIZE = 128 * 1024;        ///< Largest block the basis is split into
+
+    /**
+     * @brief Sends a file as a delta against the peer's copy
+     * @param socket Socket descriptor
+     * @param filename Path to the file to send
+     * @return true if the peer rebuilt and verified the file, false otherwise
+     */
+    static bool sendFile(int socket, const std::string& filename);
+
+    /**
+     * @brief Updates a file from a delta sent by the peer
+     * @param socket Socket descriptor
+     * @param filename Path of the file to update (created if it does not exist)
+     * @return true if the file was rebuilt and verified, false otherwise
+     */
+    static bool receiveFile(int socket, const std::string& filename);
+
+    /**
+     * @brief Chooses the block size for a basis file, about the square root of its size
+     * @param fileSize Size of the basis in bytes
+     */
+    static size_t blockSizeFor(uint64_t fileSize);
+
+private:
+    /**
+     * @struct SignatureHeader
+     * @brief Precedes the block signatures sent by the receiver
+     */
+    struct SignatureHeader {
+        uint64_t blockSize;     ///< Size of every block but possibly the last
+        uint64_t blockCount;    ///< Number of BlockSignature records that follow
+        uint64_t basisSize;     ///< Size of the basis file
+    };
+
+    /**
+     * @struct BlockSignature
+     * @brief Checksums of one block of the basis
+     */
+    struct BlockSignature {
+        uint32_t weak;          ///< Rolling checksum
+        uint32_t reserved;      ///< Padding, always 0
+        uint64_t strong;        ///< xxHash64 of the block
+    };
+
+    /**
+     * @enum CommandKind
+     * @brief Instructions streamed by the sender
+     */
+    enum class CommandKind : uint32_t {
+        Literal = 1,    ///< length bytes of data follow
+        Copy = 2,       ///< Copy length bytes of the basis starting at block index
+        End = 3         ///< Done; index holds the xxHash64 of the file, length its size
+    };
+
+    /**
+     * @struct Command
+     * @brief One instruction of the delta
+     */
+    struct Command {
+        CommandKind kind;
+        uint32_t reserved;      ///< Padding, always 0
+        uint64_t index;         ///< Block index (Copy) or file hash (End)
+        uint64_t length;        ///< Number of bytes (Literal, Copy) or file size (End)
+    };
+
+    static uint32_t weakChecksum(const unsigned char* data, size_t length);
+    static std::vector<BlockSignature> computeSignatures(int fd, uint64_t fileSize, size_t blockSize);
+    static bool sendCommand(int socket, CommandKind kind, uint64_t index, uint64_t length);
+    static bool sendLiteral(int socket, const unsigned char* data, size_t length);
+    static bool applyDelta(int socket, int basisFd, const SignatureHeader& header, int outFd);
+};
@@ -0,0 +1,97 @@
+/**
+ * @file DirectoryWalker.h
+ * @brief Header file for the parallel directory walker
+ *
+ * This file defines the DirectoryWalker class which lists a directory tree
+ * on several threads and hands out its entries through a bounded queue.
+ */
+
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include "ThreadPool.h"
+
+/**
+ * @class DirectoryWalker
+ * @brief Lists the regular files and directories under a root, in parallel
+ *
+ * Every directory is read by one task on the walker's own ThreadPool, with
+ * getdents64 in large batches on Linux. The file type comes from the
+ * directory entry; only file systems that do not report it cost a statx()
+ * per entry. Subdirectories become new tasks, so wide trees are read by all
+ * threads at once, which hides the latency of cold metadata on disks and
+ * network file systems.
+ *
+ * Entries are queued for the consumers, at most queueCapacity at a time: a
+ * walker that gets ahead of the transfers waits instead of holding the
+ * listing of a huge tree in memory. Symbolic links and special files are
+ * skipped and reported; entries come in no particular order, but every
+ * directory before its own contents.
+ */
+class DirectoryWalker {
+public:
+    static constexpr unsigned DEFAULT_THREADS = 4;          ///< Directories read at once
+    static constexpr size_t DEFAULT_QUEUE_CAPACITY = 4096;  ///< Entries listed ahead of the consumers
+
+    /**
+     * @struct Entry
+     * @brief A file or directory found by the walk
+     */
+    struct Entry {
+        std::string path;           ///< Path to open, starting with the root
+        std::string relativePath;   ///< Path below the root, '/'-separated
+        bool directory = false;     ///< Directory rather than regular file
+    };
+
+    /**
+     * @brief Starts walking a directory tree
+     * @param root Directory to list; the root itself is not returned
+     * @param threads Number of directories read at once
+     * @param queueCapacity Entries held for the consumers at most
+     */
+    explicit DirectoryWalker(const std::string& root, unsigned threads = DEFAULT_THREADS,
+                             size_t queueCapacity = DEFAULT_QUEUE_CAPACITY);
+
+    /**
+     * @brief Stops the walk and waits for its threads
+     */
+    ~DirectoryWalker();
+
+    DirectoryWalker(const DirectoryWalker&) = delete;
+    DirectoryWalker& operator=(const DirectoryWalker&) = delete;
+
+    /**
+     * @brief Takes the next entry, waiting for the walk to find one; safe to call from many threads
+     * @param entry Set to the entry
+     * @return false once the walk is complete (or cancelled) and every entry was taken
+     */
+    bool next(Entry& entry);
+
+    /**
+     * @brief Abandons the walk; next() returns false from now on
+     */
+    void cancel();
+
+    /**
+     * @brief Returns the number of directories that could not be read
+     */
+    size_t errorCount();
+
+private:
+    void walk(const std::string& path, const std::string& relativePath);
+    bool emit(Entry entry);
+    void finishDirectory();
+
+    std::mutex mutex;
+    std::condition_variable entryAdded;     ///< Signalled when an entry is queued or the walk ends
+    std::condition_variable entryTaken;     ///< Signalled when there is room in the queue
+    std::deque<Entry> queue;                ///< Entries found but not taken, guarded by mutex
+    size_t capacity;
+    size_t pendingDirectories = 1;          ///< Directories queued or being read, guarded by mutex
+    size_t errors = 0;                      ///< Guarded by mutex
+    bool cancelled = false;                 ///< Guarded by mutex
+    ThreadPool pool;                        ///< Declared last: its threads stop before the rest is destroyed
+};
@@ -0,0 +1,120 @@
+/**
+ * @file DurabilityManager.h
+ * @brief Header file for the durability policy of received files
+ *
+ * This file defines the DurabilityManager class which publishes completed
+ * files under their final names, flushing them to stable storage first when
+ * the policy asks for it.
+ */
+
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "StagedFile.h"
+
+/**
+ * @class DurabilityManager
+ * @brief Flushes, publishes and acknowledges received files according to a policy
+ *
+ * Every receive path hands its finished StagedFile to commit() or submit()
+ * instead of publishing it itself. With Policy::None the file is only
+ * published: fast, but a power failure can leave a published file without
+ * its data. Policy::PerFile fsyncs the file, publishes it and fsyncs its
+ * directory on the receiving thread, which makes each file durable before it
+ * is acknowledged but costs two journal commits per file.
+ *
+ * Policy::GroupCommit hands the file to a committer thread instead. The
+ * committer takes every file queued at that moment as one group: it starts
+ * write-back of all of them (sync_file_range), fdatasyncs and publishes each
+ * and fsyncs every parent directory once. While it works, new files queue up
+ * for the next group, so under load many concurrent receives share the same
+ * flushes and directory syncs. Each caller learns the outcome, and
+ * acknowledges its client, only once its group is durable.
+ *
+ * A file whose directory cannot be flushed after it was published is
+ * withdrawn again, so a file reported as failed never stays at its final
+ * path.
+ */
+class DurabilityManager {
+public:
+    /**
+     * @enum Policy
+     * @brief When received files are flushed to stable storage
+     */
+    enum class Policy {
+        None,           ///< Publish only; the kernel writes the data back later
+        PerFile,        ///< fsync the file and its directory before acknowledging it
+        GroupCommit     ///< Like PerFile, batched across concurrent receives by a committer thread
+    };
+
+    /**
+     * @brief Returns the process-wide manager
+     */
+    static DurabilityManager& instance();
+
+    /**
+     * @brief Parses a policy name: none, per-file or group-commit
+     * @return false if the name is not known
+     */
+    static bool parse(const std::string& name, Policy& policy);
+
+    /**
+     * @brief Replaces the policy; affects files committed afterwards
+     */
+    void setPolicy(Policy policy);
+
+    /**
+     * @brief Returns the policy
+     */
+    Policy getPolicy();
+
+    /**
+     * @brief Publishes a completed file and waits until the policy is satisfied
+     * @param file Open file; closed once published
+     * @return true if the file is at its final path (and durable, unless the policy
+     *         is None); if it could not be flushed or published it is left open for
+     *         the caller to keep or discard
+     */
+    bool commit(StagedFile& file);
+
+    /**
+     * @brief Publishes a completed file without waiting for it
+     * @param file Open file; discarded if it cannot be published
+     * @param committed Called once the future is ready, on the committer thread
+     *                  under GroupCommit; may be empty
+     * @return Future for the result commit() would return; already ready unless
+     *         the policy is GroupCommit
+     */
+    std::future<bool> submit(StagedFile&& file, std::function<void()> committed = nullptr);
+
+private:
+    /**
+     * @struct Pending
+     * @brief A file queued for the committer thread
+     */
+    struct Pending {
+        StagedFile file;
+        std::promise<bool> done;
+        StagedFile* owner;          ///< Where commit() waits to get the file back, or nullptr
+        std::function<void()> committed;    ///< Called after done is set, if not empty
+    };
+
+    DurabilityManager() = default;
+    ~DurabilityManager();
+
+    void startCommitter(std::unique_lock<std::mutex>& lock);
+    void run();
+    void commitGroup(std::vector<Pending>& group);
+
+    std::mutex mutex;
+    std::condition_variable queued;     ///< Signalled when files are queued or the manager stops
+    Policy policy = Policy::None;       ///< Guarded by mutex
+    std::vector<Pending> queue;         ///< Files waiting for the next group, guarded by mutex
+    bool stopping = false;              ///< Guarded by mutex
+    std::thread committer;              ///< Started with the first group commit
+};
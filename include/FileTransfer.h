@@ -8,9 +8,16 @@
 
 #pragma once
 #include <string>
+#include <cstddef>
 #include <cstdint>
 #include <atomic>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include "BandwidthManager.h"
+#include "Checksum.h"
+
+class ChunkSizePolicy;
 
 /**
  * @class FileTransfer
@@ -20,24 +27,216 @@ class FileTransfer {
 public:
     static constexpr int MAX_RETRIES = 3;           ///< Maximum number of retry attempts
     static constexpr int RETRY_DELAY_MS = 1000;     ///< Delay between retries in milliseconds
-    static constexpr int BASE_TRANSFER_RATE = 20;   ///< Base transfer rate in KB/s
+    static constexpr size_t UNTIL_EOF = SIZE_MAX;   ///< Range length meaning "to the end of the file/stream"
+    static constexpr uint64_t RESUME_TAIL_BYTES = 64 * 1024;  ///< Bytes of a .part file compared before resuming
+    static constexpr size_t MIN_SPARSE_HOLE = 64 * 1024;    ///< Shorter holes are sent as zeros with their extents
+    static constexpr uint64_t CRASH_SAFE_BYTES = 16 * 1024 * 1024;  ///< Receives at least this large keep a
+                                                                    ///< .part a crashed server can resume
+
+    /**
+     * @enum SendMode
+     * @brief Engine used to put file data on the wire
+     */
+    enum class SendMode {
+        Auto,      ///< sendfile, or mmap above MmapOptions::autoThreshold; buffered for non-regular files
+        Buffered,  ///< read() into user-space buffers, then send() (MSG_ZEROCOPY if enabled)
+        SendFile,  ///< sendfile(2), no user-space copy
+        Mmap,      ///< writev() straight from a memory mapping of the file
+        IoUring    ///< Linked read/send SQEs on the shared IoUringEngine
+    };
+
+    /**
+     * @enum ReceiveMode
+     * @brief Engine used to move received data into the file
+     */
+    enum class ReceiveMode {
+        Auto,      ///< Currently the same as Splice
+        Buffered,  ///< recv() into a user-space buffer, then write()
+        Splice,    ///< splice(2) socket -> pipe -> file, no user-space copy
+        IoUring,   ///< recv/write SQEs on the shared IoUringEngine
+        Direct     ///< O_DIRECT writes from aligned buffers, bypassing the page cache
+    };
+
+    /**
+     * @brief Runs a task on a thread that may block, e.g. by queueing it on a thread pool
+     */
+    using Executor = std::function<void(std::function<void()>)>;
+
+    /**
+     * @brief Receives the result of an asynchronous file transfer
+     */
+    using Continuation = std::function<void(bool success)>;
+
+    /**
+     * @brief Receives the result of an asynchronous range transfer
+     */
+    using RangeContinuation = std::function<void(bool success, size_t bytes)>;
+
+    /**
+     * @struct MmapOptions
+     * @brief Process-wide tunables of the mmap send engine
+     */
+    struct MmapOptions {
+        size_t autoThreshold = 0;                   ///< SendMode::Auto uses mmap for files this large (0 = never)
+        size_t addressBudget = 512 * 1024 * 1024;   ///< Address space one transfer may map at a time
+        bool populate = false;                      ///< Prefault each window with MAP_POPULATE
+    };
 
     /**
      * @brief Sends a file over a socket connection
      * @param socket Socket descriptor
      * @param filename Path to the file to send
+     * @param mode Engine to use for this transfer
      * @return true if successful, false otherwise
+     *
+     * Starts with the resume handshake, so the peer must call receiveFile().
+     * Files with holes are sent as their data extents only.
+     */
+    static bool sendFile(int socket, const std::string& filename, SendMode mode = SendMode::Auto);
+
+    /**
+     * @brief Sends a file like sendFile(), without holding the calling thread during the data phase
+     * @param socket Socket descriptor; must stay open until done is called
+     * @param filename Path to the file to send
+     * @param mode Engine to use for this transfer
+     * @param executor Runs the rest of the transfer once the engine has moved the data
+     * @param done Called once with the result, on the calling thread or through executor
+     *
+     * With SendMode::IoUring the handshake runs on the calling thread, the
+     * data is handed to the IoUringEngine and the call returns; the trailer
+     * and the commit acknowledgement follow through executor. Transfers the
+     * engine cannot carry (sparse files, checksums, streams) run to the end
+     * before the call returns, as do all transfers in other modes.
      */
-    static bool sendFile(int socket, const std::string& filename);
+    static void sendFileAsync(int socket, const std::string& filename, SendMode mode, const Executor& executor,
+                              Continuation done);
+
+    /**
+     * @brief Sends part of a file over a socket connection
+     * @param socket Socket descriptor
+     * @param filename Path to the file to send
+     * @param offset Offset of the first byte to send
+     * @param length Number of bytes to send, or UNTIL_EOF for the rest of the file
+     * @param flow Flow of the logical transfer the range belongs to, from openFlow()
+     * @param mode Engine to use for this transfer
+     * @return true if successful, false otherwise
+     */
+    static bool sendFileRange(int socket, const std::string& filename, size_t offset, size_t length,
+                              BandwidthManager::Flow& flow, SendMode mode = SendMode::Auto);
 
     /**
      * @brief Receives a file over a socket connection
      * @param socket Socket descriptor
      * @param filename Path where to save the received file
      * @param printContent Whether to print the file content after receiving
+     * @param mode Engine to use for this transfer
      * @return true if successful, false otherwise
+     *
+     * Resumes from filename + ".part" when it holds the start of the same
+     * file; otherwise receives into an unnamed StagedFile. On failure the data
+     * received so far is kept as filename + ".part" so a later call can resume
+     * again. When a checksum was negotiated the file is published only if it
+     * matches the sender's trailer, which covers the resumed prefix too, and
+     * discarded if it does not. Holes of a
+     * sparse source file stay holes in the received one. Publishing goes
+     * through the DurabilityManager, and a sender of known size is told the
+     * outcome only once it is done.
+     */
+    static bool receiveFile(int socket, const std::string& filename, bool printContent = false,
+                            ReceiveMode mode = ReceiveMode::Auto);
+
+    /**
+     * @brief Receives a file like receiveFile(), without holding the calling thread during the data phase
+     * @param socket Socket descriptor; must stay open until done is called
+     * @param filename Path where to save the received file
+     * @param mode Engine to use for this transfer
+     * @param executor Runs the rest of the transfer once the engine has stored the data
+     * @param done Called once with the result, on the calling thread or through executor
+     *
+     * The counterpart of sendFileAsync(): with ReceiveMode::IoUring the data
+     * phase runs on the engine and the trailer check, commit and
+     * acknowledgement follow through executor.
+     */
+    static void receiveFileAsync(int socket, const std::string& filename, ReceiveMode mode,
+                                 const Executor& executor, Continuation done);
+
+    /**
+     * @brief Receives data from a socket into part of an open file
+     * @param socket Socket descriptor
+     * @param fd Descriptor of the file to write; its position is not used
+     * @param offset Offset in the file at which to store the first byte
+     * @param length Number of bytes expected, or UNTIL_EOF to receive until the peer closes
+     * @param flow Flow of the logical transfer the range belongs to, from openFlow()
+     * @param mode Engine to use for this transfer
+     * @param bytesReceived If not null, set to the number of bytes stored
+     * @param checksum If not null, fed every byte received (forces ReceiveMode::Buffered
+     *                 unless mode is ReceiveMode::Direct)
+     * @return true if all expected bytes were stored, false otherwise
+     */
+    static bool receiveRange(int socket, int fd, size_t offset, size_t length, BandwidthManager::Flow& flow,
+                             ReceiveMode mode = ReceiveMode::Auto, size_t* bytesReceived = nullptr,
+                             StreamChecksum* checksum = nullptr);
+
+    /**
+     * @brief Receives into part of an open file like receiveRange(), without holding the calling thread
+     * @param socket Socket descriptor; must stay open until done is called
+     * @param fd Descriptor of the file to write; must stay open until done is called
+     * @param offset Offset in the file at which to store the first byte
+     * @param length Number of bytes expected, or UNTIL_EOF to receive until the peer closes
+     * @param flow Flow of the logical transfer; must stay open until done is called
+     * @param mode Engine to use; only ReceiveMode::IoUring returns before the data has arrived
+     * @param executor Runs done once the engine has stored the data
+     * @param done Called once with the result and the number of bytes stored
+     */
+    static void receiveRangeAsync(int socket, int fd, size_t offset, size_t length, BandwidthManager::Flow& flow,
+                                  ReceiveMode mode, const Executor& executor, RangeContinuation done);
+
+    /**
+     * @brief Reserves disk space for data about to be written to a file
+     * @param fd Descriptor of the file
+     * @param offset Offset of the first byte that will be written
+     * @param length Number of bytes that will be written
+     * @return false if the file system is out of space, true otherwise
+     *
+     * Allocates the whole range in one go so it lands in few, contiguous
+     * extents instead of growing one small write at a time. The size of the
+     * file is left alone: it only grows as data is written, so a file left by
+     * a crash never looks longer than what arrived. File systems that cannot
+     * preallocate are left alone too; the writes then allocate as usual.
+     */
+    static bool preallocate(int fd, size_t offset, size_t length);
+
+    /**
+     * @brief Sends exactly size bytes, continuing after partial sends
+     * @return true if every byte was sent
+     */
+    static bool sendChunk(int socket, const char* data, size_t size);
+
+    /**
+     * @brief Receives exactly size bytes, continuing after partial reads
+     * @return true if every byte was received, false on error or early close
+     */
+    static bool receiveChunk(int socket, char* data, size_t size);
+
+    /**
+     * @brief Opens a BandwidthManager flow for a transfer on a connected socket
+     * @param socket Socket descriptor; its peer address is the client key
+     *
+     * Opening a flow rebalances every client of the bandwidth manager, so
+     * it is done once where a logical transfer starts, and the flow is
+     * handed to every range and engine call the transfer makes.
+     */
+    static std::unique_ptr<BandwidthManager::Flow> openFlow(int socket);
+
+    /**
+     * @brief Waits until the bandwidth manager admits bytes for a transfer
+     * @param flow Flow of the transfer
+     * @param wanted Number of bytes the caller would like to move
+     * @return Number of bytes the caller may move now (between 1 and wanted)
+     *
+     * Unused bytes must be handed back with BandwidthManager::Flow::refund().
      */
-    static bool receiveFile(int socket, const std::string& filename, bool printContent = false);
+    static size_t admit(BandwidthManager::Flow& flow, size_t wanted);
 
     /**
      * @brief Prints the contents of a file to stdout
@@ -45,12 +244,152 @@ public:
      */
     static void printFileContent(const std::string& filename);
 
+    /**
+     * @brief Replaces the mmap send engine tunables
+     * @param options New options; affect transfers started afterwards
+     */
+    static void setMmapOptions(const MmapOptions& options);
+
+    /**
+     * @brief Returns a copy of the mmap send engine tunables
+     */
+    static MmapOptions getMmapOptions();
+
+    /**
+     * @brief Selects the checksum this process asks for when it sends or receives a file
+     * @param algorithm Algorithm; the peer's request takes precedence when it makes one
+     */
+    static void setChecksumAlgorithm(ChecksumAlgorithm algorithm);
+
+    /**
+     * @brief Returns the checksum this process asks for
+     */
+    static ChecksumAlgorithm getChecksumAlgorithm();
+
+    /**
+     * @brief Selects whether the buffered send engine uses MSG_ZEROCOPY
+     * @param enabled true to send user-space buffers without copying them
+     *
+     * Pays off for large sends to a real network device; on loopback the
+     * kernel copies anyway and the engine falls back to plain sends.
+     */
+    static void setZeroCopySend(bool enabled);
+
+    /**
+     * @brief Returns whether the buffered send engine uses MSG_ZEROCOPY
+     */
+    static bool getZeroCopySend();
+
 private:
+    /**
+     * @struct ResumeOffer
+     * @brief Sent by the receiver before any data: what its .part file holds
+     */
+    struct ResumeOffer {
+        uint64_t partSize;      ///< Size of the existing .part file (0 if none)
+        uint64_t tailLength;    ///< Number of bytes hashed at the end of it
+        uint64_t tailHash;      ///< xxHash64 of those bytes
+        ChecksumAlgorithm checksum; ///< Checksum the receiver wants (None to leave it to the sender)
+        uint32_t flags;         ///< TRANSFER_* features the receiver understands
+    };
+
+    /**
+     * @struct ResumeReply
+     * @brief Sent by the sender in answer to a ResumeOffer
+     */
+    struct ResumeReply {
+        uint64_t offset;        ///< Offset the data starts at: partSize if the tails match, else 0
+        uint64_t fileSize;      ///< Size of the whole file, or UNTIL_EOF if not known in advance
+        ChecksumAlgorithm checksum; ///< Checksum of the whole file, sent as a trailer after the data
+        uint32_t flags;         ///< TRANSFER_* features the data is sent with
+    };
+
+    static constexpr uint32_t TRANSFER_SPARSE = 1;  ///< Data goes as ExtentHeader-framed extents
+    static constexpr uint32_t TRANSFER_COMMIT_ACK = 2;  ///< Receiver answers COMMIT_OK/FAILED after the data
+    static constexpr char COMMIT_OK = 'K';          ///< File published under the durability policy
+    static constexpr char COMMIT_FAILED = 'F';      ///< File not published
+
+    /**
+     * @struct ExtentHeader
+     * @brief Precedes each data extent of a sparse transfer
+     *
+     * Extents come in increasing offset order; the bytes between them are
+     * holes. The last header has length 0 and offset equal to the file size.
+     */
+    struct ExtentHeader {
+        uint64_t offset;        ///< Offset in the file of the first byte that follows
+        uint64_t length;        ///< Number of bytes that follow
+    };
+
+    /**
+     * @brief Produces the extents of a sparse transfer one at a time
+     *
+     * Walks the file on the sending side and reads the headers off the
+     * socket on the receiving one. Sets the next extent, with length 0 once
+     * there are none left; returns false if the transfer has failed.
+     */
+    using ExtentSource = std::function<bool(ExtentHeader& extent)>;
+
     static std::atomic<int> activeTransfers;  ///< Counter for active transfers
     static std::mutex transferMutex;          ///< Mutex for thread safety
+    static MmapOptions mmapOptions;           ///< Guarded by transferMutex
+    static ChecksumAlgorithm checksumAlgorithm; ///< Guarded by transferMutex
+    static bool zeroCopySend;                 ///< Guarded by transferMutex
+
+    struct SendState;
+    struct ReceiveState;
+
+    // Phases shared by the synchronous and asynchronous transfers
+    static std::shared_ptr<SendState> beginSend(int socket, const std::string& filename);
+    static bool sendData(int socket, SendState& state, SendMode mode);
+    static bool finishSend(int socket, SendState& state, bool sent);
+    static std::shared_ptr<ReceiveState> beginReceive(int socket, const std::string& filename);
+    static bool receiveData(int socket, ReceiveState& state, ReceiveMode mode);
+    static bool finishReceive(int socket, ReceiveState& state, bool received, bool printContent);
 
     // Private helper methods
-    static bool sendChunk(int socket, const char* data, size_t size);
-    static bool receiveChunk(int socket, char* data, size_t size);
-    static size_t calculateChunkSize();
+    static bool hashTail(int fd, uint64_t end, uint64_t tailLength, uint64_t& hash);
+    static bool hashPrefix(int fd, uint64_t length, StreamChecksum& checksum);
+    static bool sendOpenFile(int socket, int fd, size_t offset, size_t length, SendMode mode,
+                             BandwidthManager::Flow& flow, StreamChecksum* checksum = nullptr,
+                             ChunkSizePolicy* policy = nullptr);
+    static bool hasHoles(int fd, size_t offset, size_t fileSize);
+    static bool findExtent(int fd, size_t position, size_t fileSize, ExtentHeader& extent);
+    static bool sendExtent(int socket, const ExtentHeader& extent, StreamChecksum* checksum);
+    static bool sendSparse(int socket, int fd, size_t offset, size_t fileSize, SendMode mode,
+                           BandwidthManager::Flow& flow, StreamChecksum* checksum);
+    static bool receiveSparse(int socket, int fd, size_t offset, size_t fileSize, ReceiveMode mode,
+                              BandwidthManager::Flow& flow, StreamChecksum* checksum,
+                              size_t& totalBytesReceived, size_t& validEnd);
+    static ReceiveMode receiveModeFor(ReceiveMode mode, StreamChecksum*& checksum);
+    static bool receiveWith(int socket, int fd, size_t offset, size_t length, ReceiveMode mode,
+                            BandwidthManager::Flow& flow, ChunkSizePolicy& policy, size_t& totalBytesReceived,
+                            StreamChecksum* checksum);
+
+    // Send engines
+    static bool sendFileZeroCopy(int socket, int fd, size_t offset, size_t length, BandwidthManager::Flow& flow,
+                                 ChunkSizePolicy& policy);
+    static bool sendFileBuffered(int socket, int fd, size_t length, BandwidthManager::Flow& flow,
+                                 ChunkSizePolicy& policy, StreamChecksum* checksum = nullptr,
+                                 const ExtentSource* extents = nullptr);
+    static bool sendFileMmap(int socket, int fd, size_t offset, size_t length, BandwidthManager::Flow& flow,
+                             ChunkSizePolicy& policy, StreamChecksum* checksum = nullptr);
+    static bool sendFileIoUring(int socket, int fd, size_t offset, size_t length, BandwidthManager::Flow& flow);
+
+    // Receive engines
+    static bool receiveFileSplice(int socket, int fd, size_t offset, size_t length,
+                                  size_t& totalBytesReceived, BandwidthManager::Flow& flow,
+                                  ChunkSizePolicy& policy);
+    static bool receiveFileBuffered(int socket, int fd, size_t offset, size_t length,
+                                    size_t& totalBytesReceived, BandwidthManager::Flow& flow,
+                                    ChunkSizePolicy& policy, StreamChecksum* checksum = nullptr);
+    static bool receiveFileIoUring(int socket, int fd, size_t offset, size_t length,
+                                   size_t& totalBytesReceived, BandwidthManager::Flow& flow);
+    static bool receivePipelined(int socket, int fd, int directFd, size_t offset, size_t length,
+                                 size_t& totalBytesReceived, BandwidthManager::Flow& flow,
+                                 ChunkSizePolicy& policy, StreamChecksum* checksum,
+                                 const ExtentSource* extents = nullptr, size_t* validEnd = nullptr);
+    static bool receiveFileDirect(int socket, int fd, size_t offset, size_t length,
+                                  size_t& totalBytesReceived, BandwidthManager::Flow& flow,
+                                  ChunkSizePolicy& policy, StreamChecksum* checksum = nullptr);
 }; 
\ No newline at end of file
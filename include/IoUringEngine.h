@@ -0,0 +1,112 @@
+/**
+ * @file IoUringEngine.h
+ * @brief Header file for the io_uring transfer engine
+ *
+ * This file defines the IoUringEngine class which moves file data between
+ * files and sockets for many transfers at once using Linux io_uring.
+ */
+
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "BandwidthManager.h"
+
+/**
+ * @class IoUringEngine
+ * @brief Drives the data phase of many concurrent transfers from a few threads
+ *
+ * The engine owns a small number of rings, each served by one thread. A
+ * transfer is handed to a ring as a job; the ring thread then issues its
+ * file reads/writes and socket sends/recvs as SQEs, batching the submissions
+ * of every job on the ring into a single io_uring_enter() call.
+ *
+ * Sends are issued as a READ_FIXED linked to a SEND of the same registered
+ * buffer. Receives alternate two registered buffers so the WRITE_FIXED of one
+ * chunk overlaps the RECV of the next. Sockets and files are installed in
+ * the ring's fixed file table for the lifetime of the job.
+ *
+ * Only available on Linux kernels with io_uring; instance() returns nullptr
+ * elsewhere and callers fall back to their synchronous engines.
+ */
+class IoUringEngine {
+public:
+    /**
+     * @struct Options
+     * @brief Sizing of the engine, fixed when the engine starts
+     *
+     * The registered buffers are pinned memory; when RLIMIT_MEMLOCK is too
+     * low for them, the engine starts with smaller buffers and fewer jobs
+     * per ring than asked for.
+     */
+    struct Options {
+        unsigned rings = 2;                 ///< Number of rings (and threads)
+        unsigned queueDepth = 256;          ///< Submission queue entries per ring
+        unsigned maxJobsPerRing = 128;      ///< Concurrent jobs per ring; more wait in a queue
+        size_t bufferSize = 256 * 1024;     ///< Size of each registered buffer
+    };
+
+    /**
+     * @brief Completion callback, run on the ring thread
+     * @param success Whether the job moved all of its data
+     * @param bytes Number of bytes moved
+     */
+    using Completion = std::function<void(bool success, size_t bytes)>;
+
+    /**
+     * @brief Sets the options used when the engine is first started
+     * @param options Engine sizing; ignored once instance() has been called
+     */
+    static void configure(const Options& options);
+
+    /**
+     * @brief Returns the process-wide engine, starting it on first use
+     * @return The engine, or nullptr if io_uring is not available
+     */
+    static IoUringEngine* instance();
+
+    /**
+     * @brief Queues sending part of a file over a socket
+     * @param socket Socket descriptor
+     * @param fileFd Descriptor of the file to read
+     * @param offset Offset in the file of the first byte to send
+     * @param length Number of bytes to send
+     * @param flow Bandwidth manager flow pacing this transfer; must outlive the job
+     * @param completion Called once the job finishes
+     */
+    void submitSend(int socket, int fileFd, size_t offset, size_t length,
+                    BandwidthManager::Flow& flow, Completion completion);
+
+    /**
+     * @brief Queues receiving from a socket into a file
+     * @param socket Socket descriptor
+     * @param fileFd Descriptor of the file to write
+     * @param offset Offset in the file at which to store the first byte
+     * @param length Number of bytes expected, or SIZE_MAX to read until the peer closes
+     * @param flow Bandwidth manager flow pacing this transfer; must outlive the job
+     * @param completion Called once the job finishes
+     */
+    void submitReceive(int socket, int fileFd, size_t offset, size_t length,
+                       BandwidthManager::Flow& flow, Completion completion);
+
+    ~IoUringEngine();
+
+private:
+    struct Job;
+    class Ring;
+
+    explicit IoUringEngine(const Options& options);
+
+    std::vector<std::unique_ptr<Ring>> rings;   ///< One ring per thread
+    std::vector<std::thread> threads;           ///< Ring threads
+    size_t nextRing;                            ///< Round-robin cursor for new jobs
+    std::mutex mutex;                           ///< Guards nextRing
+
+    static Options options;                     ///< Options for the first start
+    static std::mutex optionsMutex;             ///< Guards options
+
+    void submit(std::unique_ptr<Job> job);
+};
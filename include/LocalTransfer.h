@@ -0,0 +1,122 @@
+/**
+ * @file LocalTransfer.h
+ * @brief Header file for same-host transfers over Unix domain sockets
+ *
+ * This file defines the LocalTransfer class which lets a client on the
+ * server's machine hand over an open file instead of streaming its bytes.
+ */
+
+#pragma once
+#include <string>
+
+/**
+ * @class LocalTransfer
+ * @brief Same-host fast path: Unix domain sockets and file descriptor passing
+ *
+ * The server also listens on a Unix domain socket, and a client whose server
+ * address belongs to this machine connects there instead of over TCP. Every
+ * command works on that connection, without the loopback TCP stack and
+ * without TLS. That is only sound while the socket cannot be impersonated:
+ * the default socket lives in a directory private to the user, the socket
+ * file is mode 0600, and both ends check the peer's credentials. Neither
+ * end uses the socket when TLS is configured, since the user asked for an
+ * authenticated server.
+ *
+ * On such a connection an upload uses the 'L' command: after the remote path
+ * the client sends one byte carrying the open source file as SCM_RIGHTS
+ * ancillary data. The server copies it into a StagedFile entirely in the
+ * kernel, sharing the extents (FICLONE) when both files are on a
+ * reflink-capable file system and with copy_file_range(2) otherwise, then
+ * publishes it and answers with ACK_OK or ACK_FAILED. No data crosses the
+ * socket, so the copy is neither paced by the BandwidthManager nor
+ * checksummed.
+ */
+class LocalTransfer {
+public:
+    static constexpr char COMMAND = 'L';        ///< Command byte of a descriptor-passing upload
+    static constexpr char ACK_OK = 'K';         ///< File copied
+    static constexpr char ACK_FAILED = 'F';     ///< File not copied
+
+    /**
+     * @brief Returns the socket path a server on the given TCP port listens on by default
+     * @param port TCP port of the server
+     * @return A path inside defaultSocketDirectory()
+     */
+    static std::string defaultSocketPath(int port);
+
+    /**
+     * @brief Returns the directory holding the default sockets of this user
+     * @return $XDG_RUNTIME_DIR/filetransfer, or /tmp/filetransfer-<uid> without it
+     */
+    static std::string defaultSocketDirectory();
+
+    /**
+     * @brief Creates a directory only its owner may enter, or checks an existing one
+     * @param path Directory path
+     * @return false, with the reason reported, if it exists but is not ours or not mode 0700
+     */
+    static bool makePrivateDirectory(const std::string& path);
+
+    /**
+     * @brief Tells whether the process at the other end runs as this user or as root
+     * @param socket Connected Unix domain socket
+     */
+    static bool trustedPeer(int socket);
+
+    /**
+     * @brief Creates a listening Unix domain socket, replacing a stale socket file
+     * @param path Path of the socket file, made mode 0600
+     * @return Socket descriptor, or -1 with the reason reported
+     */
+    static int listen(const std::string& path);
+
+    /**
+     * @brief Connects to a server's Unix domain socket
+     * @param path Path of the socket file
+     * @return Socket descriptor, or -1 if nothing listens there or the server is not trustedPeer()
+     */
+    static int connect(const std::string& path);
+
+    /**
+     * @brief Tells whether a connected socket is a Unix domain socket
+     */
+    static bool isLocalSocket(int socket);
+
+    /**
+     * @brief Tells whether an IP address is one of this machine's
+     * @param ip Textual IPv4 or IPv6 address
+     * @return true for loopback addresses and addresses of local interfaces
+     */
+    static bool isLocalAddress(const std::string& ip);
+
+    /**
+     * @brief Passes a file descriptor to the peer as SCM_RIGHTS on a one-byte message
+     * @param socket Unix domain socket
+     * @param fd Descriptor to pass; the caller keeps its own and closes it when done
+     * @return true if the message was sent
+     */
+    static bool sendDescriptor(int socket, int fd);
+
+    /**
+     * @brief Receives the one-byte message that carries a descriptor from sendDescriptor()
+     * @param socket Unix domain socket
+     * @return The new descriptor (close-on-exec), or -1 if none arrived
+     */
+    static int receiveDescriptor(int socket);
+
+    /**
+     * @brief Hands a file to the peer and waits for it to be copied
+     * @param socket Unix domain socket, positioned just after the remote path
+     * @param filename Path to the file to send
+     * @return true if the peer stored the file, false otherwise
+     */
+    static bool sendFile(int socket, const std::string& filename);
+
+    /**
+     * @brief Receives a file descriptor from the peer and copies its file
+     * @param socket Unix domain socket, positioned just after the remote path
+     * @param filename Path where to save the file
+     * @return true if the file was copied and published, false otherwise
+     */
+    static bool receiveFile(int socket, const std::string& filename);
+};
@@ -0,0 +1,138 @@
+/**
+ * @file ParallelTransfer.h
+ * @brief Header file for multi-stream range transfers
+ *
+ * This file defines the ParallelTransfer class which moves one file over
+ * several TCP connections at once, each carrying a byte range of the file.
+ */
+
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "FileTransfer.h"
+#include "StagedFile.h"
+
+/**
+ * @class ParallelTransfer
+ * @brief Splits a file into byte ranges sent over parallel connections
+ *
+ * A single connection is limited to one congestion window, which caps
+ * throughput on long, fat links. The sender instead opens one connection per
+ * range; each starts with the 'P' command and the remote path like a normal
+ * upload, followed by a RangeHeader and exactly header.length bytes of data.
+ *
+ * The receiver creates the StagedFile once, allocated for the whole file, and
+ * every connection writes its range at its own offset. The file is published
+ * only when all ranges of the transfer have been stored, and discarded if
+ * any of them failed. Each connection is answered with a single byte,
+ * ACK_OK or ACK_FAILED, once its range is on disk. The ranges of a
+ * transfer share one BandwidthManager flow on each end, so a rate limit
+ * applies to the transfer as a whole however many streams it uses.
+ *
+ * A transfer whose remaining ranges never connect (the sender died) is
+ * expired once no range has been in progress for ASSEMBLY_TIMEOUT: its
+ * file is discarded and a new transfer of the same path may start.
+ */
+class ParallelTransfer {
+public:
+    static constexpr char COMMAND = 'P';                    ///< Command byte of a range connection
+    static constexpr char ACK_OK = 'K';                     ///< Range stored
+    static constexpr char ACK_FAILED = 'F';                 ///< Range not stored
+    static constexpr uint64_t RANGE_ALIGNMENT = 1 << 20;    ///< Ranges start on 1 MiB boundaries
+    static constexpr std::chrono::seconds ASSEMBLY_TIMEOUT{60};  ///< Idle time after which a transfer is abandoned
+
+    /**
+     * @struct RangeHeader
+     * @brief Describes the range carried by one connection
+     *
+     * Sent as raw bytes in host byte order, like the path length that precedes it.
+     */
+    struct RangeHeader {
+        uint64_t transferId;    ///< Identifies the connections belonging to one transfer
+        uint64_t fileSize;      ///< Size of the whole file
+        uint64_t offset;        ///< Offset of the first byte of this range
+        uint64_t length;        ///< Number of bytes in this range
+        uint32_t streams;       ///< Number of ranges in the transfer
+        uint32_t index;         ///< Index of this range, from 0 to streams - 1
+    };
+
+    /**
+     * @brief Splits a file into at most streams ranges
+     * @param transferId Identifier written into every header
+     * @param fileSize Size of the file in bytes
+     * @param streams Requested number of connections
+     * @return One header per range; fewer than streams if the file is small
+     */
+    static std::vector<RangeHeader> planRanges(uint64_t transferId, uint64_t fileSize, unsigned streams);
+
+    /**
+     * @brief Sends one range on a connected socket and waits for its acknowledgement
+     * @param socket Socket descriptor
+     * @param localFile Path to the local file
+     * @param remotePath Path where the server should save the file
+     * @param header Range to send
+     * @param flow Flow shared by all ranges of the transfer
+     * @return true if the server stored the range, false otherwise
+     */
+    static bool sendRange(int socket, const std::string& localFile, const std::string& remotePath,
+                          const RangeHeader& header, BandwidthManager::Flow& flow);
+
+    /**
+     * @brief Receives one range of a file and acknowledges it
+     * @param socket Socket descriptor, positioned just after the remote path
+     * @param filename Path where the file is being assembled
+     * @param mode Engine to use for this range
+     * @return true if the range was stored, false otherwise
+     */
+    static bool receiveRange(int socket, const std::string& filename,
+                             FileTransfer::ReceiveMode mode = FileTransfer::ReceiveMode::Auto);
+
+    /**
+     * @brief Receives one range like receiveRange(), without holding the calling thread
+     *
+     * With ReceiveMode::IoUring the range is stored by the engine and the
+     * rest (finishing the assembly, the acknowledgement and done) runs
+     * through executor; otherwise everything happens before returning.
+     * @param done Called with whether the range was stored
+     */
+    static void receiveRangeAsync(int socket, const std::string& filename, FileTransfer::ReceiveMode mode,
+                                  const FileTransfer::Executor& executor, FileTransfer::Continuation done);
+
+    /**
+     * @brief Discards the assemblies abandoned for longer than ASSEMBLY_TIMEOUT
+     *
+     * Called for every new range, and periodically by the server so that
+     * the files of abandoned transfers do not wait for the next one.
+     */
+    static void expireAssemblies();
+
+private:
+    /**
+     * @struct Assembly
+     * @brief A file being assembled from ranges on the receiving side
+     */
+    struct Assembly {
+        uint64_t transferId;            ///< Transfer the ranges belong to
+        uint64_t fileSize;              ///< Expected size of the file
+        std::vector<bool> arrived;      ///< Ranges that have connected, by index
+        uint32_t finished = 0;          ///< Ranges whose connection has ended
+        bool failed = false;            ///< Some range could not be stored
+        std::chrono::steady_clock::time_point lastActivity;  ///< When a range last connected or ended
+        StagedFile file;                ///< File the ranges are written to
+        std::unique_ptr<BandwidthManager::Flow> flow;   ///< Paces all ranges together, opened by the first
+    };
+
+    static std::map<std::string, std::shared_ptr<Assembly>> assemblies;   ///< Active assemblies by path
+    static std::mutex assemblyMutex;                                      ///< Guards assemblies
+
+    static std::shared_ptr<Assembly> beginRange(int socket, const std::string& filename, RangeHeader& header);
+    static std::shared_ptr<Assembly> join(int socket, const std::string& filename, const RangeHeader& header);
+    static bool finish(const std::string& filename, Assembly& assembly, bool stored);
+    static bool abandoned(const Assembly& assembly, std::chrono::steady_clock::time_point now);
+    static void expireLocked(std::chrono::steady_clock::time_point now);
+};
@@ -0,0 +1,150 @@
+/**
+ * @file SharedMemoryRing.h
+ * @brief Header file for the shared-memory ring transport
+ *
+ * This file defines the SharedMemoryRing class which streams data between a
+ * client and a server on the same machine through memory both have mapped.
+ */
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/**
+ * @class SharedMemoryRing
+ * @brief Byte ring in a memfd, shared by one producer and one consumer process
+ *
+ * The ring is a memfd holding a control page and a power-of-two data area.
+ * The producer only writes tail and the consumer only writes head, like
+ * SpscRing, so handing over data is a store to shared memory. Each side
+ * reads from or writes to the data area in place, with no copy to or from a
+ * socket.
+ *
+ * A side that finds the ring empty (or full) spins briefly, then sleeps on a
+ * futex word in the control page. The other side calls FUTEX_WAKE only when
+ * it sees that a waiter announced itself, so a stream that keeps both sides
+ * busy costs no system call per chunk. Waits time out every
+ * WAIT_TIMEOUT_MS to check the connection the ring was set up on, so a
+ * peer that dies does not leave the other side waiting forever.
+ *
+ * A transfer uses the 'M' command on a Unix domain socket: the client creates
+ * the ring, passes the memfd with SCM_RIGHTS and produces the file's data
+ * into it, then closes the ring; the server stores the data through a staged
+ * file and answers on the socket with ACK_OK or ACK_FAILED. The source does
+ * not need to be a regular file, so data generated by another program
+ * (through a pipe or /dev/stdin) gets the same path. The memfd is sealed
+ * against resizing, so the client cannot make the server's mapping fault.
+ *
+ * Requires Linux (memfd_create and futex); elsewhere create() and attach()
+ * fail and clients use the other transports.
+ */
+class SharedMemoryRing {
+public:
+    static constexpr char COMMAND = 'M';                    ///< Command byte of a shared-memory upload
+    static constexpr char ACK_OK = 'K';                     ///< File stored
+    static constexpr char ACK_FAILED = 'F';                 ///< File not stored
+    static constexpr size_t DEFAULT_CAPACITY = 8 * 1024 * 1024;  ///< Data area of a ring
+    static constexpr size_t MAX_CAPACITY = 1024 * 1024 * 1024;   ///< Largest data area accepted by attach()
+    static constexpr int WAIT_TIMEOUT_MS = 100;             ///< Futex waits stop this often to check the peer
+
+    /**
+     * @brief Creates a new, empty ring
+     * @param capacity Minimum size of the data area, rounded up to a power of two
+     * @param peerSocket Connection to the other side, checked while waiting (-1 for none)
+     * @return The ring, or nullptr if it could not be created
+     */
+    static std::unique_ptr<SharedMemoryRing> create(size_t capacity = DEFAULT_CAPACITY, int peerSocket = -1);
+
+    /**
+     * @brief Maps a ring created by another process
+     * @param fd memfd received from the creator; the ring takes ownership of it
+     * @param peerSocket Connection to the other side, checked while waiting (-1 for none)
+     * @return The ring, or nullptr if fd is not a valid, sealed ring
+     */
+    static std::unique_ptr<SharedMemoryRing> attach(int fd, int peerSocket = -1);
+
+    ~SharedMemoryRing();
+
+    SharedMemoryRing(const SharedMemoryRing&) = delete;
+    SharedMemoryRing& operator=(const SharedMemoryRing&) = delete;
+
+    /**
+     * @brief Returns the memfd, for passing to the other side
+     */
+    int fd() const { return memoryFd; }
+
+    /**
+     * @brief Waits for free space in the ring (producer only)
+     * @param data Set to the start of the free space
+     * @return Number of contiguous free bytes, or 0 if the consumer went away
+     */
+    size_t reserve(char*& data);
+
+    /**
+     * @brief Publishes bytes written to the space from reserve() (producer only)
+     */
+    void commit(size_t bytes);
+
+    /**
+     * @brief Ends the stream; the consumer sees the end after the last byte (producer only)
+     */
+    void close();
+
+    /**
+     * @brief Waits for data in the ring (consumer only)
+     * @param data Set to the start of the data
+     * @return Number of contiguous bytes available, or 0 at the end of the stream
+     */
+    size_t acquire(const char*& data);
+
+    /**
+     * @brief Frees bytes obtained from acquire() (consumer only)
+     */
+    void release(size_t bytes);
+
+    /**
+     * @brief Stops consuming; the producer's reserve() returns 0 from now on (consumer only)
+     */
+    void abort();
+
+    /**
+     * @brief Tells whether the stream ended with close() rather than a broken ring or peer
+     */
+    bool closedCleanly() const;
+
+    /**
+     * @brief Streams a file or pipe to the peer through a new ring
+     * @param socket Unix domain socket, positioned just after the remote path
+     * @param filename Path to read; need not be a regular file
+     * @return true if the peer stored all the data, false otherwise
+     */
+    static bool sendFile(int socket, const std::string& filename);
+
+    /**
+     * @brief Receives a ring from the peer and stores the data streamed through it
+     * @param socket Unix domain socket, positioned just after the remote path
+     * @param filename Path where to save the file
+     * @return true if the file was received and published, false otherwise
+     */
+    static bool receiveFile(int socket, const std::string& filename);
+
+private:
+    struct Control;
+
+    SharedMemoryRing(int fd, void* mapping, size_t mappingSize, int peerSocket);
+
+    bool wait(std::atomic<uint32_t>& word, uint32_t expected);
+    bool peerAlive();
+
+    int memoryFd;
+    void* mapping;
+    size_t mappingSize;
+    int peerSocket;
+    Control* control;       ///< Shared control page
+    char* data;             ///< Shared data area
+    uint64_t capacity;      ///< Size of the data area, checked once at attach()
+    bool broken = false;    ///< Indices or peer found inconsistent; local to this side
+};
@@ -0,0 +1,187 @@
+/**
+ * @file SpscRing.h
+ * @brief Header file for the single-producer single-consumer ring buffer
+ *
+ * This file defines the SpscRing class which connects the disk stage and
+ * the network stage of a pipelined transfer, each running on its own thread.
+ */
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/**
+ * @class SpscRing
+ * @brief Bounded lock-free queue between exactly one producer and one consumer thread
+ *
+ * The producer only writes tail and the consumer only writes head, so push
+ * and pop need no lock and no read-modify-write instruction; each index sits
+ * on its own cache line to keep the two threads from bouncing it. Capacity
+ * is rounded up to a power of two.
+ *
+ * push() and pop() wait when the ring is full or empty: they spin briefly,
+ * then yield, then block on a condition variable until the other side
+ * moves, so an idle stage costs no CPU. The other side only takes the lock
+ * to notify when someone is blocked. A wait gives up and returns false once
+ * the cancel flag is set; whoever sets it calls wake() so blocked waits
+ * notice.
+ */
+template <typename T>
+class SpscRing {
+public:
+    /**
+     * @brief Creates an empty ring
+     * @param capacity Minimum number of items the ring can hold
+     */
+    explicit SpscRing(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    /**
+     * @brief Appends an item if there is room (producer only)
+     * @return false if the ring is full
+     */
+    bool tryPush(const T& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) > mask) {
+            return false;
+        }
+        slots[t & mask] = item;
+        tail.store(t + 1, std::memory_order_release);
+        notify();
+        return true;
+    }
+
+    /**
+     * @brief Removes the oldest item if there is one (consumer only)
+     * @return false if the ring is empty
+     */
+    bool tryPop(T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = slots[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        notify();
+        return true;
+    }
+
+    /**
+     * @brief Appends an item, waiting for room (producer only)
+     * @param item Item to append
+     * @param cancel Flag that aborts the wait when set
+     * @return true if the item was appended, false if cancelled
+     */
+    bool push(const T& item, const std::atomic<bool>& cancel) {
+        for (unsigned round = 0; !tryPush(item); ++round) {
+            if (cancel.load(std::memory_order_acquire)) return false;
+            if (round < SPIN_ROUNDS) {
+                backOff(round);
+                continue;
+            }
+            block([&] {
+                return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire) <= mask ||
+                       cancel.load(std::memory_order_acquire);
+            });
+        }
+        return true;
+    }
+
+    /**
+     * @brief Removes the oldest item, waiting for one (consumer only)
+     * @param item Set to the removed item
+     * @param cancel Flag that aborts the wait when set
+     * @return true if an item was removed, false if cancelled
+     */
+    bool pop(T& item, const std::atomic<bool>& cancel) {
+        for (unsigned round = 0; !tryPop(item); ++round) {
+            if (cancel.load(std::memory_order_acquire)) return false;
+            if (round < SPIN_ROUNDS) {
+                backOff(round);
+                continue;
+            }
+            block([&] {
+                return head.load(std::memory_order_relaxed) != tail.load(std::memory_order_acquire) ||
+                       cancel.load(std::memory_order_acquire);
+            });
+        }
+        return true;
+    }
+
+    /**
+     * @brief Wakes blocked push() and pop() calls so they check their cancel flag
+     */
+    void wake() {
+        std::lock_guard<std::mutex> lock(waitMutex);
+        changed.notify_all();
+    }
+
+    /**
+     * @brief Spins or yields before a stage checks a condition again
+     * @param round Number of checks that already failed; pauses first, then yields
+     *
+     * Meant for the first SPIN_ROUNDS checks; callers block after that.
+     */
+    static void backOff(unsigned round) {
+        if (round < SPIN_ROUNDS / 2) {
+#if defined(__x86_64__) || defined(__i386__)
+            _mm_pause();
+#endif
+        } else {
+            std::this_thread::yield();
+        }
+    }
+
+    static constexpr unsigned SPIN_ROUNDS = 128;   ///< Checks before a wait blocks
+
+private:
+    static constexpr size_t CACHE_LINE = 64;
+
+    /**
+     * @brief Wakes the other side if it is blocked, after an index moved
+     */
+    void notify() {
+        // Pairs with the fence in block(): either it sees the new index, or we see it waiting
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock(waitMutex);
+            changed.notify_all();
+        }
+    }
+
+    /**
+     * @brief Blocks until ready() holds
+     */
+    template <typename Ready>
+    void block(Ready ready) {
+        std::unique_lock<std::mutex> lock(waitMutex);
+        waiters.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        changed.wait(lock, ready);
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    alignas(CACHE_LINE) std::atomic<size_t> head{0};  ///< Next slot to pop, written by the consumer
+    alignas(CACHE_LINE) std::atomic<size_t> tail{0};  ///< Next slot to fill, written by the producer
+    alignas(CACHE_LINE) std::vector<T> slots;
+    size_t mask = 0;
+
+    alignas(CACHE_LINE) std::atomic<unsigned> waiters{0};  ///< Threads blocked in block()
+    std::mutex waitMutex;
+    std::condition_variable changed;                        ///< Signalled when an index moves or on wake()
+};
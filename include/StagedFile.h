@@ -0,0 +1,153 @@
+/**
+ * @file StagedFile.h
+ * @brief Header file for files being received before they are published
+ *
+ * This file defines the StagedFile class which holds a received file until
+ * it is complete and can appear under its final name in one step.
+ */
+
+#pragma once
+#include <sys/types.h>
+#include <memory>
+#include <string>
+
+/**
+ * @class StagedFile
+ * @brief A file being received, invisible until it is published under its final name
+ *
+ * Where the file system supports it (Linux 3.11+ on ext4, XFS, Btrfs, tmpfs
+ * and most others) the file is created with O_TMPFILE: an unnamed inode in
+ * the destination directory that gets its name with a single linkat() once
+ * it is complete. Nothing is left behind if the transfer fails or the
+ * process dies, and publishing touches the directory once instead of
+ * creating a .part entry and renaming it. Elsewhere the file is
+ * filename + ".part" when it may be resumed, and a hidden name unique to
+ * the transfer otherwise, renamed into place as before.
+ *
+ * Dying with the process also takes the data: a resumable transfer that
+ * is large enough to be worth resuming after a crash calls persist() to
+ * give its unnamed file the .part name up front.
+ *
+ * Destination directories are opened once and kept in a small process-wide
+ * cache; the file is created and published relative to the cached
+ * descriptor, so a receive costs one stat() of the directory (to notice it
+ * was replaced) instead of existence and permission checks and full path
+ * walks. Missing directories are created on first use.
+ *
+ * Files are normally published through the DurabilityManager, which flushes
+ * them first when the policy asks for it. A file that is neither published,
+ * kept nor discarded is discarded when the object is destroyed.
+ */
+class StagedFile {
+public:
+    struct Directory;
+
+    static constexpr size_t MAX_CACHED_DIRECTORIES = 256;   ///< Directory descriptors kept open
+
+    /**
+     * @brief Returns a descriptor of a destination directory, creating the directory if needed
+     * @param path Directory path; empty for the working directory
+     * @return Shared handle, or nullptr with the reason reported
+     */
+    static std::shared_ptr<Directory> openDirectory(const std::string& path);
+
+    StagedFile() = default;
+    ~StagedFile();
+
+    StagedFile(StagedFile&& other) noexcept;
+    StagedFile& operator=(StagedFile&& other) noexcept;
+    StagedFile(const StagedFile&) = delete;
+    StagedFile& operator=(const StagedFile&) = delete;
+
+    /**
+     * @brief Creates the file that will be published at filename
+     * @param filename Final path of the file
+     * @param resume Reopen filename + ".part" if an interrupted transfer left one
+     * @return true if the file is open for reading and writing
+     */
+    bool create(const std::string& filename, bool resume = false);
+
+    /**
+     * @brief Creates the file that will be published as name in an open directory
+     * @param directory Handle from openDirectory()
+     * @param name File name within the directory
+     * @param resume Reopen name + ".part" if an interrupted transfer left one
+     * @return true if the file is open for reading and writing
+     */
+    bool create(const std::shared_ptr<Directory>& directory, const std::string& name, bool resume = false);
+
+    /**
+     * @brief Returns the descriptor of the file, or -1 once it is closed
+     */
+    int fd() const { return descriptor; }
+
+    /**
+     * @brief Returns the path the file will be published at
+     */
+    const std::string& path() const { return finalPath; }
+
+    /**
+     * @brief Describes where the data currently lives, for messages
+     */
+    std::string tempName() const;
+
+    /**
+     * @brief Gives the file its final name, replacing any file there, and closes it
+     *
+     * Does not flush anything; DurabilityManager::commit() calls this once
+     * the policy is satisfied.
+     * @return false with the file left open and unpublished on failure
+     */
+    bool publish();
+
+    /**
+     * @brief Removes the name publish() gave the file, unless another file took it since
+     *
+     * For a name that could not be made durable: the file is then reported
+     * as not received, and should not be found either.
+     * @return true if the name was removed
+     */
+    bool withdraw();
+
+    /**
+     * @brief Flushes the destination directory, making the file's name durable
+     */
+    bool syncDirectory() const;
+
+    /**
+     * @brief Returns the descriptor of the destination directory
+     */
+    int directoryFd() const;
+
+    /**
+     * @brief Names an unnamed file filename + ".part" now, so its data survives a crash
+     *
+     * The file then behaves as if it had been created as the .part: published
+     * by renaming it, and removed by discard().
+     * @return false, with a warning, if the link failed; the file stays usable but unnamed
+     */
+    bool persist();
+
+    /**
+     * @brief Closes the file, leaving its data as filename + ".part" for a later resume
+     * @return false if an unnamed file could not be linked there (its data is then lost)
+     */
+    bool keep();
+
+    /**
+     * @brief Closes the file and removes its data
+     */
+    void discard();
+
+private:
+    bool linkPart();
+
+    std::shared_ptr<Directory> directory;
+    std::string name;           ///< File name within the directory
+    std::string finalPath;      ///< Directory path joined with name
+    std::string partName;       ///< Name of the data within the directory until it is published, unless unnamed
+    int descriptor = -1;
+    bool unnamed = false;       ///< Created with O_TMPFILE, so there is no .part
+    dev_t publishedDevice = 0;  ///< Identity of the file once published, for withdraw()
+    ino_t publishedInode = 0;
+};
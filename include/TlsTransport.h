@@ -0,0 +1,87 @@
+/**
+ * @file TlsTransport.h
+ * @brief Header file for kernel TLS (kTLS) encrypted connections
+ *
+ * This file defines the TlsTransport class which encrypts connections with
+ * TLS 1.3 while leaving the data path of the transfer engines unchanged.
+ */
+
+#pragma once
+#include <string>
+
+/**
+ * @class TlsTransport
+ * @brief TLS 1.3 handshake in OpenSSL, record encryption in the kernel
+ *
+ * The handshake runs in user space on the connected socket. Its traffic
+ * secrets are then turned into AES-GCM keys and installed on the socket with
+ * the "tls" upper layer protocol (TCP_ULP), for both directions. From then on
+ * the kernel encrypts every send() and decrypts every recv(), so sendfile,
+ * splice, io_uring and the buffered engines all work on the plain socket
+ * descriptor exactly as they do without TLS, and sendfile still never copies
+ * file data into user space.
+ *
+ * Because the engines bypass OpenSSL, a connection whose keys cannot be
+ * handed to the kernel cannot fall back to user-space TLS; accept() and
+ * connect() fail instead. Only TLS_AES_128_GCM_SHA256 and
+ * TLS_AES_256_GCM_SHA384 are offered, the suites every kTLS kernel supports.
+ * The server issues no session tickets, so record sequence numbers start at
+ * zero when the kernel takes over.
+ *
+ * Requires Linux with the tls module and a build with OpenSSL; elsewhere
+ * every call reports that TLS is unavailable.
+ */
+class TlsTransport {
+public:
+    /**
+     * @brief Returns whether this build includes TLS support
+     */
+    static bool supported();
+
+    /**
+     * @brief Returns whether the kernel can take over TLS record encryption
+     *
+     * Probes for the "tls" TCP upper layer protocol once and caches the result.
+     */
+    static bool kernelTlsAvailable();
+
+    /**
+     * @brief Makes accept() use a certificate and private key
+     * @param certificateFile PEM certificate chain presented to clients
+     * @param privateKeyFile PEM private key of the certificate
+     * @return true if both were loaded and match, false otherwise
+     */
+    static bool configureServer(const std::string& certificateFile, const std::string& privateKeyFile);
+
+    /**
+     * @brief Makes connect() verify servers
+     * @param caFile PEM file of trusted certificates; empty for the system store
+     * @param serverName Host name or IP address the certificate must be issued for
+     * @return true if the trust store was loaded, false otherwise
+     */
+    static bool configureClient(const std::string& caFile, const std::string& serverName);
+
+    /**
+     * @brief Returns whether configureServer() succeeded
+     */
+    static bool serverEnabled();
+
+    /**
+     * @brief Returns whether configureClient() succeeded
+     */
+    static bool clientEnabled();
+
+    /**
+     * @brief Runs the server side of the handshake and enables kTLS
+     * @param socket Accepted TCP socket
+     * @return true if the socket now encrypts and decrypts in the kernel
+     */
+    static bool accept(int socket);
+
+    /**
+     * @brief Runs the client side of the handshake and enables kTLS
+     * @param socket Connected TCP socket
+     * @return true if the socket now encrypts and decrypts in the kernel
+     */
+    static bool connect(int socket);
+};
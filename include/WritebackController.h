@@ -0,0 +1,80 @@
+/**
+ * @file WritebackController.h
+ * @brief Header file for write-back control on the receive path
+ *
+ * This file defines the WritebackController class which keeps the dirty
+ * page cache of one received file bounded while it is being written.
+ */
+
+#pragma once
+#include <cstddef>
+#include <mutex>
+
+/**
+ * @class WritebackController
+ * @brief Flushes a file behind its write cursor, one window at a time
+ *
+ * Left alone, the kernel lets received data pile up as dirty pages until a
+ * global threshold is hit and then throttles every writer at once while it
+ * flushes. The controller instead starts write-back of each window as soon
+ * as it is complete (sync_file_range WRITE), waits for the window before it
+ * (so one transfer never has more than about two windows dirty) and drops
+ * the flushed pages from the page cache (posix_fadvise DONTNEED), so a
+ * large upload does not evict the files other transfers are reading.
+ *
+ * Linux only; elsewhere the controller does nothing. The tunables are
+ * process-wide and shared by every transfer.
+ */
+class WritebackController {
+public:
+    /**
+     * @struct Settings
+     * @brief Process-wide tunables shared by all transfers
+     */
+    struct Settings {
+        size_t window = 8 * 1024 * 1024;    ///< Bytes flushed at a time (0 leaves write-back to the kernel)
+        bool dropCache = true;              ///< Drop flushed pages from the page cache
+    };
+
+    /**
+     * @brief Starts controlling a range being written sequentially
+     * @param fd Descriptor of the file; must stay open while the controller exists
+     * @param offset Offset of the first byte that will be written
+     */
+    WritebackController(int fd, size_t offset);
+
+    /**
+     * @brief Starts write-back of whatever is still dirty, without waiting for it
+     */
+    ~WritebackController();
+
+    WritebackController(const WritebackController&) = delete;
+    WritebackController& operator=(const WritebackController&) = delete;
+
+    /**
+     * @brief Reports bytes written right after the ones reported before
+     * @param bytes Number of bytes
+     */
+    void advance(size_t bytes);
+
+    /**
+     * @brief Replaces the process-wide tunables
+     * @param settings New settings; affect transfers started afterwards
+     */
+    static void setSettings(const Settings& settings);
+
+    /**
+     * @brief Returns a copy of the process-wide tunables
+     */
+    static Settings getSettings();
+
+private:
+    int fd;             ///< File being written
+    Settings config;    ///< Snapshot of the settings at construction
+    size_t cursor;      ///< End of the data written so far
+    size_t started;     ///< End of the data whose write-back was started
+    size_t retired;     ///< End of the data flushed (and dropped from the cache)
+
+    static Settings settings;           ///< Process-wide tunables
+    static std::mutex settingsMutex;    ///< Guards settings
+};
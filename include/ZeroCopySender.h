@@ -0,0 +1,118 @@
+/**
+ * @file ZeroCopySender.h
+ * @brief Header file for MSG_ZEROCOPY sends
+ *
+ * This file defines the ZeroCopySender class which sends user-space buffers
+ * without copying them into the kernel and reports when the kernel is done
+ * with them.
+ */
+
+#pragma once
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <utility>
+#include "BufferPool.h"
+
+/**
+ * @class ZeroCopySender
+ * @brief Sends buffers on one socket with MSG_ZEROCOPY and tracks their completion
+ *
+ * With MSG_ZEROCOPY the kernel sends straight from the caller's pages, so a
+ * buffer must not be reused or freed until the kernel reports, through the
+ * socket error queue, that it has released it. Every send() returns a ticket;
+ * completed(ticket) tells whether the buffer sent under it may be reused and
+ * waitFor(ticket) blocks until it may. Callers that send pooled buffers can
+ * instead hand them over with send(BufferPool::Buffer, size): the sender
+ * holds each until its ticket is released and then returns it to the pool,
+ * so the caller simply goes on with a fresh buffer.
+ *
+ * Sends smaller than MIN_ZEROCOPY_SIZE are copied as usual: pinning pages
+ * costs more than copying a few kilobytes. When the kernel reports that it
+ * had to copy anyway (loopback, devices without scatter-gather), zero copy is
+ * switched off for the rest of the connection, as the kernel documentation
+ * recommends. On systems without MSG_ZEROCOPY every send is a plain send().
+ */
+class ZeroCopySender {
+public:
+    static constexpr size_t MIN_ZEROCOPY_SIZE = 16 * 1024;  ///< Smaller sends are copied
+    static constexpr unsigned MAX_EMPTY_WAKEUPS = 3;        ///< waitFor() gives up after this many
+                                                            ///< error wakeups without a completion
+
+    /**
+     * @brief Enables SO_ZEROCOPY on a connected socket
+     * @param socket Socket descriptor; must stay open while the sender exists
+     */
+    explicit ZeroCopySender(int socket);
+
+    /**
+     * @brief Waits for the kernel to release the buffers still held
+     *
+     * Buffers it never releases (the socket failed) are leaked rather than
+     * returned to the pool while the kernel may still read them.
+     */
+    ~ZeroCopySender();
+
+    ZeroCopySender(const ZeroCopySender&) = delete;
+    ZeroCopySender& operator=(const ZeroCopySender&) = delete;
+
+    /**
+     * @brief Returns whether sends currently avoid the copy
+     */
+    bool enabled() const { return zeroCopy; }
+
+    /**
+     * @brief Sends exactly size bytes, continuing after partial sends
+     * @param data Bytes to send; must stay untouched until completed(ticket)
+     * @param size Number of bytes
+     * @param ticket Set to the ticket of the last byte sent
+     * @return true if every byte was sent
+     */
+    bool send(const char* data, size_t size, uint64_t& ticket);
+
+    /**
+     * @brief Sends what the socket takes of size bytes in one call
+     * @param data Bytes to send; must stay untouched until completed(ticket)
+     * @param size Number of bytes
+     * @param ticket Set to the ticket of the last byte sent
+     * @return Number of bytes sent, which may be fewer than size; -1 on error
+     *         (EINTR is retried)
+     */
+    ssize_t sendSome(const char* data, size_t size, uint64_t& ticket);
+
+    /**
+     * @brief Sends the first size bytes of a pooled buffer and keeps it until the kernel releases it
+     * @param buffer Buffer to send; the sender owns it from now on
+     * @param size Number of bytes to send
+     * @return true if every byte was sent
+     */
+    bool send(BufferPool::Buffer buffer, size_t size);
+
+    /**
+     * @brief Returns whether the kernel has released everything sent up to ticket
+     *
+     * Collects pending completion notifications without blocking.
+     */
+    bool completed(uint64_t ticket);
+
+    /**
+     * @brief Waits until the kernel has released everything sent up to ticket
+     * @return false if the socket failed while waiting
+     *
+     * A failed socket keeps reporting POLLERR or POLLHUP without ever
+     * completing anything, so MAX_EMPTY_WAKEUPS such wakeups in a row end
+     * the wait.
+     */
+    bool waitFor(uint64_t ticket);
+
+private:
+    bool reap();
+    void recycle();
+
+    int socket;             ///< Connection being sent on
+    bool zeroCopy;          ///< MSG_ZEROCOPY is in use
+    uint64_t issued;        ///< Zero-copy sends issued so far (the kernel numbers them from 0)
+    uint64_t released;      ///< Zero-copy sends the kernel has released
+    std::deque<std::pair<uint64_t, BufferPool::Buffer>> held;  ///< Buffers handed over, by ticket
+};
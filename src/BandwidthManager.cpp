@@ -0,0 +1,180 @@
+/**
+ * @file BandwidthManager.cpp
+ * @brief Implementation of transfer rate limiting
+ */
+
+#include "BandwidthManager.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+namespace {
+
+constexpr double UNLIMITED = std::numeric_limits<double>::infinity();
+constexpr double MIN_BURST_BYTES = 64 * 1024;  ///< Keeps slow flows from being admitted byte by byte
+
+double toRate(uint64_t bytesPerSecond) {
+    return bytesPerSecond == 0 ? UNLIMITED : static_cast<double>(bytesPerSecond);
+}
+
+} // namespace
+
+BandwidthManager& BandwidthManager::instance() {
+    static BandwidthManager manager;
+    return manager;
+}
+
+void BandwidthManager::setLimits(const Limits& newLimits) {
+    std::lock_guard<std::mutex> lock(mutex);
+    limits = newLimits;
+    rebalance();
+}
+
+BandwidthManager::Limits BandwidthManager::getLimits() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return limits;
+}
+
+std::unique_ptr<BandwidthManager::Flow> BandwidthManager::openFlow(const std::string& clientKey) {
+    std::unique_ptr<Flow> flow(new Flow(*this, clientKey));
+    std::lock_guard<std::mutex> lock(mutex);
+    clients[clientKey].push_back(flow.get());
+    rebalance();
+    return flow;
+}
+
+/**
+ * @brief Splits capacity between demands so that no demand can grow without
+ *        shrinking a smaller one (max-min fairness, by water-filling)
+ * @param capacity Capacity to share (infinity if unlimited)
+ * @param demands Upper bound of each consumer (infinity if unlimited)
+ * @return Allocation for each consumer, in the order of demands
+ */
+std::vector<double> BandwidthManager::maxMinShare(double capacity, const std::vector<double>& demands) {
+    std::vector<double> shares(demands.size(), 0.0);
+    if (std::isinf(capacity)) {
+        return demands;
+    }
+
+    std::vector<size_t> order(demands.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return demands[a] < demands[b]; });
+
+    double remaining = capacity;
+    for (size_t i = 0; i < order.size(); ++i) {
+        double fairShare = remaining / static_cast<double>(order.size() - i);
+        double share = std::min(demands[order[i]], fairShare);
+        shares[order[i]] = share;
+        remaining -= share;
+    }
+    return shares;
+}
+
+/**
+ * @brief Recomputes every flow's rate; must be called with mutex held
+ *
+ * The global rate is shared between client IPs, each client asking for at
+ * most min(perClientRate, sum of its flows' caps). Each client's allocation
+ * is then shared between its own flows, each capped at perTransferRate.
+ */
+void BandwidthManager::rebalance() {
+    auto now = std::chrono::steady_clock::now();
+    double transferCap = toRate(limits.perTransferRate);
+    double clientCap = toRate(limits.perClientRate);
+
+    std::vector<double> clientDemands;
+    for (const auto& client : clients) {
+        double demand = transferCap * static_cast<double>(client.second.size());
+        clientDemands.push_back(std::min(clientCap, demand));
+    }
+
+    std::vector<double> clientShares = maxMinShare(toRate(limits.globalRate), clientDemands);
+
+    size_t index = 0;
+    for (auto& client : clients) {
+        std::vector<double> flowDemands(client.second.size(), transferCap);
+        std::vector<double> flowShares = maxMinShare(clientShares[index++], flowDemands);
+        for (size_t i = 0; i < client.second.size(); ++i) {
+            client.second[i]->setRate(flowShares[i], now);
+        }
+    }
+}
+
+BandwidthManager::Flow::Flow(BandwidthManager& manager, const std::string& clientKey)
+    : manager(manager),
+      clientKey(clientKey),
+      rate(UNLIMITED),
+      burst(MIN_BURST_BYTES),
+      tokens(0),
+      lastRefill(std::chrono::steady_clock::now()) {}
+
+BandwidthManager::Flow::~Flow() {
+    std::lock_guard<std::mutex> lock(manager.mutex);
+    auto client = manager.clients.find(clientKey);
+    if (client != manager.clients.end()) {
+        auto& flows = client->second;
+        flows.erase(std::remove(flows.begin(), flows.end(), this), flows.end());
+        if (flows.empty()) {
+            manager.clients.erase(client);
+        }
+    }
+    manager.rebalance();
+}
+
+/**
+ * @brief Adds the tokens earned since the last refill; mutex must be held
+ */
+void BandwidthManager::Flow::refill(std::chrono::steady_clock::time_point now) {
+    if (!std::isinf(rate)) {
+        std::chrono::duration<double> elapsed = now - lastRefill;
+        tokens = std::min(burst, tokens + elapsed.count() * rate);
+    }
+    lastRefill = now;
+}
+
+/**
+ * @brief Changes the allocated rate, settling tokens at the old rate first;
+ *        mutex must be held
+ */
+void BandwidthManager::Flow::setRate(double newRate, std::chrono::steady_clock::time_point now) {
+    refill(now);
+    rate = newRate;
+    if (std::isinf(rate)) {
+        burst = MIN_BURST_BYTES;
+        tokens = 0;
+        return;
+    }
+    std::chrono::duration<double> window = manager.limits.burstWindow;
+    burst = std::max(MIN_BURST_BYTES, rate * window.count());
+    tokens = std::min(tokens, burst);
+}
+
+BandwidthManager::Grant BandwidthManager::Flow::acquire(size_t wanted) {
+    std::lock_guard<std::mutex> lock(manager.mutex);
+    if (std::isinf(rate) || wanted == 0) {
+        return {wanted, std::chrono::nanoseconds(0)};
+    }
+
+    refill(std::chrono::steady_clock::now());
+
+    // Wait for a reasonable batch rather than admitting a trickle of bytes
+    // on every call; a quarter of the bucket keeps pacing smooth
+    double needed = std::min(static_cast<double>(wanted), burst / 4);
+    if (tokens >= needed) {
+        size_t granted = std::min(wanted, static_cast<size_t>(tokens));
+        tokens -= static_cast<double>(granted);
+        return {granted, std::chrono::nanoseconds(0)};
+    }
+
+    auto wait = std::chrono::duration<double>((needed - tokens) / rate);
+    return {0, std::max(std::chrono::nanoseconds(1),
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(wait))};
+}
+
+void BandwidthManager::Flow::refund(size_t bytes) {
+    std::lock_guard<std::mutex> lock(manager.mutex);
+    if (!std::isinf(rate)) {
+        tokens = std::min(burst, tokens + static_cast<double>(bytes));
+    }
+}
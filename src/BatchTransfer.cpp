@@ -0,0 +1,679 @@
+/**
+ * @file BatchTransfer.cpp
+ * @brief Implementation of multi-file batch streams
+ */
+
+#include "BatchTransfer.h"
+#include "DurabilityManager.h"
+#include "StagedFile.h"
+#include <sys/socket.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+namespace {
+
+constexpr size_t ACK_BATCH = 4096;  ///< Acknowledgements queued before they are sent regardless
+
+/**
+ * @brief Writes the whole buffer to a file at the given offset
+ * @return true if every byte was written, false otherwise
+ */
+bool pwriteAll(int fd, const char* data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t written = pwrite(fd, data, size, static_cast<off_t>(offset));
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+        offset += static_cast<uint64_t>(written);
+    }
+    return true;
+}
+
+/**
+ * @class CommitSignal
+ * @brief Descriptor that becomes readable when the committer finishes a commit
+ *
+ * An eventfd on Linux and a pipe elsewhere. Pending commits share it with
+ * the reader, so it stays open until the last of them has signalled.
+ */
+class CommitSignal {
+public:
+    CommitSignal() {
+#if defined(__linux__)
+        readFd = writeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+        int fds[2];
+        if (pipe(fds) == 0) {
+            for (int fd : fds) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+            readFd = fds[0];
+            writeFd = fds[1];
+        }
+#endif
+    }
+
+    ~CommitSignal() {
+        if (writeFd >= 0 && writeFd != readFd) close(writeFd);
+        if (readFd >= 0) close(readFd);
+    }
+
+    CommitSignal(const CommitSignal&) = delete;
+    CommitSignal& operator=(const CommitSignal&) = delete;
+
+    /**
+     * @brief Returns the descriptor to poll, or -1 if it could not be created
+     */
+    int fd() const { return readFd; }
+
+    void raise() {
+        uint64_t one = 1;
+        ssize_t written = write(writeFd, &one, sizeof(one));
+        (void)written;  // A full pipe or counter is already readable
+    }
+
+    void clear() {
+        char drain[64];
+        while (read(readFd, drain, sizeof(drain)) > 0) {}
+    }
+
+private:
+    int readFd = -1;
+    int writeFd = -1;
+};
+
+/**
+ * @class BatchReader
+ * @brief Buffered reading of batch records, with the acknowledgements going the other way
+ *
+ * Queued acknowledgements are sent every time the buffer runs dry, right
+ * before the next recv(): that is when the receiver would otherwise wait,
+ * and it tells the sender about every record stored so far.
+ *
+ * Under group commit a record is only acknowledged once its file is
+ * durable. Those records wait in order behind their commit; while any do,
+ * a dry buffer waits for the socket and a CommitSignal together, so that
+ * finished commits are reported even if the sender is waiting for them
+ * before it sends more.
+ */
+class BatchReader {
+public:
+    BatchReader(int socket, char* memory, size_t capacity)
+        : socket(socket), memory(memory), capacity(capacity) {}
+
+    size_t buffered() const { return end - begin; }
+
+    /**
+     * @brief Consumes up to wanted buffered bytes, refilling the buffer if it is empty
+     * @return false if the connection closed or failed
+     */
+    bool next(size_t wanted, const char*& data, size_t& length) {
+        if (begin == end && !fill()) {
+            return false;
+        }
+        length = std::min(wanted, end - begin);
+        data = memory + begin;
+        begin += length;
+        return true;
+    }
+
+    /**
+     * @brief Copies exactly size bytes out of the stream
+     */
+    bool read(void* out, size_t size) {
+        char* target = static_cast<char*>(out);
+        while (size > 0) {
+            const char* data;
+            size_t length;
+            if (!next(size, data, length)) return false;
+            std::memcpy(target, data, length);
+            target += length;
+            size -= length;
+        }
+        return true;
+    }
+
+    bool acknowledge(bool stored) {
+        char ack = stored ? BatchTransfer::ACK_OK : BatchTransfer::ACK_FAILED;
+        if (commits.empty()) {
+            acks.push_back(ack);
+        } else {
+            commits.push_back(PendingCommit{ack, std::future<bool>()});
+        }
+        return acks.size() + commits.size() < ACK_BATCH || flushAcknowledgements();
+    }
+
+    /**
+     * @brief Submits a record's file and acknowledges the record once it is committed
+     * @param durability Manager the file is submitted to
+     * @param file Completed file
+     */
+    bool acknowledgeCommit(DurabilityManager& durability, StagedFile&& file) {
+        if (!signal) {
+            signal = std::make_shared<CommitSignal>();
+        }
+        std::shared_ptr<CommitSignal> committed = signal;
+        std::future<bool> commit = durability.submit(std::move(file), [committed]() { committed->raise(); });
+        commits.push_back(PendingCommit{BatchTransfer::ACK_OK, std::move(commit)});
+        return acks.size() + commits.size() < ACK_BATCH || flushAcknowledgements();
+    }
+
+    /**
+     * @brief Sends the acknowledgements that are decided, without waiting for commits
+     */
+    bool flushAcknowledgements() {
+        collectCommits(false);
+        if (acks.empty()) return true;
+        bool sent = FileTransfer::sendChunk(socket, acks.data(), acks.size());
+        acks.clear();
+        return sent;
+    }
+
+    /**
+     * @brief Waits for every commit, then sends all acknowledgements
+     */
+    bool finishAcknowledgements() {
+        collectCommits(true);
+        return flushAcknowledgements();
+    }
+
+    size_t failedCommits() const { return commitFailures; }
+
+private:
+    /**
+     * @struct PendingCommit
+     * @brief Acknowledgement queued behind a commit that is not done yet
+     */
+    struct PendingCommit {
+        char ack;                   ///< Acknowledgement, if commit is not valid
+        std::future<bool> commit;   ///< Decides the acknowledgement when valid
+    };
+
+    void collectCommits(bool wait) {
+        while (!commits.empty()) {
+            PendingCommit& front = commits.front();
+            if (front.commit.valid()) {
+                if (!wait && front.commit.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                    break;
+                }
+                bool committed = front.commit.get();
+                if (!committed) {
+                    ++commitFailures;
+                }
+                front.ack = committed ? BatchTransfer::ACK_OK : BatchTransfer::ACK_FAILED;
+            }
+            acks.push_back(front.ack);
+            commits.pop_front();
+        }
+    }
+
+    bool fill() {
+        begin = end = 0;
+        if (!flushAcknowledgements()) {
+            return false;
+        }
+        while (!commits.empty()) {
+            // Without a signal descriptor, look at the commits every millisecond
+            struct pollfd pfds[2] = {{socket, POLLIN, 0}, {signal->fd(), POLLIN, 0}};
+            int ready = poll(pfds, 2, signal->fd() >= 0 ? -1 : 1);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready < 0 || pfds[0].revents != 0) break;  // Data (or an error) to read
+            signal->clear();
+            if (!flushAcknowledgements()) {
+                return false;
+            }
+        }
+        for (;;) {
+            ssize_t received = recv(socket, memory, capacity, 0);
+            if (received < 0 && errno == EINTR) continue;
+            if (received <= 0) return false;
+            end = static_cast<size_t>(received);
+            return true;
+        }
+    }
+
+    int socket;
+    char* memory;
+    size_t capacity;
+    size_t begin = 0;       ///< First unread byte
+    size_t end = 0;         ///< End of the buffered bytes
+    std::string acks;       ///< Acknowledgements not sent yet
+    std::deque<PendingCommit> commits;  ///< Acknowledgements that follow acks, in record order
+    size_t commitFailures = 0;          ///< Commits that failed after the record was counted as stored
+    std::shared_ptr<CommitSignal> signal;   ///< Raised by finished commits; created with the first one
+};
+
+/**
+ * @brief Receives the data of one record into fd, or discards it
+ * @param reader Stream positioned at the data
+ * @param socket Socket descriptor, for moving large files with an engine
+ * @param fd File to write to (ignored once stored is false)
+ * @param size Number of data bytes in the record
+ * @param mode Engine for the part of a large file that is not buffered yet
+ * @param flow Flow of the batch, pacing the files the engines move
+ * @param stored Cleared when the data cannot be stored; it is then read and dropped
+ * @return false if the stream broke and no further record can be read
+ */
+bool receiveData(BatchReader& reader, int socket, int fd, uint64_t size, FileTransfer::ReceiveMode mode,
+                 BandwidthManager::Flow& flow, bool& stored) {
+    uint64_t offset = 0;
+    while (offset < size) {
+        uint64_t remaining = size - offset;
+        if (stored && reader.buffered() == 0 && remaining > BatchTransfer::INLINE_LIMIT) {
+            // Large rest, nothing of it buffered: an engine moves it straight from the socket
+            if (!reader.flushAcknowledgements()) {
+                return false;
+            }
+            if (FileTransfer::preallocate(fd, offset, remaining)) {
+                return FileTransfer::receiveRange(socket, fd, offset, remaining, flow, mode);
+            }
+            stored = false;     // Out of space: drop the rest below
+        }
+
+        const char* data;
+        size_t length;
+        if (!reader.next(remaining, data, length)) {
+            return false;
+        }
+        if (stored && !pwriteAll(fd, data, length, offset)) {
+            std::cerr << "Error: Write failed: " << std::strerror(errno) << std::endl;
+            stored = false;
+        }
+        offset += length;
+    }
+    return true;
+}
+
+} // namespace
+
+BatchTransfer::Sender::Sender(int socket, FileTransfer::SendMode mode)
+    : socket(socket), mode(mode), buffer(BufferPool::instance().acquire(BUFFER_SIZE)),
+      flow(FileTransfer::openFlow(socket)) {
+    if (!buffer) {
+        throw std::runtime_error("No memory for the batch buffer");
+    }
+    if (FileTransfer::getZeroCopySend()) {
+        zeroCopy = std::make_unique<ZeroCopySender>(socket);
+    }
+    reader = std::thread(&Sender::readAcknowledgements, this);
+}
+
+BatchTransfer::Sender::~Sender() {
+    if (reader.joinable()) {
+        // Abandoned batch: wake the reader, which may wait for acknowledgements forever
+        shutdown(socket, SHUT_RDWR);
+        reader.join();
+    }
+}
+
+bool BatchTransfer::Sender::add(const std::string& localPath, const std::string& relativePath) {
+    int fd = open(localPath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    bool readable = fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (!readable || relativePath.empty() || relativePath.size() > MAX_PATH_LENGTH) {
+        std::cerr << "Skipping " << localPath << ": "
+                  << (readable ? "path too long" : fd < 0 ? std::strerror(errno) : "not a regular file") << std::endl;
+        if (fd >= 0) close(fd);
+        std::lock_guard<std::mutex> lock(mutex);
+        ++failed;
+        return !broken;
+    }
+
+    if (!waitForWindow()) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = static_cast<size_t>(st.st_size);
+    RecordHeader header = {static_cast<uint64_t>(size), static_cast<uint32_t>(relativePath.size()), 0};
+    size_t recordSize = sizeof(header) + relativePath.size() + size;
+    bool ok;
+
+    if (size <= INLINE_LIMIT) {
+        if (used + recordSize > buffer.size() && !flush()) {
+            close(fd);
+            return false;
+        }
+        // Read before writing the header: a file that shrank since fstat()
+        // must not be announced with a size it no longer has
+        char* data = buffer.data() + used + sizeof(header) + relativePath.size();
+        size_t done = 0;
+        while (done < size) {
+            ssize_t n = pread(fd, data + done, size - done, static_cast<off_t>(done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += static_cast<size_t>(n);
+        }
+        close(fd);
+        if (done < size) {
+            std::cerr << "Skipping " << localPath << ": read failed" << std::endl;
+            std::lock_guard<std::mutex> lock(mutex);
+            ++failed;
+            return !broken;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(relativePath);
+            ++sent;
+        }
+        std::memcpy(buffer.data() + used, &header, sizeof(header));
+        std::memcpy(buffer.data() + used + sizeof(header), relativePath.data(), relativePath.size());
+        used += recordSize;
+        ok = true;
+    } else {
+        close(fd);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(relativePath);
+            ++sent;
+        }
+        ok = append(&header, sizeof(header)) && append(relativePath.data(), relativePath.size()) && flush() &&
+             FileTransfer::sendFileRange(socket, localPath, 0, size, *flow, mode);
+    }
+
+    if (!ok) {
+        std::lock_guard<std::mutex> lock(mutex);
+        broken = true;
+    }
+    return ok;
+}
+
+bool BatchTransfer::Sender::addDirectory(const std::string& relativePath) {
+    if (relativePath.empty() || relativePath.size() > MAX_PATH_LENGTH) {
+        std::cerr << "Skipping directory " << relativePath << ": path too long" << std::endl;
+        std::lock_guard<std::mutex> lock(mutex);
+        ++failed;
+        return !broken;
+    }
+    if (!waitForWindow()) {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(relativePath);
+        ++sent;
+    }
+    RecordHeader header = {0, static_cast<uint32_t>(relativePath.size()), RECORD_DIRECTORY};
+    return append(&header, sizeof(header)) && append(relativePath.data(), relativePath.size());
+}
+
+bool BatchTransfer::Sender::addFrom(DirectoryWalker& walker) {
+    DirectoryWalker::Entry entry;
+    while (walker.next(entry)) {
+        bool connected = entry.directory ? addDirectory(entry.relativePath) : add(entry.path, entry.relativePath);
+        if (!connected) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BatchTransfer::Sender::finish() {
+    if (finished) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return !broken && failed == 0;
+    }
+    finished = true;
+
+    RecordHeader end = {0, 0, 0};
+    bool ok = append(&end, sizeof(end)) && flush();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (ok) {
+        acknowledged.wait(lock, [this]() { return broken || pending.empty(); });
+    }
+    lock.unlock();
+
+    // Everything is acknowledged (or lost): stop the reader
+    shutdown(socket, SHUT_RD);
+    reader.join();
+
+    lock.lock();
+    return ok && !broken && failed == 0;
+}
+
+size_t BatchTransfer::Sender::sentCount() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return sent;
+}
+
+size_t BatchTransfer::Sender::failedCount() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return failed;
+}
+
+bool BatchTransfer::Sender::flush() {
+    if (used == 0) {
+        return static_cast<bool>(buffer);     // No buffer left after a failed flush
+    }
+    bool ok;
+    if (zeroCopy) {
+        // The kernel sends straight from the buffer, so it is handed over
+        // until released and records go on in a fresh one
+        ok = zeroCopy->send(std::move(buffer), used);
+        buffer = BufferPool::instance().acquire(BUFFER_SIZE);
+        ok = ok && buffer;
+    } else {
+        ok = FileTransfer::sendChunk(socket, buffer.data(), used);
+    }
+    used = 0;
+    if (!ok) {
+        std::lock_guard<std::mutex> lock(mutex);
+        broken = true;
+    }
+    return ok;
+}
+
+bool BatchTransfer::Sender::append(const void* data, size_t size) {
+    if (used + size > buffer.size() && !flush()) {
+        return false;
+    }
+    std::memcpy(buffer.data() + used, data, size);
+    used += size;
+    return true;
+}
+
+/**
+ * @brief Waits until fewer than MAX_IN_FLIGHT records are unacknowledged
+ * @return false if the connection failed
+ *
+ * Sends the buffered records first: the receiver cannot acknowledge them
+ * otherwise.
+ */
+bool BatchTransfer::Sender::waitForWindow() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (broken) return false;
+        if (pending.size() < MAX_IN_FLIGHT) return true;
+    }
+    if (!flush()) {
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    acknowledged.wait(lock, [this]() { return broken || pending.size() < MAX_IN_FLIGHT; });
+    return !broken;
+}
+
+/**
+ * @brief Body of the reader thread: matches acknowledgements to pending records
+ */
+void BatchTransfer::Sender::readAcknowledgements() {
+    char acks[ACK_BATCH];
+    for (;;) {
+        ssize_t received = recv(socket, acks, sizeof(acks), 0);
+        if (received < 0 && errno == EINTR) continue;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (received <= 0) {
+            if (!pending.empty()) {
+                broken = true;
+            }
+            acknowledged.notify_all();
+            return;
+        }
+        for (ssize_t i = 0; i < received; ++i) {
+            if (pending.empty()) {
+                broken = true;  // Acknowledgement for a record never sent
+                break;
+            }
+            if (acks[i] != ACK_OK) {
+                std::cerr << "Server could not store " << pending.front() << std::endl;
+                ++failed;
+            }
+            pending.pop_front();
+        }
+        acknowledged.notify_all();
+    }
+}
+
+bool BatchTransfer::receiveBatch(int socket, const std::string& directory, FileTransfer::ReceiveMode mode) {
+    BufferPool::Buffer buffer = BufferPool::instance().acquire(BUFFER_SIZE);
+    if (!buffer) {
+        std::cerr << "Error: No memory for the batch buffer" << std::endl;
+        return false;
+    }
+    BatchReader reader(socket, buffer.data(), buffer.size());
+    auto flow = FileTransfer::openFlow(socket);
+
+    std::string preparedPath;       // Parent directory last opened
+    std::shared_ptr<StagedFile::Directory> prepared;
+    size_t stored = 0;
+    size_t directories = 0;
+    size_t failures = 0;
+    uint64_t bytes = 0;
+    DurabilityManager& durability = DurabilityManager::instance();
+    bool groupCommit = durability.getPolicy() == DurabilityManager::Policy::GroupCommit;
+
+    for (;;) {
+        RecordHeader header;
+        if (!reader.read(&header, sizeof(header))) {
+            std::cerr << "Error: Batch ended without its end record" << std::endl;
+            return false;
+        }
+        if (header.pathLength == 0) {
+            break;
+        }
+        if (header.pathLength > MAX_PATH_LENGTH || (header.flags & ~RECORD_DIRECTORY) != 0 ||
+            ((header.flags & RECORD_DIRECTORY) && header.size != 0)) {
+            std::cerr << "Error: Invalid batch record" << std::endl;
+            return false;
+        }
+
+        std::string relativePath(header.pathLength, '\0');
+        if (!reader.read(&relativePath[0], relativePath.size())) {
+            return false;
+        }
+
+        bool ok = isSafeRelativePath(relativePath);
+        if (!ok) {
+            std::cerr << "Error: Refusing path outside " << directory << ": " << relativePath << std::endl;
+        }
+        std::filesystem::path target = std::filesystem::path(directory) / relativePath;
+        if (header.flags & RECORD_DIRECTORY) {
+            std::error_code error;
+            if (ok) {
+                std::filesystem::create_directories(target, error);
+                ok = !error;
+                if (!ok) {
+                    std::cerr << "Error: Cannot create directory " << target.string() << ": " << error.message()
+                              << std::endl;
+                }
+            }
+            if (ok) {
+                ++directories;
+            } else {
+                ++failures;
+            }
+            if (!reader.acknowledge(ok)) {
+                return false;
+            }
+            continue;
+        }
+        StagedFile file;
+        if (ok) {
+            // Batches usually hold many files per directory; open each one once
+            std::string parent = target.parent_path().string();
+            if (parent != preparedPath) {
+                preparedPath = parent;
+                prepared = StagedFile::openDirectory(parent);
+            }
+            ok = prepared && file.create(prepared, target.filename().string());
+        }
+
+        if (!receiveData(reader, socket, file.fd(), header.size, mode, *flow, ok)) {
+            std::cerr << "Error: Batch connection failed while receiving " << relativePath << std::endl;
+            return false;
+        }
+
+        if (ok && groupCommit) {
+            // Acknowledged once the committer has made the file durable
+            ++stored;
+            bytes += header.size;
+            if (!reader.acknowledgeCommit(durability, std::move(file))) {
+                return false;
+            }
+            continue;
+        }
+        ok = ok && durability.commit(file);
+
+        if (ok) {
+            ++stored;
+            bytes += header.size;
+        } else {
+            ++failures;
+        }
+        if (!reader.acknowledge(ok)) {
+            return false;
+        }
+    }
+
+    bool acknowledged = reader.finishAcknowledgements();
+    stored -= reader.failedCommits();
+    failures += reader.failedCommits();
+    std::cout << "Batch stored " << stored << " files (" << bytes << " bytes) in " << directory;
+    if (directories > 0) {
+        std::cout << ", created " << directories << " directories";
+    }
+    if (failures > 0) {
+        std::cout << ", " << failures << " failed";
+    }
+    std::cout << std::endl;
+    return acknowledged && failures == 0;
+}
+
+bool BatchTransfer::isSafeRelativePath(const std::string& path) {
+    if (path.empty() || path.front() == '/' || path.back() == '/' || path.find('\0') != std::string::npos) {
+        return false;
+    }
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t slash = path.find('/', start);
+        if (slash == std::string::npos) slash = path.size();
+        std::string component = path.substr(start, slash - start);
+        if (component == "." || component == "..") {
+            return false;
+        }
+        start = slash + 1;
+    }
+    return true;
+}
@@ -0,0 +1,247 @@
+/**
+ * @file BufferPool.cpp
+ * @brief Implementation of the process-wide transfer buffer pool
+ */
+
+#include "BufferPool.h"
+#include <sys/mman.h>
+#include <algorithm>
+#include <iostream>
+
+/**
+ * @brief Buffers a thread released and may reuse without taking the pool lock
+ *
+ * Hands everything back to the shared free lists when the thread exits.
+ */
+struct ThreadCache {
+    std::vector<char*> lists[BufferPool::CLASS_COUNT];
+
+    ~ThreadCache() {
+        BufferPool& pool = BufferPool::instance();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        for (size_t i = 0; i < BufferPool::CLASS_COUNT; ++i) {
+            for (char* memory : lists[i]) pool.freeLists[i].push_back(memory);
+            lists[i].clear();
+        }
+        pool.released.notify_all();
+    }
+};
+
+namespace {
+
+thread_local ThreadCache threadCache;
+
+} // namespace
+
+BufferPool::Buffer::Buffer(Buffer&& other) noexcept : memory(other.memory), capacity(other.capacity) {
+    other.memory = nullptr;
+    other.capacity = 0;
+}
+
+BufferPool::Buffer& BufferPool::Buffer::operator=(Buffer&& other) noexcept {
+    if (this != &other) {
+        reset();
+        memory = other.memory;
+        capacity = other.capacity;
+        other.memory = nullptr;
+        other.capacity = 0;
+    }
+    return *this;
+}
+
+void BufferPool::Buffer::reset() {
+    if (memory) {
+        BufferPool::instance().release(memory, capacity);
+        memory = nullptr;
+        capacity = 0;
+    }
+}
+
+BufferPool& BufferPool::instance() {
+    static BufferPool pool;
+    return pool;
+}
+
+BufferPool::~BufferPool() {
+    for (size_t i = 0; i < CLASS_COUNT; ++i) {
+        for (char* memory : freeLists[i]) unmap(memory, classSize(i));
+    }
+}
+
+void BufferPool::setOptions(const Options& newOptions) {
+    std::lock_guard<std::mutex> lock(mutex);
+    options = newOptions;
+    released.notify_all();
+}
+
+BufferPool::Options BufferPool::getOptions() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return options;
+}
+
+BufferPool::Stats BufferPool::stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    Stats result;
+    result.mapped = mapped;
+    result.inUse = inUse.load();
+    result.peakMapped = peakMapped;
+    return result;
+}
+
+BufferPool::Buffer BufferPool::acquire(size_t size) {
+    return obtain(size, true);
+}
+
+BufferPool::Buffer BufferPool::tryAcquire(size_t size) {
+    return obtain(size, false);
+}
+
+/**
+ * @brief Returns the index of the smallest class holding size bytes, or CLASS_COUNT if none does
+ */
+size_t BufferPool::classOf(size_t size) {
+    size_t index = 0;
+    while (index < CLASS_COUNT && classSize(index) < size) ++index;
+    return index;
+}
+
+size_t BufferPool::classSize(size_t index) {
+    return MIN_CLASS_SIZE << index;
+}
+
+BufferPool::Buffer BufferPool::obtain(size_t size, bool wait) {
+    size_t index = classOf(std::max<size_t>(size, 1));
+    size_t capacity;
+    if (index < CLASS_COUNT) {
+        capacity = classSize(index);
+        // Fast path: a buffer this thread released earlier
+        auto& cached = threadCache.lists[index];
+        if (!cached.empty()) {
+            char* memory = cached.back();
+            cached.pop_back();
+            inUse += capacity;
+            return Buffer(memory, capacity);
+        }
+    } else {
+        // Oversized requests are mapped to measure and never cached
+        size_t page = 4096;
+        capacity = (size + page - 1) / page * page;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    auto deadline = std::chrono::steady_clock::now() + options.waitTimeout;
+    while (true) {
+        if (index < CLASS_COUNT && !freeLists[index].empty()) {
+            char* memory = freeLists[index].back();
+            freeLists[index].pop_back();
+            inUse += capacity;
+            return Buffer(memory, capacity);
+        }
+
+        // Optional buffers leave the last quarter of the cap, and anything a
+        // waiter could use, to transfers that have no buffer yet
+        size_t cap = options.memoryCap;
+        if (!wait && cap > 0 && (waiters.load() > 0 || (cap -= cap / 4) < capacity)) {
+            return Buffer();
+        }
+
+        // With nothing on loan no release can ever wake us; go over the cap
+        // rather than wait forever for memory parked in idle threads' caches
+        bool fits = cap == 0 || mapped + capacity <= cap || trimLocked(capacity, cap) || inUse.load() == 0;
+        if (fits) {
+            mapped += capacity;
+            peakMapped = std::max(peakMapped, mapped);
+            lock.unlock();
+            char* memory = map(capacity);
+            if (!memory) {
+                lock.lock();
+                mapped -= capacity;
+                return Buffer();
+            }
+            inUse += capacity;
+            return Buffer(memory, capacity);
+        }
+
+        if (!wait) {
+            return Buffer();
+        }
+        ++waiters;
+        bool timedOut = released.wait_until(lock, deadline) == std::cv_status::timeout;
+        --waiters;
+        if (timedOut) {
+            std::cerr << "Error: No transfer buffer memory became available within "
+                      << options.waitTimeout.count() << " ms" << std::endl;
+            return Buffer();
+        }
+    }
+}
+
+/**
+ * @brief Unmaps free buffers of any class until needed more bytes fit under cap
+ * @return true if they now fit
+ */
+bool BufferPool::trimLocked(size_t needed, size_t cap) {
+    for (size_t i = CLASS_COUNT; i-- > 0 && mapped + needed > cap;) {
+        while (!freeLists[i].empty() && mapped + needed > cap) {
+            unmap(freeLists[i].back(), classSize(i));
+            freeLists[i].pop_back();
+            mapped -= classSize(i);
+        }
+    }
+    return mapped + needed <= cap;
+}
+
+void BufferPool::release(char* memory, size_t capacity) {
+    inUse -= capacity;
+    size_t index = classOf(capacity);
+    bool pooled = index < CLASS_COUNT && classSize(index) == capacity;
+
+    // Keep it for this thread unless someone is waiting for memory
+    if (pooled && waiters.load() == 0 && threadCache.lists[index].size() < THREAD_CACHE_DEPTH) {
+        threadCache.lists[index].push_back(memory);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pooled && (options.memoryCap == 0 || mapped <= options.memoryCap)) {
+        freeLists[index].push_back(memory);
+    } else {
+        unmap(memory, capacity);
+        mapped -= capacity;
+    }
+    released.notify_all();
+}
+
+/**
+ * @brief Maps capacity bytes, on huge pages when enabled and large enough
+ * @return The memory, or nullptr on failure
+ */
+char* BufferPool::map(size_t capacity) {
+    void* memory = MAP_FAILED;
+#if defined(__linux__)
+    constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+    bool huge = capacity % HUGE_PAGE_SIZE == 0 && getOptions().hugePages;
+    if (huge) {
+        // Reserved huge pages first, then transparent ones
+        memory = mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (memory == MAP_FAILED) {
+        memory = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            std::cerr << "Error: Cannot map a " << capacity << " byte transfer buffer" << std::endl;
+            return nullptr;
+        }
+#if defined(__linux__)
+        if (huge) {
+            madvise(memory, capacity, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    return static_cast<char*>(memory);
+}
+
+void BufferPool::unmap(char* memory, size_t capacity) {
+    munmap(memory, capacity);
+}
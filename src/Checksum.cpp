@@ -0,0 +1,267 @@
+/**
+ * @file Checksum.cpp
+ * @brief Implementation of data checksums
+ */
+
+#include "Checksum.h"
+#include "ChecksumKernels.h"
+#include <algorithm>
+#include <cstring>
+#include <initializer_list>
+
+namespace {
+
+constexpr uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t rotl(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// xxHash is defined on little-endian input
+inline uint64_t read64(const unsigned char* p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i) value = (value << 8) | p[i];
+    return value;
+}
+
+inline uint32_t read32(const unsigned char* p) {
+    return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+           static_cast<uint32_t>(p[2]) << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+inline uint64_t round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl(acc, 31);
+    return acc * PRIME64_1;
+}
+
+inline uint64_t mergeRound(uint64_t acc, uint64_t lane) {
+    acc ^= round(0, lane);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+constexpr uint64_t PRIME32_1 = 0x9E3779B1ULL;
+constexpr uint64_t PRIME32_2 = 0x85EBCA77ULL;
+constexpr uint64_t PRIME32_3 = 0xC2B2AE3DULL;
+
+} // namespace
+
+XxHash64::XxHash64(uint64_t seed)
+    : seed(seed),
+      lanes{seed + PRIME64_1 + PRIME64_2, seed + PRIME64_2, seed, seed - PRIME64_1},
+      buffered(0),
+      totalLength(0) {}
+
+void XxHash64::update(const void* data, size_t length) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    totalLength += length;
+
+    // Complete a stripe left over from the previous call first
+    if (buffered > 0) {
+        size_t take = std::min(length, sizeof(stripe) - buffered);
+        std::memcpy(stripe + buffered, p, take);
+        buffered += take;
+        p += take;
+        length -= take;
+        if (buffered < sizeof(stripe)) {
+            return;
+        }
+        for (int i = 0; i < 4; ++i) lanes[i] = round(lanes[i], read64(stripe + 8 * i));
+        buffered = 0;
+    }
+
+    while (length >= sizeof(stripe)) {
+        for (int i = 0; i < 4; ++i) lanes[i] = round(lanes[i], read64(p + 8 * i));
+        p += sizeof(stripe);
+        length -= sizeof(stripe);
+    }
+
+    std::memcpy(stripe, p, length);
+    buffered = length;
+}
+
+uint64_t XxHash64::digest() const {
+    uint64_t h;
+    if (totalLength >= sizeof(stripe)) {
+        h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+        for (int i = 0; i < 4; ++i) h = mergeRound(h, lanes[i]);
+    } else {
+        h = seed + PRIME64_5;
+    }
+    h += totalLength;
+
+    const unsigned char* p = stripe;
+    size_t length = buffered;
+    while (length >= 8) {
+        h ^= round(0, read64(p));
+        h = rotl(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+        length -= 8;
+    }
+    if (length >= 4) {
+        h ^= static_cast<uint64_t>(read32(p)) * PRIME64_1;
+        h = rotl(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+        length -= 4;
+    }
+    while (length > 0) {
+        h ^= *p * PRIME64_5;
+        h = rotl(h, 11) * PRIME64_1;
+        ++p;
+        --length;
+    }
+
+    // Avalanche
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t XxHash64::hash(const void* data, size_t length, uint64_t seed) {
+    XxHash64 state(seed);
+    state.update(data, length);
+    return state.digest();
+}
+
+Crc32c::Crc32c() : state(0xFFFFFFFF) {}
+
+void Crc32c::update(const void* data, size_t length) {
+    state = ChecksumKernels::crc32c(state, data, length);
+}
+
+uint32_t Crc32c::digest() const {
+    return ~state;
+}
+
+uint32_t Crc32c::compute(const void* data, size_t length) {
+    Crc32c crc;
+    crc.update(data, length);
+    return crc.digest();
+}
+
+XxHashWide::XxHashWide()
+    : lanes{PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1},
+      buffered(0),
+      stripeInBlock(0),
+      totalLength(0) {}
+
+void XxHashWide::update(const void* data, size_t length) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    totalLength += length;
+
+    if (buffered > 0) {
+        size_t take = std::min(length, sizeof(stripe) - buffered);
+        std::memcpy(stripe + buffered, p, take);
+        buffered += take;
+        p += take;
+        length -= take;
+        if (buffered < sizeof(stripe)) {
+            return;
+        }
+        ChecksumKernels::wideHashStripes(lanes, stripe, 1, stripeInBlock);
+        buffered = 0;
+    }
+
+    size_t stripes = length / sizeof(stripe);
+    ChecksumKernels::wideHashStripes(lanes, p, stripes, stripeInBlock);
+    p += stripes * sizeof(stripe);
+    length -= stripes * sizeof(stripe);
+
+    std::memcpy(stripe, p, length);
+    buffered = length;
+}
+
+uint64_t XxHashWide::digest() const {
+    uint64_t finalLanes[8];
+    std::memcpy(finalLanes, lanes, sizeof(finalLanes));
+
+    // A partial stripe is zero-padded; the length mixed in below tells it
+    // apart from real zero bytes
+    if (buffered > 0) {
+        unsigned char last[sizeof(stripe)] = {0};
+        std::memcpy(last, stripe, buffered);
+        unsigned position = stripeInBlock;
+        ChecksumKernels::wideHashStripes(finalLanes, last, 1, position);
+    }
+
+    uint64_t h = totalLength * PRIME64_1;
+    for (unsigned i = 0; i < 8; i += 2) {
+        unsigned __int128 product = static_cast<unsigned __int128>(finalLanes[i] ^ ChecksumKernels::wideMergeKey(i)) *
+                                    (finalLanes[i + 1] ^ ChecksumKernels::wideMergeKey(i + 1));
+        h += static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+    }
+
+    // Avalanche
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t XxHashWide::hash(const void* data, size_t length) {
+    XxHashWide state;
+    state.update(data, length);
+    return state.digest();
+}
+
+StreamChecksum::StreamChecksum(ChecksumAlgorithm algorithm) : selected(algorithm) {}
+
+void StreamChecksum::update(const void* data, size_t length) {
+    switch (selected) {
+        case ChecksumAlgorithm::Crc32c:
+            crc.update(data, length);
+            break;
+        case ChecksumAlgorithm::XxHash64:
+            xxhash.update(data, length);
+            break;
+        case ChecksumAlgorithm::XxHashWide:
+            wide.update(data, length);
+            break;
+        default:
+            break;
+    }
+}
+
+uint64_t StreamChecksum::digest() const {
+    switch (selected) {
+        case ChecksumAlgorithm::Crc32c:
+            return crc.digest();
+        case ChecksumAlgorithm::XxHash64:
+            return xxhash.digest();
+        case ChecksumAlgorithm::XxHashWide:
+            return wide.digest();
+        default:
+            return 0;
+    }
+}
+
+const char* StreamChecksum::name(ChecksumAlgorithm algorithm) {
+    switch (algorithm) {
+        case ChecksumAlgorithm::Crc32c:
+            return "crc32c";
+        case ChecksumAlgorithm::XxHash64:
+            return "xxhash64";
+        case ChecksumAlgorithm::XxHashWide:
+            return "xxhash-wide";
+        default:
+            return "none";
+    }
+}
+
+bool StreamChecksum::parse(const std::string& text, ChecksumAlgorithm& algorithm) {
+    for (auto candidate : {ChecksumAlgorithm::None, ChecksumAlgorithm::Crc32c, ChecksumAlgorithm::XxHash64,
+                           ChecksumAlgorithm::XxHashWide}) {
+        if (text == name(candidate)) {
+            algorithm = candidate;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,112 @@
+/**
+ * @file ChecksumBenchmark.cpp
+ * @brief Single-core throughput of every checksum kernel the CPU supports
+ *
+ * Hashes the same buffer with each kernel, in one call and in the 256 KiB
+ * pieces the transfer engines feed it, checks that all kernels of an
+ * algorithm agree, and prints GB/s.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "Checksum.h"
+#include "ChecksumKernels.h"
+
+namespace {
+
+constexpr size_t CHUNK_SIZE = 256 * 1024;   ///< Piece size used by the transfer engines
+
+/**
+ * @brief Runs hash over the buffer repeatedly for about half a second
+ * @return Throughput in GB/s (10^9 bytes per second)
+ */
+double measure(const std::vector<unsigned char>& buffer, const std::function<uint64_t()>& hash, uint64_t& result) {
+    result = hash();    // Warm up caches and page in the buffer
+
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed(0);
+    size_t rounds = 0;
+    while (elapsed.count() < 0.5) {
+        result = hash();
+        ++rounds;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    return static_cast<double>(buffer.size()) * rounds / elapsed.count() / 1e9;
+}
+
+template <typename Hasher>
+uint64_t hashInChunks(const std::vector<unsigned char>& buffer) {
+    Hasher hasher;
+    for (size_t offset = 0; offset < buffer.size(); offset += CHUNK_SIZE) {
+        hasher.update(buffer.data() + offset, std::min(CHUNK_SIZE, buffer.size() - offset));
+    }
+    return hasher.digest();
+}
+
+void report(const char* algorithm, const char* kernel, double whole, double chunked) {
+    std::printf("  %-12s %-15s %8.2f GB/s %12.2f GB/s\n", algorithm, kernel, whole, chunked);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    size_t megabytes = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+    if (megabytes == 0) {
+        std::cerr << "Usage: ./checksum_bench [buffer size in MiB, default 64]\n";
+        return 1;
+    }
+
+    std::vector<unsigned char> buffer(megabytes * 1024 * 1024);
+    std::mt19937_64 random(42);
+    for (auto& byte : buffer) byte = static_cast<unsigned char>(random());
+
+    std::printf("Buffer: %zu MiB, chunked runs feed %zu KiB pieces\n\n", megabytes, CHUNK_SIZE / 1024);
+    std::printf("  %-12s %-15s %13s %17s\n", "algorithm", "kernel", "one call", "chunked");
+
+    bool consistent = true;
+    uint64_t reference = 0;
+    uint64_t result = 0;
+    uint64_t chunkedResult = 0;
+
+    using Crc = ChecksumKernels::Crc32cKernel;
+    for (Crc kernel : {Crc::Scalar, Crc::Sse42, Crc::Sse42Clmul, Crc::ArmCrc}) {
+        if (!ChecksumKernels::supported(kernel)) continue;
+        ChecksumKernels::use(kernel);
+        double whole = measure(buffer, [&]() { return Crc32c::compute(buffer.data(), buffer.size()); }, result);
+        double chunked = measure(buffer, [&]() { return hashInChunks<Crc32c>(buffer); }, chunkedResult);
+        if (kernel == Crc::Scalar) reference = result;
+        consistent = consistent && result == reference && chunkedResult == reference;
+        report("crc32c", ChecksumKernels::name(kernel), whole, chunked);
+    }
+
+    using Wide = ChecksumKernels::WideHashKernel;
+    for (Wide kernel : {Wide::Scalar, Wide::Avx2}) {
+        if (!ChecksumKernels::supported(kernel)) continue;
+        ChecksumKernels::use(kernel);
+        double whole = measure(buffer, [&]() { return XxHashWide::hash(buffer.data(), buffer.size()); }, result);
+        double chunked = measure(buffer, [&]() { return hashInChunks<XxHashWide>(buffer); }, chunkedResult);
+        if (kernel == Wide::Scalar) reference = result;
+        consistent = consistent && result == reference && chunkedResult == reference;
+        report("xxhash-wide", ChecksumKernels::name(kernel), whole, chunked);
+    }
+
+    double whole = measure(buffer, [&]() { return XxHash64::hash(buffer.data(), buffer.size()); }, result);
+    double chunked = measure(buffer, [&]() { return hashInChunks<XxHash64>(buffer); }, chunkedResult);
+    consistent = consistent && result == chunkedResult;
+    report("xxhash64", "scalar", whole, chunked);
+
+    if (!consistent) {
+        std::cerr << "\nError: kernels of the same algorithm disagree\n";
+        return 1;
+    }
+    std::printf("\nAll kernels of each algorithm agree\n");
+    return 0;
+}
@@ -0,0 +1,439 @@
+/**
+ * @file ChecksumKernels.cpp
+ * @brief Implementation of the checksum inner loops
+ */
+
+#include "ChecksumKernels.h"
+#include <atomic>
+#include <initializer_list>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CHECKSUM_KERNELS_X86 1
+#include <immintrin.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define CHECKSUM_KERNELS_ARM_CRC 1
+#include <arm_acle.h>
+#endif
+
+namespace {
+
+constexpr uint32_t CRC32C_POLYNOMIAL = 0x82F63B78;  ///< Castagnoli polynomial, bit-reversed
+constexpr uint64_t PRIME32_1 = 0x9E3779B1ULL;
+constexpr uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+// Inputs are defined as little-endian
+inline uint64_t read64(const unsigned char* p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i) value = (value << 8) | p[i];
+    return value;
+}
+
+inline uint32_t read32(const unsigned char* p) {
+    return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+           static_cast<uint32_t>(p[2]) << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+/**
+ * @brief Lookup tables for slicing-by-8: table[k][b] is the CRC of byte b followed by k zero bytes
+ */
+struct Crc32cTables {
+    uint32_t table[8][256];
+
+    Crc32cTables() {
+        for (uint32_t b = 0; b < 256; ++b) {
+            uint32_t crc = b;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLYNOMIAL : 0);
+            }
+            table[0][b] = crc;
+        }
+        for (uint32_t b = 0; b < 256; ++b) {
+            for (int k = 1; k < 8; ++k) {
+                table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+            }
+        }
+    }
+};
+
+const Crc32cTables& crc32cTables() {
+    static const Crc32cTables tables;
+    return tables;
+}
+
+uint32_t crc32cScalar(uint32_t crc, const unsigned char* p, size_t length) {
+    const auto& t = crc32cTables().table;
+
+    // Eight bytes per step, one table lookup per byte
+    while (length >= 8) {
+        uint32_t low = crc ^ read32(p);
+        uint32_t high = read32(p + 4);
+        crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^ t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^
+              t[3][high & 0xff] ^ t[2][(high >> 8) & 0xff] ^ t[1][(high >> 16) & 0xff] ^ t[0][high >> 24];
+        p += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+        ++p;
+        --length;
+    }
+    return crc;
+}
+
+/**
+ * @brief Keys of XxHashWide, derived once from a fixed seed with splitmix64
+ */
+struct WideHashKeys {
+    uint64_t stripe[ChecksumKernels::WIDE_BLOCK_STRIPES][8];    ///< Mixed into each stripe of a block
+    uint64_t scramble[8];                                       ///< Mixed into the lanes after each block
+    uint64_t merge[8];                                          ///< Mixed into the lanes when merging
+
+    WideHashKeys() {
+        uint64_t state = PRIME64_5;
+        auto next = [&state]() {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            return z ^ (z >> 31);
+        };
+        for (auto& keys : stripe) {
+            for (auto& key : keys) key = next();
+        }
+        for (auto& key : scramble) key = next();
+        for (auto& key : merge) key = next();
+    }
+};
+
+const WideHashKeys& wideHashKeys() {
+    static const WideHashKeys keys;
+    return keys;
+}
+
+/**
+ * @brief XXH3-style accumulation: each lane adds its neighbour's input and
+ *        the product of the two 32-bit halves of its keyed input
+ */
+void wideHashStripesScalar(uint64_t lanes[8], const unsigned char* data, size_t stripes,
+                           unsigned& stripeInBlock) {
+    const WideHashKeys& keys = wideHashKeys();
+    for (size_t s = 0; s < stripes; ++s, data += ChecksumKernels::WIDE_STRIPE) {
+        uint64_t input[8];
+        for (int i = 0; i < 8; ++i) input[i] = read64(data + 8 * i);
+        for (int i = 0; i < 8; ++i) {
+            uint64_t keyed = input[i] ^ keys.stripe[stripeInBlock][i];
+            lanes[i] += input[i ^ 1] + (keyed & 0xFFFFFFFF) * (keyed >> 32);
+        }
+
+        if (++stripeInBlock == ChecksumKernels::WIDE_BLOCK_STRIPES) {
+            for (int i = 0; i < 8; ++i) {
+                lanes[i] ^= lanes[i] >> 47;
+                lanes[i] ^= keys.scramble[i];
+                lanes[i] *= PRIME32_1;
+            }
+            stripeInBlock = 0;
+        }
+    }
+}
+
+#if defined(CHECKSUM_KERNELS_X86)
+
+__attribute__((target("sse4.2")))
+uint32_t crc32cSse42(uint32_t crc, const unsigned char* p, size_t length) {
+    uint64_t c = crc;
+    while (length >= 8) {
+        uint64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+        p += 8;
+        length -= 8;
+    }
+    uint32_t c32 = static_cast<uint32_t>(c);
+    while (length > 0) {
+        c32 = _mm_crc32_u8(c32, *p);
+        ++p;
+        --length;
+    }
+    return c32;
+}
+
+constexpr size_t LONG_STREAM = 8192;    ///< Bytes per stream for large inputs
+constexpr size_t SHORT_STREAM = 256;    ///< Bytes per stream for medium inputs
+
+/**
+ * @brief x^n mod P, bit-reversed like the CRC register
+ */
+uint32_t xPowerMod(size_t n) {
+    uint32_t value = 0x80000000;    // x^0
+    while (n-- > 0) {
+        value = (value >> 1) ^ (value & 1 ? CRC32C_POLYNOMIAL : 0);
+    }
+    return value;
+}
+
+/**
+ * @brief Constants that advance a CRC register over n zero bytes with one carry-less multiply
+ *
+ * With the register and the constant both bit-reversed, crc32(0, clmul(a, b))
+ * computes a * b * x^33 mod P. Using b = x^(8n - 33) mod P therefore yields
+ * a * x^(8n) mod P, the register after n more zero bytes.
+ */
+struct ClmulShifts {
+    uint64_t long1 = xPowerMod(8 * LONG_STREAM - 33);
+    uint64_t long2 = xPowerMod(16 * LONG_STREAM - 33);
+    uint64_t short1 = xPowerMod(8 * SHORT_STREAM - 33);
+    uint64_t short2 = xPowerMod(16 * SHORT_STREAM - 33);
+};
+
+const ClmulShifts& clmulShifts() {
+    static const ClmulShifts shifts;
+    return shifts;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+inline uint64_t shiftClmul(uint64_t crc, uint64_t constant) {
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi64_si128(static_cast<long long>(crc)),
+                                           _mm_cvtsi64_si128(static_cast<long long>(constant)), 0);
+    return _mm_crc32_u64(0, static_cast<uint64_t>(_mm_cvtsi128_si64(product)));
+}
+
+/**
+ * @brief Runs three crc32 streams over consecutive thirds of a block
+ *
+ * crc32 has a latency of three cycles but a throughput of one per cycle, so
+ * a single dependency chain leaves two thirds of the unit idle. The second
+ * and third streams start from 0; the partial CRCs are then joined by
+ * shifting the earlier ones over the bytes that follow them.
+ */
+template <size_t STREAM>
+__attribute__((target("sse4.2,pclmul")))
+inline uint64_t crc32cThreeWay(uint64_t c0, const unsigned char*& p, size_t& length,
+                               uint64_t shift1, uint64_t shift2) {
+    while (length >= 3 * STREAM) {
+        uint64_t c1 = 0;
+        uint64_t c2 = 0;
+        for (size_t i = 0; i < STREAM; i += 8) {
+            uint64_t w0, w1, w2;
+            std::memcpy(&w0, p + i, 8);
+            std::memcpy(&w1, p + STREAM + i, 8);
+            std::memcpy(&w2, p + 2 * STREAM + i, 8);
+            c0 = _mm_crc32_u64(c0, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+        }
+        c0 = shiftClmul(c0, shift2) ^ shiftClmul(c1, shift1) ^ c2;
+        p += 3 * STREAM;
+        length -= 3 * STREAM;
+    }
+    return c0;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+uint32_t crc32cSse42Clmul(uint32_t crc, const unsigned char* p, size_t length) {
+    const ClmulShifts& shifts = clmulShifts();
+    uint64_t c = crc32cThreeWay<LONG_STREAM>(crc, p, length, shifts.long1, shifts.long2);
+    c = crc32cThreeWay<SHORT_STREAM>(c, p, length, shifts.short1, shifts.short2);
+    return crc32cSse42(static_cast<uint32_t>(c), p, length);
+}
+
+__attribute__((target("avx2")))
+inline __m256i wideAccumulateAvx2(__m256i acc, __m256i input, __m256i key) {
+    __m256i keyed = _mm256_xor_si256(input, key);
+    __m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+    __m256i swapped = _mm256_shuffle_epi32(input, _MM_SHUFFLE(1, 0, 3, 2));
+    return _mm256_add_epi64(acc, _mm256_add_epi64(swapped, product));
+}
+
+__attribute__((target("avx2")))
+inline __m256i wideScrambleAvx2(__m256i acc, __m256i key, __m256i prime) {
+    acc = _mm256_xor_si256(acc, _mm256_srli_epi64(acc, 47));
+    acc = _mm256_xor_si256(acc, key);
+
+    // 64 x 32-bit multiply from two 32 x 32 -> 64 products
+    __m256i low = _mm256_mul_epu32(acc, prime);
+    __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(acc, 32), prime);
+    return _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+}
+
+__attribute__((target("avx2")))
+void wideHashStripesAvx2(uint64_t lanes[8], const unsigned char* data, size_t stripes,
+                         unsigned& stripeInBlock) {
+    const WideHashKeys& keys = wideHashKeys();
+    __m256i acc0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lanes));
+    __m256i acc1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lanes + 4));
+    const __m256i prime = _mm256_set1_epi64x(static_cast<long long>(PRIME32_1));
+    const __m256i scramble0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys.scramble));
+    const __m256i scramble1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys.scramble + 4));
+
+    for (size_t s = 0; s < stripes; ++s, data += ChecksumKernels::WIDE_STRIPE) {
+        const uint64_t* key = keys.stripe[stripeInBlock];
+        acc0 = wideAccumulateAvx2(acc0, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data)),
+                          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(key)));
+        acc1 = wideAccumulateAvx2(acc1, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32)),
+                          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(key + 4)));
+
+        if (++stripeInBlock == ChecksumKernels::WIDE_BLOCK_STRIPES) {
+            acc0 = wideScrambleAvx2(acc0, scramble0, prime);
+            acc1 = wideScrambleAvx2(acc1, scramble1, prime);
+            stripeInBlock = 0;
+        }
+    }
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc0);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes + 4), acc1);
+}
+
+#endif // CHECKSUM_KERNELS_X86
+
+#if defined(CHECKSUM_KERNELS_ARM_CRC)
+
+uint32_t crc32cArm(uint32_t crc, const unsigned char* p, size_t length) {
+    while (length >= 8) {
+        uint64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        crc = __crc32cd(crc, word);
+        p += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        crc = __crc32cb(crc, *p);
+        ++p;
+        --length;
+    }
+    return crc;
+}
+
+#endif // CHECKSUM_KERNELS_ARM_CRC
+
+ChecksumKernels::Crc32cKernel bestCrc32cKernel() {
+    using Kernel = ChecksumKernels::Crc32cKernel;
+    for (Kernel kernel : {Kernel::Sse42Clmul, Kernel::Sse42, Kernel::ArmCrc}) {
+        if (ChecksumKernels::supported(kernel)) return kernel;
+    }
+    return Kernel::Scalar;
+}
+
+ChecksumKernels::WideHashKernel bestWideHashKernel() {
+    using Kernel = ChecksumKernels::WideHashKernel;
+    return ChecksumKernels::supported(Kernel::Avx2) ? Kernel::Avx2 : Kernel::Scalar;
+}
+
+std::atomic<ChecksumKernels::Crc32cKernel>& currentCrc32cKernel() {
+    static std::atomic<ChecksumKernels::Crc32cKernel> kernel(bestCrc32cKernel());
+    return kernel;
+}
+
+std::atomic<ChecksumKernels::WideHashKernel>& currentWideHashKernel() {
+    static std::atomic<ChecksumKernels::WideHashKernel> kernel(bestWideHashKernel());
+    return kernel;
+}
+
+} // namespace
+
+uint32_t ChecksumKernels::crc32c(uint32_t crc, const void* data, size_t length) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    switch (currentCrc32cKernel().load(std::memory_order_relaxed)) {
+#if defined(CHECKSUM_KERNELS_X86)
+        case Crc32cKernel::Sse42Clmul:
+            return crc32cSse42Clmul(crc, p, length);
+        case Crc32cKernel::Sse42:
+            return crc32cSse42(crc, p, length);
+#endif
+#if defined(CHECKSUM_KERNELS_ARM_CRC)
+        case Crc32cKernel::ArmCrc:
+            return crc32cArm(crc, p, length);
+#endif
+        default:
+            return crc32cScalar(crc, p, length);
+    }
+}
+
+void ChecksumKernels::wideHashStripes(uint64_t lanes[8], const unsigned char* data, size_t stripes,
+                                      unsigned& stripeInBlock) {
+#if defined(CHECKSUM_KERNELS_X86)
+    if (currentWideHashKernel().load(std::memory_order_relaxed) == WideHashKernel::Avx2) {
+        wideHashStripesAvx2(lanes, data, stripes, stripeInBlock);
+        return;
+    }
+#endif
+    wideHashStripesScalar(lanes, data, stripes, stripeInBlock);
+}
+
+uint64_t ChecksumKernels::wideStripeKey(unsigned stripe, unsigned lane) {
+    return wideHashKeys().stripe[stripe][lane];
+}
+
+uint64_t ChecksumKernels::wideMergeKey(unsigned lane) {
+    return wideHashKeys().merge[lane];
+}
+
+bool ChecksumKernels::supported(Crc32cKernel kernel) {
+    switch (kernel) {
+        case Crc32cKernel::Scalar:
+            return true;
+#if defined(CHECKSUM_KERNELS_X86)
+        case Crc32cKernel::Sse42:
+            return __builtin_cpu_supports("sse4.2");
+        case Crc32cKernel::Sse42Clmul:
+            return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+#endif
+#if defined(CHECKSUM_KERNELS_ARM_CRC)
+        case Crc32cKernel::ArmCrc:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+bool ChecksumKernels::supported(WideHashKernel kernel) {
+    switch (kernel) {
+        case WideHashKernel::Scalar:
+            return true;
+#if defined(CHECKSUM_KERNELS_X86)
+        case WideHashKernel::Avx2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+void ChecksumKernels::use(Crc32cKernel kernel) {
+    if (supported(kernel)) {
+        currentCrc32cKernel().store(kernel);
+    }
+}
+
+void ChecksumKernels::use(WideHashKernel kernel) {
+    if (supported(kernel)) {
+        currentWideHashKernel().store(kernel);
+    }
+}
+
+ChecksumKernels::Crc32cKernel ChecksumKernels::crc32cKernel() {
+    return currentCrc32cKernel().load();
+}
+
+ChecksumKernels::WideHashKernel ChecksumKernels::wideHashKernel() {
+    return currentWideHashKernel().load();
+}
+
+const char* ChecksumKernels::name(Crc32cKernel kernel) {
+    switch (kernel) {
+        case Crc32cKernel::Sse42:
+            return "sse4.2";
+        case Crc32cKernel::Sse42Clmul:
+            return "sse4.2+pclmul";
+        case Crc32cKernel::ArmCrc:
+            return "armv8-crc";
+        default:
+            return "scalar";
+    }
+}
+
+const char* ChecksumKernels::name(WideHashKernel kernel) {
+    return kernel == WideHashKernel::Avx2 ? "avx2" : "scalar";
+}
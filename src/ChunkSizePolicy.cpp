@@ -0,0 +1,107 @@
+/**
+ * @file ChunkSizePolicy.cpp
+ * @brief Implementation of per-connection transfer chunk sizing
+ */
+
+#include "ChunkSizePolicy.h"
+#include <algorithm>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Initialize static members
+ChunkSizePolicy::Settings ChunkSizePolicy::settings;  ///< Process-wide tunables
+std::mutex ChunkSizePolicy::settingsMutex;            ///< Guards settings
+
+void ChunkSizePolicy::setSettings(const Settings& newSettings) {
+    std::lock_guard<std::mutex> lock(settingsMutex);
+    settings = newSettings;
+}
+
+ChunkSizePolicy::Settings ChunkSizePolicy::getSettings() {
+    std::lock_guard<std::mutex> lock(settingsMutex);
+    return settings;
+}
+
+ChunkSizePolicy::ChunkSizePolicy(int socket, Direction direction, size_t fileSize)
+    : socket(socket),
+      direction(direction),
+      fileSize(fileSize),
+      config(getSettings()),
+      fullCalls(0),
+      shortCalls(0),
+      callsSinceSample(0) {
+    ceiling = config.maxChunkSize;
+    if (fileSize > 0) {
+        ceiling = std::min(ceiling, std::max(fileSize, config.minChunkSize));
+    }
+    current = clamp(measureTarget());
+}
+
+/**
+ * @brief Clamps a size into [minChunkSize, ceiling]
+ */
+size_t ChunkSizePolicy::clamp(size_t size) const {
+    return std::max(config.minChunkSize, std::min(size, ceiling));
+}
+
+/**
+ * @brief Estimates a good chunk size from the socket's current state
+ * @return Half the socket buffer or the bandwidth-delay product, whichever is larger
+ *
+ * Half the socket buffer lets the kernel drain one chunk while we queue the
+ * next. The bandwidth-delay product is read from TCP_INFO: on the send side
+ * it is the congestion window (bytes the kernel can put in flight per RTT),
+ * on the receive side it is the kernel's RTT-based receive space estimate.
+ */
+size_t ChunkSizePolicy::measureTarget() const {
+    size_t target = 0;
+
+    int bufferSize = 0;
+    socklen_t len = sizeof(bufferSize);
+    int option = direction == Direction::Send ? SO_SNDBUF : SO_RCVBUF;
+    if (getsockopt(socket, SOL_SOCKET, option, &bufferSize, &len) == 0 && bufferSize > 0) {
+        target = static_cast<size_t>(bufferSize) / 2;
+    }
+
+#if defined(__linux__)
+    struct tcp_info info;
+    len = sizeof(info);
+    if (getsockopt(socket, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 && info.tcpi_rtt > 0) {
+        size_t bdp = direction == Direction::Send
+            ? static_cast<size_t>(info.tcpi_snd_cwnd) * info.tcpi_snd_mss
+            : static_cast<size_t>(info.tcpi_rcv_space);
+        target = std::max(target, bdp);
+    }
+#endif
+
+    return target > 0 ? target : config.defaultChunkSize;
+}
+
+void ChunkSizePolicy::update(size_t requested, size_t transferred) {
+    if (requested == 0) return;
+
+    if (transferred >= requested) {
+        shortCalls = 0;
+        if (++fullCalls >= config.growAfter && current < ceiling) {
+            current = clamp(current * 2);
+            fullCalls = 0;
+        }
+    } else if (transferred < requested / 4) {
+        fullCalls = 0;
+        if (++shortCalls >= config.shrinkAfter && current > config.minChunkSize) {
+            current = clamp(current / 2);
+            shortCalls = 0;
+        }
+    } else {
+        fullCalls = 0;
+        shortCalls = 0;
+    }
+
+    // The congestion window moves over the life of a connection; never let
+    // adaptive shrinking fall below what the socket can clearly absorb
+    if (++callsSinceSample >= config.resampleInterval) {
+        callsSinceSample = 0;
+        current = std::max(current, clamp(measureTarget()));
+    }
+}
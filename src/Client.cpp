@@ -10,10 +10,22 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <algorithm>
 #include <filesystem>
 #include <iostream>
+#include <random>
+#include <set>
 #include <string>
+#include <thread>
+#include <vector>
 #include "FileTransfer.h"
+#include "ParallelTransfer.h"
+#include "DeltaTransfer.h"
+#include "BatchTransfer.h"
+#include "DirectoryWalker.h"
+#include "LocalTransfer.h"
+#include "SharedMemoryRing.h"
+#include "TlsTransport.h"
 
 /**
  * @struct ServerPath
@@ -27,6 +39,21 @@ struct ServerPath {
 
 class FileClient {
 public:
+    static constexpr unsigned DEFAULT_TREE_STREAMS = 4;  ///< Connections of a recursive send without --streams
+
+    /**
+     * @brief Selects how clients reach a server on this machine
+     * @param enabled Whether to try the server's Unix domain socket before TCP
+     * @param path Socket file; empty for the default of the server's port
+     * @param sharedMemory Whether uploads on it stream through a shared-memory ring
+     *                     even when the file could be passed as a descriptor
+     */
+    static void setLocalSocket(bool enabled, const std::string& path, bool sharedMemory) {
+        localEnabled = enabled;
+        localSocketPath = path;
+        localSharedMemory = sharedMemory;
+    }
+
     /**
      * @brief Parses a server path string into its components
      * @param serverPath String in format "ip:port:/path" or "ip:/path"
@@ -75,6 +102,93 @@ public:
         }
     }
 
+    /**
+     * @brief Sends a file to the server as byte ranges over parallel connections
+     * @param localPath Path to the local file to send
+     * @param serverPath Server path in format "ip:port:/path"
+     * @param streams Number of connections to use
+     * @return true if every range was stored by the server, false otherwise
+     */
+    static bool sendFileParallel(const std::string& localPath, const std::string& serverPath, unsigned streams) {
+        try {
+            ServerPath parsed = parseServerPath(serverPath);
+            FileClient client(parsed.ip, parsed.port);
+            return client.sendFileToPathParallel(localPath, parsed.path, streams);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return false;
+        }
+    }
+
+    /**
+     * @brief Sends only the differences between a file and the server's copy of it
+     * @param localPath Path to the local file to send
+     * @param serverPath Server path in format "ip:port:/path"
+     * @return true if the server rebuilt and verified the file, false otherwise
+     */
+    static bool sendFileDelta(const std::string& localPath, const std::string& serverPath) {
+        try {
+            ServerPath parsed = parseServerPath(serverPath);
+            FileClient client(parsed.ip, parsed.port);
+            return client.sendFileToPathDelta(localPath, parsed.path);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return false;
+        }
+    }
+
+    /**
+     * @brief Sends many files to a server directory over a single connection
+     * @param localPaths Paths to the local files to send
+     * @param serverPath Server directory in format "ip:port:/path"
+     * @return true if the server stored every file, false otherwise
+     */
+    static bool sendFileBatch(const std::vector<std::string>& localPaths, const std::string& serverPath) {
+        try {
+            ServerPath parsed = parseServerPath(serverPath);
+            FileClient client(parsed.ip, parsed.port);
+            return client.sendFilesToDirectory(localPaths, parsed.path);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return false;
+        }
+    }
+
+    /**
+     * @brief Sends a directory tree to the server, keeping its layout
+     * @param localDirectory Path to the local directory to send
+     * @param serverPath Server path in format "ip:port:/path"
+     * @param streams Number of connections the files are spread over
+     * @return true if the whole tree was read and stored by the server, false otherwise
+     */
+    static bool sendDirectory(const std::string& localDirectory, const std::string& serverPath, unsigned streams) {
+        try {
+            ServerPath parsed = parseServerPath(serverPath);
+            FileClient client(parsed.ip, parsed.port);
+            return client.sendDirectoryToPath(localDirectory, parsed.path, streams);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return false;
+        }
+    }
+
+    /**
+     * @brief Receives a directory tree from the server
+     * @param serverPath Server path in format "ip:port:/path"
+     * @param localPath Local path where to save the directory
+     * @return true if the whole tree was received and stored, false otherwise
+     */
+    static bool receiveDirectory(const std::string& serverPath, const std::string& localPath) {
+        try {
+            ServerPath parsed = parseServerPath(serverPath);
+            FileClient client(parsed.ip, parsed.port);
+            return client.receiveDirectoryFromPath(parsed.path, localPath);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return false;
+        }
+    }
+
     /**
      * @brief Receives a file from the server
      * @param serverPath Server path in format "ip:port:/path"
@@ -96,6 +210,10 @@ private:
     std::string serverIP;  ///< Server IP address
     int port;             ///< Server port number
 
+    static inline bool localEnabled = true;         ///< Try the Unix domain socket for same-host servers
+    static inline std::string localSocketPath;      ///< Socket file, or empty for the port's default
+    static inline bool localSharedMemory = false;   ///< Upload regular files through the ring too
+
     FileClient(const std::string& serverIP, int port) 
         : serverIP(serverIP), port(port) {}
 
@@ -129,8 +247,12 @@ private:
         int sock = connectToServer();
         if (sock < 0) return false;
 
-        std::cout << "Operation started: Sending file to server\n";
-        send(sock, "S", 1, 0);
+        // A server on this machine copies a regular file itself from the
+        // descriptor we pass; anything else is streamed through shared memory
+        bool local = LocalTransfer::isLocalSocket(sock);
+        bool ring = local && (localSharedMemory || !std::filesystem::is_regular_file(localFile));
+        std::cout << "Operation started: Sending file to server" << (local ? " (same host)" : "") << "\n";
+        send(sock, ring ? &SharedMemoryRing::COMMAND : local ? &LocalTransfer::COMMAND : "S", 1, 0);
         
         // Get the proper remote path
         std::string finalRemotePath = getRemotePath(localFile, remotePath);
@@ -141,7 +263,75 @@ private:
         send(sock, &pathLen, sizeof(pathLen), 0);
         send(sock, finalRemotePath.c_str(), pathLen, 0);
         
-        bool result = FileTransfer::sendFile(sock, localFile);
+        bool result = ring ? SharedMemoryRing::sendFile(sock, localFile)
+                    : local ? LocalTransfer::sendFile(sock, localFile)
+                    : FileTransfer::sendFile(sock, localFile);
+        if (result) {
+            std::cout << "File sent successfully\n";
+        } else {
+            std::cout << "Failed to send file\n";
+        }
+
+        close(sock);
+        return result;
+    }
+
+    bool sendFileToPathParallel(const std::string& localFile, const std::string& remotePath, unsigned streams) {
+        std::error_code error;
+        uint64_t fileSize = std::filesystem::file_size(localFile, error);
+        if (error) {
+            std::cerr << "Cannot read " << localFile << ": " << error.message() << "\n";
+            return false;
+        }
+
+        std::string finalRemotePath = getRemotePath(localFile, remotePath);
+        std::random_device random;
+        uint64_t transferId = (static_cast<uint64_t>(random()) << 32) | random();
+        auto ranges = ParallelTransfer::planRanges(transferId, fileSize, streams);
+
+        std::cout << "Operation started: Sending file to server over " << ranges.size() << " connections\n";
+        std::cout << "Remote path: " << finalRemotePath << "\n";
+
+        // Each worker reports into its own slot; vector<bool> is not safe for that
+        std::vector<char> results(ranges.size(), 0);
+        std::vector<std::thread> workers;
+        auto flow = BandwidthManager::instance().openFlow(serverIP);
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            workers.emplace_back([this, &localFile, &finalRemotePath, &ranges, &results, &flow, i]() {
+                int sock = connectToServer();
+                if (sock < 0) return;
+                results[i] = ParallelTransfer::sendRange(sock, localFile, finalRemotePath, ranges[i], *flow);
+                close(sock);
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+
+        bool result = std::all_of(results.begin(), results.end(), [](char ok) { return ok; });
+        if (result) {
+            std::cout << "File sent successfully\n";
+        } else {
+            std::cout << "Failed to send file\n";
+        }
+        return result;
+    }
+
+    bool sendFileToPathDelta(const std::string& localFile, const std::string& remotePath) {
+        int sock = connectToServer();
+        if (sock < 0) return false;
+
+        std::cout << "Operation started: Sending file delta to server\n";
+        send(sock, &DeltaTransfer::COMMAND, 1, 0);
+
+        std::string finalRemotePath = getRemotePath(localFile, remotePath);
+        std::cout << "Remote path: " << finalRemotePath << "\n";
+
+        size_t pathLen = finalRemotePath.length();
+        send(sock, &pathLen, sizeof(pathLen), 0);
+        send(sock, finalRemotePath.c_str(), pathLen, 0);
+
+        bool result = DeltaTransfer::sendFile(sock, localFile);
         if (result) {
             std::cout << "File sent successfully\n";
         } else {
@@ -152,6 +342,165 @@ private:
         return result;
     }
 
+    bool sendFilesToDirectory(const std::vector<std::string>& localFiles, const std::string& remoteDirectory) {
+        int sock = connectToServer();
+        if (sock < 0) return false;
+
+        std::cout << "Operation started: Sending " << localFiles.size() << " files to server\n";
+        std::cout << "Remote directory: " << remoteDirectory << "\n";
+        send(sock, &BatchTransfer::COMMAND, 1, 0);
+
+        size_t pathLen = remoteDirectory.length();
+        send(sock, &pathLen, sizeof(pathLen), 0);
+        send(sock, remoteDirectory.c_str(), pathLen, 0);
+
+        bool result = false;
+        try {
+            BatchTransfer::Sender sender(sock);
+            bool connected = true;
+            std::set<std::string> remoteNames;
+            size_t duplicates = 0;
+            for (const auto& localFile : localFiles) {
+                std::string remoteName = batchEntryPath(localFile);
+                if (!remoteNames.insert(remoteName).second) {
+                    std::cerr << "Skipping " << localFile << ": another file of the batch is stored as "
+                              << remoteName << "\n";
+                    ++duplicates;
+                    continue;
+                }
+                if (!sender.add(localFile, remoteName)) {
+                    connected = false;
+                    break;
+                }
+            }
+            result = connected && sender.finish() && duplicates == 0;
+            std::cout << "Files sent: " << sender.sentCount() << ", failed: " << sender.failedCount() + duplicates
+                      << "\n";
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << "\n";
+        }
+
+        if (result) {
+            std::cout << "All files sent successfully\n";
+        } else {
+            std::cout << "Failed to send some files\n";
+        }
+
+        close(sock);
+        return result;
+    }
+
+    /**
+     * @brief Returns the path a batch entry is stored under in the remote directory
+     *
+     * Relative paths are kept, so that files of the same name from different
+     * directories do not overwrite each other; absolute paths and paths that
+     * climb out with ".." only keep their file name.
+     */
+    static std::string batchEntryPath(const std::string& localFile) {
+        std::filesystem::path path = std::filesystem::path(localFile).lexically_normal();
+        if (path.is_absolute() || (!path.empty() && *path.begin() == "..")) {
+            return path.filename().string();
+        }
+        return path.generic_string();
+    }
+
+    /**
+     * @brief Drops trailing separators, so "dir/" names the directory "dir" like "dir" does
+     */
+    static std::string withoutTrailingSlash(std::string path) {
+        while (path.size() > 1 && path.back() == '/') {
+            path.pop_back();
+        }
+        return path;
+    }
+
+    bool sendDirectoryToPath(const std::string& localDirectory, const std::string& remotePath, unsigned streams) {
+        std::string localRoot = withoutTrailingSlash(localDirectory);
+        std::string remoteDirectory = getRemotePath(localRoot, remotePath);
+
+        std::cout << "Operation started: Sending directory to server over " << streams << " connections\n";
+        std::cout << "Remote directory: " << remoteDirectory << "\n";
+
+        // Every connection is a batch fed from the same walk, so the listing
+        // of the tree overlaps with the transfers and is spread over them
+        DirectoryWalker walker(localRoot);
+        std::vector<char> results(streams, 0);
+        std::vector<size_t> sentCounts(streams, 0);
+        std::vector<size_t> failedCounts(streams, 0);
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < streams; ++i) {
+            workers.emplace_back([this, &walker, &remoteDirectory, &results, &sentCounts, &failedCounts, i]() {
+                int sock = connectToServer();
+                if (sock < 0) {
+                    std::cerr << "Connection " << i << " failed\n";
+                    return;
+                }
+                send(sock, &BatchTransfer::COMMAND, 1, 0);
+                size_t pathLen = remoteDirectory.length();
+                send(sock, &pathLen, sizeof(pathLen), 0);
+                send(sock, remoteDirectory.c_str(), pathLen, 0);
+
+                try {
+                    BatchTransfer::Sender sender(sock);
+                    bool connected = sender.addFrom(walker);
+                    results[i] = connected && sender.finish();
+                    sentCounts[i] = sender.sentCount();
+                    failedCounts[i] = sender.failedCount();
+                } catch (const std::exception& e) {
+                    std::cerr << "Error: " << e.what() << "\n";
+                }
+                close(sock);
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+
+        size_t sent = 0;
+        size_t failed = 0;
+        for (unsigned i = 0; i < streams; ++i) {
+            sent += sentCounts[i];
+            failed += failedCounts[i];
+        }
+        std::cout << "Entries sent: " << sent << ", failed: " << failed << "\n";
+
+        bool result = std::all_of(results.begin(), results.end(), [](char ok) { return ok; }) &&
+                      walker.errorCount() == 0;
+        if (result) {
+            std::cout << "Directory sent successfully\n";
+        } else {
+            std::cout << "Failed to send some files\n";
+        }
+        return result;
+    }
+
+    bool receiveDirectoryFromPath(const std::string& remotePath, const std::string& localPath) {
+        int sock = connectToServer();
+        if (sock < 0) return false;
+
+        std::string remoteDirectory = withoutTrailingSlash(remotePath);
+        std::cout << "Operation started: Receiving directory from server\n";
+        send(sock, &BatchTransfer::TREE_COMMAND, 1, 0);
+
+        size_t pathLen = remoteDirectory.length();
+        send(sock, &pathLen, sizeof(pathLen), 0);
+        send(sock, remoteDirectory.c_str(), pathLen, 0);
+
+        std::string localDirectory = getLocalPath(remoteDirectory, localPath);
+        std::cout << "Local directory: " << localDirectory << "\n";
+
+        bool result = BatchTransfer::receiveBatch(sock, localDirectory);
+        if (result) {
+            std::cout << "Directory received successfully\n";
+        } else {
+            std::cout << "Failed to receive directory\n";
+        }
+
+        close(sock);
+        return result;
+    }
+
     bool receiveFileFromPath(const std::string& remotePath, const std::string& localPath) {
         int sock = connectToServer();
         if (sock < 0) return false;
@@ -170,7 +519,7 @@ private:
         
         // Check if directory is protected
         std::filesystem::path dirPath = std::filesystem::path(finalLocalPath).parent_path();
-        if (dirPath == "/System" || dirPath.string().starts_with("/System/")) {
+        if (dirPath == "/System" || dirPath.string().rfind("/System/", 0) == 0) {
             std::cerr << "Error: Cannot write to /System directory (protected by SIP on macOS)\n";
             std::cerr << "Please choose a different directory, such as /tmp/ or your home directory\n";
             close(sock);
@@ -189,6 +538,14 @@ private:
     }
 
     int connectToServer() {
+        // Same host: skip the TCP stack if the server listens on its Unix domain socket,
+        // unless TLS was asked for, which the socket would silently bypass
+        if (localEnabled && !TlsTransport::clientEnabled() && LocalTransfer::isLocalAddress(serverIP)) {
+            std::string path = localSocketPath.empty() ? LocalTransfer::defaultSocketPath(port) : localSocketPath;
+            int sock = LocalTransfer::connect(path);
+            if (sock >= 0) return sock;
+        }
+
         int sock = socket(AF_INET, SOCK_STREAM, 0);
         if (sock < 0) return -1;
 
@@ -202,6 +559,11 @@ private:
             return -1;
         }
 
+        if (TlsTransport::clientEnabled() && !TlsTransport::connect(sock)) {
+            close(sock);
+            return -1;
+        }
+
         return sock;
     }
 }; 
@@ -210,22 +572,178 @@ void printUsage() {
     std::cout << "Usage:\n"
               << "  To send:    ./client <local_file> <server_ip>[:<port>]:<remote_path>\n"
               << "  To receive: ./client <server_ip>[:<port>]:<remote_path> <local_path>\n"
+              << "  To batch:   ./client --batch <local_file>... <server_ip>[:<port>]:<remote_dir>\n"
+              << "  Trees:      ./client -r <local_dir> <server_ip>[:<port>]:<remote_path>\n"
+              << "              ./client -r <server_ip>[:<port>]:<remote_dir> <local_path>\n"
+              << "\nOptions:\n"
+              << "  --streams <n>   Send the file as n byte ranges over parallel connections\n"
+              << "                  (with -r: spread the files over n connections, default 4)\n"
+              << "  -r, --recursive Send or receive a whole directory tree\n"
+              << "  --delta         Send only the parts that differ from the server's copy\n"
+              << "  --batch         Send many files into a directory over one connection\n"
+              << "                  (a local file of - reads the list of files from stdin);\n"
+              << "                  relative paths are kept, other files go by their name\n"
+              << "  --checksum <a>  Verify the transfer with crc32c, xxhash64 or xxhash-wide\n"
+              << "  --tls           Encrypt with TLS 1.3 in the kernel (kTLS)\n"
+              << "  --tls-ca <file> Trust the certificates in this PEM file instead of the system store\n"
+              << "  --tls-name <n>  Name the server certificate must match (default: the server address)\n"
+              << "  --unix-socket <path>  Server socket file to use when the server is on this machine (not with --tls)\n"
+              << "  --no-unix-socket      Always connect over TCP\n"
+              << "  --shared-memory       On the same host, stream uploads through a shared-memory ring\n"
+              << "                        (always used there for pipes such as /dev/stdin)\n"
               << "\nExamples:\n"
               << "  ./client myfile.txt 192.168.0.5:/home/user/test\n"
-              << "  ./client 192.168.0.5:8080:/home/user/test/file.txt /tmp/\n";
+              << "  ./client 192.168.0.5:8080:/home/user/test/file.txt /tmp/\n"
+              << "  ./client --streams 8 image.qcow2 192.168.0.5:/data/\n"
+              << "  ./client --delta backup.tar 192.168.0.5:/data/backup.tar\n"
+              << "  ./client -r --streams 8 photos 192.168.0.5:/data/\n"
+              << "  find logs -type f | ./client --batch - 192.168.0.5:/data/\n";
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
+    unsigned streams = 0;  // 0: not given
+    bool delta = false;
+    bool batch = false;
+    bool recursive = false;
+    bool unixSocket = true;
+    bool sharedMemory = false;
+    std::string unixSocketPath;
+    bool tls = false;
+    std::string tlsCaFile;
+    std::string tlsName;
+    std::vector<std::string> args;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--streams" && i + 1 < argc) {
+            try {
+                int value = std::stoi(argv[++i]);
+                if (value < 1) throw std::out_of_range("streams");
+                streams = static_cast<unsigned>(value);
+            } catch (const std::exception& e) {
+                std::cerr << "Error: --streams needs a positive number\n";
+                printUsage();
+                return 1;
+            }
+        } else if (arg == "--delta") {
+            delta = true;
+        } else if (arg == "--batch") {
+            batch = true;
+        } else if (arg == "-r" || arg == "--recursive") {
+            recursive = true;
+        } else if (arg == "--unix-socket" && i + 1 < argc) {
+            unixSocketPath = argv[++i];
+        } else if (arg == "--no-unix-socket") {
+            unixSocket = false;
+        } else if (arg == "--shared-memory") {
+            sharedMemory = true;
+        } else if (arg == "--tls") {
+            tls = true;
+        } else if (arg == "--tls-ca" && i + 1 < argc) {
+            tls = true;
+            tlsCaFile = argv[++i];
+        } else if (arg == "--tls-name" && i + 1 < argc) {
+            tls = true;
+            tlsName = argv[++i];
+        } else if (arg == "--checksum" && i + 1 < argc) {
+            ChecksumAlgorithm checksum;
+            if (!StreamChecksum::parse(argv[++i], checksum)) {
+                std::cerr << "Error: --checksum must be none, crc32c, xxhash64 or xxhash-wide\n";
+                printUsage();
+                return 1;
+            }
+            FileTransfer::setChecksumAlgorithm(checksum);
+        } else if (arg == "--streams" || arg == "--unix-socket" || arg == "--tls-ca" || arg == "--tls-name" ||
+                   arg == "--checksum") {
+            std::cerr << "Error: Missing value for " << arg << "\n";
+            printUsage();
+            return 1;
+        } else {
+            args.push_back(arg);
+        }
+    }
+
+    bool validArgs = batch ? args.size() >= 2 && args.back().find(':') != std::string::npos
+                           : args.size() == 2;
+    if (!validArgs) {
         printUsage();
         return 1;
     }
 
-    std::string arg1 = argv[1];
-    std::string arg2 = argv[2];
+    FileClient::setLocalSocket(unixSocket, unixSocketPath, sharedMemory);
+
+    std::string arg1 = args[0];
+    std::string arg2 = args[1];
+
+    if (tls) {
+        if (tlsName.empty()) {
+            const std::string& serverArg = batch ? args.back() : arg1.find(':') != std::string::npos ? arg1 : arg2;
+            try {
+                tlsName = FileClient::parseServerPath(serverArg).ip;
+            } catch (const std::exception& e) {
+                std::cerr << "Error: " << e.what() << "\n";
+                return 1;
+            }
+        }
+        if (!TlsTransport::configureClient(tlsCaFile, tlsName)) {
+            return 1;
+        }
+    }
+
+    if (recursive) {
+        if (batch || delta) {
+            std::cerr << "Error: --recursive cannot be combined with --batch or --delta\n";
+            return 1;
+        }
+        bool transferred;
+        if (arg1.find(':') != std::string::npos) {
+            if (streams > 1) {
+                std::cerr << "Error: --streams is only supported when sending\n";
+                return 1;
+            }
+            transferred = FileClient::receiveDirectory(arg1, arg2);
+        } else {
+            transferred = FileClient::sendDirectory(arg1, arg2, streams > 0 ? streams : FileClient::DEFAULT_TREE_STREAMS);
+        }
+        if (!transferred) {
+            std::cerr << "Failed to transfer directory\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (batch) {
+        if (streams > 1 || delta) {
+            std::cerr << "Error: --batch cannot be combined with --streams or --delta\n";
+            return 1;
+        }
+
+        // Every argument but the last is a file, or "-" for a list of files on stdin
+        std::vector<std::string> localFiles;
+        for (size_t i = 0; i + 1 < args.size(); ++i) {
+            if (args[i] == "-") {
+                std::string line;
+                while (std::getline(std::cin, line)) {
+                    if (!line.empty()) localFiles.push_back(line);
+                }
+            } else {
+                localFiles.push_back(args[i]);
+            }
+        }
+        if (!FileClient::sendFileBatch(localFiles, args.back())) {
+            std::cerr << "Failed to send files\n";
+            return 1;
+        }
+        return 0;
+    }
 
     // Check if the first argument contains ':' to determine if it's a server path
     if (arg1.find(':') != std::string::npos) {
+        if (streams > 1 || delta) {
+            std::cerr << "Error: --streams and --delta are only supported when sending\n";
+            return 1;
+        }
+
         // Receiving file from server
         if (!FileClient::receiveFile(arg1, arg2)) {
             std::cerr << "Failed to receive file\n";
@@ -233,7 +751,14 @@ int main(int argc, char* argv[]) {
         }
     } else {
         // Sending file to server
-        if (!FileClient::sendFile(arg1, arg2)) {
+        if (streams > 1 && delta) {
+            std::cerr << "Error: --streams and --delta cannot be combined\n";
+            return 1;
+        }
+        bool sent = delta ? FileClient::sendFileDelta(arg1, arg2)
+                  : streams > 1 ? FileClient::sendFileParallel(arg1, arg2, streams)
+                  : FileClient::sendFile(arg1, arg2);
+        if (!sent) {
             std::cerr << "Failed to send file\n";
             return 1;
         }
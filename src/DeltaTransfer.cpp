@@ -0,0 +1,409 @@
+/**
+ * @file DeltaTransfer.cpp
+ * @brief Implementation of delta (rsync-style) transfers
+ */
+
+#include "DeltaTransfer.h"
+#include "BufferPool.h"
+#include "Checksum.h"
+#include "DurabilityManager.h"
+#include "FileTransfer.h"
+#include "StagedFile.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t IO_CHUNK = 1024 * 1024;  ///< Largest literal sent, and buffer size when copying
+
+/**
+ * @brief rsync's rolling checksum over a window of fixed length
+ *
+ * a is the sum of the bytes and b the sum of the bytes weighted by their
+ * distance from the end of the window, both modulo 2^16, so moving the
+ * window by one byte only needs the byte leaving and the byte entering.
+ */
+class RollingChecksum {
+public:
+    void reset(const unsigned char* data, size_t length) {
+        a = b = 0;
+        window = static_cast<uint32_t>(length);
+        for (size_t i = 0; i < length; ++i) {
+            a += data[i];
+            b += static_cast<uint32_t>(length - i) * data[i];
+        }
+    }
+
+    void roll(unsigned char out, unsigned char in) {
+        a += in - static_cast<uint32_t>(out);
+        b += a - window * out;
+    }
+
+    uint32_t value() const {
+        return (a & 0xffff) | (b << 16);
+    }
+
+private:
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t window = 0;
+};
+
+/**
+ * @brief Index into the 16-bit tag table that rules out most weak checksums cheaply
+ */
+inline uint32_t tag(uint32_t weak) {
+    return (weak ^ (weak >> 16)) & 0xffff;
+}
+
+bool writeAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+} // namespace
+
+size_t DeltaTransfer::blockSizeFor(uint64_t fileSize) {
+    size_t size = static_cast<size_t>(std::sqrt(static_cast<double>(fileSize)));
+    size = (size + 1023) / 1024 * 1024;
+    return std::max(MIN_BLOCK_SIZE, std::min(MAX_BLOCK_SIZE, size));
+}
+
+uint32_t DeltaTransfer::weakChecksum(const unsigned char* data, size_t length) {
+    RollingChecksum checksum;
+    checksum.reset(data, length);
+    return checksum.value();
+}
+
+/**
+ * @brief Computes the signature of every block of a file, reading it once front to back
+ */
+std::vector<DeltaTransfer::BlockSignature> DeltaTransfer::computeSignatures(int fd, uint64_t fileSize,
+                                                                            size_t blockSize) {
+    std::vector<BlockSignature> signatures;
+    BufferPool::Buffer buffer = BufferPool::instance().acquire(blockSize);
+    if (!buffer) return {};
+    auto* block = reinterpret_cast<unsigned char*>(buffer.data());
+    for (uint64_t offset = 0; offset < fileSize; offset += blockSize) {
+        size_t length = static_cast<size_t>(std::min<uint64_t>(blockSize, fileSize - offset));
+        size_t done = 0;
+        while (done < length) {
+            ssize_t n = pread(fd, block + done, length - done, static_cast<off_t>(offset + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return {};
+            done += static_cast<size_t>(n);
+        }
+        signatures.push_back({weakChecksum(block, length), 0, XxHash64::hash(block, length)});
+    }
+    return signatures;
+}
+
+bool DeltaTransfer::sendCommand(int socket, CommandKind kind, uint64_t index, uint64_t length) {
+    Command command = {kind, 0, index, length};
+    return FileTransfer::sendChunk(socket, reinterpret_cast<const char*>(&command), sizeof(command));
+}
+
+bool DeltaTransfer::sendLiteral(int socket, const unsigned char* data, size_t length) {
+    while (length > 0) {
+        size_t count = std::min(length, IO_CHUNK);
+        if (!sendCommand(socket, CommandKind::Literal, 0, count) ||
+            !FileTransfer::sendChunk(socket, reinterpret_cast<const char*>(data), count)) {
+            return false;
+        }
+        data += count;
+        length -= count;
+    }
+    return true;
+}
+
+bool DeltaTransfer::sendFile(int socket, const std::string& filename) {
+    SignatureHeader header;
+    if (!FileTransfer::receiveChunk(socket, reinterpret_cast<char*>(&header), sizeof(header))) {
+        std::cerr << "Failed to receive block signatures" << std::endl;
+        return false;
+    }
+    if (header.blockSize == 0 || header.blockSize > MAX_BLOCK_SIZE ||
+        header.blockCount != (header.basisSize + header.blockSize - 1) / header.blockSize) {
+        std::cerr << "Invalid signature header" << std::endl;
+        return false;
+    }
+    std::vector<BlockSignature> signatures(header.blockCount);
+    if (!FileTransfer::receiveChunk(socket, reinterpret_cast<char*>(signatures.data()),
+                                    signatures.size() * sizeof(BlockSignature))) {
+        std::cerr << "Failed to receive block signatures" << std::endl;
+        return false;
+    }
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        std::cerr << "Cannot open " << filename << " for a delta transfer" << std::endl;
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    size_t fileSize = static_cast<size_t>(st.st_size);
+    const unsigned char* data = nullptr;
+    if (fileSize > 0) {
+        void* mapped = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(mapped, fileSize, MADV_SEQUENTIAL);
+        data = static_cast<const unsigned char*>(mapped);
+    }
+    close(fd);
+
+    // Full blocks are found by the rolling search; a short last block can
+    // only ever match at the very end of our file
+    size_t blockSize = static_cast<size_t>(header.blockSize);
+    size_t fullBlocks = static_cast<size_t>(header.basisSize / blockSize);
+    size_t lastLength = static_cast<size_t>(header.basisSize % blockSize);
+
+    std::vector<bool> tags(1 << 16, false);
+    std::unordered_map<uint32_t, std::vector<uint64_t>> blocksByWeak;
+    for (size_t i = 0; i < fullBlocks; ++i) {
+        tags[tag(signatures[i].weak)] = true;
+        blocksByWeak[signatures[i].weak].push_back(i);
+    }
+
+    // Consecutive matching blocks are merged into a single Copy command
+    uint64_t copyIndex = 0;
+    uint64_t copyLength = 0;
+    auto flushCopy = [&]() {
+        bool ok = copyLength == 0 || sendCommand(socket, CommandKind::Copy, copyIndex, copyLength);
+        copyLength = 0;
+        return ok;
+    };
+    auto addCopy = [&](uint64_t index, uint64_t length) {
+        if (copyLength > 0 && copyLength % blockSize == 0 && index == copyIndex + copyLength / blockSize) {
+            copyLength += length;
+            return true;
+        }
+        bool ok = flushCopy();
+        copyIndex = index;
+        copyLength = length;
+        return ok;
+    };
+
+    size_t position = 0;
+    size_t literalStart = 0;
+    uint64_t literalBytes = 0;
+    auto flushLiteral = [&](size_t end) {
+        if (end == literalStart) return true;
+        bool ok = flushCopy() && sendLiteral(socket, data + literalStart, end - literalStart);
+        literalBytes += end - literalStart;
+        literalStart = end;
+        return ok;
+    };
+
+    bool success = true;
+    RollingChecksum rolling;
+    bool rollingValid = false;
+
+    while (success && fullBlocks > 0 && fileSize - position >= blockSize) {
+        if (!rollingValid) {
+            rolling.reset(data + position, blockSize);
+            rollingValid = true;
+        }
+
+        // The tag table rejects most positions without touching the map
+        uint32_t weak = rolling.value();
+        bool matched = false;
+        uint64_t matchIndex = 0;
+        if (tags[tag(weak)]) {
+            auto candidates = blocksByWeak.find(weak);
+            if (candidates != blocksByWeak.end()) {
+                uint64_t strong = XxHash64::hash(data + position, blockSize);
+                for (uint64_t index : candidates->second) {
+                    if (signatures[index].strong == strong) {
+                        matched = true;
+                        matchIndex = index;
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (matched) {
+            success = flushLiteral(position) && addCopy(matchIndex, blockSize);
+            position += blockSize;
+            literalStart = position;
+            rollingValid = false;
+            continue;
+        }
+
+        if (fileSize - position > blockSize) {
+            rolling.roll(data[position], data[position + blockSize]);
+        } else {
+            rollingValid = false;
+        }
+        position++;
+
+        // Keep literals flowing rather than holding back a long unmatched run
+        if (position - literalStart >= IO_CHUNK) {
+            success = flushLiteral(position);
+        }
+    }
+
+    if (success && lastLength > 0 && fileSize >= lastLength && fileSize - lastLength >= literalStart) {
+        const unsigned char* tail = data + fileSize - lastLength;
+        const BlockSignature& last = signatures[fullBlocks];
+        if (weakChecksum(tail, lastLength) == last.weak && XxHash64::hash(tail, lastLength) == last.strong) {
+            success = flushLiteral(fileSize - lastLength) && addCopy(fullBlocks, lastLength);
+            literalStart = fileSize;
+        }
+    }
+
+    uint64_t fileHash = data ? XxHash64::hash(data, fileSize) : XxHash64().digest();
+    success = success && flushLiteral(fileSize) && flushCopy() &&
+              sendCommand(socket, CommandKind::End, fileHash, fileSize);
+
+    if (data) {
+        munmap(const_cast<unsigned char*>(data), fileSize);
+    }
+
+    char ack = ACK_FAILED;
+    success = success && FileTransfer::receiveChunk(socket, &ack, 1) && ack == ACK_OK;
+    std::cout << "Delta transfer: " << literalBytes << " literal bytes, "
+              << fileSize - literalBytes << " bytes reused from the remote copy" << std::endl;
+    return success;
+}
+
+/**
+ * @brief Rebuilds a file from the commands streamed by the sender
+ * @param socket Socket descriptor
+ * @param basisFd Descriptor of the basis file (-1 if there is none)
+ * @param header Signature header sent to the sender
+ * @param outFd Descriptor of the file being rebuilt
+ * @return true if the End command arrived and the result matches its size and hash
+ */
+bool DeltaTransfer::applyDelta(int socket, int basisFd, const SignatureHeader& header, int outFd) {
+    BufferPool::Buffer buffer = BufferPool::instance().acquire(IO_CHUNK);
+    if (!buffer) return false;
+    // Literals are the bytes that cross the network; copies are local reads
+    auto flow = FileTransfer::openFlow(socket);
+    XxHash64 hash;
+    uint64_t written = 0;
+
+    while (true) {
+        Command command;
+        if (!FileTransfer::receiveChunk(socket, reinterpret_cast<char*>(&command), sizeof(command))) {
+            return false;
+        }
+
+        if (command.kind == CommandKind::End) {
+            return command.length == written && command.index == hash.digest();
+        }
+
+        uint64_t offset = 0;
+        if (command.kind == CommandKind::Copy) {
+            offset = command.index * header.blockSize;
+            if (basisFd < 0 || command.index >= header.blockCount || offset > header.basisSize ||
+                command.length > header.basisSize - offset) {
+                return false;
+            }
+        } else if (command.kind != CommandKind::Literal) {
+            return false;
+        }
+
+        uint64_t remaining = command.length;
+        while (remaining > 0) {
+            size_t count = static_cast<size_t>(std::min<uint64_t>(remaining, buffer.size()));
+            if (command.kind == CommandKind::Literal) {
+                count = FileTransfer::admit(*flow, count);
+                if (!FileTransfer::receiveChunk(socket, buffer.data(), count)) {
+                    return false;
+                }
+            } else {
+                ssize_t n = pread(basisFd, buffer.data(), count, static_cast<off_t>(offset));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return false;
+                count = static_cast<size_t>(n);
+                offset += count;
+            }
+
+            if (!writeAll(outFd, buffer.data(), count)) {
+                return false;
+            }
+            hash.update(buffer.data(), count);
+            written += count;
+            remaining -= count;
+        }
+    }
+}
+
+bool DeltaTransfer::receiveFile(int socket, const std::string& filename) {
+    StagedFile file;
+    if (!file.create(filename)) {
+        char ack = ACK_FAILED;
+        FileTransfer::sendChunk(socket, &ack, 1);
+        return false;
+    }
+
+    // Our current copy is the basis; without one everything arrives as literals
+    SignatureHeader header = {0, 0, 0};
+    int basisFd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (basisFd >= 0 && (fstat(basisFd, &st) < 0 || !S_ISREG(st.st_mode))) {
+        close(basisFd);
+        basisFd = -1;
+    }
+    if (basisFd >= 0) {
+        header.basisSize = static_cast<uint64_t>(st.st_size);
+    }
+    header.blockSize = blockSizeFor(header.basisSize);
+
+    std::vector<BlockSignature> signatures;
+    if (basisFd >= 0) {
+        signatures = computeSignatures(basisFd, header.basisSize, header.blockSize);
+        if (signatures.empty()) {
+            // Unreadable basis: fall back to a full transfer
+            header.basisSize = 0;
+            close(basisFd);
+            basisFd = -1;
+        }
+    }
+    header.blockCount = signatures.size();
+
+    std::cout << "Sending " << signatures.size() << " block signatures of " << header.blockSize
+              << " bytes for " << filename << std::endl;
+
+    bool success = FileTransfer::sendChunk(socket, reinterpret_cast<const char*>(&header), sizeof(header)) &&
+                   FileTransfer::sendChunk(socket, reinterpret_cast<const char*>(signatures.data()),
+                                           signatures.size() * sizeof(BlockSignature));
+
+    if (success) {
+        success = applyDelta(socket, basisFd, header, file.fd());
+        if (!success) {
+            std::cerr << "Delta transfer of " << filename << " failed or did not verify" << std::endl;
+        }
+    }
+    if (basisFd >= 0) {
+        close(basisFd);
+    }
+    // Publish the rebuilt file under the durability policy
+    success = success && DurabilityManager::instance().commit(file);
+
+    char ack = success ? ACK_OK : ACK_FAILED;
+    FileTransfer::sendChunk(socket, &ack, 1);
+    return success;
+}
@@ -0,0 +1,241 @@
+/**
+ * @file DirectoryWalker.cpp
+ * @brief Implementation of the parallel directory walker
+ */
+
+#include "DirectoryWalker.h"
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+namespace {
+
+constexpr size_t GETDENTS_BUFFER_SIZE = 128 * 1024;  ///< Directory entries read per system call
+
+/**
+ * @enum EntryType
+ * @brief What a directory entry is, as far as the walk cares
+ */
+enum class EntryType { File, Directory, Other };
+
+EntryType typeOfMode(mode_t mode) {
+    if (S_ISREG(mode)) return EntryType::File;
+    if (S_ISDIR(mode)) return EntryType::Directory;
+    return EntryType::Other;
+}
+
+/**
+ * @brief Finds the type of an entry whose directory entry did not tell
+ * @return Other if the entry vanished or cannot be examined
+ */
+EntryType statType(int directoryFd, const char* name) {
+#if defined(__linux__) && defined(STATX_TYPE)
+    struct statx st;
+    if (statx(directoryFd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_TYPE, &st) == 0) {
+        return typeOfMode(st.stx_mode);
+    }
+#else
+    struct stat st;
+    if (fstatat(directoryFd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        return typeOfMode(st.st_mode);
+    }
+#endif
+    return EntryType::Other;
+}
+
+EntryType typeOfEntry(int directoryFd, const char* name, unsigned char type) {
+    switch (type) {
+        case DT_REG: return EntryType::File;
+        case DT_DIR: return EntryType::Directory;
+        case DT_UNKNOWN: return statType(directoryFd, name);
+        default: return EntryType::Other;
+    }
+}
+
+bool isDotOrDotDot(const char* name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+/**
+ * @brief Calls visit(name, type) for every entry of an open directory but "." and ".."
+ * @return false if the directory could not be read to the end
+ */
+template<class Visit>
+bool forEachEntry(int fd, Visit visit) {
+#if defined(__linux__)
+    // The kernel fills the buffer with as many linux_dirent64 records as fit
+    struct LinuxDirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[1];
+    };
+    thread_local std::vector<char> buffer(GETDENTS_BUFFER_SIZE);
+
+    for (;;) {
+        long length = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+        if (length < 0 && errno == EINTR) continue;
+        if (length < 0) return false;
+        if (length == 0) return true;
+
+        for (long offset = 0; offset < length;) {
+            auto* entry = reinterpret_cast<LinuxDirent64*>(buffer.data() + offset);
+            offset += entry->d_reclen;
+            if (!isDotOrDotDot(entry->d_name)) {
+                visit(entry->d_name, typeOfEntry(fd, entry->d_name, entry->d_type));
+            }
+        }
+    }
+#else
+    int ownFd = dup(fd);
+    DIR* directory = ownFd >= 0 ? fdopendir(ownFd) : nullptr;
+    if (directory == nullptr) {
+        if (ownFd >= 0) close(ownFd);
+        return false;
+    }
+    errno = 0;
+    while (struct dirent* entry = readdir(directory)) {
+        if (!isDotOrDotDot(entry->d_name)) {
+            visit(entry->d_name, typeOfEntry(fd, entry->d_name, entry->d_type));
+        }
+        errno = 0;
+    }
+    bool complete = errno == 0;
+    closedir(directory);
+    return complete;
+#endif
+}
+
+} // namespace
+
+DirectoryWalker::DirectoryWalker(const std::string& root, unsigned threads, size_t queueCapacity)
+    : capacity(queueCapacity > 0 ? queueCapacity : 1), pool(threads > 0 ? threads : 1) {
+    pool.enqueue([this, root]() { walk(root, ""); });
+}
+
+DirectoryWalker::~DirectoryWalker() {
+    // Directories still queued on the pool see the cancellation and return at once
+    cancel();
+}
+
+bool DirectoryWalker::next(Entry& entry) {
+    std::unique_lock<std::mutex> lock(mutex);
+    entryAdded.wait(lock, [this]() { return cancelled || !queue.empty() || pendingDirectories == 0; });
+    if (cancelled || queue.empty()) {
+        return false;
+    }
+    entry = std::move(queue.front());
+    queue.pop_front();
+    lock.unlock();
+    entryTaken.notify_one();
+    return true;
+}
+
+void DirectoryWalker::cancel() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelled = true;
+        queue.clear();
+    }
+    entryAdded.notify_all();
+    entryTaken.notify_all();
+}
+
+size_t DirectoryWalker::errorCount() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return errors;
+}
+
+/**
+ * @brief Body of a pool task: lists one directory
+ *
+ * Every subdirectory is queued as an entry before it becomes a task of its
+ * own, so consumers always see a directory before anything inside it.
+ */
+void DirectoryWalker::walk(const std::string& path, const std::string& relativePath) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (cancelled) {
+            finishDirectory();
+            return;
+        }
+    }
+
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    bool complete = fd >= 0;
+    int error = errno;
+    if (complete) {
+        std::string prefix = path.back() == '/' ? path : path + "/";
+        bool going = true;
+        complete = forEachEntry(fd, [&](const char* name, EntryType type) {
+            if (!going) return;
+            Entry entry;
+            entry.path = prefix + name;
+            entry.relativePath = relativePath.empty() ? std::string(name) : relativePath + "/" + name;
+            if (type == EntryType::Other) {
+                std::cerr << "Skipping " << entry.path << ": not a regular file or directory" << std::endl;
+                return;
+            }
+            entry.directory = type == EntryType::Directory;
+            if (entry.directory) {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++pendingDirectories;
+            }
+            std::string childPath = entry.path;
+            std::string childRelativePath = entry.relativePath;
+            bool directory = entry.directory;
+            going = emit(std::move(entry));
+            if (directory) {
+                if (going) {
+                    pool.enqueue([this, childPath, childRelativePath]() { walk(childPath, childRelativePath); });
+                } else {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    finishDirectory();
+                }
+            }
+        });
+        error = errno;
+        close(fd);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!complete) {
+        std::cerr << "Error: Cannot read directory " << path << ": " << std::strerror(error) << std::endl;
+        ++errors;
+    }
+    finishDirectory();
+}
+
+/**
+ * @brief Queues an entry, waiting while the queue is full
+ * @return false if the walk was cancelled
+ */
+bool DirectoryWalker::emit(Entry entry) {
+    std::unique_lock<std::mutex> lock(mutex);
+    entryTaken.wait(lock, [this]() { return cancelled || queue.size() < capacity; });
+    if (cancelled) {
+        return false;
+    }
+    queue.push_back(std::move(entry));
+    lock.unlock();
+    entryAdded.notify_one();
+    return true;
+}
+
+/**
+ * @brief Marks one directory as listed; the caller holds mutex
+ */
+void DirectoryWalker::finishDirectory() {
+    if (--pendingDirectories == 0) {
+        entryAdded.notify_all();
+    }
+}
@@ -0,0 +1,199 @@
+/**
+ * @file DurabilityManager.cpp
+ * @brief Implementation of the durability policy of received files
+ */
+
+#include "DurabilityManager.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+
+namespace {
+
+/**
+ * @brief Flushes a file's data, and the metadata needed to read it back
+ */
+bool syncData(int fd) {
+#if defined(__linux__)
+    return fdatasync(fd) == 0;
+#else
+    return fsync(fd) == 0;
+#endif
+}
+
+std::future<bool> readyFuture(bool value) {
+    std::promise<bool> promise;
+    promise.set_value(value);
+    return promise.get_future();
+}
+
+} // namespace
+
+DurabilityManager& DurabilityManager::instance() {
+    static DurabilityManager manager;
+    return manager;
+}
+
+DurabilityManager::~DurabilityManager() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    queued.notify_all();
+    if (committer.joinable()) {
+        committer.join();
+    }
+}
+
+bool DurabilityManager::parse(const std::string& name, Policy& policy) {
+    if (name == "none") {
+        policy = Policy::None;
+    } else if (name == "per-file") {
+        policy = Policy::PerFile;
+    } else if (name == "group-commit") {
+        policy = Policy::GroupCommit;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void DurabilityManager::setPolicy(Policy newPolicy) {
+    std::lock_guard<std::mutex> lock(mutex);
+    policy = newPolicy;
+}
+
+DurabilityManager::Policy DurabilityManager::getPolicy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return policy;
+}
+
+bool DurabilityManager::commit(StagedFile& file) {
+    Policy current = getPolicy();
+    if (current == Policy::GroupCommit) {
+        // The committer hands a file it could not publish back, as the other policies leave it
+        std::unique_lock<std::mutex> lock(mutex);
+        queue.push_back(Pending{std::move(file), std::promise<bool>(), &file, nullptr});
+        std::future<bool> result = queue.back().done.get_future();
+        startCommitter(lock);
+        return result.get();
+    }
+
+    if (current != Policy::None && !syncData(file.fd())) {
+        std::cerr << "Error: Cannot flush " << file.tempName() << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    if (!file.publish()) {
+        return false;
+    }
+    if (current == Policy::PerFile && !file.syncDirectory()) {
+        std::cerr << "Error: Cannot flush the directory of " << file.path() << ", withdrawing it" << std::endl;
+        file.withdraw();
+        return false;
+    }
+    return true;
+}
+
+std::future<bool> DurabilityManager::submit(StagedFile&& file, std::function<void()> committed) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (policy != Policy::GroupCommit) {
+        lock.unlock();
+        StagedFile staged = std::move(file);
+        std::future<bool> result = readyFuture(commit(staged));
+        if (committed) committed();
+        return result;
+    }
+
+    queue.push_back(Pending{std::move(file), std::promise<bool>(), nullptr, std::move(committed)});
+    std::future<bool> result = queue.back().done.get_future();
+    startCommitter(lock);
+    return result;
+}
+
+/**
+ * @brief Wakes the committer thread, starting it first if needed; releases lock
+ */
+void DurabilityManager::startCommitter(std::unique_lock<std::mutex>& lock) {
+    if (!committer.joinable()) {
+        committer = std::thread(&DurabilityManager::run, this);
+    }
+    lock.unlock();
+    queued.notify_one();
+}
+
+/**
+ * @brief Body of the committer thread: commits whatever is queued as one group
+ */
+void DurabilityManager::run() {
+    std::vector<Pending> group;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queued.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            group.swap(queue);
+        }
+        commitGroup(group);
+        group.clear();
+    }
+}
+
+/**
+ * @brief Makes a group of files durable and publishes them
+ *
+ * All write-backs are started before the first one is waited for, so the
+ * device sees the whole group at once, and each directory is synced once
+ * however many of the group's files landed in it.
+ */
+void DurabilityManager::commitGroup(std::vector<Pending>& group) {
+#if defined(__linux__)
+    for (Pending& item : group) {
+        sync_file_range(item.file.fd(), 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+#endif
+
+    std::vector<char> ok(group.size(), 0);
+    std::map<int, std::vector<size_t>> directories;
+    for (size_t i = 0; i < group.size(); ++i) {
+        StagedFile& file = group[i].file;
+        bool flushed = syncData(file.fd());
+        if (!flushed) {
+            std::cerr << "Error: Cannot flush " << file.tempName() << ": " << std::strerror(errno) << std::endl;
+        }
+        ok[i] = flushed && file.publish();
+        if (ok[i]) {
+            directories[file.directoryFd()].push_back(i);
+        }
+    }
+
+    for (const auto& directory : directories) {
+        const StagedFile& file = group[directory.second.front()].file;
+        if (!file.syncDirectory()) {
+            std::cerr << "Error: Cannot flush the directory of " << file.path() << ", withdrawing its files"
+                      << std::endl;
+            for (size_t i : directory.second) {
+                group[i].file.withdraw();
+                ok[i] = 0;
+            }
+        }
+    }
+
+    // Files that failed go back to a waiting commit(), or are discarded
+    for (size_t i = 0; i < group.size(); ++i) {
+        if (group[i].owner) {
+            *group[i].owner = std::move(group[i].file);
+        } else {
+            group[i].file.discard();
+        }
+        group[i].done.set_value(ok[i] != 0);
+        if (group[i].committed) {
+            group[i].committed();
+        }
+    }
+}
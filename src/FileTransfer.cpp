@@ -7,236 +7,2025 @@
  */
 
 #include "FileTransfer.h"
+#include "ChunkSizePolicy.h"
+#include "IoUringEngine.h"
+#include "BufferPool.h"
+#include "Checksum.h"
+#include "DurabilityManager.h"
+#include "StagedFile.h"
+#include "SpscRing.h"
+#include "WritebackController.h"
+#include "ZeroCopySender.h"
 #include <fstream>
+#include <algorithm>
 #include <thread>
 #include <vector>
 #include <chrono>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
 #include <filesystem>
+#include <future>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <iostream>
 
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#elif defined(__APPLE__)
+#include <sys/types.h>
+#endif
+
 // Initialize static members
 std::atomic<int> FileTransfer::activeTransfers(0);  ///< Counter for active transfers
 std::mutex FileTransfer::transferMutex;             ///< Mutex for thread safety
+FileTransfer::MmapOptions FileTransfer::mmapOptions; ///< Tunables of the mmap send engine
+ChecksumAlgorithm FileTransfer::checksumAlgorithm = ChecksumAlgorithm::None; ///< Checksum we ask for
+bool FileTransfer::zeroCopySend = false;            ///< Buffered engine sends with MSG_ZEROCOPY
+
+namespace {
+
+/**
+ * @brief Returns the IP address of the peer of a connected socket
+ * @param socket Socket descriptor
+ * @return Textual address, or an empty string if it cannot be determined
+ */
+std::string peerAddress(int socket) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(socket, reinterpret_cast<struct sockaddr*>(&addr), &len) < 0) {
+        return "";
+    }
+
+    char text[INET6_ADDRSTRLEN] = {0};
+    if (addr.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &reinterpret_cast<struct sockaddr_in*>(&addr)->sin_addr, text, sizeof(text));
+    } else if (addr.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &reinterpret_cast<struct sockaddr_in6*>(&addr)->sin6_addr, text, sizeof(text));
+    }
+    return text;
+}
+
+/**
+ * @brief Tells the operator, once per engine, that checksums replace the engine they chose
+ *
+ * Checksummed data has to pass through user space, so the zero-copy engines
+ * cannot carry it; otherwise the override would go unnoticed.
+ */
+void reportChecksumOverride(ChecksumAlgorithm algorithm, const char* requested, const char* used) {
+    static std::mutex reportedMutex;
+    static std::set<std::string> reported;
+    std::lock_guard<std::mutex> lock(reportedMutex);
+    if (reported.insert(requested).second) {
+        std::cerr << "Note: " << StreamChecksum::name(algorithm) << " checksums need the data in user space; "
+                  << "using the " << used << " engine instead of " << requested << std::endl;
+    }
+}
+
+/**
+ * @brief Opens an O_DIRECT descriptor of the file fd refers to
+ * @return The descriptor, or -1 if the system or file system does not support O_DIRECT
+ *
+ * O_DIRECT is a property of the open file description; a descriptor of our
+ * own keeps other users of fd (parallel ranges) unaffected.
+ */
+int openDirect(int fd) {
+#if defined(__linux__)
+    std::string path = "/proc/self/fd/" + std::to_string(fd);
+    return open(path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+#else
+    (void)fd;
+    return -1;
+#endif
+}
+
+} // namespace
+
+std::unique_ptr<BandwidthManager::Flow> FileTransfer::openFlow(int socket) {
+    return BandwidthManager::instance().openFlow(peerAddress(socket));
+}
+
+size_t FileTransfer::admit(BandwidthManager::Flow& flow, size_t wanted) {
+    while (true) {
+        auto grant = flow.acquire(wanted);
+        if (grant.bytes > 0) {
+            return grant.bytes;
+        }
+        std::this_thread::sleep_for(grant.retryAfter);
+    }
+}
+
+void FileTransfer::setMmapOptions(const MmapOptions& options) {
+    std::lock_guard<std::mutex> lock(transferMutex);
+    mmapOptions = options;
+}
+
+FileTransfer::MmapOptions FileTransfer::getMmapOptions() {
+    std::lock_guard<std::mutex> lock(transferMutex);
+    return mmapOptions;
+}
+
+void FileTransfer::setChecksumAlgorithm(ChecksumAlgorithm algorithm) {
+    std::lock_guard<std::mutex> lock(transferMutex);
+    checksumAlgorithm = algorithm;
+}
+
+ChecksumAlgorithm FileTransfer::getChecksumAlgorithm() {
+    std::lock_guard<std::mutex> lock(transferMutex);
+    return checksumAlgorithm;
+}
+
+void FileTransfer::setZeroCopySend(bool enabled) {
+    std::lock_guard<std::mutex> lock(transferMutex);
+    zeroCopySend = enabled;
+}
+
+bool FileTransfer::getZeroCopySend() {
+    std::lock_guard<std::mutex> lock(transferMutex);
+    return zeroCopySend;
+}
+
+/**
+ * @brief Hashes the last tailLength bytes before end in a file
+ * @param fd Descriptor of the file
+ * @param end Offset just past the last byte to hash
+ * @param tailLength Number of bytes to hash
+ * @param hash Set to the xxHash64 of the bytes
+ * @return true if the bytes could be read, false otherwise
+ */
+bool FileTransfer::hashTail(int fd, uint64_t end, uint64_t tailLength, uint64_t& hash) {
+    BufferPool::Buffer buffer = BufferPool::instance().acquire(tailLength);
+    if (!buffer) return false;
+    size_t done = 0;
+    while (done < tailLength) {
+        ssize_t n = pread(fd, buffer.data() + done, tailLength - done,
+                          static_cast<off_t>(end - tailLength + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += static_cast<size_t>(n);
+    }
+    hash = XxHash64::hash(buffer.data(), tailLength);
+    return true;
+}
+
+/**
+ * @brief Feeds the first bytes of a file into a checksum
+ * @param fd Descriptor of the file
+ * @param length Number of bytes to read from offset 0
+ * @param checksum Checksum to update
+ * @return false if the file could not be read that far
+ *
+ * A resumed transfer only sends what comes after the offset; both sides
+ * run this over the prefix first so the trailer vouches for the whole file.
+ */
+bool FileTransfer::hashPrefix(int fd, uint64_t length, StreamChecksum& checksum) {
+    if (length == 0 || checksum.algorithm() == ChecksumAlgorithm::None) {
+        return true;
+    }
+    BufferPool::Buffer buffer = BufferPool::instance().acquire(BufferPool::MAX_CLASS_SIZE);
+    if (!buffer) return false;
+    uint64_t done = 0;
+    while (done < length) {
+        size_t count = static_cast<size_t>(std::min<uint64_t>(length - done, buffer.size()));
+        ssize_t n = pread(fd, buffer.data(), count, static_cast<off_t>(done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        checksum.update(buffer.data(), static_cast<size_t>(n));
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+/**
+ * @struct FileTransfer::SendState
+ * @brief A file being sent, between the resume handshake and the trailer
+ */
+struct FileTransfer::SendState {
+    std::string filename;
+    int fd = -1;
+    ResumeReply reply = {0, UNTIL_EOF, ChecksumAlgorithm::None, 0};
+    StreamChecksum checksum{ChecksumAlgorithm::None};
+    std::unique_ptr<BandwidthManager::Flow> flow;   ///< Paces every byte of the transfer
+
+    ~SendState() {
+        if (fd >= 0) close(fd);
+    }
+};
+
+/**
+ * @brief Sends a file over a socket connection
+ * @param socket Socket descriptor
+ * @param filename Path to the file to send
+ * @param mode Engine to use for this transfer
+ * @return true if successful, false otherwise
+ */
+bool FileTransfer::sendFile(int socket, const std::string& filename, SendMode mode) {
+    std::shared_ptr<SendState> state = beginSend(socket, filename);
+    return state && finishSend(socket, *state, sendData(socket, *state, mode));
+}
+
+void FileTransfer::sendFileAsync(int socket, const std::string& filename, SendMode mode,
+                                 const Executor& executor, Continuation done) {
+    std::shared_ptr<SendState> state = beginSend(socket, filename);
+    if (!state) {
+        done(false);
+        return;
+    }
+
+    // The engine moves plain ranges of regular files; everything else stays here
+    const ResumeReply& reply = state->reply;
+    IoUringEngine* engine = mode == SendMode::IoUring ? IoUringEngine::instance() : nullptr;
+    if (!engine || reply.fileSize == UNTIL_EOF || reply.offset >= reply.fileSize ||
+        (reply.flags & TRANSFER_SPARSE) || reply.checksum != ChecksumAlgorithm::None) {
+        done(finishSend(socket, *state, sendData(socket, *state, mode)));
+        return;
+    }
+
+    engine->submitSend(socket, state->fd, reply.offset, reply.fileSize - reply.offset, *state->flow,
+                       [socket, state, executor, done](bool success, size_t) {
+                           executor([socket, state, done, success]() {
+                               done(finishSend(socket, *state, success));
+                           });
+                       });
+}
+
+/**
+ * @brief Answers the receiver's ResumeOffer: where to start, how big the file is, and how it is sent
+ * @return The transfer, or nullptr if it failed before any data
+ *
+ * Before any data is sent the receiver describes the .part file it already
+ * holds (ResumeOffer). If its tail matches our file at the same position we
+ * continue from where it stopped; otherwise we start over from byte 0. The
+ * chosen offset and the file size are sent back as a ResumeReply.
+ *
+ * The reply also names the checksum for the transfer: the one the receiver
+ * asked for, else our own setting. It is computed over the resumed prefix,
+ * read back from the file, and then the bytes sent on this connection as
+ * they go out, and sent as an 8-byte trailer after them. Streams of unknown
+ * length are never checksummed, as the receiver could not tell the trailer
+ * from the data.
+ *
+ * If the receiver understands sparse transfers and the rest of the file has
+ * holes, only its data extents are sent (see sendSparse()). If it offers a
+ * commit acknowledgement, we wait for it after the data: the transfer only
+ * succeeds once the receiver has published the file under its durability
+ * policy.
+ */
+std::shared_ptr<FileTransfer::SendState> FileTransfer::beginSend(int socket, const std::string& filename) {
+    ResumeOffer offer;
+    if (!receiveChunk(socket, reinterpret_cast<char*>(&offer), sizeof(offer))) {
+        std::cerr << "Failed to receive resume offer" << std::endl;
+        return nullptr;
+    }
+
+    auto state = std::make_shared<SendState>();
+    state->filename = filename;
+    state->fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (state->fd < 0 || fstat(state->fd, &st) < 0) {
+        return nullptr;
+    }
+
+    ResumeReply& reply = state->reply;
+    if (S_ISREG(st.st_mode)) {
+        bool known = offer.checksum == ChecksumAlgorithm::Crc32c || offer.checksum == ChecksumAlgorithm::XxHash64 ||
+                     offer.checksum == ChecksumAlgorithm::XxHashWide;
+        reply.checksum = known ? offer.checksum : getChecksumAlgorithm();
+        reply.fileSize = static_cast<uint64_t>(st.st_size);
+
+        uint64_t tailHash;
+        if (offer.partSize > 0 && offer.partSize <= reply.fileSize && offer.tailLength <= offer.partSize &&
+            offer.tailLength <= RESUME_TAIL_BYTES &&
+            hashTail(state->fd, offer.partSize, offer.tailLength, tailHash) && tailHash == offer.tailHash) {
+            reply.offset = offer.partSize;
+            std::cout << "Resuming " << filename << " at byte " << reply.offset << std::endl;
+        }
+
+        if ((offer.flags & TRANSFER_SPARSE) && hasHoles(state->fd, reply.offset, reply.fileSize)) {
+            reply.flags |= TRANSFER_SPARSE;
+        }
+        // Only a known size leaves the connection open for the receiver to answer on
+        reply.flags |= offer.flags & TRANSFER_COMMIT_ACK;
+    }
+    state->checksum = StreamChecksum(reply.checksum);
+    state->flow = openFlow(socket);
+
+    // The receiver hashes its copy of the prefix meanwhile
+    if (!sendChunk(socket, reinterpret_cast<const char*>(&reply), sizeof(reply)) ||
+        !hashPrefix(state->fd, reply.offset, state->checksum)) {
+        return nullptr;
+    }
+    activeTransfers++;
+    return state;
+}
+
+/**
+ * @brief Sends the data of a transfer after the handshake, on the calling thread
+ */
+bool FileTransfer::sendData(int socket, SendState& state, SendMode mode) {
+    if (state.reply.flags & TRANSFER_SPARSE) {
+        return sendSparse(socket, state.fd, state.reply.offset, state.reply.fileSize, mode, *state.flow,
+                          &state.checksum);
+    }
+    return sendOpenFile(socket, state.fd, state.reply.offset, UNTIL_EOF, mode, *state.flow, &state.checksum);
+}
+
+/**
+ * @brief Ends a transfer after its data: sends the trailer and waits for the commit acknowledgement
+ * @param sent Whether all the data went out
+ * @return true if the receiver has the file
+ */
+bool FileTransfer::finishSend(int socket, SendState& state, bool sent) {
+    bool result = sent;
+    if (result && state.reply.checksum != ChecksumAlgorithm::None) {
+        uint64_t trailer = state.checksum.digest();
+        result = sendChunk(socket, reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+    }
+
+    if (result && (state.reply.flags & TRANSFER_COMMIT_ACK)) {
+        char ack;
+        result = receiveChunk(socket, &ack, 1) && ack == COMMIT_OK;
+        if (!result) {
+            std::cerr << "Receiver did not commit " << state.filename << std::endl;
+        }
+    }
+
+    close(state.fd);
+    state.fd = -1;
+    activeTransfers--;
+    return result;
+}
+
+/**
+ * @brief Tells whether part of a regular file contains holes
+ * @param fd Descriptor of the file
+ * @param offset Start of the part to look at
+ * @param fileSize Size of the file
+ * @return true if SEEK_HOLE finds a hole before the end of the file
+ *
+ * File systems without hole tracking report the end of the file as the only
+ * hole, so their files are never considered sparse.
+ */
+bool FileTransfer::hasHoles(int fd, size_t offset, size_t fileSize) {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    if (offset >= fileSize) {
+        return false;
+    }
+    off_t hole = lseek(fd, static_cast<off_t>(offset), SEEK_HOLE);
+    return hole >= 0 && static_cast<size_t>(hole) < fileSize;
+#else
+    (void)fd;
+    (void)offset;
+    (void)fileSize;
+    return false;
+#endif
+}
+
+/**
+ * @brief Sends the header of an extent, feeding it to the checksum like the data
+ *
+ * The receiver places the data by these headers, so a corrupted one must
+ * fail the checksum as much as corrupted data would.
+ */
+bool FileTransfer::sendExtent(int socket, const ExtentHeader& extent, StreamChecksum* checksum) {
+    if (checksum) {
+        checksum->update(&extent, sizeof(extent));
+    }
+    return sendChunk(socket, reinterpret_cast<const char*>(&extent), sizeof(extent));
+}
+
+/**
+ * @brief Finds the next data extent of a file, bridging short holes
+ * @param fd Descriptor of the file
+ * @param position Offset to search from
+ * @param fileSize Size of the file, as announced in the ResumeReply
+ * @param extent Set to the extent, or to {fileSize, 0} if only a hole is left
+ * @return true if successful, false if the file could not be searched
+ *
+ * Holes shorter than MIN_SPARSE_HOLE are folded into the extent and sent as
+ * zeros: a header and a restart of the engine cost more than they save.
+ */
+bool FileTransfer::findExtent(int fd, size_t position, size_t fileSize, ExtentHeader& extent) {
+    extent = {static_cast<uint64_t>(fileSize), 0};
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    off_t data = position < fileSize ? lseek(fd, static_cast<off_t>(position), SEEK_DATA) : -1;
+    if (data < 0) {
+        return position >= fileSize || errno == ENXIO;  // Only a hole is left
+    }
+    if (static_cast<size_t>(data) >= fileSize) {
+        return true;
+    }
+
+    size_t end = static_cast<size_t>(data);
+    while (end < fileSize) {
+        off_t hole = lseek(fd, static_cast<off_t>(end), SEEK_HOLE);
+        if (hole < 0) {
+            return false;
+        }
+        end = std::min(static_cast<size_t>(hole), fileSize);
+        if (end == fileSize) break;
+
+        off_t next = lseek(fd, static_cast<off_t>(end), SEEK_DATA);
+        if (next < 0 && errno != ENXIO) {
+            return false;
+        }
+        if (next < 0 || static_cast<size_t>(next) >= fileSize ||
+            static_cast<size_t>(next) - end >= MIN_SPARSE_HOLE) {
+            break;
+        }
+        end = static_cast<size_t>(next);
+    }
+    extent = {static_cast<uint64_t>(data), static_cast<uint64_t>(end - static_cast<size_t>(data))};
+#else
+    // No hole information: the rest of the file is one extent
+    (void)fd;
+    if (position < fileSize) {
+        extent = {static_cast<uint64_t>(position), static_cast<uint64_t>(fileSize - position)};
+    }
+#endif
+    return true;
+}
+
+/**
+ * @brief Sends the data extents of a regular file, skipping its holes
+ * @param socket Socket descriptor
+ * @param fd Descriptor of the file to send
+ * @param offset Offset of the first byte to send
+ * @param fileSize Size of the file, as announced in the ResumeReply
+ * @param mode Engine used for the data of the extents
+ * @param flow Flow of the transfer, shared by all extents
+ * @param checksum If not null, fed every extent header and data byte sent (holes are not hashed)
+ * @return true if successful, false otherwise
+ *
+ * Walks the file with findExtent() and sends an ExtentHeader before each
+ * data extent, then the extent itself; a final header of length 0 at
+ * fileSize ends the stream and the receiver recreates everything in between
+ * as holes. The buffered engine runs one pipeline for the whole file, its
+ * reader thread walking the extents; the others send each extent through
+ * sendOpenFile() with one ChunkSizePolicy for the whole file.
+ */
+bool FileTransfer::sendSparse(int socket, int fd, size_t offset, size_t fileSize, SendMode mode,
+                              BandwidthManager::Flow& flow, StreamChecksum* checksum) {
+    if (checksum && checksum->algorithm() == ChecksumAlgorithm::None) {
+        checksum = nullptr;
+    }
+
+    ChunkSizePolicy policy(socket, ChunkSizePolicy::Direction::Send, fileSize - offset);
+    size_t extents = 0;
+    size_t dataBytes = 0;
+    size_t position = offset;
+    ExtentSource next = [&](ExtentHeader& extent) {
+        if (!findExtent(fd, position, fileSize, extent)) {
+            return false;
+        }
+        if (extent.length > 0) {
+            ++extents;
+            dataBytes += static_cast<size_t>(extent.length);
+            position = static_cast<size_t>(extent.offset + extent.length);
+        }
+        return true;
+    };
+
+    if (mode == SendMode::Buffered) {
+        if (!sendFileBuffered(socket, fd, 0, flow, policy, checksum, &next)) {
+            return false;
+        }
+    } else {
+        for (;;) {
+            ExtentHeader extent;
+            if (!next(extent)) {
+                return false;
+            }
+            if (extent.length == 0) break;
+            if (!sendExtent(socket, extent, checksum) ||
+                !sendOpenFile(socket, fd, static_cast<size_t>(extent.offset), static_cast<size_t>(extent.length),
+                              mode, flow, checksum, &policy)) {
+                return false;
+            }
+        }
+    }
+
+    ExtentHeader last = {static_cast<uint64_t>(fileSize), 0};
+    if (!sendExtent(socket, last, checksum)) {
+        return false;
+    }
+    std::cout << "Sent " << dataBytes << " of " << fileSize - offset << " bytes in " << extents
+              << " data extents, skipping holes" << std::endl;
+    return true;
+}
+
+/**
+ * @brief Sends part of a file over a socket connection
+ * @param socket Socket descriptor
+ * @param filename Path to the file to send
+ * @param offset Offset of the first byte to send
+ * @param length Number of bytes to send, or UNTIL_EOF for the rest of the file
+ * @param flow Flow of the logical transfer the range belongs to
+ * @param mode Engine to use for this transfer
+ * @return true if successful, false otherwise
+ */
+bool FileTransfer::sendFileRange(int socket, const std::string& filename, size_t offset, size_t length,
+                                 BandwidthManager::Flow& flow, SendMode mode) {
+    // Increment active transfers counter
+    activeTransfers++;
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        activeTransfers--;
+        return false;
+    }
+
+    bool result = sendOpenFile(socket, fd, offset, length, mode, flow);
+
+    close(fd);
+    activeTransfers--;
+    return result;
+}
+
+/**
+ * @brief Sends part of an open file with the engine selected by mode
+ * @param socket Socket descriptor
+ * @param fd Descriptor of the file to send
+ * @param offset Offset of the first byte to send
+ * @param length Number of bytes to send, or UNTIL_EOF for the rest of the file
+ * @param mode Engine to use for this transfer
+ * @param flow Bandwidth manager flow pacing the transfer
+ * @param checksum If not null, fed every byte sent
+ * @param policy Chunk sizing of the transfer the range belongs to, or nullptr for one of its own
+ * @return true if successful, false otherwise
+ *
+ * A checksum needs to see the data, so it rules out sendfile and io_uring:
+ * regular files are then sent from a memory mapping (or buffered, if
+ * explicitly asked for) and hashed as each chunk goes out.
+ *
+ * By default regular files are handed to the kernel with sendfile(2) so the
+ * data never crosses into user space, or sent from a memory mapping when
+ * they reach MmapOptions::autoThreshold. Anything else (pipes, character
+ * devices) always goes through the buffered read/send loop.
+ */
+bool FileTransfer::sendOpenFile(int socket, int fd, size_t offset, size_t length, SendMode mode,
+                                BandwidthManager::Flow& flow, StreamChecksum* checksum, ChunkSizePolicy* policy) {
+    if (checksum && checksum->algorithm() == ChecksumAlgorithm::None) {
+        checksum = nullptr;
+    }
+    std::optional<ChunkSizePolicy> ownPolicy;
+    auto policyFor = [&](size_t bytes) -> ChunkSizePolicy& {
+        if (!policy) {
+            policy = &ownPolicy.emplace(socket, ChunkSizePolicy::Direction::Send, bytes == UNTIL_EOF ? 0 : bytes);
+        }
+        return *policy;
+    };
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return false;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        // Streams cannot seek; skip to the offset by reading
+        bool positioned = offset == 0 || lseek(fd, static_cast<off_t>(offset), SEEK_SET) >= 0;
+        return positioned && sendFileBuffered(socket, fd, length, flow, policyFor(length), checksum);
+    }
+
+    size_t fileSize = static_cast<size_t>(st.st_size);
+    if (offset > fileSize || (length != UNTIL_EOF && length > fileSize - offset)) {
+        return false;
+    }
+    if (length == UNTIL_EOF) {
+        length = fileSize - offset;
+    }
+
+    if (checksum && mode != SendMode::Auto && mode != SendMode::Buffered && mode != SendMode::Mmap) {
+        reportChecksumOverride(checksum->algorithm(), mode == SendMode::IoUring ? "io_uring" : "sendfile",
+                               "mmap");
+    }
+    if (mode == SendMode::Auto) {
+        size_t threshold = getMmapOptions().autoThreshold;
+        mode = threshold > 0 && length >= threshold ? SendMode::Mmap : SendMode::SendFile;
+    }
+    if (checksum && mode != SendMode::Buffered) {
+        mode = SendMode::Mmap;
+    }
+
+    switch (mode) {
+        case SendMode::Mmap:
+            return sendFileMmap(socket, fd, offset, length, flow, policyFor(length), checksum);
+        case SendMode::Buffered:
+            return lseek(fd, static_cast<off_t>(offset), SEEK_SET) >= 0 &&
+                   sendFileBuffered(socket, fd, length, flow, policyFor(length), checksum);
+        case SendMode::IoUring:
+            return sendFileIoUring(socket, fd, offset, length, flow);
+        default:
+            return sendFileZeroCopy(socket, fd, offset, length, flow, policyFor(length));
+    }
+}
+
+/**
+ * @brief Sends part of a regular file with sendfile(2), without copying through user space
+ * @param socket Socket descriptor
+ * @param fd Open descriptor of the file to send
+ * @param offset Offset of the first byte to send
+ * @param length Number of bytes to send
+ * @param flow Bandwidth manager flow pacing this transfer
+ * @param policy Chunk sizing of this transfer
+ * @return true if successful, false otherwise
+ */
+bool FileTransfer::sendFileZeroCopy(int socket, int fd, size_t offset, size_t length,
+                                    BandwidthManager::Flow& flow, ChunkSizePolicy& policy) {
+#if defined(__linux__) || defined(__APPLE__)
+    off_t position = static_cast<off_t>(offset);
+    size_t end = offset + length;
+    int retries = 0;
+
+    while (static_cast<size_t>(position) < end) {
+        size_t count = admit(flow, std::min(policy.chunkSize(), end - static_cast<size_t>(position)));
+
+#if defined(__linux__)
+        ssize_t sent = ::sendfile(socket, fd, &position, count);
+#else
+        off_t len = static_cast<off_t>(count);
+        ssize_t sent = -1;
+        if (::sendfile(fd, socket, position, &len, nullptr, 0) == 0 || len > 0) {
+            sent = len;
+            position += len;
+        }
+#endif
+
+        if (sent < 0) {
+            flow.refund(count);
+            if (errno == EINTR) continue;
+
+            // The file system or socket type does not support sendfile;
+            // nothing has been sent yet, so use the buffered path instead
+            if (static_cast<size_t>(position) == offset &&
+                (errno == EINVAL || errno == ENOSYS || errno == ENOTSUP)) {
+                return lseek(fd, position, SEEK_SET) >= 0 && sendFileBuffered(socket, fd, length, flow, policy);
+            }
+
+            // Implement retry mechanism for failed chunk sends
+            if (++retries == MAX_RETRIES) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(RETRY_DELAY_MS));
+            continue;
+        }
+
+        // The file shrank underneath us; report it rather than spinning
+        if (sent == 0) {
+            return false;
+        }
+
+        retries = 0;
+        flow.refund(count - static_cast<size_t>(sent));
+        policy.update(count, static_cast<size_t>(sent));
+    }
+
+    return true;
+#else
+    return lseek(fd, static_cast<off_t>(offset), SEEK_SET) >= 0 && sendFileBuffered(socket, fd, length, flow, policy);
+#endif
+}
+
+namespace {
+
+constexpr size_t PIPELINE_BLOCKS = 4;               ///< Blocks circulating between the disk and network stages
+constexpr size_t PIPELINE_BLOCK_SIZE = 1024 * 1024; ///< Bytes per block
+constexpr size_t DIRECT_ALIGNMENT = 4096;           ///< Offset, size and address alignment of O_DIRECT writes
+
+/**
+ * @brief Part of a file travelling between the stages of a pipelined transfer
+ */
+struct PipelineBlock {
+    char* data = nullptr;       ///< Buffer holding the bytes; nullptr marks the end of the stream
+    size_t size = 0;            ///< Number of bytes in data
+    size_t offset = 0;          ///< File offset of the first byte
+    size_t extentLength = 0;    ///< In a sparse send, length of the extent this block starts, else 0
+};
+
+/**
+ * @brief Blocks of one pipelined transfer, on loan from the BufferPool
+ *
+ * Pool buffers are page aligned, so the same blocks serve O_DIRECT writes.
+ * Only the first block is waited for; the others are taken if the memory
+ * cap allows. Under memory pressure a transfer thus loses some overlap
+ * instead of waiting for memory while it holds blocks.
+ */
+struct PipelineBlocks {
+    BufferPool::Buffer buffers[PIPELINE_BLOCKS];
+    char* blocks[PIPELINE_BLOCKS] = {};
+    size_t count = 0;
+
+    PipelineBlocks() {
+        BufferPool& pool = BufferPool::instance();
+        for (BufferPool::Buffer& buffer : buffers) {
+            buffer = count == 0 ? pool.acquire(PIPELINE_BLOCK_SIZE) : pool.tryAcquire(PIPELINE_BLOCK_SIZE);
+            if (!buffer) break;
+            blocks[count++] = buffer.data();
+        }
+    }
+
+    bool valid() const { return count > 0; }
+
+    /**
+     * @brief Keeps a block out of the pool for good
+     *
+     * For blocks the kernel may still be sending from (MSG_ZEROCOPY on a
+     * failed socket): leaking them is better than lending their pages out.
+     */
+    void leak(char* block) {
+        for (BufferPool::Buffer& buffer : buffers) {
+            if (buffer && buffer.data() == block) {
+                new BufferPool::Buffer(std::move(buffer));
+                return;
+            }
+        }
+    }
+};
+
+} // namespace
+
+/**
+ * @brief Sends from a descriptor by reading into user-space buffers and calling send()
+ * @param socket Socket descriptor
+ * @param fd Descriptor to read from, starting at its current position
+ * @param length Number of bytes to send, or UNTIL_EOF to send until end of file
+ * @param flow Bandwidth manager flow pacing this transfer
+ * @param policy Chunk sizing of this transfer
+ * @param checksum If not null, fed every byte sent
+ * @param extents If not null, the extents of a sparse send; length is then ignored
+ * @return true if successful, false otherwise
+ *
+ * A reader thread fills blocks from the descriptor while the calling thread
+ * sends the previous ones, so disk and network latency overlap. In a sparse
+ * send the reader walks the extents with pread() and the calling thread
+ * sends the ExtentHeader of each before its first block.
+ */
+bool FileTransfer::sendFileBuffered(int socket, int fd, size_t length, BandwidthManager::Flow& flow,
+                                    ChunkSizePolicy& policy, StreamChecksum* checksum,
+                                    const ExtentSource* extents) {
+    PipelineBlocks blocks;
+    if (!blocks.valid()) {
+        std::cerr << "Error: Cannot allocate transfer buffers" << std::endl;
+        return false;
+    }
+
+    // Disk stage: reads ahead into free blocks while earlier ones are on the wire
+    SpscRing<PipelineBlock> filled(blocks.count + 1);
+    SpscRing<char*> empty(blocks.count);
+    for (size_t i = 0; i < blocks.count; ++i) empty.tryPush(blocks.blocks[i]);
+    std::atomic<bool> cancelled(false);
+    bool readSuccess = true;    // Only read after the reader has been joined
+
+    std::thread reader([&]() {
+        size_t remaining = extents ? 0 : length;
+        size_t position = 0;        // Only used in a sparse send
+        size_t extentLength = 0;    // Set until the first block of an extent is queued
+        char* block = nullptr;
+        for (;;) {
+            if (remaining == 0 && extents) {
+                ExtentHeader extent;
+                if (!(*extents)(extent)) {
+                    readSuccess = false;
+                    break;
+                }
+                position = static_cast<size_t>(extent.offset);
+                remaining = extentLength = static_cast<size_t>(extent.length);
+            }
+            if (remaining == 0 || !empty.pop(block, cancelled)) break;
+
+            size_t wanted = std::min(PIPELINE_BLOCK_SIZE, remaining);
+            ssize_t bytesRead;
+            do {
+                bytesRead = extents ? pread(fd, block, wanted, static_cast<off_t>(position))
+                                    : read(fd, block, wanted);
+            } while (bytesRead < 0 && errno == EINTR);
+
+            if (bytesRead <= 0) {
+                // End of file is only fine if we were asked to send until it
+                readSuccess = bytesRead == 0 && !extents && length == UNTIL_EOF;
+                break;
+            }
+            if (!filled.push(PipelineBlock{block, static_cast<size_t>(bytesRead), position, extentLength},
+                             cancelled)) {
+                return;
+            }
+            extentLength = 0;
+            position += static_cast<size_t>(bytesRead);
+            if (remaining != UNTIL_EOF) {
+                remaining -= static_cast<size_t>(bytesRead);
+            }
+        }
+        filled.push(PipelineBlock{}, cancelled);
+    });
+
+    // Network stage: sends each block in the pieces the bandwidth manager admits
+    std::unique_ptr<ZeroCopySender> zeroCopy;
+    if (getZeroCopySend()) {
+        zeroCopy = std::make_unique<ZeroCopySender>(socket);
+    }
+
+    // With MSG_ZEROCOPY a sent block goes back to the reader only once the
+    // kernel has released its pages
+    std::deque<std::pair<char*, uint64_t>> unreleased;
+    auto recycle = [&](bool waitForOldest) {
+        if (waitForOldest && !zeroCopy->waitFor(unreleased.front().second)) {
+            return false;
+        }
+        while (!unreleased.empty() && zeroCopy->completed(unreleased.front().second)) {
+            empty.tryPush(unreleased.front().first);
+            unreleased.pop_front();
+        }
+        return true;
+    };
+
+    bool sendSuccess = true;
+    PipelineBlock block;
+    while (sendSuccess) {
+        // Without a filled block to send, the reader may be waiting for one
+        // of ours; wait for the kernel to release the oldest
+        if (!filled.tryPop(block)) {
+            if (!unreleased.empty() && !recycle(true)) {
+                sendSuccess = false;
+                break;
+            }
+            if (!filled.pop(block, cancelled)) break;
+        }
+        if (!block.data) break;
+        if (block.extentLength > 0) {
+            ExtentHeader extent = {static_cast<uint64_t>(block.offset), static_cast<uint64_t>(block.extentLength)};
+            if (!sendExtent(socket, extent, checksum)) {
+                sendSuccess = false;
+                break;
+            }
+        }
+
+        uint64_t ticket = 0;
+        int retries = 0;
+        for (size_t sent = 0; sendSuccess && sent < block.size;) {
+            size_t piece = admit(flow, std::min(policy.chunkSize(), block.size - sent));
+            ssize_t accepted = zeroCopy ? zeroCopy->sendSome(block.data + sent, piece, ticket)
+                                        : send(socket, block.data + sent, piece, 0);
+            if (accepted < 0 && errno == EINTR) {
+                flow.refund(piece);
+                continue;
+            }
+            if (accepted <= 0) {
+                flow.refund(piece);
+                // Implement retry mechanism for failed chunk sends
+                if (accepted == 0 || ++retries == MAX_RETRIES) {
+                    sendSuccess = false;
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(RETRY_DELAY_MS));
+                continue;
+            }
+
+            // A short send means the socket buffer is full; the policy sizes
+            // the next piece from what was actually taken
+            retries = 0;
+            flow.refund(piece - static_cast<size_t>(accepted));
+            policy.update(piece, static_cast<size_t>(accepted));
+            sent += static_cast<size_t>(accepted);
+        }
+
+        // A send only succeeds once the whole piece is queued
+        if (sendSuccess && checksum) {
+            checksum->update(block.data, block.size);
+        }
+        if (zeroCopy) {
+            unreleased.emplace_back(block.data, ticket);
+            recycle(false);
+        } else {
+            empty.tryPush(block.data);
+        }
+    }
+
+    cancelled = true;
+    empty.wake();
+    filled.wake();
+    reader.join();
+
+    // The blocks go back to the pool when we return; the kernel must be done with them
+    if (zeroCopy && !unreleased.empty() && !zeroCopy->waitFor(unreleased.back().second)) {
+        std::cerr << "Error: Lost track of zero-copy buffers on a failed socket" << std::endl;
+        for (const auto& entry : unreleased) {
+            if (!zeroCopy->completed(entry.second)) {
+                blocks.leak(entry.first);
+            }
+        }
+    }
+    return sendSuccess && readSuccess;
+}
+
+namespace {
+
+/**
+ * @brief One mapped window [offset, offset + length) of a file
+ */
+struct MappedWindow {
+    char* data = nullptr;
+    size_t offset = 0;
+    size_t length = 0;
+
+    size_t end() const { return offset + length; }
+
+    void unmap() {
+        if (data) munmap(data, length);
+        data = nullptr;
+    }
+};
+
+/**
+ * @brief Maps part of a file for sequential reading
+ * @return The mapped window, with data == nullptr on failure
+ */
+MappedWindow mapWindow(int fd, size_t offset, size_t length, bool populate) {
+    MappedWindow window;
+    int flags = MAP_SHARED;
+#if defined(MAP_POPULATE)
+    if (populate) flags |= MAP_POPULATE;
+#else
+    (void)populate;
+#endif
+
+    void* data = mmap(nullptr, length, PROT_READ, flags, fd, static_cast<off_t>(offset));
+    if (data == MAP_FAILED) {
+        return window;
+    }
+
+    // We read every page exactly once, front to back: let the kernel read
+    // ahead aggressively and drop pages behind us, and start the I/O for the
+    // whole window now so it overlaps with sending the previous one
+    madvise(data, length, MADV_SEQUENTIAL);
+    madvise(data, length, MADV_WILLNEED);
+
+    window.data = static_cast<char*>(data);
+    window.offset = offset;
+    window.length = length;
+    return window;
+}
+
+} // namespace
+
+/**
+ * @brief Sends part of a regular file with writev() straight from a memory mapping
+ * @param socket Socket descriptor
+ * @param fd Open descriptor of the file to send
+ * @param offset Offset of the first byte to send
+ * @param length Number of bytes to send
+ * @param flow Bandwidth manager flow pacing this transfer
+ * @param policy Chunk sizing of this transfer
+ * @param checksum If not null, fed every byte sent, straight from the mapping
+ * @return true if successful, false otherwise
+ *
+ * The file is mapped in two windows of half the address budget each: the one
+ * being sent and the one after it, which is already being read ahead. A chunk
+ * that crosses the boundary goes out as a single two-element writev().
+ */
+bool FileTransfer::sendFileMmap(int socket, int fd, size_t offset, size_t length,
+                                BandwidthManager::Flow& flow, ChunkSizePolicy& policy, StreamChecksum* checksum) {
+    if (length == 0) {
+        return true;
+    }
+
+    MmapOptions options = getMmapOptions();
+    size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t windowSize = std::max(pageSize, options.addressBudget / 2 / pageSize * pageSize);
+    size_t end = offset + length;
+
+    // Mappings must start on a page boundary
+    size_t windowStart = offset / pageSize * pageSize;
+    MappedWindow current = mapWindow(fd, windowStart, std::min(windowSize, end - windowStart), options.populate);
+    if (!current.data) {
+        // Not mappable (e.g. a file system without mmap support)
+        if (checksum) {
+            return lseek(fd, static_cast<off_t>(offset), SEEK_SET) >= 0 &&
+                   sendFileBuffered(socket, fd, length, flow, policy, checksum);
+        }
+        return sendFileZeroCopy(socket, fd, offset, length, flow, policy);
+    }
+    MappedWindow next;
+
+    int retries = 0;
+    bool success = true;
+
+    while (offset < end) {
+        if (offset >= current.end()) {
+            current.unmap();
+            current = next;
+            next = MappedWindow();
+        }
+        if (!next.data && current.end() < end) {
+            next = mapWindow(fd, current.end(), std::min(windowSize, end - current.end()), options.populate);
+        }
+        if (!current.data) {
+            success = false;
+            break;
+        }
+
+        size_t count = admit(flow, std::min(policy.chunkSize(), end - offset));
+
+        struct iovec iov[2];
+        int iovcnt = 1;
+        iov[0].iov_base = current.data + (offset - current.offset);
+        iov[0].iov_len = std::min(count, current.end() - offset);
+        if (count > iov[0].iov_len && next.data) {
+            iov[1].iov_base = next.data;
+            iov[1].iov_len = std::min(count - iov[0].iov_len, next.length);
+            iovcnt = 2;
+        }
+        size_t requested = iov[0].iov_len + (iovcnt == 2 ? iov[1].iov_len : 0);
+
+        ssize_t sent = writev(socket, iov, iovcnt);
+        if (sent < 0) {
+            flow.refund(count);
+            if (errno == EINTR) continue;
+
+            // Implement retry mechanism for failed chunk sends
+            if (++retries == MAX_RETRIES) {
+                success = false;
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(RETRY_DELAY_MS));
+            continue;
+        }
+
+        retries = 0;
+        if (checksum) {
+            size_t first = std::min(static_cast<size_t>(sent), iov[0].iov_len);
+            checksum->update(iov[0].iov_base, first);
+            if (static_cast<size_t>(sent) > first) {
+                checksum->update(iov[1].iov_base, static_cast<size_t>(sent) - first);
+            }
+        }
+        flow.refund(count - static_cast<size_t>(sent));
+        policy.update(requested, static_cast<size_t>(sent));
+        offset += static_cast<size_t>(sent);
+    }
+
+    current.unmap();
+    next.unmap();
+    return success;
+}
 
 /**
- * @brief Calculates the chunk size based on active transfers
- * @return Size of chunks to use for transfer
+ * @brief Sends part of a regular file through the shared io_uring engine
+ * @param socket Socket descriptor
+ * @param fd Open descriptor of the file to send
+ * @param offset Offset of the first byte to send
+ * @param length Number of bytes to send
+ * @param flow Bandwidth manager flow pacing this transfer
+ * @return true if successful, false otherwise
+ *
+ * The calling thread only waits for the job; reads and sends for every
+ * transfer on the engine are issued and reaped by the engine's ring threads.
  */
-size_t FileTransfer::calculateChunkSize() {
-    int transfers = activeTransfers.load();
-    if (transfers <= 0) transfers = 1;
-    return BASE_TRANSFER_RATE / transfers;
+bool FileTransfer::sendFileIoUring(int socket, int fd, size_t offset, size_t length,
+                                   BandwidthManager::Flow& flow) {
+    IoUringEngine* engine = IoUringEngine::instance();
+    if (!engine) {
+        ChunkSizePolicy policy(socket, ChunkSizePolicy::Direction::Send, length);
+        return sendFileZeroCopy(socket, fd, offset, length, flow, policy);
+    }
+
+    std::promise<bool> done;
+    engine->submitSend(socket, fd, offset, length, flow, [&done](bool success, size_t) {
+        done.set_value(success);
+    });
+    return done.get_future().get();
 }
 
 /**
- * @brief Sends a file over a socket connection
+ * @brief Reserves disk space for data about to be written to a file
+ * @param fd Descriptor of the file
+ * @param offset Offset of the first byte that will be written
+ * @param length Number of bytes that will be written
+ * @return false if the file system is out of space, true otherwise
+ */
+bool FileTransfer::preallocate(int fd, size_t offset, size_t length) {
+    if (length == 0 || length == UNTIL_EOF) {
+        return true;
+    }
+
+#if defined(__linux__)
+    int result;
+    do {
+        result = fallocate(fd, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(length));
+    } while (result < 0 && errno == EINTR);
+    if (result == 0) {
+        return true;
+    }
+    if (errno == ENOSPC || errno == EDQUOT) {
+        std::cerr << "Error: Not enough disk space for " << length << " bytes" << std::endl;
+        return false;
+    }
+    // EOPNOTSUPP (tmpfs on old kernels, NFS, FUSE...): let the writes allocate
+    return true;
+#elif defined(__APPLE__)
+    // F_PREALLOCATE reserves blocks past the end of the file without changing its size
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return true;
+    }
+    off_t end = static_cast<off_t>(offset + length);
+    if (end <= st.st_size) {
+        return true;
+    }
+    fstore_t store = {F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, end - st.st_size, 0};
+    if (fcntl(fd, F_PREALLOCATE, &store) < 0) {
+        store.fst_flags = F_ALLOCATEALL;
+        if (fcntl(fd, F_PREALLOCATE, &store) < 0) {
+            if (errno == ENOSPC) {
+                std::cerr << "Error: Not enough disk space for " << length << " bytes" << std::endl;
+                return false;
+            }
+            return true;
+        }
+    }
+    return true;
+#else
+    (void)fd;
+    (void)offset;
+    return true;
+#endif
+}
+
+/**
+ * @struct FileTransfer::ReceiveState
+ * @brief A file being received, between the resume handshake and the commit
+ */
+struct FileTransfer::ReceiveState {
+    std::string filename;
+    StagedFile file;
+    ResumeReply reply = {};
+    StreamChecksum checksum{ChecksumAlgorithm::None};
+    std::unique_ptr<BandwidthManager::Flow> flow;   ///< Paces every byte of the transfer
+    size_t length = 0;          ///< Bytes expected after reply.offset, or UNTIL_EOF
+    size_t received = 0;        ///< Data bytes stored
+    size_t validEnd = 0;        ///< End of the prefix of the file that is final
+    bool negotiated = false;    ///< The handshake succeeded and data may follow
+    bool corrupted = false;     ///< The data is not worth keeping for a resume
+};
+
+/**
+ * @brief Receives a file over a socket connection
  * @param socket Socket descriptor
- * @param filename Path to the file to send
+ * @param filename Path where to save the received file
+ * @param printContent Whether to print the file content after receiving
+ * @param mode Engine to use for this transfer
  * @return true if successful, false otherwise
  */
-bool FileTransfer::sendFile(int socket, const std::string& filename) {
-    // Increment active transfers counter
+bool FileTransfer::receiveFile(int socket, const std::string& filename, bool printContent, ReceiveMode mode) {
+    std::shared_ptr<ReceiveState> state = beginReceive(socket, filename);
+    return state && finishReceive(socket, *state, receiveData(socket, *state, mode), printContent);
+}
+
+void FileTransfer::receiveFileAsync(int socket, const std::string& filename, ReceiveMode mode,
+                                    const Executor& executor, Continuation done) {
+    std::shared_ptr<ReceiveState> state = beginReceive(socket, filename);
+    if (!state) {
+        done(false);
+        return;
+    }
+
+    // Only plain ranges of known length go to the engine, like on the sending side
+    const ResumeReply& reply = state->reply;
+    if (mode != ReceiveMode::IoUring || !IoUringEngine::instance() || !state->negotiated ||
+        state->length == UNTIL_EOF || (reply.flags & TRANSFER_SPARSE) || reply.checksum != ChecksumAlgorithm::None) {
+        done(finishReceive(socket, *state, receiveData(socket, *state, mode), false));
+        return;
+    }
+
+    if (!preallocate(state->file.fd(), reply.offset, state->length)) {
+        done(finishReceive(socket, *state, false, false));
+        return;
+    }
+    receiveRangeAsync(socket, state->file.fd(), reply.offset, state->length, *state->flow, mode, executor,
+                      [socket, state, done](bool success, size_t bytes) {
+                          state->received = bytes;
+                          state->validEnd = state->reply.offset + bytes;
+                          done(finishReceive(socket, *state, success, false));
+                      });
+}
+
+/**
+ * @brief Opens the file to receive into and makes the resume handshake
+ * @return The transfer, or nullptr if the file could not be created
+ *
+ * A failed handshake still returns the transfer, with negotiated unset, so
+ * that finishReceive() keeps what an earlier attempt left.
+ */
+std::shared_ptr<FileTransfer::ReceiveState> FileTransfer::beginReceive(int socket, const std::string& filename) {
+    std::cout << "Start receiving file" << "\n";
+
+    // Keep whatever an earlier, interrupted attempt left in the .part file
+    auto state = std::make_shared<ReceiveState>();
+    state->filename = filename;
+    struct stat st;
+    if (!state->file.create(filename, true) || fstat(state->file.fd(), &st) < 0) {
+        std::cerr << "Please ensure you have write permissions for this location." << std::endl;
+        if (std::filesystem::path(filename).parent_path() == "/System") {
+            std::cerr << "Note: The /System directory is protected by System Integrity Protection (SIP) on macOS." << std::endl;
+            std::cerr << "Please choose a different directory, such as /tmp/ or your home directory." << std::endl;
+        }
+        return nullptr;
+    }
     activeTransfers++;
-    
-    std::ifstream file(filename, std::ios::binary);
-    if (!file) {
-        activeTransfers--;
+    state->flow = openFlow(socket);
+    int tempFd = state->file.fd();
+    std::cout << "Receiving into " << state->file.tempName() << std::endl;
+
+    // Describe what we already have; the sender decides where to start
+    ResumeOffer offer = {static_cast<uint64_t>(st.st_size), 0, 0, getChecksumAlgorithm(),
+                         TRANSFER_SPARSE | TRANSFER_COMMIT_ACK};
+    offer.tailLength = std::min<uint64_t>(offer.partSize, RESUME_TAIL_BYTES);
+    ResumeReply& reply = state->reply;
+    if (!hashTail(tempFd, offer.partSize, offer.tailLength, offer.tailHash) ||
+        !sendChunk(socket, reinterpret_cast<const char*>(&offer), sizeof(offer)) ||
+        !receiveChunk(socket, reinterpret_cast<char*>(&reply), sizeof(reply)) || reply.offset > offer.partSize) {
+        return state;
+    }
+
+    if (reply.offset > 0) {
+        std::cout << "Resuming at byte " << reply.offset << std::endl;
+    }
+    // An unnamed file dies with the process; large ones are worth resuming after a crash
+    if (reply.fileSize == UNTIL_EOF || reply.fileSize >= CRASH_SAFE_BYTES) {
+        state->file.persist();
+    }
+    // With a known size an early close is a failure, not the end of the file
+    state->length = reply.fileSize == UNTIL_EOF ? UNTIL_EOF : reply.fileSize - reply.offset;
+    state->validEnd = reply.offset;
+    state->checksum = StreamChecksum(reply.checksum);
+
+    // Drop anything past the agreed offset (everything, if the tails differed);
+    // the checksum covers what is left, as it does on the sending side
+    state->negotiated = ftruncate(tempFd, static_cast<off_t>(reply.offset)) == 0 &&
+                        hashPrefix(tempFd, reply.offset, state->checksum);
+    return state;
+}
+
+/**
+ * @brief Receives the data of a transfer after the handshake, on the calling thread
+ */
+bool FileTransfer::receiveData(int socket, ReceiveState& state, ReceiveMode mode) {
+    if (!state.negotiated) {
         return false;
     }
 
-    auto start = std::chrono::steady_clock::now();
-    size_t totalBytesSent = 0;
-    
-    // Use dynamic buffer size
-    std::vector<char> buffer(calculateChunkSize());
-    
-    while (!file.eof()) {
-        buffer.resize(calculateChunkSize()); // Adjust buffer size dynamically
-        file.read(buffer.data(), buffer.size());
-        std::streamsize bytesRead = file.gcount();
-        
-        // Implement retry mechanism for failed chunk sends
-        int retries = 0;
-        while (retries < MAX_RETRIES) {
-            // Attempt to send the chunk
-            if (sendChunk(socket, buffer.data(), bytesRead)) {
-                break;  // Success - exit retry loop
+    int fd = state.file.fd();
+    const ResumeReply& reply = state.reply;
+    if ((reply.flags & TRANSFER_SPARSE) && state.length != UNTIL_EOF) {
+        return receiveSparse(socket, fd, reply.offset, reply.fileSize, mode, *state.flow, &state.checksum,
+                             state.received, state.validEnd);
+    }
+    bool result = preallocate(fd, reply.offset, state.length) &&
+                  receiveRange(socket, fd, reply.offset, state.length, *state.flow, mode, &state.received,
+                               &state.checksum);
+    state.validEnd = reply.offset + state.received;
+    return result;
+}
+
+/**
+ * @brief Ends a transfer after its data: checks the trailer, commits the file and acknowledges it
+ * @param received Whether all the data arrived
+ * @param printContent Whether to print the file content once it is published
+ * @return true if the file was published
+ */
+bool FileTransfer::finishReceive(int socket, ReceiveState& state, bool received, bool printContent) {
+    bool transferSuccess = received && state.negotiated;
+    const ResumeReply& reply = state.reply;
+    StagedFile& file = state.file;
+
+    // The data is only trusted once the sender's checksum agrees with ours
+    if (transferSuccess && reply.checksum != ChecksumAlgorithm::None) {
+        uint64_t trailer;
+        transferSuccess = receiveChunk(socket, reinterpret_cast<char*>(&trailer), sizeof(trailer));
+        if (transferSuccess && trailer != state.checksum.digest()) {
+            std::cerr << "Error: " << StreamChecksum::name(reply.checksum) << " mismatch, "
+                      << "discarding corrupted " << file.tempName() << std::endl;
+            state.corrupted = true;
+            transferSuccess = false;
+        }
+    }
+
+    // Cut the file and its preallocated space off after the last byte that
+    // actually arrived, so it only holds data a resume can trust
+    if (!transferSuccess && state.negotiated && !state.corrupted && state.length != UNTIL_EOF) {
+        if (ftruncate(file.fd(), static_cast<off_t>(state.validEnd)) < 0) {
+            std::cerr << "Error: Cannot trim " << file.tempName() << ", discarding it" << std::endl;
+            state.corrupted = true;
+        }
+    }
+
+    // Publish the file under the durability policy; this closes it
+    if (transferSuccess) {
+        transferSuccess = DurabilityManager::instance().commit(file);
+    }
+    std::cout << "Transfer completed. Success: " << (transferSuccess ? "true" : "false") << std::endl;
+    std::cout << "Total bytes received: " << state.received << std::endl;
+
+    // The sender waits for this once the data is complete
+    if (reply.flags & TRANSFER_COMMIT_ACK) {
+        char ack = transferSuccess ? COMMIT_OK : COMMIT_FAILED;
+        sendChunk(socket, &ack, 1);
+    }
+
+    // If requested, print the file contents to terminal
+    if (transferSuccess && printContent) {
+        printFileContent(state.filename);
+    }
+
+    // Keep non-empty data as the .part file so the next attempt can resume from it
+    if (!transferSuccess) {
+        struct stat st;
+        if (state.corrupted || fstat(file.fd(), &st) < 0 || st.st_size == 0) {
+            file.discard();
+        } else if (file.keep()) {
+            std::cerr << "Keeping " << state.filename << ".part to resume the transfer later" << std::endl;
+        }
+    }
+
+    activeTransfers--;
+    return transferSuccess;
+}
+
+/**
+ * @brief Receives the extents of a sparse transfer, leaving holes between them
+ * @param socket Socket descriptor
+ * @param fd Descriptor of the file to write
+ * @param offset Offset the transfer starts at; the file must end there
+ * @param fileSize Size of the whole file
+ * @param mode Engine used for the data of the extents
+ * @param flow Flow of the transfer, shared by all extents
+ * @param checksum If not null, fed every extent header and data byte received
+ * @param totalBytesReceived Incremented with the number of data bytes stored
+ * @param validEnd Set to the end of the prefix of the file that is final,
+ *                 holes included, for truncating the .part on failure
+ * @return true if every extent and the end marker arrived, false otherwise
+ *
+ * Only the extents that arrive are allocated (preallocated one at a time)
+ * and written; writing past the end of the file leaves the gap before each
+ * extent as a hole, and the end marker extends the file over the final one.
+ * Preallocating does not change the size, so the file only grows with the
+ * data written: a .part left by a crash ends after the last byte stored,
+ * never in space reserved for an extent that did not arrive.
+ *
+ * The buffered and direct engines run one pipeline for the whole file,
+ * reading each header when the extent before it is complete; the others
+ * receive each extent with one ChunkSizePolicy for the whole file.
+ */
+bool FileTransfer::receiveSparse(int socket, int fd, size_t offset, size_t fileSize, ReceiveMode mode,
+                                 BandwidthManager::Flow& flow, StreamChecksum* checksum,
+                                 size_t& totalBytesReceived, size_t& validEnd) {
+    mode = receiveModeFor(mode, checksum);
+    ChunkSizePolicy policy(socket, ChunkSizePolicy::Direction::Receive, fileSize - offset);
+    validEnd = offset;
+    size_t extents = 0;
+    size_t expected = offset;   // Extents must not go back over what came before
+    ExtentSource next = [&](ExtentHeader& extent) {
+        if (!receiveChunk(socket, reinterpret_cast<char*>(&extent), sizeof(extent))) {
+            return false;
+        }
+        if (checksum) {
+            checksum->update(&extent, sizeof(extent));   // As the sender did, see sendExtent()
+        }
+        if (extent.offset < expected || extent.offset > fileSize || extent.length > fileSize - extent.offset) {
+            std::cerr << "Error: Invalid extent of " << extent.length << " bytes at " << extent.offset << std::endl;
+            return false;
+        }
+        if (extent.length == 0 && extent.offset != fileSize) {
+            std::cerr << "Error: Sparse transfer ended at " << extent.offset << " of " << fileSize << std::endl;
+            return false;
+        }
+        if (extent.length > 0) {
+            if (!preallocate(fd, static_cast<size_t>(extent.offset), static_cast<size_t>(extent.length))) {
+                return false;
             }
-            retries++;
-            // Wait before retrying
-            std::this_thread::sleep_for(std::chrono::milliseconds(RETRY_DELAY_MS));
+            ++extents;
+        }
+        expected = static_cast<size_t>(extent.offset + extent.length);
+        return true;
+    };
+
+    int directFd = mode == ReceiveMode::Direct ? openDirect(fd) : -1;
+    if (mode == ReceiveMode::Direct && directFd < 0) {
+        mode = checksum ? ReceiveMode::Buffered : ReceiveMode::Splice;
+    }
+
+    if (mode == ReceiveMode::Buffered || mode == ReceiveMode::Direct) {
+        // Everything up to each extent is a hole, so validEnd follows the headers too
+        bool ok = receivePipelined(socket, fd, directFd, offset, fileSize - offset, totalBytesReceived, flow,
+                                   policy, checksum, &next, &validEnd);
+        if (directFd >= 0) {
+            close(directFd);
         }
-        
-        // If all retries failed, abort the transfer
-        if (retries == MAX_RETRIES) {
-            activeTransfers--;
+        if (!ok) {
             return false;
         }
+    } else {
+        for (;;) {
+            ExtentHeader extent;
+            if (!next(extent)) {
+                return false;
+            }
+            // Everything up to the extent is a hole
+            validEnd = static_cast<size_t>(extent.offset);
+            if (extent.length == 0) break;
 
-        // Implement rate limiting
-        totalBytesSent += bytesRead;
-        auto elapsed = std::chrono::steady_clock::now() - start;
-        auto expectedDuration = std::chrono::seconds(totalBytesSent / BASE_TRANSFER_RATE);
-        if (elapsed < expectedDuration) {
-            std::this_thread::sleep_for(expectedDuration - elapsed);
+            size_t received = 0;
+            bool ok = receiveWith(socket, fd, validEnd, static_cast<size_t>(extent.length), mode, flow, policy,
+                                  received, checksum);
+            totalBytesReceived += received;
+            validEnd += received;
+            if (!ok) {
+                return false;
+            }
         }
     }
 
-    activeTransfers--;
+    if (ftruncate(fd, static_cast<off_t>(fileSize)) < 0) {
+        std::cerr << "Error: Cannot extend file to " << fileSize << " bytes" << std::endl;
+        return false;
+    }
+    std::cout << "Received " << totalBytesReceived << " bytes in " << extents
+              << " data extents, keeping holes" << std::endl;
     return true;
 }
 
 /**
- * @brief Receives a file over a socket connection
+ * @brief Receives data from a socket into part of an open file
  * @param socket Socket descriptor
- * @param filename Path where to save the received file
- * @param printContent Whether to print the file content after receiving
- * @return true if successful, false otherwise
+ * @param fd Descriptor of the file to write
+ * @param offset Offset in the file at which to store the first byte
+ * @param length Number of bytes expected, or UNTIL_EOF to receive until the peer closes
+ * @param flow Flow of the logical transfer the range belongs to
+ * @param mode Engine to use for this transfer
+ * @param bytesReceived If not null, set to the number of bytes stored
+ * @param checksum If not null, fed every byte received; forces the buffered engine
+ *                 unless the direct one was asked for, the only ones that see the data
+ * @return true if all expected bytes were stored, false otherwise
  */
-bool FileTransfer::receiveFile(int socket, const std::string& filename, bool printContent) {
-    activeTransfers++;
+bool FileTransfer::receiveRange(int socket, int fd, size_t offset, size_t length, BandwidthManager::Flow& flow,
+                                ReceiveMode mode, size_t* bytesReceived, StreamChecksum* checksum) {
+    mode = receiveModeFor(mode, checksum);
+    ChunkSizePolicy policy(socket, ChunkSizePolicy::Direction::Receive, length == UNTIL_EOF ? 0 : length);
+    size_t total = 0;
+    bool result = receiveWith(socket, fd, offset, length, mode, flow, policy, total, checksum);
+    if (bytesReceived) {
+        *bytesReceived = total;
+    }
+    return result;
+}
 
-    std::cout << "Start receiving file" << "\n";
+/**
+ * @brief Picks the engine that can serve a receive with the given checksum
+ * @param mode Engine asked for
+ * @param checksum Checksum of the transfer; set to nullptr if it hashes nothing
+ * @return The buffered engine if a checksum rules out the one asked for, else mode
+ */
+FileTransfer::ReceiveMode FileTransfer::receiveModeFor(ReceiveMode mode, StreamChecksum*& checksum) {
+    if (!checksum || checksum->algorithm() == ChecksumAlgorithm::None) {
+        checksum = nullptr;
+        return mode;
+    }
+    if (mode == ReceiveMode::Splice || mode == ReceiveMode::IoUring) {
+        reportChecksumOverride(checksum->algorithm(), mode == ReceiveMode::IoUring ? "io_uring" : "splice",
+                               "buffered");
+    }
+    return mode == ReceiveMode::Direct ? mode : ReceiveMode::Buffered;
+}
 
-    // Validate filename
-    if (filename.empty()) {
-        std::cerr << "Error: Empty filename provided" << std::endl;
-        activeTransfers--;
-        return false;
+/**
+ * @brief Receives part of a file with the engine selected by mode
+ * @param policy Chunk sizing of the transfer the range belongs to
+ * @param totalBytesReceived Incremented with the number of bytes stored
+ * @param checksum If not null, fed every byte received; mode must be one that sees the data
+ */
+bool FileTransfer::receiveWith(int socket, int fd, size_t offset, size_t length, ReceiveMode mode,
+                               BandwidthManager::Flow& flow, ChunkSizePolicy& policy, size_t& totalBytesReceived,
+                               StreamChecksum* checksum) {
+    switch (mode) {
+        case ReceiveMode::Buffered:
+            return receiveFileBuffered(socket, fd, offset, length, totalBytesReceived, flow, policy, checksum);
+        case ReceiveMode::IoUring:
+            return receiveFileIoUring(socket, fd, offset, length, totalBytesReceived, flow);
+        case ReceiveMode::Direct:
+            return receiveFileDirect(socket, fd, offset, length, totalBytesReceived, flow, policy, checksum);
+        default:
+            return receiveFileSplice(socket, fd, offset, length, totalBytesReceived, flow, policy);
     }
+}
 
-    // Create necessary directories
-    try {
-        std::filesystem::path filePath(filename);
-        auto parentPath = filePath.parent_path();
-        if (!parentPath.empty()) {
-            // Check if directory is writable before attempting to create it
-            if (std::filesystem::exists(parentPath)) {
-                if (access(parentPath.c_str(), W_OK) != 0) {
-                    std::cerr << "Error: No write permission for directory: " << parentPath << std::endl;
-                    std::cerr << "Please choose a different directory with write permissions." << std::endl;
-                    activeTransfers--;
-                    return false;
-                }
-            } else {
-                std::filesystem::create_directories(parentPath);
-                std::cout << "Created directory structure: " << parentPath << std::endl;
-                
-                // Verify we can write to the created directory
-                if (access(parentPath.c_str(), W_OK) != 0) {
-                    std::cerr << "Error: Cannot write to created directory: " << parentPath << std::endl;
-                    std::cerr << "Please choose a different directory with write permissions." << std::endl;
-                    activeTransfers--;
-                    return false;
-                }
-            }
+void FileTransfer::receiveRangeAsync(int socket, int fd, size_t offset, size_t length,
+                                     BandwidthManager::Flow& flow, ReceiveMode mode, const Executor& executor,
+                                     RangeContinuation done) {
+    IoUringEngine* engine = mode == ReceiveMode::IoUring ? IoUringEngine::instance() : nullptr;
+    if (!engine) {
+        size_t received = 0;
+        bool result = receiveRange(socket, fd, offset, length, flow, mode, &received);
+        done(result, received);
+        return;
+    }
+
+    engine->submitReceive(socket, fd, offset, length, flow,
+                          [executor, done](bool success, size_t received) {
+                              executor([done, success, received]() { done(success, received); });
+                          });
+}
+
+namespace {
+
+/**
+ * @brief Pipe pair owned by a worker thread and reused by every splice receive
+ *
+ * Creating a pipe per transfer costs two descriptors and a pipe buffer
+ * allocation; keeping one per thread makes the steady state syscall-free
+ * apart from the splices themselves.
+ */
+struct SplicePipe {
+    int fds[2] = {-1, -1};
+    size_t capacity = 0;  ///< Bytes the pipe can hold
+
+    SplicePipe() { open(); }
+    ~SplicePipe() { reset(); }
+
+    bool valid() const { return fds[0] >= 0; }
+
+    void open() {
+#if defined(__linux__)
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            fds[0] = fds[1] = -1;
+            return;
         }
-    } catch (const std::filesystem::filesystem_error& e) {
-        std::cerr << "Failed to create/check directories: " << e.what() << std::endl;
-        activeTransfers--;
-        return false;
+        // Grow the pipe so a single splice can move a large chunk; failure
+        // just leaves the default 64 KiB capacity
+        fcntl(fds[1], F_SETPIPE_SZ, 1 << 20);
+        int size = fcntl(fds[1], F_GETPIPE_SZ);
+        capacity = size > 0 ? static_cast<size_t>(size) : 64 * 1024;
+#endif
     }
 
-    // Create temporary filename with .part extension
-    std::string tempFilename = filename + ".part";
-    std::cout << "Creating temporary file: " << tempFilename << std::endl;
+    void reset() {
+        if (fds[0] >= 0) close(fds[0]);
+        if (fds[1] >= 0) close(fds[1]);
+        fds[0] = fds[1] = -1;
+    }
 
-    // Test if we can create the file before proceeding
-    {
-        std::ofstream testFile(tempFilename);
-        if (!testFile) {
-            std::cerr << "Error: Cannot create file in " << std::filesystem::path(filename).parent_path() << std::endl;
-            std::cerr << "Please ensure you have write permissions for this location." << std::endl;
-            if (std::filesystem::path(filename).parent_path() == "/System") {
-                std::cerr << "Note: The /System directory is protected by System Integrity Protection (SIP) on macOS." << std::endl;
-                std::cerr << "Please choose a different directory, such as /tmp/ or your home directory." << std::endl;
-            }
-            activeTransfers--;
+    // A failed transfer may leave bytes in the pipe; start over with a fresh one
+    void recycle() {
+        reset();
+        open();
+    }
+};
+
+/**
+ * @brief Writes the whole buffer to a file at the given offset
+ * @return true if every byte was written, false otherwise
+ */
+bool pwriteAll(int fd, const char* data, size_t size, size_t offset) {
+    while (size > 0) {
+        ssize_t written = pwrite(fd, data, size, static_cast<off_t>(offset));
+        if (written < 0) {
+            if (errno == EINTR) continue;
             return false;
         }
-        testFile.close();
-        std::filesystem::remove(tempFilename);
+        data += written;
+        size -= static_cast<size_t>(written);
+        offset += static_cast<size_t>(written);
     }
+    return true;
+}
 
-    // Open temporary file for writing
-    std::ofstream tempFile(tempFilename, std::ios::binary);
-    if (!tempFile) {
-        std::cerr << "Failed to create temporary file: " << tempFilename << std::endl;
-        activeTransfers--;
-        return false;
+} // namespace
+
+/**
+ * @brief Receives into a file by moving pages socket -> pipe -> file
+ * @param socket Socket descriptor
+ * @param fd Descriptor of the file being written
+ * @param offset Offset in the file at which to store the first byte
+ * @param length Number of bytes expected, or UNTIL_EOF to receive until the peer closes
+ * @param totalBytesReceived Incremented with the number of bytes stored
+ * @param flow Bandwidth manager flow pacing this transfer
+ * @param policy Chunk sizing of this transfer
+ * @return true if all expected bytes were stored, false otherwise
+ *
+ * Falls back to receiveFileBuffered() when splice(2) is unavailable for this
+ * socket/file pair (non-Linux systems, file systems without splice_write).
+ */
+bool FileTransfer::receiveFileSplice(int socket, int fd, size_t offset, size_t length,
+                                     size_t& totalBytesReceived, BandwidthManager::Flow& flow,
+                                     ChunkSizePolicy& policy) {
+#if defined(__linux__)
+    thread_local SplicePipe splicePipe;
+    if (!splicePipe.valid()) {
+        splicePipe.open();
+        if (!splicePipe.valid()) {
+            return receiveFileBuffered(socket, fd, offset, length, totalBytesReceived, flow, policy);
+        }
     }
 
-    auto start = std::chrono::steady_clock::now();
-    size_t totalBytesReceived = 0;
-    bool transferSuccess = true;
-    
-    // ... existing buffer and receiving logic ...
-    std::vector<char> buffer(calculateChunkSize());
+    loff_t position = static_cast<loff_t>(offset);
+    size_t remaining = length;
+    WritebackController writeback(fd, offset);
 
-    while (true) {
-        buffer.resize(calculateChunkSize());
+    while (remaining > 0) {
         int retries = 0;
         ssize_t bytesReceived;
-        
-        while (retries < MAX_RETRIES) {
-            bytesReceived = recv(socket, buffer.data(), buffer.size(), 0);
+
+        // A single splice can never move more than the pipe holds
+        size_t requested = admit(flow, std::min({policy.chunkSize(), splicePipe.capacity, remaining}));
+        while (true) {
+            bytesReceived = splice(socket, nullptr, splicePipe.fds[1], nullptr,
+                                   requested, SPLICE_F_MOVE | SPLICE_F_MORE);
             if (bytesReceived >= 0) break;
-            retries++;
+            if (errno == EINTR) continue;
+
+            // splice is not supported for this socket; nothing is in the pipe yet
+            if (static_cast<size_t>(position) == offset && (errno == EINVAL || errno == ENOSYS)) {
+                flow.refund(requested);
+                return receiveFileBuffered(socket, fd, offset, length, totalBytesReceived, flow, policy);
+            }
+            if (++retries == MAX_RETRIES) break;
             std::this_thread::sleep_for(std::chrono::milliseconds(RETRY_DELAY_MS));
         }
-        
-        if (bytesReceived < 0 || retries == MAX_RETRIES) {
-            transferSuccess = false;
-            break;
+
+        flow.refund(requested - static_cast<size_t>(std::max<ssize_t>(bytesReceived, 0)));
+        if (bytesReceived < 0) {
+            splicePipe.recycle();
+            return false;
         }
 
         // If we received 0 bytes, it means end of transmission
         if (bytesReceived == 0) {
-            transferSuccess = true;  // Explicitly mark as successful
-            break;
+            return remaining == UNTIL_EOF;
         }
 
-        tempFile.write(buffer.data(), bytesReceived);
+        // Drain everything we just put into the pipe into the file
+        size_t pending = static_cast<size_t>(bytesReceived);
+        while (pending > 0) {
+            ssize_t moved = splice(splicePipe.fds[0], nullptr, fd, &position, pending, SPLICE_F_MOVE);
+            if (moved < 0 && errno == EINTR) continue;
+
+            // The file system cannot splice_write: copy what is already in
+            // the pipe out by hand and finish with the buffered engine
+            if (moved < 0 && errno == EINVAL) {
+                BufferPool::Buffer buffer = BufferPool::instance().acquire(pending);
+                size_t drained = 0;
+                while (buffer && drained < pending) {
+                    ssize_t n = read(splicePipe.fds[0], buffer.data() + drained, pending - drained);
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) break;
+                    drained += static_cast<size_t>(n);
+                }
+                if (drained != pending || !pwriteAll(fd, buffer.data(), pending, static_cast<size_t>(position))) {
+                    splicePipe.recycle();
+                    return false;
+                }
+                size_t stored = static_cast<size_t>(position) + pending - offset;
+                totalBytesReceived += static_cast<size_t>(bytesReceived);
+                return receiveFileBuffered(socket, fd, offset + stored,
+                                           length == UNTIL_EOF ? UNTIL_EOF : length - stored,
+                                           totalBytesReceived, flow, policy);
+            }
+
+            if (moved <= 0) {
+                splicePipe.recycle();
+                return false;
+            }
+            pending -= static_cast<size_t>(moved);
+        }
 
-        totalBytesReceived += bytesReceived;
-        auto elapsed = std::chrono::steady_clock::now() - start;
-        auto expectedDuration = std::chrono::seconds(totalBytesReceived / BASE_TRANSFER_RATE);
-        if (elapsed < expectedDuration) {
-            std::this_thread::sleep_for(expectedDuration - elapsed);
+        writeback.advance(static_cast<size_t>(bytesReceived));
+        policy.update(requested, static_cast<size_t>(bytesReceived));
+        totalBytesReceived += static_cast<size_t>(bytesReceived);
+        if (remaining != UNTIL_EOF) {
+            remaining -= static_cast<size_t>(bytesReceived);
         }
     }
+    return true;
+#else
+    return receiveFileBuffered(socket, fd, offset, length, totalBytesReceived, flow, policy);
+#endif
+}
 
-    tempFile.close();
-    std::cout << "Transfer completed. Success: " << (transferSuccess ? "true" : "false") << std::endl;
-    std::cout << "Total bytes received: " << totalBytesReceived << std::endl;
+namespace {
 
-    if (transferSuccess) {
-        try {
-            // Rename temporary file to final filename
-            std::filesystem::rename(tempFilename, filename);
-            
-            // If requested, print the file contents to terminal
-            if (printContent) {
-                printFileContent(filename);
+/**
+ * @class BlockWriter
+ * @brief Disk stage of a pipelined receive
+ *
+ * A writer thread stores the blocks the network stage submits while the
+ * network stage receives into the next one. Full blocks travel to the
+ * writer and empty ones back through two SpscRings, so the stages never
+ * take a lock. Blocks are written in the order they are submitted, at
+ * increasing offsets, so end() always closes a prefix of the range that is
+ * final, and a WritebackController flushes it from the same thread; the
+ * holes between the extents of a sparse receive count as written.
+ *
+ * With an O_DIRECT descriptor, the block-aligned part of each block at a
+ * block-aligned offset is written through it and the rest through fd. A
+ * direct write the file system rejects (EINVAL: stricter alignment than
+ * DIRECT_ALIGNMENT) is redone through fd, and so is the rest of the transfer.
+ */
+class BlockWriter {
+public:
+    /**
+     * @param fd Descriptor of the file
+     * @param directFd O_DIRECT descriptor of the same file, or -1
+     * @param offset Offset of the first block that will be submitted
+     * @param blocks Buffers of PIPELINE_BLOCK_SIZE bytes to circulate
+     */
+    BlockWriter(int fd, int directFd, size_t offset, const PipelineBlocks& blocks)
+        : fd(fd), directFd(directFd), writeback(fd, offset), filled(blocks.count + 1), empty(blocks.count),
+          writtenEnd(offset) {
+        for (size_t i = 0; i < blocks.count; ++i) empty.tryPush(blocks.blocks[i]);
+        worker = std::thread(&BlockWriter::run, this);
+    }
+
+    ~BlockWriter() { finish(); }
+
+    /**
+     * @brief Waits for a block that is not being written
+     * @return The block, or nullptr once a write has failed
+     */
+    char* acquire() {
+        char* block = nullptr;
+        if (failed.load() || !empty.pop(block, failed)) return nullptr;
+        return block;
+    }
+
+    /**
+     * @brief Queues size bytes of block for writing at offset
+     */
+    void submit(char* block, size_t size, size_t offset) {
+        // Never full: it has room for every block plus the end marker
+        filled.tryPush(PipelineBlock{block, size, offset});
+    }
+
+    /**
+     * @brief Waits until every submitted block is written and stops the writer
+     * @return true if all writes succeeded
+     */
+    bool finish() {
+        if (worker.joinable()) {
+            filled.tryPush(PipelineBlock{});
+            worker.join();
+        }
+        return !failed.load();
+    }
+
+    /**
+     * @brief Returns the number of bytes written so far
+     */
+    size_t written() const { return bytesWritten.load(); }
+
+    /**
+     * @brief Returns the end of the last block written
+     */
+    size_t end() const { return writtenEnd.load(); }
+
+private:
+    void run() {
+        PipelineBlock block;
+        while (filled.pop(block, stopped) && block.data) {
+            if (!failed.load()) {
+                if (write(block)) {
+                    writeback.advance(block.offset + block.size - writtenEnd.load());
+                    bytesWritten += block.size;
+                    writtenEnd = block.offset + block.size;
+                } else {
+                    failed = true;
+                }
             }
-        } catch (const std::filesystem::filesystem_error& e) {
-            std::cerr << "Failed to rename temporary file: " << e.what() << std::endl;
-            transferSuccess = false;
+            empty.tryPush(block.data);
         }
     }
 
-    // Clean up temporary file if transfer failed
-    if (!transferSuccess) {
-        try {
-            std::filesystem::remove(tempFilename);
-        } catch (const std::filesystem::filesystem_error& e) {
-            std::cerr << "Failed to remove temporary file: " << e.what() << std::endl;
+    bool write(const PipelineBlock& block) {
+        size_t direct = 0;
+        if (directFd >= 0 && block.offset % DIRECT_ALIGNMENT == 0) {
+            direct = block.size - block.size % DIRECT_ALIGNMENT;
+        }
+        if (direct > 0 && !pwriteAll(directFd, block.data, direct, block.offset)) {
+            if (errno != EINVAL) return false;
+            std::cerr << "Warning: O_DIRECT write rejected, continuing through the page cache" << std::endl;
+            directFd = -1;
+            direct = 0;
         }
+        return pwriteAll(fd, block.data + direct, block.size - direct, block.offset + direct);
     }
 
-    activeTransfers--;
-    return transferSuccess;
+    int fd;                             ///< Descriptor of the file
+    int directFd;                       ///< O_DIRECT descriptor, -1 if none or refused
+    WritebackController writeback;      ///< Bounds the dirty pages of buffered writes
+    SpscRing<PipelineBlock> filled;     ///< Network stage -> writer
+    SpscRing<char*> empty;              ///< Writer -> network stage
+    std::atomic<bool> failed{false};
+    std::atomic<bool> stopped{false};   ///< Never set: the end marker stops the writer
+    std::atomic<size_t> bytesWritten{0};
+    std::atomic<size_t> writtenEnd;
+    std::thread worker;
+};
+
+} // namespace
+
+/**
+ * @brief Receives into a file through a user-space buffer
+ * @param socket Socket descriptor
+ * @param fd Descriptor of the file being written
+ * @param offset Offset in the file at which to store the first byte
+ * @param length Number of bytes expected, or UNTIL_EOF to receive until the peer closes
+ * @param totalBytesReceived Incremented with the number of bytes stored
+ * @param flow Bandwidth manager flow pacing this transfer
+ * @param policy Chunk sizing of this transfer
+ * @param checksum If not null, fed every byte received
+ * @return true if all expected bytes were stored, false otherwise
+ *
+ * Receives on the calling thread while a writer thread stores the previous
+ * blocks, so network and disk latency overlap.
+ */
+bool FileTransfer::receiveFileBuffered(int socket, int fd, size_t offset, size_t length,
+                                       size_t& totalBytesReceived, BandwidthManager::Flow& flow,
+                                       ChunkSizePolicy& policy, StreamChecksum* checksum) {
+    return receivePipelined(socket, fd, -1, offset, length, totalBytesReceived, flow, policy, checksum);
+}
+
+/**
+ * @brief Network stage of a pipelined receive
+ * @param socket Socket descriptor
+ * @param fd Descriptor of the file being written
+ * @param directFd O_DIRECT descriptor of the same file, or -1
+ * @param offset Offset in the file at which to store the first byte
+ * @param length Number of bytes expected, or UNTIL_EOF to receive until the peer closes
+ * @param totalBytesReceived Incremented with the number of bytes stored
+ * @param flow Bandwidth manager flow pacing this transfer
+ * @param policy Chunk sizing of this transfer
+ * @param checksum If not null, fed every byte received
+ * @param extents If not null, the extents of a sparse receive; length is then ignored
+ * @param validEnd If not null, set to the end of the prefix of the file that is final
+ * @return true if all expected bytes were stored, false otherwise
+ *
+ * Fills blocks borrowed from the BufferPool and hands them to a BlockWriter.
+ * In a sparse receive the next extent is asked for whenever the one before
+ * it is complete, until one of length 0 ends the transfer.
+ */
+bool FileTransfer::receivePipelined(int socket, int fd, int directFd, size_t offset, size_t length,
+                                    size_t& totalBytesReceived, BandwidthManager::Flow& flow,
+                                    ChunkSizePolicy& policy, StreamChecksum* checksum,
+                                    const ExtentSource* extents, size_t* validEnd) {
+    PipelineBlocks blocks;
+    if (!blocks.valid()) {
+        std::cerr << "Error: Cannot allocate transfer buffers" << std::endl;
+        return false;
+    }
+    BlockWriter writer(fd, directFd, offset, blocks);
+    size_t remaining = extents ? 0 : length;
+    bool success = true;
+    bool closed = false;
+
+    while (success && !closed) {
+        if (remaining == 0) {
+            ExtentHeader extent;
+            if (!extents) break;
+            if (!(*extents)(extent)) {
+                success = false;
+                break;
+            }
+            offset = static_cast<size_t>(extent.offset);
+            if (extent.length == 0) break;
+            remaining = static_cast<size_t>(extent.length);
+        }
+
+        char* block = writer.acquire();
+        if (!block) {
+            success = false;
+            break;
+        }
+
+        // Direct writes need an aligned offset, so an unaligned first block
+        // only goes up to the next boundary
+        size_t wanted = std::min(PIPELINE_BLOCK_SIZE, remaining);
+        if (directFd >= 0 && offset % DIRECT_ALIGNMENT != 0) {
+            wanted = std::min(wanted, DIRECT_ALIGNMENT - offset % DIRECT_ALIGNMENT);
+        }
+
+        size_t received = 0;
+        while (received < wanted) {
+            size_t granted = admit(flow, std::min(policy.chunkSize(), wanted - received));
+            int retries = 0;
+            ssize_t bytesReceived;
+
+            while (retries < MAX_RETRIES) {
+                bytesReceived = recv(socket, block + received, granted, 0);
+                if (bytesReceived >= 0) break;
+                retries++;
+                std::this_thread::sleep_for(std::chrono::milliseconds(RETRY_DELAY_MS));
+            }
+
+            flow.refund(granted - static_cast<size_t>(std::max<ssize_t>(bytesReceived, 0)));
+            if (bytesReceived < 0 || retries == MAX_RETRIES) {
+                success = false;
+                break;
+            }
+
+            // If we received 0 bytes, it means end of transmission
+            if (bytesReceived == 0) {
+                closed = true;
+                break;
+            }
+
+            policy.update(granted, static_cast<size_t>(bytesReceived));
+            received += static_cast<size_t>(bytesReceived);
+        }
+
+        // Whatever arrived is good data, even if the connection then failed
+        if (checksum) {
+            checksum->update(block, received);
+        }
+        writer.submit(block, received, offset);
+        offset += received;
+        if (remaining != UNTIL_EOF) {
+            remaining -= received;
+        }
+    }
+
+    bool stored = writer.finish();
+    totalBytesReceived += writer.written();
+    if (validEnd) {
+        *validEnd = stored ? offset : writer.end();
+    }
+    return stored && success && (remaining == 0 || (closed && length == UNTIL_EOF && !extents));
+}
+
+/**
+ * @brief Receives into a file with O_DIRECT writes, bypassing the page cache
+ * @param socket Socket descriptor
+ * @param fd Descriptor of the file being written
+ * @param offset Offset in the file at which to store the first byte
+ * @param length Number of bytes expected, or UNTIL_EOF to receive until the peer closes
+ * @param totalBytesReceived Incremented with the number of bytes stored
+ * @param flow Bandwidth manager flow pacing this transfer
+ * @param policy Chunk sizing of this transfer
+ * @param checksum If not null, fed every byte received
+ * @return true if all expected bytes were stored, false otherwise
+ *
+ * Bulk uploads written this way do not evict the files being served from
+ * the page cache. It is the pipelined buffered engine with the writer
+ * storing whole blocks through a second, O_DIRECT descriptor of the file;
+ * the unaligned head (up to the first block boundary, e.g. when resuming)
+ * and the tail after the last whole block go through fd as ordinary
+ * writes. Falls back to receiveFileBuffered() or receiveFileSplice() when
+ * the file system does not support O_DIRECT.
+ */
+bool FileTransfer::receiveFileDirect(int socket, int fd, size_t offset, size_t length,
+                                     size_t& totalBytesReceived, BandwidthManager::Flow& flow,
+                                     ChunkSizePolicy& policy, StreamChecksum* checksum) {
+    int directFd = openDirect(fd);
+    if (directFd >= 0) {
+        bool result = receivePipelined(socket, fd, directFd, offset, length, totalBytesReceived, flow, policy,
+                                       checksum);
+        close(directFd);
+        return result;
+    }
+    return checksum ? receiveFileBuffered(socket, fd, offset, length, totalBytesReceived, flow, policy, checksum)
+                    : receiveFileSplice(socket, fd, offset, length, totalBytesReceived, flow, policy);
+}
+
+/**
+ * @brief Receives into a file through the shared io_uring engine
+ * @param socket Socket descriptor
+ * @param fd Descriptor of the file being written
+ * @param offset Offset in the file at which to store the first byte
+ * @param length Number of bytes expected, or UNTIL_EOF to receive until the peer closes
+ * @param totalBytesReceived Incremented with the number of bytes stored
+ * @param flow Bandwidth manager flow pacing this transfer
+ * @return true if all expected bytes were stored, false otherwise
+ */
+bool FileTransfer::receiveFileIoUring(int socket, int fd, size_t offset, size_t length,
+                                      size_t& totalBytesReceived, BandwidthManager::Flow& flow) {
+    IoUringEngine* engine = IoUringEngine::instance();
+    if (!engine) {
+        ChunkSizePolicy policy(socket, ChunkSizePolicy::Direction::Receive, length == UNTIL_EOF ? 0 : length);
+        return receiveFileSplice(socket, fd, offset, length, totalBytesReceived, flow, policy);
+    }
+
+    std::promise<std::pair<bool, size_t>> done;
+    engine->submitReceive(socket, fd, offset, length, flow, [&done](bool success, size_t bytes) {
+        done.set_value(std::make_pair(success, bytes));
+    });
+    auto result = done.get_future().get();
+    totalBytesReceived += result.second;
+    return result.first;
 }
 
 // Utility function to print the contents of a file to the terminal
@@ -260,15 +2049,31 @@ void FileTransfer::printFileContent(const std::string& filename) {
 // Helper function to send a single chunk of data
 // Returns true if the chunk was sent successfully
 bool FileTransfer::sendChunk(int socket, const char* data, size_t size) {
-    // Attempt to send exactly 'size' bytes of data
+    // Attempt to send exactly 'size' bytes of data, continuing after partial
+    // sends so a retry never puts the same bytes on the wire twice
     // Returns true only if all bytes were sent successfully
-    return send(socket, data, size, 0) == static_cast<ssize_t>(size);
+    while (size > 0) {
+        ssize_t sent = send(socket, data, size, 0);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        data += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
 }
 
 // Helper function to receive a single chunk of data
 // Returns true if the chunk was received successfully
 bool FileTransfer::receiveChunk(int socket, char* data, size_t size) {
-    // Attempt to receive exactly 'size' bytes of data
+    // Attempt to receive exactly 'size' bytes of data, continuing after
+    // partial reads (a header may arrive split across segments)
     // Returns true only if all bytes were received successfully
-    return recv(socket, data, size, 0) == static_cast<ssize_t>(size);
+    while (size > 0) {
+        ssize_t received = recv(socket, data, size, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
+        data += received;
+        size -= static_cast<size_t>(received);
+    }
+    return true;
 } 
\ No newline at end of file
@@ -0,0 +1,923 @@
+/**
+ * @file IoUringEngine.cpp
+ * @brief Implementation of the io_uring transfer engine
+ *
+ * liburing is not required: the few pieces of it we need (ring setup and
+ * mapping, SQE/CQE bookkeeping, buffer and file registration) are done with
+ * the raw io_uring_setup/io_uring_enter/io_uring_register system calls.
+ */
+
+#include "IoUringEngine.h"
+#include "ChunkSizePolicy.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+// Initialize static members
+IoUringEngine::Options IoUringEngine::options;  ///< Options for the first start
+std::mutex IoUringEngine::optionsMutex;         ///< Guards options
+
+void IoUringEngine::configure(const Options& newOptions) {
+    std::lock_guard<std::mutex> lock(optionsMutex);
+    options = newOptions;
+}
+
+#if defined(__linux__)
+
+namespace {
+
+constexpr size_t MIN_BUFFER_SIZE = 64 * 1024;   ///< Registered buffers are not shrunk below this
+
+/**
+ * @brief Shrinks the registered buffers to fit the locked memory limit
+ * @param options Engine sizing asked for
+ * @return The sizing to use
+ * @throws std::runtime_error if not even one job per ring fits
+ *
+ * Registered buffers are pinned and charged to RLIMIT_MEMLOCK, often only
+ * 8 MiB, and registering more than it allows fails. Half the limit is left
+ * for the rings themselves; within the other half the buffers shrink first,
+ * down to MIN_BUFFER_SIZE, then the number of jobs per ring.
+ */
+IoUringEngine::Options fitLockedMemory(IoUringEngine::Options options) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_MEMLOCK, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY) {
+        return options;
+    }
+
+    unsigned rings = std::max(1u, options.rings);
+    size_t budget = static_cast<size_t>(limit.rlim_cur) / 2 / rings;
+    auto needed = [&options]() { return static_cast<size_t>(options.maxJobsPerRing) * 2 * options.bufferSize; };
+    if (needed() <= budget) {
+        return options;
+    }
+
+    while (needed() > budget && options.bufferSize / 2 >= MIN_BUFFER_SIZE) {
+        options.bufferSize /= 2;
+    }
+    if (needed() > budget) {
+        options.maxJobsPerRing = static_cast<unsigned>(budget / (2 * options.bufferSize));
+    }
+    if (options.maxJobsPerRing == 0) {
+        throw std::runtime_error("locked memory limit of " + std::to_string(limit.rlim_cur) +
+                                 " bytes is too small for the registered buffers (raise ulimit -l)");
+    }
+    std::cerr << "Note: locked memory limit of " << limit.rlim_cur << " bytes allows " << options.maxJobsPerRing
+              << " io_uring jobs of two " << options.bufferSize << " byte buffers per ring" << std::endl;
+    return options;
+}
+
+/**
+ * @class SubmissionRing
+ * @brief Minimal wrapper around one io_uring instance
+ */
+class SubmissionRing {
+public:
+    /**
+     * @brief Creates and maps a ring
+     * @param entries Number of submission queue entries
+     * @throws std::runtime_error if the kernel refuses to create the ring
+     */
+    explicit SubmissionRing(unsigned entries) {
+        struct io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+
+        fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0) {
+            throw std::runtime_error("io_uring_setup failed");
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap) {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQ_RING);
+        cqRing = singleMmap ? sqRing
+                            : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                   fd, IORING_OFF_CQ_RING);
+        sqeSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        void* sqeMap = mmap(nullptr, sqeSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            fd, IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqeMap == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("Failed to map io_uring");
+        }
+        sqes = static_cast<struct io_uring_sqe*>(sqeMap);
+
+        char* sq = static_cast<char*>(sqRing);
+        sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+        char* cq = static_cast<char*>(cqRing);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        localTail = *sqTail;
+    }
+
+    ~SubmissionRing() {
+        munmap(sqes, sqeSize);
+        if (cqRing != sqRing) munmap(cqRing, cqRingSize);
+        munmap(sqRing, sqRingSize);
+        close(fd);
+    }
+
+    SubmissionRing(const SubmissionRing&) = delete;
+    SubmissionRing& operator=(const SubmissionRing&) = delete;
+
+    /**
+     * @brief Returns the number of SQEs that can be queued without submitting
+     */
+    unsigned freeEntries() const {
+        return sqEntries - (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE));
+    }
+
+    /**
+     * @brief Returns a zeroed SQE, submitting queued ones first if the queue is full
+     * @return The SQE, or nullptr if the kernel did not take the queued ones;
+     *         Ring::reserve() makes sure this does not happen
+     */
+    struct io_uring_sqe* getSqe() {
+        if (freeEntries() == 0) {
+            submit(0);
+            if (freeEntries() == 0) return nullptr;
+        }
+        struct io_uring_sqe* sqe = &sqes[localTail & sqMask];
+        sqArray[localTail & sqMask] = localTail & sqMask;
+        localTail++;
+        std::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    /**
+     * @brief Publishes queued SQEs and optionally waits for completions
+     * @param waitFor Number of completions to wait for
+     * @return Result of io_uring_enter
+     */
+    int submit(unsigned waitFor) {
+        unsigned pending = localTail - *sqTail;
+        __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+        if (pending == 0 && waitFor == 0) return 0;
+        unsigned flags = waitFor > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int ret;
+        do {
+            ret = static_cast<int>(syscall(__NR_io_uring_enter, fd, pending, waitFor, flags, nullptr, 0));
+        } while (ret < 0 && errno == EINTR && waitFor == 0);
+        return ret;
+    }
+
+    /**
+     * @brief Returns the next completion, or nullptr if there is none
+     */
+    struct io_uring_cqe* peekCqe() {
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) return nullptr;
+        return &cqes[head & cqMask];
+    }
+
+    /**
+     * @brief Marks the completion returned by peekCqe() as consumed
+     */
+    void cqeSeen() {
+        __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+    }
+
+    int registerBuffers(const struct iovec* iovecs, unsigned count) {
+        return static_cast<int>(syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iovecs, count));
+    }
+
+    int registerFiles(const int* fds, unsigned count) {
+        return static_cast<int>(syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, fds, count));
+    }
+
+    int updateFile(unsigned slot, int fileFd) {
+        struct io_uring_files_update update;
+        std::memset(&update, 0, sizeof(update));
+        update.offset = slot;
+        update.fds = reinterpret_cast<uint64_t>(&fileFd);
+        return static_cast<int>(syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES_UPDATE, &update, 1));
+    }
+
+private:
+    int fd;
+    void* sqRing;
+    void* cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqeSize;
+    struct io_uring_sqe* sqes;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqArray;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned localTail;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+};
+
+constexpr int RESERVE_ATTEMPTS = 100;   ///< Rounds of submit/reap before reserve() gives up
+
+/**
+ * @brief Kinds of operations, stored in the low bits of user_data
+ */
+enum OpKind : uint64_t {
+    OP_WAKE = 0,     ///< Read of the ring's eventfd; user_data carries no job
+    OP_READ = 1,     ///< File read of a send job
+    OP_SEND = 2,     ///< Socket send of a send job
+    OP_RECV = 3,     ///< Socket recv of a receive job
+    OP_WRITE = 4,    ///< File write of a receive job
+    OP_TIMEOUT = 5,  ///< Bandwidth manager back-off
+    OP_MASK = 7,
+    SLOT_SHIFT = 3,  ///< Bit holding the index of the job buffer the op uses
+    TAG_MASK = 15
+};
+
+} // namespace
+
+/**
+ * @struct IoUringEngine::Job
+ * @brief State of one transfer on a ring
+ */
+struct alignas(16) IoUringEngine::Job {
+    enum class Kind { Send, Receive } kind;
+
+    int socket;
+    int fileFd;
+    int socketSlot = -1;        ///< Fixed file slot of the socket, -1 if not registered
+    int fileSlot = -1;          ///< Fixed file slot of the file, -1 if not registered
+
+    size_t offset;              ///< File offset of the next read (send) or recv (receive)
+    size_t remaining;           ///< Bytes not yet read/received, SIZE_MAX if unbounded
+    size_t moved = 0;           ///< Bytes fully sent/written
+    BandwidthManager::Flow* flow;
+    ChunkSizePolicy policy;
+    Completion completion;
+
+    struct Slot {
+        int buffer = -1;        ///< Index of the registered buffer
+        size_t length = 0;      ///< Bytes held in the buffer
+        size_t done = 0;        ///< Bytes of length already sent/written
+        size_t fileOffset = 0;  ///< Where the buffer's data lives in the file
+        bool busy = false;      ///< Buffer has an operation in flight
+    };
+    Slot slots[2];
+
+    size_t requested = 0;       ///< Bytes asked for by the current read/recv
+    bool recvInFlight = false;  ///< Receive: a recv is outstanding
+    bool waiting = false;       ///< A back-off timeout is outstanding
+    bool eof = false;           ///< No more data will be read/received
+    bool failed = false;
+    unsigned inFlight = 0;      ///< Outstanding SQEs
+    struct __kernel_timespec backoff;
+
+    Job(Kind kind, int socket, int fileFd, size_t offset, size_t length,
+        BandwidthManager::Flow& flow, Completion completion)
+        : kind(kind), socket(socket), fileFd(fileFd), offset(offset), remaining(length),
+          flow(&flow),
+          policy(socket, kind == Kind::Send ? ChunkSizePolicy::Direction::Send
+                                            : ChunkSizePolicy::Direction::Receive,
+                 length == SIZE_MAX ? 0 : length),
+          completion(std::move(completion)) {}
+};
+
+/**
+ * @class IoUringEngine::Ring
+ * @brief One ring, its registered buffers and fixed files, and the jobs on it
+ */
+class IoUringEngine::Ring {
+public:
+    explicit Ring(const Options& options)
+        : ring(options.queueDepth),
+          bufferSize(options.bufferSize),
+          maxJobs(options.maxJobsPerRing),
+          active(0),
+          stopping(false) {
+        wakeFd = eventfd(0, EFD_CLOEXEC);
+        if (wakeFd < 0) {
+            throw std::runtime_error("Failed to create eventfd");
+        }
+
+        // Two buffers per job, registered once for the life of the ring
+        unsigned bufferCount = maxJobs * 2;
+        size_t total = bufferSize * bufferCount;
+        void* memory = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            close(wakeFd);
+            throw std::runtime_error("Failed to allocate io_uring buffers");
+        }
+        buffers = static_cast<char*>(memory);
+        std::vector<struct iovec> iovecs(bufferCount);
+        for (unsigned i = 0; i < bufferCount; ++i) {
+            iovecs[i].iov_base = buffers + i * bufferSize;
+            iovecs[i].iov_len = bufferSize;
+            freeBuffers.push_back(static_cast<int>(i));
+        }
+        if (ring.registerBuffers(iovecs.data(), bufferCount) < 0) {
+            munmap(buffers, total);
+            close(wakeFd);
+            throw std::runtime_error("Failed to register io_uring buffers");
+        }
+
+        // Sparse fixed file table: a socket and a file slot per job. Kernels
+        // that reject sparse tables still work, just without fixed files.
+        std::vector<int> table(maxJobs * 2, -1);
+        if (ring.registerFiles(table.data(), static_cast<unsigned>(table.size())) == 0) {
+            for (unsigned i = 0; i < table.size(); ++i) {
+                freeFileSlots.push_back(static_cast<int>(i));
+            }
+        }
+    }
+
+    ~Ring() {
+        munmap(buffers, bufferSize * maxJobs * 2);
+        close(wakeFd);
+    }
+
+    /**
+     * @brief Hands a job to the ring thread; callable from any thread
+     */
+    void post(std::unique_ptr<Job> job) {
+        {
+            std::lock_guard<std::mutex> lock(incomingMutex);
+            incoming.push_back(std::move(job));
+        }
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    /**
+     * @brief Asks the ring thread to exit once it wakes up
+     */
+    void stop() {
+        stopping = true;
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    /**
+     * @brief Ring thread main loop
+     */
+    void run() {
+        while (!stopping) {
+            if (!wakeArmed) {
+                armWake();
+            }
+            // Without the wake read armed nothing may complete; poll until it is
+            if (ring.submit(wakeArmed ? 1 : 0) < 0 && errno != EINTR && errno != EBUSY) {
+                std::cerr << "io_uring_enter failed: " << std::strerror(errno) << std::endl;
+                break;
+            }
+            if (!wakeArmed) {
+                usleep(1000);
+            }
+            reap();
+            while (!reaped.empty()) {
+                std::pair<uint64_t, int> completion = reaped.front();
+                reaped.pop_front();
+                dispatch(completion.first, completion.second);
+            }
+        }
+    }
+
+private:
+    SubmissionRing ring;
+    char* buffers;
+    size_t bufferSize;
+    unsigned maxJobs;
+    unsigned active;                            ///< Jobs currently holding buffers
+    std::vector<int> freeBuffers;
+    std::vector<int> freeFileSlots;
+    std::deque<std::unique_ptr<Job>> waitingJobs; ///< Jobs waiting for buffers
+    int wakeFd;
+    uint64_t wakeValue;
+    bool wakeArmed = false;                     ///< The read of wakeFd is queued
+    std::atomic<bool> stopping;                 ///< Set by stop() from another thread
+    std::deque<std::pair<uint64_t, int>> reaped;  ///< Completions taken off the CQ, not dispatched yet
+
+    std::mutex incomingMutex;
+    std::vector<std::unique_ptr<Job>> incoming;
+
+    static uint64_t tag(Job* job, OpKind kind, unsigned slot = 0) {
+        return reinterpret_cast<uint64_t>(job) | kind | (static_cast<uint64_t>(slot) << SLOT_SHIFT);
+    }
+
+    char* bufferData(int index) {
+        return buffers + static_cast<size_t>(index) * bufferSize;
+    }
+
+    /**
+     * @brief Moves every completion off the CQ, to be dispatched in order by run()
+     */
+    void reap() {
+        while (struct io_uring_cqe* cqe = ring.peekCqe()) {
+            reaped.emplace_back(cqe->user_data, cqe->res);
+            ring.cqeSeen();
+        }
+    }
+
+    /**
+     * @brief Makes sure count SQEs can be queued, so a linked pair is never split
+     * @return false if the kernel keeps refusing submissions
+     *
+     * A full SQ is normally emptied by submitting it. The kernel refuses to
+     * (EBUSY) while completions it could not post are pending, so those are
+     * reaped here; dispatching them is left to run(), as callers are in the
+     * middle of handling a completion themselves.
+     */
+    bool reserve(unsigned count) {
+        for (int attempt = 0; attempt < RESERVE_ATTEMPTS; ++attempt) {
+            if (ring.freeEntries() >= count) return true;
+            ring.submit(0);
+            if (ring.freeEntries() >= count) return true;
+            reap();
+            if (attempt > 0) std::this_thread::yield();
+        }
+        std::cerr << "io_uring submission queue stays full, failing a transfer" << std::endl;
+        return false;
+    }
+
+    /**
+     * @brief Ends a job's current operation with an error
+     */
+    void fail(Job* job, Job::Slot& slot) {
+        job->failed = true;
+        slot.busy = false;
+        advance(job);
+    }
+
+    void armWake() {
+        if (!reserve(1)) return;
+        wakeArmed = true;
+        struct io_uring_sqe* sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wakeFd;
+        sqe->addr = reinterpret_cast<uint64_t>(&wakeValue);
+        sqe->len = sizeof(wakeValue);
+        sqe->user_data = OP_WAKE;
+    }
+
+    /**
+     * @brief Points an SQE at a descriptor, through the fixed table when possible
+     */
+    static void setTarget(struct io_uring_sqe* sqe, int fd, int slot) {
+        if (slot >= 0) {
+            sqe->fd = slot;
+            sqe->flags |= IOSQE_FIXED_FILE;
+        } else {
+            sqe->fd = fd;
+        }
+    }
+
+    void dispatch(uint64_t data, int res) {
+        OpKind kind = static_cast<OpKind>(data & OP_MASK);
+        if (kind == OP_WAKE) {
+            onWake();
+            return;
+        }
+
+        Job* job = reinterpret_cast<Job*>(data & ~static_cast<uint64_t>(TAG_MASK));
+        Job::Slot& slot = job->slots[(data >> SLOT_SHIFT) & 1];
+        job->inFlight--;
+        switch (kind) {
+            case OP_READ: onRead(job, res); break;
+            case OP_SEND: onSend(job, res); break;
+            case OP_RECV: onRecv(job, slot, res); break;
+            case OP_WRITE: onWrite(job, slot, res); break;
+            case OP_TIMEOUT:
+                job->waiting = false;
+                advance(job);
+                break;
+            default: break;
+        }
+    }
+
+    void onWake() {
+        wakeArmed = false;
+        std::vector<std::unique_ptr<Job>> jobs;
+        {
+            std::lock_guard<std::mutex> lock(incomingMutex);
+            jobs.swap(incoming);
+        }
+        for (auto& job : jobs) {
+            waitingJobs.push_back(std::move(job));
+        }
+        startWaitingJobs();
+    }
+
+    void startWaitingJobs() {
+        while (!waitingJobs.empty() && active < maxJobs) {
+            Job* job = waitingJobs.front().release();
+            waitingJobs.pop_front();
+            active++;
+
+            job->slots[0].buffer = freeBuffers.back();
+            freeBuffers.pop_back();
+            job->slots[1].buffer = freeBuffers.back();
+            freeBuffers.pop_back();
+
+            if (freeFileSlots.size() >= 2) {
+                int socketSlot = freeFileSlots.back();
+                int fileSlot = freeFileSlots[freeFileSlots.size() - 2];
+                if (ring.updateFile(socketSlot, job->socket) == 1 &&
+                    ring.updateFile(fileSlot, job->fileFd) == 1) {
+                    freeFileSlots.resize(freeFileSlots.size() - 2);
+                    job->socketSlot = socketSlot;
+                    job->fileSlot = fileSlot;
+                }
+            }
+            advance(job);
+        }
+    }
+
+    /**
+     * @brief Asks the bandwidth manager for the next chunk
+     * @return Bytes admitted, or 0 if a back-off timeout was armed instead
+     */
+    size_t admit(Job* job, size_t wanted) {
+        auto grant = job->flow->acquire(wanted);
+        if (grant.bytes > 0) return grant.bytes;
+
+        if (!reserve(1)) {
+            job->failed = true;
+            return 0;
+        }
+        job->waiting = true;
+        job->backoff.tv_sec = grant.retryAfter.count() / 1000000000;
+        job->backoff.tv_nsec = grant.retryAfter.count() % 1000000000;
+        struct io_uring_sqe* sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = reinterpret_cast<uint64_t>(&job->backoff);
+        sqe->len = 1;
+        sqe->user_data = tag(job, OP_TIMEOUT);
+        job->inFlight++;
+        return 0;
+    }
+
+    /**
+     * @brief Issues whatever the job can do next, or finishes it
+     */
+    void advance(Job* job) {
+        if (job->waiting) return;
+        if (job->kind == Job::Kind::Send) {
+            advanceSend(job);
+        } else {
+            advanceReceive(job);
+        }
+        if (job->inFlight == 0 && (job->failed || job->eof)) {
+            finish(job);
+        }
+    }
+
+    void advanceSend(Job* job) {
+        Job::Slot& slot = job->slots[0];
+        if (job->failed || slot.busy) return;
+
+        if (job->remaining == 0) {
+            job->eof = true;
+            return;
+        }
+
+        size_t wanted = std::min({job->policy.chunkSize(), bufferSize, job->remaining});
+        size_t count = admit(job, wanted);
+        if (count == 0) return;
+        if (!reserve(2)) {
+            job->flow->refund(count);
+            job->failed = true;
+            return;
+        }
+
+        slot.busy = true;
+        slot.length = count;
+        slot.done = 0;
+        slot.fileOffset = job->offset;
+        job->requested = count;
+
+        // Read into the registered buffer and, if the read is complete, send
+        // it straight away: one submission, no wake-up in between
+        struct io_uring_sqe* read = ring.getSqe();
+        read->opcode = IORING_OP_READ_FIXED;
+        setTarget(read, job->fileFd, job->fileSlot);
+        read->addr = reinterpret_cast<uint64_t>(bufferData(slot.buffer));
+        read->len = static_cast<uint32_t>(count);
+        read->off = job->offset;
+        read->buf_index = static_cast<uint16_t>(slot.buffer);
+        read->flags |= IOSQE_IO_LINK;
+        read->user_data = tag(job, OP_READ);
+
+        struct io_uring_sqe* send = ring.getSqe();
+        send->opcode = IORING_OP_SEND;
+        setTarget(send, job->socket, job->socketSlot);
+        send->addr = reinterpret_cast<uint64_t>(bufferData(slot.buffer));
+        send->len = static_cast<uint32_t>(count);
+        send->msg_flags = MSG_NOSIGNAL;
+        send->user_data = tag(job, OP_SEND);
+
+        job->inFlight += 2;
+    }
+
+    void issueSend(Job* job) {
+        Job::Slot& slot = job->slots[0];
+        if (!reserve(1)) {
+            fail(job, slot);
+            return;
+        }
+        struct io_uring_sqe* sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_SEND;
+        setTarget(sqe, job->socket, job->socketSlot);
+        sqe->addr = reinterpret_cast<uint64_t>(bufferData(slot.buffer) + slot.done);
+        sqe->len = static_cast<uint32_t>(slot.length - slot.done);
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = tag(job, OP_SEND);
+        job->inFlight++;
+    }
+
+    void onRead(Job* job, int res) {
+        Job::Slot& slot = job->slots[0];
+        if (res <= 0) {
+            // Error, or the file shrank underneath us; the linked send is cancelled
+            job->flow->refund(slot.length);
+            job->failed = true;
+        } else if (static_cast<size_t>(res) < slot.length) {
+            // Short reads break the link; onSend() resends what we did read
+            job->flow->refund(slot.length - static_cast<size_t>(res));
+            slot.length = static_cast<size_t>(res);
+        }
+    }
+
+    void onSend(Job* job, int res) {
+        Job::Slot& slot = job->slots[0];
+        if (res == -ECANCELED && !job->failed) {
+            issueSend(job);
+            return;
+        }
+        if (res == -EINTR || res == -EAGAIN) {
+            issueSend(job);
+            return;
+        }
+        if (res <= 0) {
+            fail(job, slot);
+            return;
+        }
+
+        slot.done += static_cast<size_t>(res);
+        if (slot.done < slot.length) {
+            issueSend(job);
+            return;
+        }
+
+        job->policy.update(job->requested, slot.length);
+        job->offset += slot.length;
+        job->remaining -= slot.length;
+        job->moved += slot.length;
+        slot.busy = false;
+        advance(job);
+    }
+
+    void advanceReceive(Job* job) {
+        if (job->failed || job->eof || job->recvInFlight) return;
+
+        unsigned index = job->slots[0].busy ? 1 : 0;
+        Job::Slot* slot = &job->slots[index];
+        if (slot->busy) return;  // both buffers are being written; onWrite() resumes us
+
+        if (job->remaining == 0) {
+            job->eof = true;
+            return;
+        }
+
+        size_t wanted = std::min({job->policy.chunkSize(), bufferSize, job->remaining});
+        size_t count = admit(job, wanted);
+        if (count == 0) return;
+        if (!reserve(1)) {
+            job->flow->refund(count);
+            job->failed = true;
+            return;
+        }
+
+        slot->busy = true;
+        slot->length = count;
+        slot->done = 0;
+        job->requested = count;
+        job->recvInFlight = true;
+
+        struct io_uring_sqe* sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_RECV;
+        setTarget(sqe, job->socket, job->socketSlot);
+        sqe->addr = reinterpret_cast<uint64_t>(bufferData(slot->buffer));
+        sqe->len = static_cast<uint32_t>(count);
+        sqe->user_data = tag(job, OP_RECV, index);
+        job->inFlight++;
+    }
+
+    /**
+     * @return false if the write could not be queued; the job has failed
+     */
+    bool issueWrite(Job* job, Job::Slot& slot) {
+        if (!reserve(1)) {
+            job->failed = true;
+            slot.busy = false;
+            return false;
+        }
+        unsigned index = &slot == &job->slots[0] ? 0 : 1;
+        struct io_uring_sqe* sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        setTarget(sqe, job->fileFd, job->fileSlot);
+        sqe->addr = reinterpret_cast<uint64_t>(bufferData(slot.buffer) + slot.done);
+        sqe->len = static_cast<uint32_t>(slot.length - slot.done);
+        sqe->off = slot.fileOffset + slot.done;
+        sqe->buf_index = static_cast<uint16_t>(slot.buffer);
+        sqe->user_data = tag(job, OP_WRITE, index);
+        job->inFlight++;
+        return true;
+    }
+
+    void onRecv(Job* job, Job::Slot& slot, int res) {
+        job->recvInFlight = false;
+
+        if (res == -EINTR || res == -EAGAIN) {
+            job->flow->refund(slot.length);
+            slot.busy = false;
+            advance(job);
+            return;
+        }
+        if (res <= 0) {
+            job->flow->refund(slot.length);
+            slot.busy = false;
+            if (res < 0 || job->remaining != SIZE_MAX) {
+                // An error, or the peer closed before sending everything it announced
+                job->failed = true;
+            }
+            job->eof = true;
+            advance(job);
+            return;
+        }
+
+        size_t received = static_cast<size_t>(res);
+        job->flow->refund(slot.length - received);
+        job->policy.update(job->requested, received);
+        slot.length = received;
+        slot.fileOffset = job->offset;
+        job->offset += received;
+        if (job->remaining != SIZE_MAX) job->remaining -= received;
+
+        issueWrite(job, slot);
+        advance(job);
+    }
+
+    void onWrite(Job* job, Job::Slot& slot, int res) {
+        if (res <= 0) {
+            fail(job, slot);
+            return;
+        }
+
+        slot.done += static_cast<size_t>(res);
+        if (slot.done < slot.length) {
+            if (!issueWrite(job, slot)) {
+                advance(job);
+            }
+            return;
+        }
+        job->moved += slot.length;
+        slot.busy = false;
+        advance(job);
+    }
+
+    void finish(Job* job) {
+        for (auto& slot : job->slots) {
+            freeBuffers.push_back(slot.buffer);
+        }
+        if (job->socketSlot >= 0) {
+            ring.updateFile(job->socketSlot, -1);
+            ring.updateFile(job->fileSlot, -1);
+            freeFileSlots.push_back(job->fileSlot);
+            freeFileSlots.push_back(job->socketSlot);
+        }
+        active--;
+
+        std::unique_ptr<Job> owned(job);
+        owned->completion(!owned->failed, owned->moved);
+        owned.reset();
+
+        startWaitingJobs();
+    }
+
+    friend class IoUringEngine;
+};
+
+IoUringEngine::IoUringEngine(const Options& requested) : nextRing(0) {
+    Options engineOptions = fitLockedMemory(requested);
+    unsigned count = std::max(1u, engineOptions.rings);
+    for (unsigned i = 0; i < count; ++i) {
+        rings.push_back(std::unique_ptr<Ring>(new Ring(engineOptions)));
+    }
+    for (auto& ring : rings) {
+        Ring* target = ring.get();
+        threads.emplace_back([target] { target->run(); });
+    }
+}
+
+IoUringEngine::~IoUringEngine() {
+    for (auto& ring : rings) {
+        ring->stop();
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+IoUringEngine* IoUringEngine::instance() {
+    static std::unique_ptr<IoUringEngine> engine = []() -> std::unique_ptr<IoUringEngine> {
+        Options engineOptions;
+        {
+            std::lock_guard<std::mutex> lock(optionsMutex);
+            engineOptions = options;
+        }
+        try {
+            return std::unique_ptr<IoUringEngine>(new IoUringEngine(engineOptions));
+        } catch (const std::exception& e) {
+            std::cerr << "io_uring engine unavailable: " << e.what() << std::endl;
+            return nullptr;
+        }
+    }();
+    return engine.get();
+}
+
+void IoUringEngine::submit(std::unique_ptr<Job> job) {
+    Ring* target;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        target = rings[nextRing++ % rings.size()].get();
+    }
+    target->post(std::move(job));
+}
+
+void IoUringEngine::submitSend(int socket, int fileFd, size_t offset, size_t length,
+                               BandwidthManager::Flow& flow, Completion completion) {
+    submit(std::unique_ptr<Job>(new Job(Job::Kind::Send, socket, fileFd, offset, length,
+                                        flow, std::move(completion))));
+}
+
+void IoUringEngine::submitReceive(int socket, int fileFd, size_t offset, size_t length,
+                                  BandwidthManager::Flow& flow, Completion completion) {
+    submit(std::unique_ptr<Job>(new Job(Job::Kind::Receive, socket, fileFd, offset, length,
+                                        flow, std::move(completion))));
+}
+
+#else
+
+class IoUringEngine::Ring {};
+struct IoUringEngine::Job {};
+
+IoUringEngine::IoUringEngine(const Options&) : nextRing(0) {}
+IoUringEngine::~IoUringEngine() {}
+
+IoUringEngine* IoUringEngine::instance() {
+    return nullptr;
+}
+
+void IoUringEngine::submit(std::unique_ptr<Job>) {}
+
+void IoUringEngine::submitSend(int, int, size_t, size_t, BandwidthManager::Flow&, Completion completion) {
+    completion(false, 0);
+}
+
+void IoUringEngine::submitReceive(int, int, size_t, size_t, BandwidthManager::Flow&, Completion completion) {
+    completion(false, 0);
+}
+
+#endif
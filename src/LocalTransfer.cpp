@@ -0,0 +1,348 @@
+/**
+ * @file LocalTransfer.cpp
+ * @brief Implementation of same-host transfers over Unix domain sockets
+ */
+
+#include "LocalTransfer.h"
+#include "BufferPool.h"
+#include "DurabilityManager.h"
+#include "FileTransfer.h"
+#include "StagedFile.h"
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
+
+namespace {
+
+constexpr size_t COPY_CHUNK = 1024 * 1024;  ///< Bytes per copy_file_range() call, and buffer size when copying
+
+bool fillAddress(const std::string& path, struct sockaddr_un& addr) {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+/**
+ * @brief Copies length bytes from the start of src to dst with read and write
+ *
+ * For kernels and file system pairs copy_file_range() does not handle.
+ */
+bool copyBuffered(int src, int dst, uint64_t offset, uint64_t length) {
+    BufferPool::Buffer buffer = BufferPool::instance().acquire(COPY_CHUNK);
+    if (!buffer) {
+        errno = ENOMEM;
+        return false;
+    }
+    while (offset < length) {
+        size_t wanted = static_cast<size_t>(std::min<uint64_t>(buffer.size(), length - offset));
+        ssize_t n = pread(src, buffer.data(), wanted, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        size_t done = 0;
+        while (done < static_cast<size_t>(n)) {
+            ssize_t written = pwrite(dst, buffer.data() + done, static_cast<size_t>(n) - done,
+                                     static_cast<off_t>(offset + done));
+            if (written < 0 && errno == EINTR) continue;
+            if (written < 0) return false;
+            done += static_cast<size_t>(written);
+        }
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+/**
+ * @brief Copies a whole file inside the kernel where it can
+ * @return true if all length bytes are in dst
+ */
+bool copyFile(int src, int dst, uint64_t length) {
+#if defined(__linux__)
+#if defined(FICLONE)
+    // Same file system with reflinks: share the extents, copying nothing
+    if (ioctl(dst, FICLONE, src) == 0) {
+        return true;
+    }
+#endif
+    if (!FileTransfer::preallocate(dst, 0, length)) {
+        return false;
+    }
+    loff_t inOffset = 0;
+    loff_t outOffset = 0;
+    while (static_cast<uint64_t>(outOffset) < length) {
+        size_t wanted = static_cast<size_t>(std::min<uint64_t>(COPY_CHUNK, length - outOffset));
+        ssize_t copied = copy_file_range(src, &inOffset, dst, &outOffset, wanted, 0);
+        if (copied < 0 && errno == EINTR) continue;
+        if (copied < 0 && outOffset == 0 &&
+            (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+            return copyBuffered(src, dst, 0, length);
+        }
+        if (copied <= 0) return false;
+    }
+    return true;
+#else
+    return FileTransfer::preallocate(dst, 0, length) && copyBuffered(src, dst, 0, length);
+#endif
+}
+
+} // namespace
+
+std::string LocalTransfer::defaultSocketPath(int port) {
+    return defaultSocketDirectory() + "/" + std::to_string(port) + ".sock";
+}
+
+std::string LocalTransfer::defaultSocketDirectory() {
+    const char* runtime = std::getenv("XDG_RUNTIME_DIR");
+    if (runtime && runtime[0] == '/') {
+        return std::string(runtime) + "/filetransfer";
+    }
+    return "/tmp/filetransfer-" + std::to_string(geteuid());
+}
+
+bool LocalTransfer::makePrivateDirectory(const std::string& path) {
+    if (mkdir(path.c_str(), 0700) < 0 && errno != EEXIST) {
+        std::cerr << "Error: Cannot create " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    // Someone else may have created it first in a shared directory such as /tmp
+    struct stat st;
+    if (lstat(path.c_str(), &st) < 0) {
+        std::cerr << "Error: Cannot access " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077) != 0) {
+        std::cerr << "Error: " << path << " is not a directory private to this user" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool LocalTransfer::trustedPeer(int socket) {
+    uid_t uid;
+#if defined(__linux__)
+    struct ucred credentials;
+    socklen_t len = sizeof(credentials);
+    if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &credentials, &len) < 0) {
+        return false;
+    }
+    uid = credentials.uid;
+#else
+    gid_t gid;
+    if (getpeereid(socket, &uid, &gid) < 0) {
+        return false;
+    }
+#endif
+    return uid == geteuid() || uid == 0;
+}
+
+int LocalTransfer::listen(const std::string& path) {
+    struct sockaddr_un addr;
+    if (!fillAddress(path, addr)) {
+        std::cerr << "Error: Invalid Unix socket path: " << path << std::endl;
+        return -1;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        std::cerr << "Error: Cannot create Unix socket: " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+
+    // A socket file left by a server that did not exit cleanly refuses connections
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = connect(path);
+        if (probe >= 0) {
+            close(probe);
+            close(sock);
+            std::cerr << "Error: Another server listens on " << path << std::endl;
+            return -1;
+        }
+        unlink(path.c_str());
+    }
+
+    // Only this user may connect; nothing can connect before listen() anyway
+    if (bind(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 || chmod(path.c_str(), 0600) < 0 ||
+        ::listen(sock, 10) < 0) {
+        std::cerr << "Error: Cannot listen on " << path << ": " << std::strerror(errno) << std::endl;
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int LocalTransfer::connect(const std::string& path) {
+    struct sockaddr_un addr;
+    if (!fillAddress(path, addr)) {
+        return -1;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    if (::connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    if (!trustedPeer(sock)) {
+        std::cerr << "Warning: " << path << " belongs to another user, not using it" << std::endl;
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+bool LocalTransfer::isLocalSocket(int socket) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    return getsockname(socket, reinterpret_cast<struct sockaddr*>(&addr), &len) == 0 && addr.ss_family == AF_UNIX;
+}
+
+bool LocalTransfer::isLocalAddress(const std::string& ip) {
+    struct in_addr v4;
+    struct in6_addr v6;
+    bool isV4 = inet_pton(AF_INET, ip.c_str(), &v4) == 1;
+    bool isV6 = !isV4 && inet_pton(AF_INET6, ip.c_str(), &v6) == 1;
+    if (isV4 && (ntohl(v4.s_addr) >> 24) == 127) return true;
+    if (isV6 && IN6_IS_ADDR_LOOPBACK(&v6)) return true;
+    if (!isV4 && !isV6) return false;
+
+    struct ifaddrs* interfaces;
+    if (getifaddrs(&interfaces) < 0) {
+        return false;
+    }
+    bool found = false;
+    for (struct ifaddrs* it = interfaces; it != nullptr && !found; it = it->ifa_next) {
+        if (it->ifa_addr == nullptr) continue;
+        if (isV4 && it->ifa_addr->sa_family == AF_INET) {
+            found = reinterpret_cast<struct sockaddr_in*>(it->ifa_addr)->sin_addr.s_addr == v4.s_addr;
+        } else if (isV6 && it->ifa_addr->sa_family == AF_INET6) {
+            found = IN6_ARE_ADDR_EQUAL(&reinterpret_cast<struct sockaddr_in6*>(it->ifa_addr)->sin6_addr, &v6);
+        }
+    }
+    freeifaddrs(interfaces);
+    return found;
+}
+
+bool LocalTransfer::sendDescriptor(int socket, int fd) {
+    char byte = COMMAND;
+    struct iovec iov = {&byte, 1};
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    std::memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(socket, &msg, 0);
+    } while (sent < 0 && errno == EINTR);
+    return sent == 1;
+}
+
+int LocalTransfer::receiveDescriptor(int socket) {
+    char byte;
+    struct iovec iov = {&byte, 1};
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received;
+    do {
+#if defined(MSG_CMSG_CLOEXEC)
+        received = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+#else
+        received = recvmsg(socket, &msg, 0);
+#endif
+    } while (received < 0 && errno == EINTR);
+    if (received != 1) {
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+            std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool LocalTransfer::sendFile(int socket, const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Error: Cannot open " << filename << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    bool sent = sendDescriptor(socket, fd);
+    // The peer holds its own reference to the file from here on
+    close(fd);
+    if (!sent) {
+        std::cerr << "Error: Cannot pass " << filename << " to the server: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    char ack;
+    return FileTransfer::receiveChunk(socket, &ack, 1) && ack == ACK_OK;
+}
+
+bool LocalTransfer::receiveFile(int socket, const std::string& filename) {
+    int src = receiveDescriptor(socket);
+    if (src < 0) {
+        std::cerr << "Error: No file descriptor received for " << filename << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    bool ok = fstat(src, &st) == 0 && S_ISREG(st.st_mode);
+    if (!ok) {
+        std::cerr << "Error: Received descriptor is not a regular file" << std::endl;
+    }
+    StagedFile file;
+    ok = ok && file.create(filename);
+
+    if (ok && !copyFile(src, file.fd(), static_cast<uint64_t>(st.st_size))) {
+        std::cerr << "Error: Copy to " << file.tempName() << " failed: " << std::strerror(errno) << std::endl;
+        ok = false;
+    }
+    close(src);
+    ok = ok && DurabilityManager::instance().commit(file);
+
+    char ack = ok ? ACK_OK : ACK_FAILED;
+    return FileTransfer::sendChunk(socket, &ack, 1) && ok;
+}
@@ -0,0 +1,250 @@
+/**
+ * @file ParallelTransfer.cpp
+ * @brief Implementation of multi-stream range transfers
+ */
+
+#include "ParallelTransfer.h"
+#include "DurabilityManager.h"
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Initialize static members
+std::map<std::string, std::shared_ptr<ParallelTransfer::Assembly>> ParallelTransfer::assemblies;
+std::mutex ParallelTransfer::assemblyMutex;
+
+std::vector<ParallelTransfer::RangeHeader> ParallelTransfer::planRanges(uint64_t transferId, uint64_t fileSize,
+                                                                        unsigned streams) {
+    // Never split below the alignment; a tiny file goes over one connection
+    uint64_t maxStreams = std::max<uint64_t>(1, (fileSize + RANGE_ALIGNMENT - 1) / RANGE_ALIGNMENT);
+    uint32_t count = static_cast<uint32_t>(std::min<uint64_t>(std::max(streams, 1u), maxStreams));
+
+    // Rounding the ranges up can leave too few bytes for the last ones; drop those
+    uint64_t rangeSize = (fileSize / count + RANGE_ALIGNMENT - 1) / RANGE_ALIGNMENT * RANGE_ALIGNMENT;
+    if (rangeSize > 0) {
+        count = static_cast<uint32_t>((fileSize + rangeSize - 1) / rangeSize);
+    }
+    std::vector<RangeHeader> ranges;
+    for (uint32_t i = 0; i < count; ++i) {
+        RangeHeader header;
+        header.transferId = transferId;
+        header.fileSize = fileSize;
+        header.offset = std::min(fileSize, rangeSize * i);
+        header.length = i + 1 == count ? fileSize - header.offset
+                                       : std::min(rangeSize, fileSize - header.offset);
+        header.streams = count;
+        header.index = i;
+        ranges.push_back(header);
+    }
+    return ranges;
+}
+
+bool ParallelTransfer::sendRange(int socket, const std::string& localFile, const std::string& remotePath,
+                                 const RangeHeader& header, BandwidthManager::Flow& flow) {
+    size_t pathLen = remotePath.length();
+    if (!FileTransfer::sendChunk(socket, &COMMAND, 1) ||
+        !FileTransfer::sendChunk(socket, reinterpret_cast<const char*>(&pathLen), sizeof(pathLen)) ||
+        !FileTransfer::sendChunk(socket, remotePath.c_str(), pathLen) ||
+        !FileTransfer::sendChunk(socket, reinterpret_cast<const char*>(&header), sizeof(header))) {
+        return false;
+    }
+
+    if (!FileTransfer::sendFileRange(socket, localFile, header.offset, header.length, flow)) {
+        return false;
+    }
+
+    char ack = ACK_FAILED;
+    return FileTransfer::receiveChunk(socket, &ack, 1) && ack == ACK_OK;
+}
+
+bool ParallelTransfer::receiveRange(int socket, const std::string& filename, FileTransfer::ReceiveMode mode) {
+    RangeHeader header;
+    std::shared_ptr<Assembly> assembly = beginRange(socket, filename, header);
+    if (!assembly) {
+        return false;
+    }
+
+    bool stored = FileTransfer::receiveRange(socket, assembly->file.fd(), header.offset, header.length,
+                                             *assembly->flow, mode);
+    stored = finish(filename, *assembly, stored);
+
+    char ack = stored ? ACK_OK : ACK_FAILED;
+    FileTransfer::sendChunk(socket, &ack, 1);
+    return stored;
+}
+
+void ParallelTransfer::receiveRangeAsync(int socket, const std::string& filename, FileTransfer::ReceiveMode mode,
+                                         const FileTransfer::Executor& executor, FileTransfer::Continuation done) {
+    RangeHeader header;
+    std::shared_ptr<Assembly> assembly = beginRange(socket, filename, header);
+    if (!assembly) {
+        done(false);
+        return;
+    }
+
+    // The assembly, and with it the flow, lives until the engine is done with the range
+    FileTransfer::receiveRangeAsync(socket, assembly->file.fd(), header.offset, header.length, *assembly->flow,
+                                    mode, executor, [socket, filename, assembly, done](bool success, size_t) {
+                                        bool stored = finish(filename, *assembly, success);
+                                        char ack = stored ? ACK_OK : ACK_FAILED;
+                                        FileTransfer::sendChunk(socket, &ack, 1);
+                                        done(stored);
+                                    });
+}
+
+/**
+ * @brief Reads the header of a range connection and joins its assembly
+ * @param header Set to the header read
+ * @return The assembly, or nullptr with the failure acknowledged
+ */
+std::shared_ptr<ParallelTransfer::Assembly> ParallelTransfer::beginRange(int socket, const std::string& filename,
+                                                                         RangeHeader& header) {
+    if (!FileTransfer::receiveChunk(socket, reinterpret_cast<char*>(&header), sizeof(header))) {
+        std::cerr << "Failed to read range header\n";
+        return nullptr;
+    }
+
+    std::shared_ptr<Assembly> assembly = join(socket, filename, header);
+    if (!assembly) {
+        char ack = ACK_FAILED;
+        FileTransfer::sendChunk(socket, &ack, 1);
+        return nullptr;
+    }
+
+    std::cout << "Receiving range " << header.index + 1 << "/" << header.streams
+              << " (" << header.length << " bytes at offset " << header.offset << ")\n";
+    return assembly;
+}
+
+/**
+ * @brief Registers a range with the assembly of its file, creating the assembly for the first range
+ * @return The assembly, or nullptr if the range cannot be accepted
+ */
+std::shared_ptr<ParallelTransfer::Assembly> ParallelTransfer::join(int socket, const std::string& filename,
+                                                                   const RangeHeader& header) {
+    if (header.streams == 0 || header.index >= header.streams || header.offset > header.fileSize ||
+        header.length > header.fileSize - header.offset) {
+        std::cerr << "Error: Invalid range header for " << filename << std::endl;
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(assemblyMutex);
+    auto now = std::chrono::steady_clock::now();
+    expireLocked(now);
+    auto it = assemblies.find(filename);
+    if (it != assemblies.end()) {
+        Assembly& assembly = *it->second;
+        if (assembly.transferId != header.transferId || assembly.fileSize != header.fileSize ||
+            assembly.arrived.size() != header.streams) {
+            std::cerr << "Error: Another transfer to " << filename << " is in progress" << std::endl;
+            return nullptr;
+        }
+        if (assembly.arrived[header.index]) {
+            std::cerr << "Error: Duplicate range " << header.index << " for " << filename << std::endl;
+            return nullptr;
+        }
+        assembly.arrived[header.index] = true;
+        assembly.lastActivity = now;
+        return it->second;
+    }
+
+    // The first range to arrive allocates the whole file, which keeps the
+    // interleaved writes of the ranges from fragmenting it; its size is only
+    // set once every range is stored
+    auto assembly = std::make_shared<Assembly>();
+    StagedFile& file = assembly->file;
+    if (!file.create(filename)) {
+        return nullptr;
+    }
+    if (!FileTransfer::preallocate(file.fd(), 0, header.fileSize)) {
+        std::cerr << "Error: Cannot allocate " << file.tempName() << std::endl;
+        return nullptr;
+    }
+
+    assembly->transferId = header.transferId;
+    assembly->fileSize = header.fileSize;
+    assembly->arrived.assign(header.streams, false);
+    assembly->arrived[header.index] = true;
+    assembly->flow = FileTransfer::openFlow(socket);
+    assembly->lastActivity = now;
+    assemblies[filename] = assembly;
+    return assembly;
+}
+
+/**
+ * @brief Records the outcome of a range; the last range publishes or discards the file
+ * @return Whether this range was stored (and, for the last range, the file published)
+ */
+bool ParallelTransfer::finish(const std::string& filename, Assembly& assembly, bool stored) {
+    std::unique_lock<std::mutex> lock(assemblyMutex);
+    assembly.failed = assembly.failed || !stored;
+    assembly.lastActivity = std::chrono::steady_clock::now();
+    if (++assembly.finished < assembly.arrived.size()) {
+        return stored;
+    }
+
+    // Every range has reported: nobody else uses the file any more
+    if (assembly.failed) {
+        std::cerr << "Transfer of " << filename << " failed, discarding " << assembly.file.tempName() << std::endl;
+        assembly.file.discard();
+        assemblies.erase(filename);
+        return false;
+    }
+
+    // Flushing may take a while, so other transfers go on meanwhile; the
+    // entry stays in place until the file is published to keep a new
+    // transfer of the same file from starting under us
+    lock.unlock();
+    bool published = ftruncate(assembly.file.fd(), static_cast<off_t>(assembly.fileSize)) == 0 &&
+                     DurabilityManager::instance().commit(assembly.file);
+    if (!published) {
+        assembly.file.discard();
+    }
+    lock.lock();
+    assemblies.erase(filename);
+    if (!published) {
+        return false;
+    }
+
+    std::cout << "All " << assembly.arrived.size() << " ranges received, saved as: " << filename << "\n";
+    return true;
+}
+
+void ParallelTransfer::expireAssemblies() {
+    std::lock_guard<std::mutex> lock(assemblyMutex);
+    expireLocked(std::chrono::steady_clock::now());
+}
+
+/**
+ * @brief Tells whether the sender of an assembly has given up on it
+ *
+ * Ranges still being received keep it alive however long they take; only
+ * waiting for ranges that never connect counts against the timeout.
+ */
+bool ParallelTransfer::abandoned(const Assembly& assembly, std::chrono::steady_clock::time_point now) {
+    auto connected = static_cast<uint32_t>(std::count(assembly.arrived.begin(), assembly.arrived.end(), true));
+    return assembly.finished == connected && connected < assembly.arrived.size() &&
+           now - assembly.lastActivity >= ASSEMBLY_TIMEOUT;
+}
+
+/**
+ * @brief Discards abandoned assemblies; assemblyMutex must be held
+ */
+void ParallelTransfer::expireLocked(std::chrono::steady_clock::time_point now) {
+    for (auto it = assemblies.begin(); it != assemblies.end();) {
+        if (!abandoned(*it->second, now)) {
+            ++it;
+            continue;
+        }
+        // No range holds the assembly any more, so the file is ours to drop
+        Assembly& assembly = *it->second;
+        std::cerr << "Transfer of " << it->first << " abandoned with "
+                  << assembly.arrived.size() - assembly.finished << " ranges missing, discarding "
+                  << assembly.file.tempName() << std::endl;
+        assembly.file.discard();
+        it = assemblies.erase(it);
+    }
+}
@@ -8,12 +8,32 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <csignal>
 #include <filesystem>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
 #include <string>
 #include "ThreadPool.h"
 #include "FileTransfer.h"
+#include "IoUringEngine.h"
+#include "BandwidthManager.h"
+#include "BufferPool.h"
+#include "ParallelTransfer.h"
+#include "DeltaTransfer.h"
+#include "BatchTransfer.h"
+#include "DirectoryWalker.h"
+#include "DurabilityManager.h"
+#include "LocalTransfer.h"
+#include "SharedMemoryRing.h"
+#include "WritebackController.h"
+#include "TlsTransport.h"
 
 /**
  * @class FileServer
@@ -47,6 +67,26 @@ public:
         }
     }
 
+    /**
+     * @brief Selects the engines used for transfers handled by this server
+     * @param send Engine for 'R' and 'T' (server sends) requests
+     * @param receive Engine for 'S' and 'P' (server receives) requests
+     */
+    void setTransferModes(FileTransfer::SendMode send, FileTransfer::ReceiveMode receive) {
+        sendMode = send;
+        receiveMode = receive;
+    }
+
+    /**
+     * @brief Also accepts connections from clients on this machine on a Unix domain socket
+     * @param path Path of the socket file
+     * @return false if the socket could not be created
+     */
+    bool listenLocal(const std::string& path) {
+        localSocket = LocalTransfer::listen(path);
+        return localSocket >= 0;
+    }
+
     /**
      * @brief Starts the server and listens for connections
      */
@@ -54,19 +94,36 @@ public:
         listen(serverSocket, 10);
         std::cout << "Server listening on port " << port << std::endl;
 
-        while (true) {
-            struct sockaddr_in clientAddr;
-            socklen_t clientLen = sizeof(clientAddr);
-            int clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddr, &clientLen);
+        struct pollfd listeners[2] = {{serverSocket, POLLIN, 0}, {localSocket, POLLIN, 0}};
+        nfds_t listenerCount = localSocket >= 0 ? 2 : 1;
 
-            if (clientSocket < 0) {
-                std::cerr << "Failed to accept connection" << std::endl;
+        // Now and then drop multi-stream uploads whose sender went away
+        auto sweepInterval = std::chrono::milliseconds(ParallelTransfer::ASSEMBLY_TIMEOUT) / 4;
+        auto nextSweep = std::chrono::steady_clock::now() + sweepInterval;
+        while (true) {
+            int ready = poll(listeners, listenerCount, static_cast<int>(sweepInterval.count()));
+            if (std::chrono::steady_clock::now() >= nextSweep) {
+                ParallelTransfer::expireAssemblies();
+                nextSweep = std::chrono::steady_clock::now() + sweepInterval;
+            }
+            if (ready <= 0) {
                 continue;
             }
 
-            threadPool.enqueue([this, clientSocket]() {
-                handleClient(clientSocket);
-            });
+            for (nfds_t i = 0; i < listenerCount; ++i) {
+                if (!(listeners[i].revents & POLLIN)) continue;
+
+                int clientSocket = accept(listeners[i].fd, nullptr, nullptr);
+                if (clientSocket < 0) {
+                    std::cerr << "Failed to accept connection" << std::endl;
+                    continue;
+                }
+
+                bool local = listeners[i].fd == localSocket;
+                threadPool.enqueue([this, clientSocket, local]() {
+                    handleClient(clientSocket, local);
+                });
+            }
         }
     }
 
@@ -75,12 +132,38 @@ private:
     int port;                  ///< Port number
     ThreadPool threadPool;     ///< Thread pool for handling connections
     int maxConnections;        ///< Maximum number of simultaneous connections
+    int localSocket = -1;      ///< Unix domain socket for same-host clients, or -1
+    FileTransfer::SendMode sendMode = FileTransfer::SendMode::Auto;           ///< Engine for 'R' and 'T'
+    FileTransfer::ReceiveMode receiveMode = FileTransfer::ReceiveMode::Auto;  ///< Engine for 'S' and 'P'
+
+    /**
+     * @brief Returns an executor that runs the rest of a transfer on the thread pool
+     *
+     * Transfers handed to the io_uring engine finish through it, so a
+     * connection only holds a pool thread while something runs on it.
+     */
+    FileTransfer::Executor executor() {
+        return [this](std::function<void()> task) { threadPool.enqueue(std::move(task)); };
+    }
 
     /**
      * @brief Handles an individual client connection
      * @param clientSocket Socket for the client connection
+     * @param local Whether the client connected through the Unix domain socket
      */
-    void handleClient(int clientSocket) {
+    void handleClient(int clientSocket, bool local) {
+        // Local connections come from this user, and only exist without TLS
+        if (local && !LocalTransfer::trustedPeer(clientSocket)) {
+            std::cerr << "Refusing local client of another user\n";
+            close(clientSocket);
+            return;
+        }
+        if (!local && TlsTransport::serverEnabled() && !TlsTransport::accept(clientSocket)) {
+            std::cerr << "TLS handshake failed, closing connection\n";
+            close(clientSocket);
+            return;
+        }
+
         char command[2];
         recv(clientSocket, command, 1, 0);
         command[1] = '\0';
@@ -100,12 +183,86 @@ private:
             std::cout << "Operation started: Receiving file from client\n";
             std::cout << "Saving to path: " << remotePath << "\n";
             
-            if (FileTransfer::receiveFile(clientSocket, remotePath)) {
+            // With io_uring the data moves on the engine while this thread serves others
+            FileTransfer::receiveFileAsync(clientSocket, remotePath, receiveMode, executor(),
+                                           [clientSocket, remotePath](bool success) {
+                if (success) {
+                    std::cout << "File saved successfully as: " << remotePath << "\n";
+                } else {
+                    std::cerr << "Failed to save file\n";
+                }
+                close(clientSocket);
+            });
+            return;
+        } 
+        else if (command[0] == LocalTransfer::COMMAND && local) {
+            std::cout << "Operation started: Copying file passed by local client\n";
+            std::cout << "Saving to path: " << remotePath << "\n";
+
+            if (LocalTransfer::receiveFile(clientSocket, remotePath)) {
                 std::cout << "File saved successfully as: " << remotePath << "\n";
             } else {
                 std::cerr << "Failed to save file\n";
             }
-        } 
+        }
+        else if (command[0] == SharedMemoryRing::COMMAND && local) {
+            std::cout << "Operation started: Receiving file through shared memory\n";
+            std::cout << "Saving to path: " << remotePath << "\n";
+
+            if (SharedMemoryRing::receiveFile(clientSocket, remotePath)) {
+                std::cout << "File saved successfully as: " << remotePath << "\n";
+            } else {
+                std::cerr << "Failed to save file\n";
+            }
+        }
+        else if (command[0] == ParallelTransfer::COMMAND) {
+            // One range of a multi-stream upload; the last range renames the file
+            ParallelTransfer::receiveRangeAsync(clientSocket, remotePath, receiveMode, executor(),
+                                                [clientSocket](bool) { close(clientSocket); });
+            return;
+        }
+        else if (command[0] == DeltaTransfer::COMMAND) {
+            std::cout << "Operation started: Receiving delta from client\n";
+            std::cout << "Updating path: " << remotePath << "\n";
+
+            if (DeltaTransfer::receiveFile(clientSocket, remotePath)) {
+                std::cout << "File updated successfully: " << remotePath << "\n";
+            } else {
+                std::cerr << "Failed to update file\n";
+            }
+        }
+        else if (command[0] == BatchTransfer::COMMAND) {
+            std::cout << "Operation started: Receiving batch of files from client\n";
+            std::cout << "Saving under: " << remotePath << "\n";
+
+            if (!BatchTransfer::receiveBatch(clientSocket, remotePath, receiveMode)) {
+                std::cerr << "Batch incomplete\n";
+            }
+        }
+        else if (command[0] == BatchTransfer::TREE_COMMAND) {
+            std::cout << "Operation started: Sending directory to client\n";
+            std::cout << "Reading from path: " << remotePath << "\n";
+
+            if (!std::filesystem::is_directory(remotePath)) {
+                // Closing without an end record tells the client the batch failed
+                std::cerr << "Directory not found: " << remotePath << "\n";
+                close(clientSocket);
+                return;
+            }
+
+            try {
+                DirectoryWalker walker(remotePath);
+                BatchTransfer::Sender sender(clientSocket, sendMode);
+                bool connected = sender.addFrom(walker);
+                if (connected && sender.finish() && walker.errorCount() == 0) {
+                    std::cout << "Directory sent successfully (" << sender.sentCount() << " entries)\n";
+                } else {
+                    std::cerr << "Failed to send some files\n";
+                }
+            } catch (const std::exception& e) {
+                std::cerr << "Error: " << e.what() << "\n";
+            }
+        }
         else if (command[0] == 'R') {
             std::cout << "Operation started: Sending file to client\n";
             std::cout << "Reading from path: " << remotePath << "\n";
@@ -116,11 +273,16 @@ private:
                 return;
             }
             
-            if (FileTransfer::sendFile(clientSocket, remotePath)) {
-                std::cout << "File sent successfully\n";
-            } else {
-                std::cerr << "Failed to send file\n";
-            }
+            FileTransfer::sendFileAsync(clientSocket, remotePath, sendMode, executor(),
+                                        [clientSocket](bool success) {
+                if (success) {
+                    std::cout << "File sent successfully\n";
+                } else {
+                    std::cerr << "Failed to send file\n";
+                }
+                close(clientSocket);
+            });
+            return;
         }
 
         close(clientSocket);
@@ -132,33 +294,213 @@ private:
  */
 void printUsage() {
     std::cout << "Usage:\n"
-              << "  ./server <port>\n"
+              << "  ./server [port] [options]\n"
+              << "\nOptions:\n"
+              << "  --rate-limit <rate>           Cap for all transfers together\n"
+              << "  --client-rate-limit <rate>    Cap for all transfers of one client IP\n"
+              << "  --transfer-rate-limit <rate>  Cap for a single transfer\n"
+              << "  --mmap-threshold <size>       Send files at least this large from a memory mapping\n"
+              << "  --io-uring                    Move file data for all transfers through io_uring\n"
+              << "  --direct-io                   Write uploads with O_DIRECT, keeping them out of the page cache\n"
+              << "  --writeback-window <size>     Flush uploads to disk every <size> bytes (default 8M, 0 = kernel default)\n"
+              << "  --buffer-memory <size>        Cap on transfer buffer memory (default 1G, 0 = unlimited)\n"
+              << "  --huge-pages                  Back large transfer buffers with huge pages\n"
+              << "  --zerocopy                    Send buffered data with MSG_ZEROCOPY\n"
+              << "  --checksum <algorithm>        Verify transfers with crc32c, xxhash64 or xxhash-wide (default: none)\n"
+              << "  --durability <policy>         Flush received files before acknowledging them: none (default),\n"
+              << "                                per-file, or group-commit (batches flushes across transfers)\n"
+              << "  --tls-cert <file>             Require TLS 1.3, encrypted in the kernel (kTLS), with this PEM certificate\n"
+              << "  --tls-key <file>              PEM private key of --tls-cert\n"
+              << "  --unix-socket <path>          Socket file for clients on this machine (default\n"
+              << "                                $XDG_RUNTIME_DIR/filetransfer/<port>.sock; none with TLS)\n"
+              << "  --no-unix-socket              Accept TCP connections only\n"
+              << "  Rates are in bytes per second and accept K, M and G suffixes; 0 means unlimited\n"
               << "\nExample:\n"
               << "  ./server 8080\n"
+              << "  ./server 8080 --rate-limit 1G --client-rate-limit 200M\n"
               << "\nDefaults:\n"
-              << "  If no port is specified, default port 8080 will be used\n";
+              << "  If no port is specified, default port 8080 will be used\n"
+              << "  Transfers are not rate limited unless a limit is given\n"
+              << "  Files are sent with sendfile unless --mmap-threshold is given\n";
+}
+
+/**
+ * @brief Parses a byte count such as "500K", "100M" or "1G"
+ * @throws std::invalid_argument if the value is malformed
+ * @throws std::out_of_range if the value does not fit in 64 bits
+ */
+uint64_t parseByteCount(const std::string& text) {
+    // stoull() would accept "-1" and wrap it around
+    if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0]))) {
+        throw std::invalid_argument("Invalid byte count: " + text);
+    }
+    size_t consumed = 0;
+    unsigned long long value = std::stoull(text, &consumed);
+    std::string suffix = text.substr(consumed);
+    uint64_t multiplier;
+    if (suffix.empty()) {
+        multiplier = 1;
+    } else if (suffix == "K" || suffix == "k") {
+        multiplier = 1024ULL;
+    } else if (suffix == "M" || suffix == "m") {
+        multiplier = 1024ULL * 1024ULL;
+    } else if (suffix == "G" || suffix == "g") {
+        multiplier = 1024ULL * 1024ULL * 1024ULL;
+    } else {
+        throw std::invalid_argument("Invalid size suffix: " + suffix);
+    }
+    if (value > std::numeric_limits<uint64_t>::max() / multiplier) {
+        throw std::out_of_range("Byte count too large: " + text);
+    }
+    return value * multiplier;
+}
+
+/**
+ * @brief Tells whether an option must be followed by a value
+ */
+bool takesValue(const std::string& option) {
+    static const char* const options[] = {
+        "--rate-limit", "--client-rate-limit", "--transfer-rate-limit", "--mmap-threshold",
+        "--writeback-window", "--buffer-memory", "--checksum", "--durability",
+        "--tls-cert", "--tls-key", "--unix-socket",
+    };
+    return std::find(std::begin(options), std::end(options), option) != std::end(options);
 }
 
 int main(int argc, char* argv[]) {
     int port = 8080;  // Default port
+    BandwidthManager::Limits limits;
+    FileTransfer::MmapOptions mmapOptions;
+    bool useIoUring = false;
+    bool useDirectIo = false;
+    WritebackController::Settings writeback;
+    BufferPool::Options bufferOptions;
+    bool zeroCopySend = false;
+    ChecksumAlgorithm checksum = ChecksumAlgorithm::None;
+    DurabilityManager::Policy durability = DurabilityManager::Policy::None;
+    std::string tlsCertificate;
+    std::string tlsKey;
+    std::string unixSocketPath;
+    bool unixSocket = true;
 
-    if (argc > 1) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
         try {
-            port = std::stoi(argv[1]);
-            if (port <= 0 || port > 65535) {
-                std::cerr << "Error: Port number must be between 1 and 65535\n";
+            if (arg == "--rate-limit" && i + 1 < argc) {
+                limits.globalRate = parseByteCount(argv[++i]);
+            } else if (arg == "--client-rate-limit" && i + 1 < argc) {
+                limits.perClientRate = parseByteCount(argv[++i]);
+            } else if (arg == "--transfer-rate-limit" && i + 1 < argc) {
+                limits.perTransferRate = parseByteCount(argv[++i]);
+            } else if (arg == "--mmap-threshold" && i + 1 < argc) {
+                mmapOptions.autoThreshold = parseByteCount(argv[++i]);
+            } else if (arg == "--io-uring") {
+                useIoUring = true;
+            } else if (arg == "--direct-io") {
+                useDirectIo = true;
+            } else if (arg == "--writeback-window" && i + 1 < argc) {
+                writeback.window = parseByteCount(argv[++i]);
+            } else if (arg == "--buffer-memory" && i + 1 < argc) {
+                bufferOptions.memoryCap = parseByteCount(argv[++i]);
+            } else if (arg == "--huge-pages") {
+                bufferOptions.hugePages = true;
+            } else if (arg == "--zerocopy") {
+                zeroCopySend = true;
+            } else if (arg == "--checksum" && i + 1 < argc) {
+                if (!StreamChecksum::parse(argv[++i], checksum)) {
+                    throw std::invalid_argument("Unknown checksum algorithm");
+                }
+            } else if (arg == "--durability" && i + 1 < argc) {
+                if (!DurabilityManager::parse(argv[++i], durability)) {
+                    throw std::invalid_argument("Unknown durability policy");
+                }
+            } else if (arg == "--tls-cert" && i + 1 < argc) {
+                tlsCertificate = argv[++i];
+            } else if (arg == "--tls-key" && i + 1 < argc) {
+                tlsKey = argv[++i];
+            } else if (arg == "--unix-socket" && i + 1 < argc) {
+                unixSocketPath = argv[++i];
+            } else if (arg == "--no-unix-socket") {
+                unixSocket = false;
+            } else if (takesValue(arg)) {
+                std::cerr << "Error: Missing value for " << arg << "\n";
+                printUsage();
+                return 1;
+            } else if (arg.rfind("--", 0) == 0) {
+                std::cerr << "Error: Unknown option " << arg << "\n";
                 printUsage();
                 return 1;
+            } else {
+                port = std::stoi(arg);
+                if (port <= 0 || port > 65535) {
+                    std::cerr << "Error: Port number must be between 1 and 65535\n";
+                    printUsage();
+                    return 1;
+                }
             }
+        } catch (const std::out_of_range& e) {
+            std::cerr << "Error: Value for " << arg << " is out of range\n";
+            printUsage();
+            return 1;
         } catch (const std::exception& e) {
-            std::cerr << "Error: Invalid port number\n";
+            std::cerr << "Error: Invalid value for " << arg << "\n";
             printUsage();
             return 1;
         }
     }
 
+    // A client that goes away mid-transfer must fail that transfer, not end the server
+    std::signal(SIGPIPE, SIG_IGN);
+
+    BandwidthManager::instance().setLimits(limits);
+    FileTransfer::setMmapOptions(mmapOptions);
+    WritebackController::setSettings(writeback);
+    BufferPool::instance().setOptions(bufferOptions);
+    FileTransfer::setZeroCopySend(zeroCopySend);
+    FileTransfer::setChecksumAlgorithm(checksum);
+    DurabilityManager::instance().setPolicy(durability);
+
+    if (!tlsCertificate.empty() || !tlsKey.empty()) {
+        if (tlsCertificate.empty() || tlsKey.empty()) {
+            std::cerr << "Error: --tls-cert and --tls-key must be given together\n";
+            return 1;
+        }
+        if (!TlsTransport::configureServer(tlsCertificate, tlsKey)) {
+            return 1;
+        }
+        if (!TlsTransport::kernelTlsAvailable()) {
+            // Every connection would fail after its handshake
+            std::cerr << "Error: kernel TLS is not available (load the tls module)\n";
+            return 1;
+        }
+    }
+
     try {
         FileServer server(port);
+        if (useIoUring || useDirectIo) {
+            auto send = useIoUring ? FileTransfer::SendMode::IoUring : FileTransfer::SendMode::Auto;
+            auto receive = useDirectIo ? FileTransfer::ReceiveMode::Direct : FileTransfer::ReceiveMode::IoUring;
+            server.setTransferModes(send, receive);
+        }
+        // Falling back to the other engines would hide that the option has no effect
+        if (useIoUring && !IoUringEngine::instance()) {
+            std::cerr << "Error: --io-uring was given but io_uring is not available\n";
+            return 1;
+        }
+        // A local socket would let clients bypass the certificate they expect
+        if (unixSocket && TlsTransport::serverEnabled()) {
+            std::cout << "TLS is enabled, not accepting local clients on a Unix socket" << std::endl;
+        } else if (unixSocket) {
+            if (unixSocketPath.empty()) {
+                unixSocketPath = LocalTransfer::defaultSocketPath(port);
+                if (!LocalTransfer::makePrivateDirectory(LocalTransfer::defaultSocketDirectory())) {
+                    unixSocketPath.clear();
+                }
+            }
+            if (!unixSocketPath.empty() && server.listenLocal(unixSocketPath)) {
+                std::cout << "Accepting local clients on " << unixSocketPath << std::endl;
+            }
+        }
         std::cout << "Starting server on port " << port << std::endl;
         server.start();
     } catch (const std::exception& e) {
@@ -0,0 +1,404 @@
+/**
+ * @file SharedMemoryRing.cpp
+ * @brief Implementation of the shared-memory ring transport
+ */
+
+#include "SharedMemoryRing.h"
+#include "DurabilityManager.h"
+#include "FileTransfer.h"
+#include "LocalTransfer.h"
+#include "SpscRing.h"
+#include "StagedFile.h"
+#include "WritebackController.h"
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <new>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+namespace {
+
+constexpr uint64_t RING_MAGIC = 0x474e495254464d53ULL;  ///< "SMFTRING", marks a valid control page
+constexpr size_t CONTROL_SIZE = 4096;                  ///< Control page; the data area starts after it
+constexpr size_t MIN_CAPACITY = 64 * 1024;             ///< Smallest data area created
+constexpr unsigned SPIN_ROUNDS = 128;                  ///< Checks before a side sleeps on the futex
+constexpr uint32_t STATE_CLOSED = 1;                   ///< Producer finished the stream
+constexpr uint32_t STATE_ABORTED = 2;                  ///< Consumer stopped reading
+
+#if defined(__linux__)
+void futexWake(std::atomic<uint32_t>& word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+#endif
+
+} // namespace
+
+/**
+ * @struct SharedMemoryRing::Control
+ * @brief Control page at the start of the memfd, shared by both processes
+ *
+ * The waiting flags and signal words implement the sleep: a side that is
+ * about to wait reads the signal word, sets its waiting flag, checks the
+ * ring once more and then waits on the word; the other side bumps the word
+ * and wakes it only if it clears a waiting flag that was set.
+ */
+struct SharedMemoryRing::Control {
+    uint64_t magic;                                 ///< RING_MAGIC
+    uint64_t capacity;                              ///< Size of the data area
+    alignas(64) std::atomic<uint64_t> head;         ///< Bytes consumed, written by the consumer
+    alignas(64) std::atomic<uint64_t> tail;         ///< Bytes produced, written by the producer
+    alignas(64) std::atomic<uint32_t> dataSignal;   ///< Futex word the consumer sleeps on
+    std::atomic<uint32_t> consumerWaiting;          ///< Consumer sleeps or is about to
+    alignas(64) std::atomic<uint32_t> spaceSignal;  ///< Futex word the producer sleeps on
+    std::atomic<uint32_t> producerWaiting;          ///< Producer sleeps or is about to
+    alignas(64) std::atomic<uint32_t> state;        ///< STATE_* flags
+};
+
+std::unique_ptr<SharedMemoryRing> SharedMemoryRing::create(size_t capacity, int peerSocket) {
+    static_assert(sizeof(Control) <= CONTROL_SIZE, "control block must fit its page");
+    static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+                  "ring indices are shared between processes");
+
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+    size_t size = MIN_CAPACITY;
+    while (size < capacity && size < MAX_CAPACITY) size <<= 1;
+
+    int fd = memfd_create("filetransfer-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return nullptr;
+    }
+    size_t mappingSize = CONTROL_SIZE + size;
+    if (ftruncate(fd, static_cast<off_t>(mappingSize)) < 0 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        ::close(fd);
+        return nullptr;
+    }
+    void* mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        ::close(fd);
+        return nullptr;
+    }
+
+    // The memfd starts zeroed: head, tail, the signals and state are already 0
+    Control* control = new (mapping) Control;
+    control->capacity = size;
+    control->magic = RING_MAGIC;
+    return std::unique_ptr<SharedMemoryRing>(new SharedMemoryRing(fd, mapping, mappingSize, peerSocket));
+#else
+    (void)capacity;
+    (void)peerSocket;
+    return nullptr;
+#endif
+}
+
+std::unique_ptr<SharedMemoryRing> SharedMemoryRing::attach(int fd, int peerSocket) {
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+    // Without the shrink seal the creator could truncate the memfd under our mapping
+    int seals = fcntl(fd, F_GET_SEALS);
+    struct stat st;
+    if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fd, &st) < 0 ||
+        st.st_size < static_cast<off_t>(CONTROL_SIZE + MIN_CAPACITY) ||
+        st.st_size > static_cast<off_t>(CONTROL_SIZE + MAX_CAPACITY)) {
+        ::close(fd);
+        return nullptr;
+    }
+    size_t mappingSize = static_cast<size_t>(st.st_size);
+    size_t size = mappingSize - CONTROL_SIZE;
+    void* mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        ::close(fd);
+        return nullptr;
+    }
+    const Control* control = static_cast<const Control*>(mapping);
+    if (control->magic != RING_MAGIC || control->capacity != size || (size & (size - 1)) != 0) {
+        munmap(mapping, mappingSize);
+        ::close(fd);
+        return nullptr;
+    }
+    return std::unique_ptr<SharedMemoryRing>(new SharedMemoryRing(fd, mapping, mappingSize, peerSocket));
+#else
+    ::close(fd);
+    (void)peerSocket;
+    return nullptr;
+#endif
+}
+
+SharedMemoryRing::SharedMemoryRing(int fd, void* mapping, size_t mappingSize, int peerSocket)
+    : memoryFd(fd), mapping(mapping), mappingSize(mappingSize), peerSocket(peerSocket),
+      control(static_cast<Control*>(mapping)), data(static_cast<char*>(mapping) + CONTROL_SIZE),
+      capacity(mappingSize - CONTROL_SIZE) {}
+
+SharedMemoryRing::~SharedMemoryRing() {
+    munmap(mapping, mappingSize);
+    ::close(memoryFd);
+}
+
+size_t SharedMemoryRing::reserve(char*& out) {
+    for (unsigned round = 0;; ++round) {
+        if (broken || (control->state.load(std::memory_order_acquire) & STATE_ABORTED)) {
+            return 0;
+        }
+        uint64_t t = control->tail.load(std::memory_order_relaxed);
+        uint64_t used = t - control->head.load(std::memory_order_seq_cst);
+        if (used > capacity) {
+            broken = true;
+            return 0;
+        }
+        if (used < capacity) {
+            uint64_t offset = t & (capacity - 1);
+            out = data + offset;
+            return static_cast<size_t>(std::min(capacity - used, capacity - offset));
+        }
+
+        if (round < SPIN_ROUNDS) {
+            SpscRing<char>::backOff(round);
+            continue;
+        }
+        uint32_t signal = control->spaceSignal.load(std::memory_order_seq_cst);
+        control->producerWaiting.store(1, std::memory_order_seq_cst);
+        if (t - control->head.load(std::memory_order_seq_cst) < capacity ||
+            (control->state.load(std::memory_order_seq_cst) & STATE_ABORTED)) {
+            control->producerWaiting.store(0, std::memory_order_relaxed);
+            continue;
+        }
+        if (!wait(control->spaceSignal, signal)) {
+            broken = true;
+            return 0;
+        }
+    }
+}
+
+void SharedMemoryRing::commit(size_t bytes) {
+    control->tail.store(control->tail.load(std::memory_order_relaxed) + bytes, std::memory_order_seq_cst);
+#if defined(__linux__)
+    if (control->consumerWaiting.exchange(0, std::memory_order_seq_cst)) {
+        control->dataSignal.fetch_add(1, std::memory_order_seq_cst);
+        futexWake(control->dataSignal);
+    }
+#endif
+}
+
+void SharedMemoryRing::close() {
+    control->state.fetch_or(STATE_CLOSED, std::memory_order_seq_cst);
+#if defined(__linux__)
+    if (control->consumerWaiting.exchange(0, std::memory_order_seq_cst)) {
+        control->dataSignal.fetch_add(1, std::memory_order_seq_cst);
+        futexWake(control->dataSignal);
+    }
+#endif
+}
+
+size_t SharedMemoryRing::acquire(const char*& out) {
+    for (unsigned round = 0;; ++round) {
+        if (broken) {
+            return 0;
+        }
+        // State before tail: once STATE_CLOSED is seen, every byte before it is visible
+        uint32_t state = control->state.load(std::memory_order_seq_cst);
+        uint64_t h = control->head.load(std::memory_order_relaxed);
+        uint64_t available = control->tail.load(std::memory_order_seq_cst) - h;
+        if (available > capacity) {
+            broken = true;      // The producer wrote an impossible tail
+            return 0;
+        }
+        if (available > 0) {
+            uint64_t offset = h & (capacity - 1);
+            out = data + offset;
+            return static_cast<size_t>(std::min(available, capacity - offset));
+        }
+        if (state & STATE_CLOSED) {
+            return 0;
+        }
+
+        if (round < SPIN_ROUNDS) {
+            SpscRing<char>::backOff(round);
+            continue;
+        }
+        uint32_t signal = control->dataSignal.load(std::memory_order_seq_cst);
+        control->consumerWaiting.store(1, std::memory_order_seq_cst);
+        if (control->tail.load(std::memory_order_seq_cst) != h ||
+            (control->state.load(std::memory_order_seq_cst) & STATE_CLOSED)) {
+            control->consumerWaiting.store(0, std::memory_order_relaxed);
+            continue;
+        }
+        if (!wait(control->dataSignal, signal)) {
+            broken = true;
+            return 0;
+        }
+    }
+}
+
+void SharedMemoryRing::release(size_t bytes) {
+    control->head.store(control->head.load(std::memory_order_relaxed) + bytes, std::memory_order_seq_cst);
+#if defined(__linux__)
+    if (control->producerWaiting.exchange(0, std::memory_order_seq_cst)) {
+        control->spaceSignal.fetch_add(1, std::memory_order_seq_cst);
+        futexWake(control->spaceSignal);
+    }
+#endif
+}
+
+void SharedMemoryRing::abort() {
+    control->state.fetch_or(STATE_ABORTED, std::memory_order_seq_cst);
+#if defined(__linux__)
+    control->producerWaiting.store(0, std::memory_order_seq_cst);
+    control->spaceSignal.fetch_add(1, std::memory_order_seq_cst);
+    futexWake(control->spaceSignal);
+#endif
+}
+
+bool SharedMemoryRing::closedCleanly() const {
+    return !broken && (control->state.load(std::memory_order_acquire) & STATE_CLOSED) &&
+           control->head.load(std::memory_order_relaxed) == control->tail.load(std::memory_order_acquire);
+}
+
+/**
+ * @brief Sleeps until word no longer holds expected, a wake-up, or the timeout
+ * @return false if the peer's connection is gone
+ */
+bool SharedMemoryRing::wait(std::atomic<uint32_t>& word, uint32_t expected) {
+#if defined(__linux__)
+    struct timespec timeout = {0, WAIT_TIMEOUT_MS * 1000000L};
+    long result = syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, &timeout,
+                          nullptr, 0);
+    if (result < 0 && errno == ETIMEDOUT) {
+        return peerAlive();
+    }
+    return true;
+#else
+    (void)word;
+    (void)expected;
+    return false;
+#endif
+}
+
+/**
+ * @brief Checks the connection the ring was set up on for a hang-up
+ */
+bool SharedMemoryRing::peerAlive() {
+    if (peerSocket < 0) {
+        return true;
+    }
+    struct pollfd pfd = {peerSocket, POLLRDHUP, 0};
+    return poll(&pfd, 1, 0) == 0 || !(pfd.revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL));
+}
+
+bool SharedMemoryRing::sendFile(int socket, const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Error: Cannot open " << filename << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    auto ring = create(DEFAULT_CAPACITY, socket);
+    if (!ring) {
+        std::cerr << "Error: Cannot create a shared-memory ring: " << std::strerror(errno) << std::endl;
+        ::close(fd);
+        return false;
+    }
+    if (!LocalTransfer::sendDescriptor(socket, ring->fd())) {
+        std::cerr << "Error: Cannot pass the ring to the server: " << std::strerror(errno) << std::endl;
+        ::close(fd);
+        return false;
+    }
+
+    // read() fills the shared pages directly: the only copy of each byte
+    bool ok = true;
+    uint64_t total = 0;
+    for (;;) {
+        char* space;
+        size_t length = ring->reserve(space);
+        if (length == 0) {
+            ok = false;     // Server stopped reading
+            break;
+        }
+        ssize_t n = read(fd, space, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            std::cerr << "Error: Read failed: " << std::strerror(errno) << std::endl;
+            ok = false;
+            break;
+        }
+        if (n == 0) break;
+        ring->commit(static_cast<size_t>(n));
+        total += static_cast<uint64_t>(n);
+    }
+    ::close(fd);
+
+    if (!ok) {
+        // Without STATE_CLOSED the server sees the hang-up and discards the file
+        shutdown(socket, SHUT_RDWR);
+        return false;
+    }
+    ring->close();
+
+    char ack;
+    bool stored = FileTransfer::receiveChunk(socket, &ack, 1) && ack == ACK_OK;
+    if (stored) {
+        std::cout << "Streamed " << total << " bytes through shared memory" << std::endl;
+    }
+    return stored;
+}
+
+bool SharedMemoryRing::receiveFile(int socket, const std::string& filename) {
+    int memory = LocalTransfer::receiveDescriptor(socket);
+    auto ring = memory >= 0 ? attach(memory, socket) : nullptr;
+    if (!ring) {
+        std::cerr << "Error: No valid shared-memory ring received for " << filename << std::endl;
+        char ack = ACK_FAILED;
+        FileTransfer::sendChunk(socket, &ack, 1);
+        return false;
+    }
+
+    StagedFile file;
+    bool ok = file.create(filename);
+    int fd = file.fd();
+    uint64_t total = 0;
+    if (ok) {
+        WritebackController writeback(fd, 0);
+        for (;;) {
+            const char* chunk;
+            size_t length = ring->acquire(chunk);
+            if (length == 0) break;
+
+            size_t done = 0;
+            while (ok && done < length) {
+                ssize_t written = pwrite(fd, chunk + done, length - done, static_cast<off_t>(total + done));
+                if (written < 0 && errno == EINTR) continue;
+                if (written < 0) {
+                    std::cerr << "Error: Write failed: " << std::strerror(errno) << std::endl;
+                    ok = false;
+                    break;
+                }
+                done += static_cast<size_t>(written);
+            }
+            if (!ok) break;
+            ring->release(length);
+            writeback.advance(length);
+            total += length;
+        }
+        ok = ok && ring->closedCleanly();
+    }
+    if (!ok) {
+        ring->abort();
+    }
+
+    ok = ok && DurabilityManager::instance().commit(file);
+    if (ok) {
+        std::cout << "Total bytes received: " << total << std::endl;
+    }
+
+    char ack = ok ? ACK_OK : ACK_FAILED;
+    return FileTransfer::sendChunk(socket, &ack, 1) && ok;
+}
@@ -0,0 +1,349 @@
+/**
+ * @file StagedFile.cpp
+ * @brief Implementation of files being received before they are published
+ */
+
+#include "StagedFile.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <mutex>
+
+/**
+ * @struct StagedFile::Directory
+ * @brief An open destination directory, shared by the files created in it
+ */
+struct StagedFile::Directory {
+    int fd = -1;
+    dev_t device = 0;
+    ino_t inode = 0;
+    std::string path;
+    std::atomic<bool> unnamedFiles{true};   ///< O_TMPFILE has not been refused here
+
+    ~Directory() {
+        if (fd >= 0) close(fd);
+    }
+};
+
+namespace {
+
+std::mutex cacheMutex;
+std::map<std::string, std::shared_ptr<StagedFile::Directory>> cache;   ///< Guarded by cacheMutex
+
+#if defined(__linux__)
+std::atomic<bool> emptyPathLinks{true};     ///< linkat(AT_EMPTY_PATH) is allowed to this process
+
+/**
+ * @brief Gives an open, unnamed file a name
+ *
+ * AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH; without it the link goes through
+ * the descriptor's /proc entry instead, which any process may use.
+ */
+bool linkDescriptor(int fd, int directoryFd, const std::string& name) {
+    if (emptyPathLinks.load(std::memory_order_relaxed)) {
+        if (linkat(fd, "", directoryFd, name.c_str(), AT_EMPTY_PATH) == 0) {
+            return true;
+        }
+        if (errno != ENOENT && errno != EPERM) {
+            return false;
+        }
+    }
+    std::string procPath = "/proc/self/fd/" + std::to_string(fd);
+    if (linkat(AT_FDCWD, procPath.c_str(), directoryFd, name.c_str(), AT_SYMLINK_FOLLOW) < 0) {
+        return false;
+    }
+    emptyPathLinks.store(false, std::memory_order_relaxed);
+    return true;
+}
+#endif
+
+} // namespace
+
+std::shared_ptr<StagedFile::Directory> StagedFile::openDirectory(const std::string& path) {
+    std::string key = path.empty() ? "." : path;
+
+    // The cached descriptor is only good while the path still names the same directory
+    struct stat st;
+    bool exists = stat(key.c_str(), &st) == 0;
+    if (exists && !S_ISDIR(st.st_mode)) {
+        std::cerr << "Error: Not a directory: " << key << std::endl;
+        return nullptr;
+    }
+    if (exists) {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        auto it = cache.find(key);
+        if (it != cache.end() && it->second->device == st.st_dev && it->second->inode == st.st_ino) {
+            return it->second;
+        }
+    } else if (errno == ENOENT) {
+        std::error_code error;
+        std::filesystem::create_directories(key, error);
+        if (error) {
+            std::cerr << "Error: Cannot create directory " << key << ": " << error.message() << std::endl;
+            return nullptr;
+        }
+        std::cout << "Created directory structure: " << key << std::endl;
+    } else {
+        std::cerr << "Error: Cannot access directory " << key << ": " << std::strerror(errno) << std::endl;
+        return nullptr;
+    }
+
+    auto directory = std::make_shared<Directory>();
+    directory->path = key;
+    directory->fd = open(key.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory->fd < 0 || fstat(directory->fd, &st) < 0) {
+        std::cerr << "Error: Cannot open directory " << key << ": " << std::strerror(errno) << std::endl;
+        return nullptr;
+    }
+    directory->device = st.st_dev;
+    directory->inode = st.st_ino;
+
+    // Files still being written keep their directory open through their handle
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    if (cache.size() >= MAX_CACHED_DIRECTORIES) {
+        cache.clear();
+    }
+    cache[key] = directory;
+    return directory;
+}
+
+StagedFile::~StagedFile() {
+    discard();
+}
+
+StagedFile::StagedFile(StagedFile&& other) noexcept
+    : directory(std::move(other.directory)),
+      name(std::move(other.name)),
+      finalPath(std::move(other.finalPath)),
+      partName(std::move(other.partName)),
+      descriptor(other.descriptor),
+      unnamed(other.unnamed),
+      publishedDevice(other.publishedDevice),
+      publishedInode(other.publishedInode) {
+    other.descriptor = -1;
+}
+
+StagedFile& StagedFile::operator=(StagedFile&& other) noexcept {
+    if (this != &other) {
+        discard();
+        directory = std::move(other.directory);
+        name = std::move(other.name);
+        finalPath = std::move(other.finalPath);
+        partName = std::move(other.partName);
+        descriptor = other.descriptor;
+        unnamed = other.unnamed;
+        publishedDevice = other.publishedDevice;
+        publishedInode = other.publishedInode;
+        other.descriptor = -1;
+    }
+    return *this;
+}
+
+bool StagedFile::create(const std::string& filename, bool resume) {
+    std::filesystem::path filePath(filename);
+    std::string fileName = filePath.filename().string();
+    if (fileName.empty() || fileName == "." || fileName == "..") {
+        std::cerr << "Error: Not a valid file name: \"" << filename << "\"" << std::endl;
+        return false;
+    }
+    std::shared_ptr<Directory> parent = openDirectory(filePath.parent_path().string());
+    return parent && create(parent, fileName, resume);
+}
+
+bool StagedFile::create(const std::shared_ptr<Directory>& parent, const std::string& fileName, bool resume) {
+    discard();
+    directory = parent;
+    name = fileName;
+    finalPath = (std::filesystem::path(parent->path) / fileName).string();
+    unnamed = false;
+    publishedDevice = 0;
+    publishedInode = 0;
+    partName = name + ".part";
+
+    // A .part left by an interrupted transfer holds data worth resuming from
+    if (resume) {
+        descriptor = openat(directory->fd, partName.c_str(), O_RDWR | O_CLOEXEC);
+        if (descriptor >= 0) {
+            return true;
+        }
+        if (errno != ENOENT) {
+            std::cerr << "Error: Cannot open " << tempName() << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+    }
+
+#if defined(__linux__) && defined(O_TMPFILE)
+    if (directory->unnamedFiles.load(std::memory_order_relaxed)) {
+        descriptor = openat(directory->fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0644);
+        if (descriptor >= 0) {
+            unnamed = true;
+            return true;
+        }
+        // Kernels and file systems without O_TMPFILE get the .part file
+        if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+            std::cerr << "Error: Cannot create a file in " << directory->path << ": " << std::strerror(errno)
+                      << std::endl;
+            return false;
+        }
+        directory->unnamedFiles.store(false, std::memory_order_relaxed);
+    }
+#endif
+
+    // The .part belongs to resumable transfers; anything else gets a name of
+    // its own rather than truncating one that another transfer is writing
+    if (!resume) {
+        static std::atomic<unsigned> sequence{0};
+        partName = "." + name + "." + std::to_string(getpid()) + "." +
+                   std::to_string(sequence.fetch_add(1, std::memory_order_relaxed)) + ".part";
+    }
+    descriptor = openat(directory->fd, partName.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (descriptor < 0) {
+        std::cerr << "Error: Cannot create " << tempName() << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::string StagedFile::tempName() const {
+    return unnamed ? "unnamed file for " + finalPath : (std::filesystem::path(directory->path) / partName).string();
+}
+
+bool StagedFile::publish() {
+    if (descriptor < 0) {
+        return false;
+    }
+
+    bool published;
+    if (!unnamed) {
+        published = renameat(directory->fd, partName.c_str(), directory->fd, name.c_str()) == 0;
+    } else {
+#if defined(__linux__)
+        // linkat() cannot replace a file, so an existing one is replaced by
+        // linking under a private name and renaming that over it
+        published = linkDescriptor(descriptor, directory->fd, name);
+        if (!published && errno == EEXIST) {
+            static std::atomic<unsigned> sequence{0};
+            std::string linkName = "." + name + "." + std::to_string(getpid()) + "." +
+                                   std::to_string(sequence.fetch_add(1, std::memory_order_relaxed)) + ".link";
+            published = linkDescriptor(descriptor, directory->fd, linkName);
+            if (published && renameat(directory->fd, linkName.c_str(), directory->fd, name.c_str()) < 0) {
+                int error = errno;
+                unlinkat(directory->fd, linkName.c_str(), 0);
+                errno = error;
+                published = false;
+            }
+        }
+#else
+        published = false;
+#endif
+    }
+    if (!published) {
+        std::cerr << "Error: Cannot publish " << finalPath << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(descriptor, &st) == 0) {
+        publishedDevice = st.st_dev;
+        publishedInode = st.st_ino;
+    }
+    close(descriptor);
+    descriptor = -1;
+    return true;
+}
+
+bool StagedFile::withdraw() {
+    if (publishedInode == 0) {
+        return false;
+    }
+    struct stat st;
+    bool ours = fstatat(directory->fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                st.st_dev == publishedDevice && st.st_ino == publishedInode;
+    publishedInode = 0;
+    return ours && unlinkat(directory->fd, name.c_str(), 0) == 0;
+}
+
+bool StagedFile::syncDirectory() const {
+    return directory && fsync(directory->fd) == 0;
+}
+
+int StagedFile::directoryFd() const {
+    return directory ? directory->fd : -1;
+}
+
+/**
+ * @brief Links an unnamed file as name + ".part", replacing one left there
+ */
+bool StagedFile::linkPart() {
+#if defined(__linux__)
+    std::string resumeName = name + ".part";
+    bool linked = linkDescriptor(descriptor, directory->fd, resumeName);
+    if (!linked && errno == EEXIST) {
+        // Left by a transfer that failed meanwhile; ours is the newer attempt
+        linked = unlinkat(directory->fd, resumeName.c_str(), 0) == 0 &&
+                 linkDescriptor(descriptor, directory->fd, resumeName);
+    }
+    return linked;
+#else
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
+bool StagedFile::persist() {
+    if (descriptor < 0 || !unnamed) {
+        return descriptor >= 0;
+    }
+    if (!linkPart()) {
+        std::cerr << "Warning: Cannot link " << finalPath << ".part, a crash will lose the data: "
+                  << std::strerror(errno) << std::endl;
+        return false;
+    }
+    unnamed = false;
+    partName = name + ".part";
+    return true;
+}
+
+bool StagedFile::keep() {
+    if (descriptor < 0) {
+        return false;
+    }
+
+    bool kept = true;
+    std::string resumeName = name + ".part";
+    if (unnamed) {
+        kept = linkPart();
+    }
+    if (!unnamed && partName != resumeName) {
+        kept = renameat(directory->fd, partName.c_str(), directory->fd, resumeName.c_str()) == 0;
+        if (!kept) {
+            int error = errno;
+            unlinkat(directory->fd, partName.c_str(), 0);
+            errno = error;
+        }
+    }
+    if (!kept) {
+        std::cerr << "Error: Cannot keep " << finalPath << ".part: " << std::strerror(errno) << std::endl;
+    }
+    close(descriptor);
+    descriptor = -1;
+    return kept;
+}
+
+void StagedFile::discard() {
+    if (descriptor < 0) {
+        return;
+    }
+    close(descriptor);
+    descriptor = -1;
+    if (!unnamed) {
+        unlinkat(directory->fd, partName.c_str(), 0);
+    }
+}
@@ -0,0 +1,248 @@
+/**
+ * @file TlsBenchmark.cpp
+ * @brief Loopback throughput of kernel TLS against user-space TLS
+ *
+ * Sends the same file over a loopback TCP connection three ways: plain
+ * sendfile, SSL_write of read() buffers (user-space TLS) and sendfile on a
+ * kTLS socket set up by TlsTransport. The receiver hashes what arrives so
+ * every run is checked against the file. Prints MB/s for each.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Checksum.h"
+#include "TlsTransport.h"
+
+#if defined(HAVE_OPENSSL) && defined(__linux__)
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+namespace {
+
+constexpr size_t CHUNK_SIZE = 256 * 1024;   ///< Piece size used by the transfer engines
+const char* const CIPHER_SUITES = "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384";
+
+/**
+ * @brief Sender side of one run: gets the accepted socket, returns whether it sent the file
+ */
+using Sender = std::function<bool(int socket)>;
+
+/**
+ * @brief Receiver side of one run: gets the connected socket, hashes everything until EOF
+ */
+using Receiver = std::function<bool(int socket, XxHash64& hash, size_t& received)>;
+
+/**
+ * @brief Runs one transfer over loopback
+ * @return Throughput in MB/s (10^6 bytes per second), or a negative value on failure
+ */
+double run(const Sender& sender, const Receiver& receiver, size_t expectedSize, uint64_t expectedHash) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addressLength = sizeof(address);
+    if (listener < 0
+        || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0
+        || listen(listener, 1) < 0
+        || getsockname(listener, reinterpret_cast<sockaddr*>(&address), &addressLength) < 0) {
+        std::perror("listen");
+        if (listener >= 0) close(listener);
+        return -1;
+    }
+
+    bool sent = false;
+    std::thread server([&]() {
+        int socket = ::accept(listener, nullptr, nullptr);
+        if (socket < 0) return;
+        sent = sender(socket);
+        close(socket);
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    int socket = ::socket(AF_INET, SOCK_STREAM, 0);
+    XxHash64 hash;
+    size_t received = 0;
+    bool ok = socket >= 0
+              && connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0
+              && receiver(socket, hash, received);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (socket >= 0) close(socket);
+    server.join();
+    close(listener);
+
+    if (!ok || !sent || received != expectedSize || hash.digest() != expectedHash) {
+        return -1;
+    }
+    return static_cast<double>(received) / elapsed.count() / 1e6;
+}
+
+bool sendWithSendfile(int socket, int fd, size_t size) {
+    off_t offset = 0;
+    while (static_cast<size_t>(offset) < size) {
+        ssize_t sent = sendfile(socket, fd, &offset, std::min(size - offset, CHUNK_SIZE * 16));
+        if (sent <= 0) return false;
+    }
+    return true;
+}
+
+bool receiveWithRecv(int socket, XxHash64& hash, size_t& received) {
+    std::vector<char> buffer(CHUNK_SIZE);
+    for (;;) {
+        ssize_t count = recv(socket, buffer.data(), buffer.size(), 0);
+        if (count < 0) return false;
+        if (count == 0) return true;
+        hash.update(buffer.data(), static_cast<size_t>(count));
+        received += static_cast<size_t>(count);
+    }
+}
+
+SSL_CTX* userSpaceContext(bool isServer, const std::string& certificate, const std::string& key) {
+    SSL_CTX* context = SSL_CTX_new(isServer ? TLS_server_method() : TLS_client_method());
+    if (context == nullptr) return nullptr;
+    SSL_CTX_set_min_proto_version(context, TLS1_3_VERSION);
+    SSL_CTX_set_ciphersuites(context, CIPHER_SUITES);
+    if (isServer && (SSL_CTX_use_certificate_chain_file(context, certificate.c_str()) != 1
+                     || SSL_CTX_use_PrivateKey_file(context, key.c_str(), SSL_FILETYPE_PEM) != 1)) {
+        SSL_CTX_free(context);
+        return nullptr;
+    }
+    return context;
+}
+
+void report(const char* transport, double rate) {
+    if (rate < 0) {
+        std::printf("  %-26s %10s\n", transport, "failed");
+    } else {
+        std::printf("  %-26s %10.1f MB/s\n", transport, rate);
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: ./tls_bench <cert.pem> <key.pem> [file size in MiB, default 256]\n"
+                  << "The certificate must be valid for 127.0.0.1, for example:\n"
+                  << "  openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes -days 1 \\\n"
+                  << "    -subj /CN=localhost -addext subjectAltName=IP:127.0.0.1 -keyout key.pem -out cert.pem\n";
+        return 1;
+    }
+    std::string certificate = argv[1];
+    std::string key = argv[2];
+    size_t megabytes = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 256;
+    size_t size = megabytes * 1024 * 1024;
+
+    char path[] = "/tmp/tls_bench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || size == 0) {
+        std::cerr << "Error: cannot create the test file\n";
+        return 1;
+    }
+    unlink(path);
+
+    std::vector<char> block(CHUNK_SIZE);
+    std::mt19937_64 random(42);
+    XxHash64 fileHash;
+    for (size_t written = 0; written < size; written += block.size()) {
+        for (auto& byte : block) byte = static_cast<char>(random());
+        size_t count = std::min(block.size(), size - written);
+        fileHash.update(block.data(), count);
+        if (write(fd, block.data(), count) != static_cast<ssize_t>(count)) {
+            std::cerr << "Error: cannot write the test file\n";
+            return 1;
+        }
+    }
+    uint64_t expectedHash = fileHash.digest();
+
+    SSL_CTX* serverContext = userSpaceContext(true, certificate, key);
+    SSL_CTX* clientContext = userSpaceContext(false, certificate, key);
+    if (serverContext == nullptr || clientContext == nullptr
+        || !TlsTransport::configureServer(certificate, key)
+        || !TlsTransport::configureClient(certificate, "127.0.0.1")) {
+        std::cerr << "Error: cannot load " << certificate << " and " << key << "\n";
+        return 1;
+    }
+
+    std::printf("File: %zu MiB over loopback, TLS 1.3\n\n", megabytes);
+
+    double plain = run([&](int socket) { return sendWithSendfile(socket, fd, size); },
+                       receiveWithRecv, size, expectedHash);
+    report("plain TCP, sendfile", plain);
+
+    double userSpace = run(
+        [&](int socket) {
+            SSL* ssl = SSL_new(serverContext);
+            SSL_set_fd(ssl, socket);
+            bool ok = SSL_accept(ssl) == 1;
+            std::vector<char> buffer(CHUNK_SIZE);
+            for (size_t offset = 0; ok && offset < size;) {
+                ssize_t count = pread(fd, buffer.data(), buffer.size(), static_cast<off_t>(offset));
+                ok = count > 0 && SSL_write(ssl, buffer.data(), static_cast<int>(count)) == count;
+                offset += count > 0 ? static_cast<size_t>(count) : 0;
+            }
+            if (ok) SSL_shutdown(ssl);
+            SSL_free(ssl);
+            return ok;
+        },
+        [&](int socket, XxHash64& hash, size_t& received) {
+            SSL* ssl = SSL_new(clientContext);
+            SSL_set_fd(ssl, socket);
+            bool ok = SSL_connect(ssl) == 1;
+            std::vector<char> buffer(CHUNK_SIZE);
+            while (ok) {
+                int count = SSL_read(ssl, buffer.data(), static_cast<int>(buffer.size()));
+                if (count <= 0) {
+                    ok = SSL_get_error(ssl, count) == SSL_ERROR_ZERO_RETURN;
+                    break;
+                }
+                hash.update(buffer.data(), static_cast<size_t>(count));
+                received += static_cast<size_t>(count);
+            }
+            SSL_free(ssl);
+            return ok;
+        },
+        size, expectedHash);
+    report("user-space TLS, SSL_write", userSpace);
+
+    if (!TlsTransport::kernelTlsAvailable()) {
+        std::printf("  %-26s %10s\n", "kTLS, sendfile", "unavailable (no tls module in this kernel)");
+    } else {
+        double kernel = run(
+            [&](int socket) { return TlsTransport::accept(socket) && sendWithSendfile(socket, fd, size); },
+            [&](int socket, XxHash64& hash, size_t& received) {
+                return TlsTransport::connect(socket) && receiveWithRecv(socket, hash, received);
+            },
+            size, expectedHash);
+        report("kTLS, sendfile", kernel);
+    }
+
+    close(fd);
+    SSL_CTX_free(serverContext);
+    SSL_CTX_free(clientContext);
+    return plain < 0 || userSpace < 0 ? 1 : 0;
+}
+
+#else
+
+int main() {
+    std::cerr << "tls_bench needs Linux and a build with OpenSSL\n";
+    return 1;
+}
+
+#endif
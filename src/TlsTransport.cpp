@@ -0,0 +1,383 @@
+/**
+ * @file TlsTransport.cpp
+ * @brief Implementation of kernel TLS (kTLS) encrypted connections
+ */
+
+#include "TlsTransport.h"
+#include <iostream>
+#include <mutex>
+
+#if defined(HAVE_OPENSSL) && defined(__linux__)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/tls.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+namespace {
+
+const char* const CIPHER_SUITES = "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384";
+
+std::mutex contextMutex;
+SSL_CTX* serverContext = nullptr;   ///< Guarded by contextMutex; never freed once published
+SSL_CTX* clientContext = nullptr;   ///< Guarded by contextMutex; never freed once published
+std::string expectedServerName;     ///< Guarded by contextMutex
+
+/**
+ * @struct TrafficSecrets
+ * @brief Application traffic secrets of one connection, captured during the handshake
+ */
+struct TrafficSecrets {
+    std::vector<unsigned char> client;  ///< client_application_traffic_secret_0
+    std::vector<unsigned char> server;  ///< server_application_traffic_secret_0
+};
+
+int secretsIndex() {
+    static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+void printSslError(const char* what) {
+    unsigned long code = ERR_get_error();
+    char text[256] = "unknown error";
+    if (code != 0) ERR_error_string_n(code, text, sizeof(text));
+    std::cerr << "TLS: " << what << ": " << text << "\n";
+    ERR_clear_error();
+}
+
+bool parseHex(const char* text, std::vector<unsigned char>& bytes) {
+    bytes.clear();
+    for (; text[0] && text[1]; text += 2) {
+        char pair[3] = {text[0], text[1], '\0'};
+        char* end;
+        unsigned long value = std::strtoul(pair, &end, 16);
+        if (*end != '\0') return false;
+        bytes.push_back(static_cast<unsigned char>(value));
+    }
+    return !bytes.empty();
+}
+
+/**
+ * @brief Keylog callback; the only place OpenSSL exposes TLS 1.3 traffic secrets
+ *
+ * Lines look like "CLIENT_TRAFFIC_SECRET_0 <client random> <secret>", all hex.
+ */
+void captureSecret(const SSL* ssl, const char* line) {
+    auto* secrets = static_cast<TrafficSecrets*>(SSL_get_ex_data(ssl, secretsIndex()));
+    if (secrets == nullptr) return;
+
+    const char* random = std::strchr(line, ' ');
+    const char* secret = random ? std::strchr(random + 1, ' ') : nullptr;
+    if (secret == nullptr) return;
+
+    std::string label(line, random - line);
+    if (label == "CLIENT_TRAFFIC_SECRET_0") {
+        parseHex(secret + 1, secrets->client);
+    } else if (label == "SERVER_TRAFFIC_SECRET_0") {
+        parseHex(secret + 1, secrets->server);
+    }
+}
+
+/**
+ * @brief HKDF-Expand-Label(secret, label, "", length) from RFC 8446 section 7.1
+ */
+bool expandLabel(const std::vector<unsigned char>& secret, const EVP_MD* digest,
+                 const std::string& label, unsigned char* out, size_t length) {
+    std::string fullLabel = "tls13 " + label;
+    std::vector<unsigned char> info;
+    info.push_back(static_cast<unsigned char>(length >> 8));
+    info.push_back(static_cast<unsigned char>(length));
+    info.push_back(static_cast<unsigned char>(fullLabel.size()));
+    info.insert(info.end(), fullLabel.begin(), fullLabel.end());
+    info.push_back(0);  // Empty context
+
+    EVP_PKEY_CTX* context = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+    if (context == nullptr) return false;
+    size_t outLength = length;
+    bool ok = EVP_PKEY_derive_init(context) > 0
+              && EVP_PKEY_CTX_set_hkdf_mode(context, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0
+              && EVP_PKEY_CTX_set_hkdf_md(context, digest) > 0
+              && EVP_PKEY_CTX_set1_hkdf_key(context, secret.data(), static_cast<int>(secret.size())) > 0
+              && EVP_PKEY_CTX_add1_hkdf_info(context, info.data(), static_cast<int>(info.size())) > 0
+              && EVP_PKEY_derive(context, out, &outLength) > 0
+              && outLength == length;
+    EVP_PKEY_CTX_free(context);
+    return ok;
+}
+
+/**
+ * @brief Fills a kernel crypto_info for one direction from its traffic secret
+ *
+ * The TLS 1.3 nonce is the 12-byte write IV XORed with the record sequence
+ * number; the kernel takes its first 4 bytes as salt and the last 8 as iv.
+ */
+template <typename CryptoInfo>
+bool fillCryptoInfo(CryptoInfo& info, unsigned cipherType, const std::vector<unsigned char>& secret,
+                    const EVP_MD* digest) {
+    unsigned char iv[sizeof(info.salt) + sizeof(info.iv)];
+    std::memset(&info, 0, sizeof(info));
+    info.info.version = TLS_1_3_VERSION;
+    info.info.cipher_type = cipherType;
+    if (!expandLabel(secret, digest, "key", info.key, sizeof(info.key))
+        || !expandLabel(secret, digest, "iv", iv, sizeof(iv))) {
+        return false;
+    }
+    std::memcpy(info.salt, iv, sizeof(info.salt));
+    std::memcpy(info.iv, iv + sizeof(info.salt), sizeof(info.iv));
+    return true;
+}
+
+template <typename CryptoInfo>
+bool installKeys(int socket, unsigned cipherType, const TrafficSecrets& secrets, bool isServer,
+                 const EVP_MD* digest) {
+    CryptoInfo transmit;
+    CryptoInfo receive;
+    const auto& own = isServer ? secrets.server : secrets.client;
+    const auto& peer = isServer ? secrets.client : secrets.server;
+    bool ok = fillCryptoInfo(transmit, cipherType, own, digest)
+              && fillCryptoInfo(receive, cipherType, peer, digest);
+    if (ok && setsockopt(socket, SOL_TLS, TLS_TX, &transmit, sizeof(transmit)) < 0) {
+        std::cerr << "TLS: kernel rejected transmit keys: " << std::strerror(errno) << "\n";
+        ok = false;
+    }
+    if (ok && setsockopt(socket, SOL_TLS, TLS_RX, &receive, sizeof(receive)) < 0) {
+        std::cerr << "TLS: kernel rejected receive keys: " << std::strerror(errno) << "\n";
+        ok = false;
+    }
+    OPENSSL_cleanse(&transmit, sizeof(transmit));
+    OPENSSL_cleanse(&receive, sizeof(receive));
+    return ok;
+}
+
+/**
+ * @brief Hands the record layer of a finished handshake to the kernel
+ */
+bool enableKernelTls(int socket, SSL* ssl, const TrafficSecrets& secrets, bool isServer) {
+    if (secrets.client.empty() || secrets.server.empty()) {
+        std::cerr << "TLS: traffic secrets were not captured\n";
+        return false;
+    }
+    if (SSL_has_pending(ssl)) {
+        // OpenSSL already read records the kernel would never see
+        std::cerr << "TLS: peer sent data before the kernel took over\n";
+        return false;
+    }
+
+    if (setsockopt(socket, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+        int error = errno;
+        std::cerr << "TLS: cannot enable kernel TLS: " << std::strerror(error)
+                  << (error == ENOENT ? " (is the tls module loaded?)" : "") << "\n";
+        return false;
+    }
+
+    const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl);
+    uint32_t id = cipher ? SSL_CIPHER_get_id(cipher) : 0;
+    if (id == TLS1_3_CK_AES_128_GCM_SHA256) {
+        return installKeys<tls12_crypto_info_aes_gcm_128>(socket, TLS_CIPHER_AES_GCM_128, secrets,
+                                                          isServer, EVP_sha256());
+    }
+    if (id == TLS1_3_CK_AES_256_GCM_SHA384) {
+        return installKeys<tls12_crypto_info_aes_gcm_256>(socket, TLS_CIPHER_AES_GCM_256, secrets,
+                                                          isServer, EVP_sha384());
+    }
+    std::cerr << "TLS: negotiated cipher " << (cipher ? SSL_CIPHER_get_name(cipher) : "none")
+              << " cannot be offloaded\n";
+    return false;
+}
+
+SSL_CTX* newContext(const SSL_METHOD* method) {
+    SSL_CTX* context = SSL_CTX_new(method);
+    if (context == nullptr) return nullptr;
+    SSL_CTX_set_min_proto_version(context, TLS1_3_VERSION);
+    SSL_CTX_set_max_proto_version(context, TLS1_3_VERSION);
+    SSL_CTX_set_ciphersuites(context, CIPHER_SUITES);
+    SSL_CTX_set_keylog_callback(context, captureSecret);
+    return context;
+}
+
+/**
+ * @brief Runs one side of the handshake on a blocking socket, then enables kTLS
+ */
+bool handshake(int socket, SSL_CTX* context, bool isServer, const std::string& serverName) {
+    SSL* ssl = SSL_new(context);
+    if (ssl == nullptr) {
+        printSslError("cannot create connection");
+        return false;
+    }
+
+    TrafficSecrets secrets;
+    SSL_set_ex_data(ssl, secretsIndex(), &secrets);
+    SSL_set_fd(ssl, socket);    // Socket BIO without BIO_CLOSE: SSL_free leaves the socket open
+
+    bool ok = true;
+    if (!isServer) {
+        in6_addr address;
+        bool isAddress = inet_pton(AF_INET, serverName.c_str(), &address) == 1
+                         || inet_pton(AF_INET6, serverName.c_str(), &address) == 1;
+        if (isAddress) {
+            ok = X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), serverName.c_str()) == 1;
+        } else {
+            ok = SSL_set1_host(ssl, serverName.c_str()) == 1
+                 && SSL_set_tlsext_host_name(ssl, serverName.c_str()) == 1;
+        }
+        if (!ok) printSslError("invalid server name");
+    }
+
+    if (ok && (isServer ? SSL_accept(ssl) : SSL_connect(ssl)) != 1) {
+        printSslError("handshake failed");
+        ok = false;
+    }
+    if (ok) {
+        ok = enableKernelTls(socket, ssl, secrets, isServer);
+    }
+
+    // The kernel owns the record layer now; nothing may be sent through ssl
+    SSL_set_ex_data(ssl, secretsIndex(), nullptr);
+    SSL_free(ssl);
+    OPENSSL_cleanse(secrets.client.data(), secrets.client.size());
+    OPENSSL_cleanse(secrets.server.data(), secrets.server.size());
+    return ok;
+}
+
+} // namespace
+
+bool TlsTransport::supported() {
+    return true;
+}
+
+bool TlsTransport::kernelTlsAvailable() {
+    static const bool available = []() {
+        int probe = socket(AF_INET, SOCK_STREAM, 0);
+        if (probe < 0) return false;
+        // On an unconnected socket the tls ULP fails with ENOTCONN; a kernel
+        // without it fails with ENOENT
+        bool found = setsockopt(probe, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0 || errno != ENOENT;
+        close(probe);
+        return found;
+    }();
+    return available;
+}
+
+bool TlsTransport::configureServer(const std::string& certificateFile, const std::string& privateKeyFile) {
+    SSL_CTX* context = newContext(TLS_server_method());
+    if (context == nullptr) {
+        printSslError("cannot create server context");
+        return false;
+    }
+    // A ticket would be the first record under the new keys, sent by OpenSSL
+    // after the kernel has taken over and with a sequence number it cannot know
+    SSL_CTX_set_num_tickets(context, 0);
+
+    if (SSL_CTX_use_certificate_chain_file(context, certificateFile.c_str()) != 1) {
+        printSslError(("cannot load certificate " + certificateFile).c_str());
+        SSL_CTX_free(context);
+        return false;
+    }
+    if (SSL_CTX_use_PrivateKey_file(context, privateKeyFile.c_str(), SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(context) != 1) {
+        printSslError(("cannot load private key " + privateKeyFile).c_str());
+        SSL_CTX_free(context);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(contextMutex);
+    serverContext = context;
+    return true;
+}
+
+bool TlsTransport::configureClient(const std::string& caFile, const std::string& serverName) {
+    SSL_CTX* context = newContext(TLS_client_method());
+    if (context == nullptr) {
+        printSslError("cannot create client context");
+        return false;
+    }
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER, nullptr);
+
+    int loaded = caFile.empty() ? SSL_CTX_set_default_verify_paths(context)
+                                : SSL_CTX_load_verify_locations(context, caFile.c_str(), nullptr);
+    if (loaded != 1) {
+        printSslError(("cannot load trusted certificates " + caFile).c_str());
+        SSL_CTX_free(context);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(contextMutex);
+    clientContext = context;
+    expectedServerName = serverName;
+    return true;
+}
+
+bool TlsTransport::serverEnabled() {
+    std::lock_guard<std::mutex> lock(contextMutex);
+    return serverContext != nullptr;
+}
+
+bool TlsTransport::clientEnabled() {
+    std::lock_guard<std::mutex> lock(contextMutex);
+    return clientContext != nullptr;
+}
+
+bool TlsTransport::accept(int socket) {
+    SSL_CTX* context;
+    {
+        std::lock_guard<std::mutex> lock(contextMutex);
+        context = serverContext;
+    }
+    if (context == nullptr) {
+        std::cerr << "TLS: server is not configured\n";
+        return false;
+    }
+    return handshake(socket, context, true, std::string());
+}
+
+bool TlsTransport::connect(int socket) {
+    SSL_CTX* context;
+    std::string serverName;
+    {
+        std::lock_guard<std::mutex> lock(contextMutex);
+        context = clientContext;
+        serverName = expectedServerName;
+    }
+    if (context == nullptr) {
+        std::cerr << "TLS: client is not configured\n";
+        return false;
+    }
+    return handshake(socket, context, false, serverName);
+}
+
+#else
+
+namespace {
+
+bool unavailable() {
+    std::cerr << "TLS: this build has no TLS support (needs Linux and OpenSSL)\n";
+    return false;
+}
+
+} // namespace
+
+bool TlsTransport::supported() { return false; }
+bool TlsTransport::kernelTlsAvailable() { return false; }
+bool TlsTransport::configureServer(const std::string&, const std::string&) { return unavailable(); }
+bool TlsTransport::configureClient(const std::string&, const std::string&) { return unavailable(); }
+bool TlsTransport::serverEnabled() { return false; }
+bool TlsTransport::clientEnabled() { return false; }
+bool TlsTransport::accept(int) { return unavailable(); }
+bool TlsTransport::connect(int) { return unavailable(); }
+
+#endif
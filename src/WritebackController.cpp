@@ -0,0 +1,62 @@
+/**
+ * @file WritebackController.cpp
+ * @brief Implementation of write-back control on the receive path
+ */
+
+#include "WritebackController.h"
+#include <fcntl.h>
+
+// Initialize static members
+WritebackController::Settings WritebackController::settings;  ///< Process-wide tunables
+std::mutex WritebackController::settingsMutex;                ///< Guards settings
+
+void WritebackController::setSettings(const Settings& newSettings) {
+    std::lock_guard<std::mutex> lock(settingsMutex);
+    settings = newSettings;
+}
+
+WritebackController::Settings WritebackController::getSettings() {
+    std::lock_guard<std::mutex> lock(settingsMutex);
+    return settings;
+}
+
+WritebackController::WritebackController(int fd, size_t offset)
+    : fd(fd), config(getSettings()), cursor(offset), started(offset), retired(offset) {}
+
+WritebackController::~WritebackController() {
+#if defined(__linux__)
+    if (config.window > 0 && cursor > started) {
+        sync_file_range(fd, static_cast<off_t>(started), static_cast<off_t>(cursor - started),
+                        SYNC_FILE_RANGE_WRITE);
+    }
+#endif
+}
+
+void WritebackController::advance(size_t bytes) {
+    cursor += bytes;
+#if defined(__linux__)
+    if (config.window == 0) {
+        return;
+    }
+
+    while (cursor - started >= config.window) {
+        // Queue the window that just filled up; this does not block unless
+        // the device queue is full
+        sync_file_range(fd, static_cast<off_t>(started), static_cast<off_t>(config.window),
+                        SYNC_FILE_RANGE_WRITE);
+        started += config.window;
+
+        // Wait for the window before it, which has had a whole window's worth
+        // of receiving to reach the disk, so the wait is usually short
+        if (started - retired > config.window) {
+            sync_file_range(fd, static_cast<off_t>(retired), static_cast<off_t>(config.window),
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            if (config.dropCache) {
+                posix_fadvise(fd, static_cast<off_t>(retired), static_cast<off_t>(config.window),
+                              POSIX_FADV_DONTNEED);
+            }
+            retired += config.window;
+        }
+    }
+#endif
+}
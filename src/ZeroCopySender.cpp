@@ -0,0 +1,174 @@
+/**
+ * @file ZeroCopySender.cpp
+ * @brief Implementation of MSG_ZEROCOPY sends
+ */
+
+#include "ZeroCopySender.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#endif
+
+/*
+ * Tickets: a zero-copy send gets the ticket issued (its kernel sequence
+ * number + 1), so everything up to it is released once released >= ticket.
+ * A copied send gets the ticket of the last zero-copy send before it, which
+ * is what must complete before the buffer may be reused.
+ */
+
+ZeroCopySender::ZeroCopySender(int socket)
+    : socket(socket), zeroCopy(false), issued(0), released(0) {
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    int one = 1;
+    zeroCopy = setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#endif
+}
+
+ZeroCopySender::~ZeroCopySender() {
+    if (!held.empty() && !waitFor(held.back().first)) {
+        std::cerr << "Error: Lost track of zero-copy buffers on a failed socket" << std::endl;
+        for (auto& entry : held) {
+            new BufferPool::Buffer(std::move(entry.second));
+        }
+        held.clear();
+    }
+}
+
+bool ZeroCopySender::send(const char* data, size_t size, uint64_t& ticket) {
+    while (size > 0) {
+        ssize_t sent = sendSome(data, size, ticket);
+        if (sent <= 0) return false;
+        data += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    ticket = issued;
+    return true;
+}
+
+ssize_t ZeroCopySender::sendSome(const char* data, size_t size, uint64_t& ticket) {
+    while (true) {
+        ssize_t sent;
+#if defined(__linux__) && defined(MSG_ZEROCOPY)
+        if (zeroCopy && size >= MIN_ZEROCOPY_SIZE) {
+            sent = ::send(socket, data, size, MSG_ZEROCOPY);
+            if (sent < 0 && errno == ENOBUFS) {
+                // Too many pinned pages outstanding (optmem_max): let some
+                // complete, or copy if there are none to wait for
+                if (issued == released) {
+                    zeroCopy = false;
+                } else if (!waitFor(released + 1)) {
+                    return -1;
+                }
+                continue;
+            }
+            if (sent < 0 && errno == EOPNOTSUPP) {
+                // kTLS sockets accept SO_ZEROCOPY but not MSG_ZEROCOPY sends
+                zeroCopy = false;
+                continue;
+            }
+            if (sent > 0) ++issued;
+        } else
+#endif
+        {
+            sent = ::send(socket, data, size, 0);
+        }
+        if (sent < 0 && errno == EINTR) continue;
+        ticket = issued;
+        return sent;
+    }
+}
+
+bool ZeroCopySender::send(BufferPool::Buffer buffer, size_t size) {
+    uint64_t ticket = 0;
+    bool sent = send(buffer.data(), size, ticket);
+    // Even a failed send may have pinned the part that went out
+    held.emplace_back(ticket, std::move(buffer));
+    completed(ticket);
+    return sent;
+}
+
+bool ZeroCopySender::completed(uint64_t ticket) {
+    if (released < ticket) {
+        reap();
+    } else {
+        recycle();
+    }
+    return released >= ticket;
+}
+
+bool ZeroCopySender::waitFor(uint64_t ticket) {
+    unsigned emptyWakeups = 0;
+    while (!completed(ticket)) {
+        // The error queue is always polled: POLLERR needs no request
+        struct pollfd pfd = {socket, 0, 0};
+        int ready = poll(&pfd, 1, 1000);
+        if (ready < 0 && errno != EINTR) {
+            return false;
+        }
+        if (ready > 0) {
+            if (pfd.revents & POLLNVAL) {
+                return false;
+            }
+            if (reap()) {
+                emptyWakeups = 0;
+            } else if (++emptyWakeups >= MAX_EMPTY_WAKEUPS) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Returns the held buffers the kernel is done with to the pool
+ */
+void ZeroCopySender::recycle() {
+    while (!held.empty() && held.front().first <= released) {
+        held.pop_front();
+    }
+}
+
+/**
+ * @brief Reads every pending completion notification from the error queue
+ * @return true if at least one was read
+ */
+bool ZeroCopySender::reap() {
+    bool any = false;
+#if defined(__linux__) && defined(SO_EE_ORIGIN_ZEROCOPY)
+    while (true) {
+        char control[128];
+        struct msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            bool recvErr = (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                           (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+            if (!recvErr) continue;
+
+            auto* error = reinterpret_cast<struct sock_extended_err*>(CMSG_DATA(cmsg));
+            if (error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+            // Notifications cover the range [ee_info, ee_data] of sequence
+            // numbers; TCP releases its buffers in order
+            released = std::max<uint64_t>(released, static_cast<uint64_t>(error->ee_data) + 1);
+            any = true;
+
+            if (zeroCopy && (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)) {
+                zeroCopy = false;
+            }
+        }
+    }
+#endif
+    recycle();
+    return any;
+}